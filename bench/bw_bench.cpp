@@ -0,0 +1,473 @@
+/**
+ * @file bw_bench.cpp
+ * @brief Benchmark harness timing each stage of a conversion.
+ *
+ * Measures decode, ProcessImage, encode and end-to-end throughput in megapixels per
+ * second across image sizes, channel counts, thread counts and formats, on synthetic
+ * images and on an optional directory of real images. Results print as a table or as
+ * CSV for comparing runs.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "black_and_white_processor.hpp"
+#include "image_converter.hpp"
+#include "load_strategy.hpp"
+#include "save_strategy.hpp"
+#include "thread_pool.hpp"
+
+#include <CLI/CLI.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stb_image.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    /**
+     * @struct Sample
+     * @brief A decoded benchmark image together with the encoded files it is decoded from.
+     */
+    struct Sample
+    {
+        std::string name;                  ///< "synthetic" or the corpus file name.
+        int width = 0;                     ///< Width in pixels.
+        int height = 0;                    ///< Height in pixels.
+        int channels = 0;                  ///< Interleaved channels per pixel.
+        std::vector<unsigned char> pixels; ///< Packed decoded pixels.
+        std::vector<std::pair<std::string, std::vector<unsigned char>>> inputs; ///< Encoded files by extension.
+
+        /**
+         * @return The number of pixels in millions.
+         */
+        double Megapixels() const { return static_cast<double>(width) * height / 1e6; }
+    };
+
+    /**
+     * @struct Timing
+     * @brief Wall-clock statistics of repeated runs, in seconds.
+     */
+    struct Timing
+    {
+        double median = 0; ///< Median run time.
+        double min = 0;    ///< Fastest run time.
+    };
+
+    /**
+     * Times a body several times after one untimed warm-up run.
+     *
+     * @param repeat Number of timed runs.
+     * @param setup Called untimed before every run, e.g. to restore inputs the body modifies.
+     * @param body The work being measured.
+     * @return Median and minimum of the timed runs.
+     */
+    template <typename Setup, typename Body>
+    Timing Measure(unsigned int repeat, Setup setup, Body body)
+    {
+        std::vector<double> seconds;
+        for (unsigned int run = 0; run <= repeat; ++run) {
+            setup();
+            auto start = std::chrono::steady_clock::now();
+            body();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (run != 0) {
+                seconds.push_back(elapsed.count());
+            }
+        }
+        std::sort(seconds.begin(), seconds.end());
+        return {seconds[seconds.size() / 2], seconds.front()};
+    }
+
+    /**
+     * Creates the save strategy the converter uses for an extension.
+     *
+     * @param extension Lower-case extension without the dot.
+     * @param options Encoder settings.
+     * @return The strategy.
+     * @throws std::runtime_error if the extension is not supported.
+     */
+    std::unique_ptr<bwconv::SaveFile::SaveStrategy> MakeStrategy(const std::string& extension,
+                                                                 const bwconv::EncoderOptions& options)
+    {
+        auto strategy = bwconv::SaveFile::CreateSaveStrategy(extension, options);
+        if (!strategy) {
+            throw std::runtime_error("Unsupported format: " + extension);
+        }
+        return strategy;
+    }
+
+    /**
+     * Generates a deterministic image with smooth gradients and mild noise, so encoders
+     * see neither flat nor incompressible content.
+     *
+     * @param width Width in pixels.
+     * @param height Height in pixels.
+     * @param channels Channels per pixel.
+     * @param formats Extensions to encode the image as.
+     * @return The sample.
+     */
+    Sample MakeSynthetic(int width, int height, int channels, const std::vector<std::string>& formats)
+    {
+        Sample sample;
+        sample.name = "synthetic";
+        sample.width = width;
+        sample.height = height;
+        sample.channels = channels;
+        sample.pixels.resize(static_cast<std::size_t>(width) * height * channels);
+
+        std::uint32_t state = 2463534242u;
+        unsigned char* p = sample.pixels.data();
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                for (int c = 0; c < channels; ++c) {
+                    state ^= state << 13;
+                    state ^= state >> 17;
+                    state ^= state << 5;
+                    int gradient = (c % 2 == 0 ? x * 255 / width : y * 255 / height) + c * 40;
+                    *p++ = static_cast<unsigned char>((gradient + (state & 15)) & 0xff);
+                }
+            }
+        }
+
+        bwconv::ImageView view{sample.pixels.data(), width, height, static_cast<std::size_t>(width) * channels,
+                               channels};
+        for (const auto& format : formats) {
+            std::vector<unsigned char> encoded;
+            // Inputs are always encoded the same way so decode timings stay comparable.
+            MakeStrategy(format, bwconv::EncoderOptions())->Encode(view, encoded);
+            sample.inputs.emplace_back(format, std::move(encoded));
+        }
+        return sample;
+    }
+
+    /**
+     * Loads every supported image of a directory, keeping each file's own encoding as its
+     * only input.
+     *
+     * @param directory The corpus directory.
+     * @return The samples, in file name order.
+     * @throws std::runtime_error if an image cannot be decoded.
+     */
+    std::vector<Sample> LoadCorpus(const std::string& directory)
+    {
+        std::vector<std::filesystem::path> paths;
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            std::string extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            if (entry.is_regular_file() &&
+                (extension == ".png" || extension == ".jpg" || extension == ".jpeg" || extension == ".bmp" ||
+                 extension == ".tga")) {
+                paths.push_back(entry.path());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+
+        std::vector<Sample> samples;
+        for (const auto& path : paths) {
+            std::ifstream file(path, std::ios::binary);
+            std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+            Sample sample;
+            sample.name = path.filename().string();
+            unsigned char* data = stbi_load_from_memory(bytes.data(), static_cast<int>(bytes.size()), &sample.width,
+                                                        &sample.height, &sample.channels, 0);
+            if (data == nullptr) {
+                throw std::runtime_error("Failed to load image " + path.string());
+            }
+            sample.pixels.assign(data, data + static_cast<std::size_t>(sample.width) * sample.height * sample.channels);
+            stbi_image_free(data);
+
+            std::string extension = path.extension().string().substr(1);
+            std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            sample.inputs.emplace_back(extension, std::move(bytes));
+            samples.push_back(std::move(sample));
+        }
+        return samples;
+    }
+
+    /**
+     * @class Report
+     * @brief Collects measurements and prints them as an aligned table or as CSV.
+     */
+    class Report
+    {
+    public:
+        /**
+         * @param csv Print comma-separated values instead of a table.
+         */
+        explicit Report(bool csv) : csv(csv)
+        {
+            if (csv) {
+                std::cout << "stage,source,format,width,height,channels,threads,median_ms,min_ms,mpix_per_s\n";
+            } else {
+                std::cout << std::left << std::setw(12) << "stage" << std::setw(20) << "source" << std::setw(10)
+                          << "format" << std::setw(12) << "size" << std::setw(4) << "ch" << std::setw(8) << "threads"
+                          << std::right << std::setw(12) << "median ms" << std::setw(12) << "min ms" << std::setw(10)
+                          << "MP/s" << '\n';
+            }
+        }
+
+        /**
+         * Prints one measurement.
+         *
+         * @param stage Name of the measured stage.
+         * @param sample The image measured.
+         * @param format Format involved, empty if the stage has none.
+         * @param threads Threads used, 0 if the stage is single-threaded.
+         * @param timing The measurement.
+         */
+        void Add(const std::string& stage, const Sample& sample, const std::string& format, unsigned int threads,
+                 const Timing& timing)
+        {
+            double rate = sample.Megapixels() / timing.median;
+            std::string threadText = threads == 0 ? "-" : std::to_string(threads);
+            std::string formatText = format.empty() ? "-" : format;
+            if (csv) {
+                std::cout << stage << ',' << sample.name << ',' << formatText << ',' << sample.width << ','
+                          << sample.height << ',' << sample.channels << ',' << threadText << ',' << std::fixed
+                          << std::setprecision(3) << timing.median * 1e3 << ',' << timing.min * 1e3 << ','
+                          << std::setprecision(1) << rate << '\n';
+            } else {
+                std::ostringstream size;
+                size << sample.width << 'x' << sample.height;
+                std::cout << std::left << std::setw(12) << stage << std::setw(20) << sample.name.substr(0, 19)
+                          << std::setw(10) << formatText << std::setw(12) << size.str() << std::setw(4)
+                          << sample.channels << std::setw(8) << threadText << std::right << std::fixed
+                          << std::setprecision(3) << std::setw(12) << timing.median * 1e3 << std::setw(12)
+                          << timing.min * 1e3 << std::setprecision(1) << std::setw(10) << rate << '\n';
+            }
+            std::cout.flush();
+        }
+
+    private:
+        bool csv; ///< Print CSV rows.
+    };
+
+    /**
+     * @struct BenchOptions
+     * @brief The dimensions a benchmark run sweeps.
+     */
+    struct BenchOptions
+    {
+        std::vector<std::string> sizes{"512x512", "2048x2048"};    ///< Synthetic sizes as WIDTHxHEIGHT.
+        std::vector<int> channels{1, 2, 3, 4};                     ///< Synthetic channel counts.
+        std::vector<unsigned int> threads;                         ///< Thread counts.
+        std::vector<std::string> formats{"png", "jpg", "bmp", "tga"}; ///< Formats to decode and encode.
+        std::string corpus;                                        ///< Directory of real images.
+        unsigned int repeat = 5;                                   ///< Timed runs per measurement.
+        bool synthetic = true;                                     ///< Benchmark synthetic images.
+        bool csv = false;                                          ///< Print CSV.
+        bwconv::EncoderOptions encoder;                            ///< Settings of the measured encoders.
+        bwconv::DecoderBackend decoder = bwconv::DecoderBackend::Auto; ///< Measured decoders.
+        bwconv::GrayOptions gray;                                  ///< Luma mode of the process stage.
+        bool highBitDepth = false;                                 ///< Also process 16-bit and float copies.
+    };
+
+    /**
+     * Runs every stage for one sample.
+     *
+     * @param sample The image to measure.
+     * @param options The run's dimensions.
+     * @param scratch Directory for the files of the end-to-end stage.
+     * @param report Receives the measurements.
+     */
+    void BenchSample(const Sample& sample, const BenchOptions& options, const std::filesystem::path& scratch,
+                     Report& report)
+    {
+        std::vector<unsigned char> work(sample.pixels.size());
+        bwconv::ImageView view;
+        auto restore = [&] {
+            std::copy(sample.pixels.begin(), sample.pixels.end(), work.begin());
+            view = {work.data(), sample.width, sample.height, static_cast<std::size_t>(sample.width) * sample.channels,
+                    sample.channels};
+        };
+
+        for (unsigned int threads : options.threads) {
+            bwconv::ThreadPool pool(threads - 1);
+            bwconv::BlackAndWhiteProcessor processor(pool, 0, options.gray);
+            report.Add("process", sample, "", threads,
+                       Measure(options.repeat, restore, [&] { processor.ProcessImage(view); }));
+        }
+
+        if (options.highBitDepth) {
+            // The same pixels widened, as --high-bit-depth decodes 16-bit and HDR inputs.
+            std::size_t samples = sample.pixels.size();
+            std::vector<std::uint16_t> pixels16(samples);
+            std::vector<float> pixelsFloat(samples);
+            for (std::size_t i = 0; i < samples; ++i) {
+                pixels16[i] = static_cast<std::uint16_t>(sample.pixels[i] * 257);
+                pixelsFloat[i] = sample.pixels[i] * (1.0f / 255);
+            }
+            for (bwconv::SampleType type : {bwconv::SampleType::U16, bwconv::SampleType::F32}) {
+                const unsigned char* source = type == bwconv::SampleType::U16
+                                                  ? reinterpret_cast<const unsigned char*>(pixels16.data())
+                                                  : reinterpret_cast<const unsigned char*>(pixelsFloat.data());
+                std::vector<unsigned char> wide(samples * bwconv::SampleBytes(type));
+                auto restoreWide = [&] {
+                    std::copy(source, source + wide.size(), wide.begin());
+                    view = {wide.data(), sample.width, sample.height,
+                            static_cast<std::size_t>(sample.width) * sample.channels * bwconv::SampleBytes(type),
+                            sample.channels};
+                    view.sample = type;
+                };
+                for (unsigned int threads : options.threads) {
+                    bwconv::ThreadPool pool(threads - 1);
+                    bwconv::BlackAndWhiteProcessor processor(pool, 0, options.gray);
+                    report.Add(type == bwconv::SampleType::U16 ? "process-u16" : "process-f32", sample, "", threads,
+                               Measure(options.repeat, restoreWide, [&] { processor.ProcessImage(view); }));
+                }
+            }
+        }
+
+        // Encoders receive what the converter hands them: the processed image.
+        restore();
+        {
+            bwconv::ThreadPool pool(0);
+            bwconv::BlackAndWhiteProcessor(pool, 0, options.gray).ProcessImage(view);
+        }
+        std::vector<unsigned char> encoded;
+        for (const auto& format : options.formats) {
+            auto strategy = MakeStrategy(format, options.encoder);
+            report.Add("encode", sample, format, 0,
+                       Measure(
+                           options.repeat, [&] { encoded.clear(); }, [&] { strategy->Encode(view, encoded); }));
+        }
+
+        auto loaders = bwconv::LoadFile::CreateLoadStrategies(options.decoder);
+        for (const auto& [format, bytes] : sample.inputs) {
+            report.Add("decode", sample, format, 0,
+                       Measure(
+                           options.repeat, [] {},
+                           [&] {
+                               int w, h, c;
+                               unsigned char* data =
+                                   bwconv::LoadFile::DecodeImage(loaders, bytes.data(), bytes.size(), w, h, c, 0);
+                               if (data == nullptr) {
+                                   throw std::runtime_error("Failed to decode " + format + " input");
+                               }
+                               stbi_image_free(data);
+                           }));
+
+            std::filesystem::path input = scratch / ("input." + format);
+            std::filesystem::path output = scratch / ("output." + format);
+            std::ofstream(input, std::ios::binary)
+                .write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+            for (unsigned int threads : options.threads) {
+                bwconv::ThreadPool pool(threads - 1);
+                bwconv::ImageConverter converter(std::make_unique<bwconv::BlackAndWhiteProcessor>(pool, 0, options.gray));
+                converter.SetEncoderOptions(options.encoder);
+                converter.SetDecoderBackend(options.decoder);
+                report.Add("convert", sample, format, threads,
+                           Measure(
+                               options.repeat, [] {},
+                               [&] { converter.ConvertImage(input.string(), output.string()); }));
+            }
+        }
+    }
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    CLI::App app{"Benchmarks decode, ProcessImage, encode and end-to-end conversion"};
+
+    BenchOptions options;
+    app.add_option("--sizes", options.sizes, "Synthetic image sizes as WIDTHxHEIGHT (default: 512x512 2048x2048)");
+    app.add_option("--channels", options.channels, "Synthetic channel counts (default: 1 2 3 4)")
+        ->check(CLI::Range(1, 4));
+    app.add_option("--threads", options.threads, "Thread counts (default: 1 and all cores)")
+        ->check(CLI::Range(1u, 4096u));
+    app.add_option("--formats", options.formats, "Formats to decode and encode (default: png jpg bmp tga)");
+    app.add_option("--corpus", options.corpus, "Directory of real images to benchmark as well")
+        ->check(CLI::ExistingDirectory);
+    bool corpusOnly = false;
+    app.add_flag("--no-synthetic", corpusOnly, "Only benchmark the corpus");
+    app.add_option("--repeat", options.repeat, "Timed runs per measurement; the median is reported (default: 5)")
+        ->check(CLI::Range(1u, 1000u));
+    app.add_flag("--csv", options.csv, "Print comma-separated values");
+    app.add_option("--jpeg-quality", options.encoder.jpegQuality, "JPEG quality of the encode stage (default: 100)")
+        ->check(CLI::Range(1, 100));
+    app.add_option("--png-level", options.encoder.pngLevel, "PNG deflate level of the encode stage (default: 8)")
+        ->check(CLI::Range(0, 9));
+    bool stbEncoders = false;
+    app.add_flag("--stb-encoders", stbEncoders, "Measure the stb_image_write encoders even where faster ones exist");
+
+    std::string luma = "avg";
+    app.add_option("--luma", luma, "Gray weights of the process stage: avg, bt601, bt709 or linear")
+        ->check(CLI::IsMember({"avg", "bt601", "bt709", "linear"}));
+    bool stbDecoders = false;
+    app.add_flag("--stb-decoders", stbDecoders, "Measure the stb_image decoders even where faster ones exist");
+    app.add_flag("--high-bit-depth", options.highBitDepth,
+                 "Also measure the process stage on 16-bit and float samples");
+
+    CLI11_PARSE(app, argc, argv);
+
+    options.synthetic = !corpusOnly;
+    if (stbEncoders) {
+        options.encoder.backend = bwconv::EncoderBackend::Stb;
+    }
+    static const char* const lumaModes[] = {"avg", "bt601", "bt709", "linear"};
+    for (int i = 0; i < 4; ++i) {
+        if (luma == lumaModes[i]) {
+            options.gray.luma = static_cast<bwconv::LumaMode>(i);
+        }
+    }
+    if (stbDecoders) {
+        options.decoder = bwconv::DecoderBackend::Stb;
+    }
+    if (options.threads.empty()) {
+        options.threads.push_back(1);
+        unsigned int cores = std::thread::hardware_concurrency();
+        if (cores > 1) {
+            options.threads.push_back(cores);
+        }
+    }
+
+    std::filesystem::path scratch =
+        std::filesystem::temp_directory_path() /
+        ("bw_bench." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    try {
+        std::filesystem::create_directories(scratch);
+        Report report(options.csv);
+
+        if (options.synthetic) {
+            for (const auto& size : options.sizes) {
+                int width = 0, height = 0;
+                char separator = 0;
+                std::istringstream parser(size);
+                if (!(parser >> width >> separator >> height) || separator != 'x' || width <= 0 || height <= 0) {
+                    throw std::runtime_error("Invalid size: " + size);
+                }
+                for (int channels : options.channels) {
+                    BenchSample(MakeSynthetic(width, height, channels, options.formats), options, scratch, report);
+                }
+            }
+        }
+        if (!options.corpus.empty()) {
+            for (const auto& sample : LoadCorpus(options.corpus)) {
+                BenchSample(sample, options, scratch, report);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::filesystem::remove_all(scratch);
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::filesystem::remove_all(scratch);
+    return 0;
+}
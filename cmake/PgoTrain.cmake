@@ -0,0 +1,46 @@
+# Records the PGO profile: runs the instrumented converter over a corpus with the settings
+# the fleet uses most, then the benchmark, and merges Clang's raw profiles.
+#
+# Invoked by the pgo-train target as
+#   cmake -DCONVERTER=<exe> -DBENCH=<exe or empty> -DCORPUS=<dir> -DWORK_DIR=<dir>
+#         -DPROFILE_DIR=<dir> [-DPROFDATA=<llvm-profdata>] -P PgoTrain.cmake
+
+if(NOT CORPUS OR NOT IS_DIRECTORY "${CORPUS}")
+  message(FATAL_ERROR "Set BWCONV_PGO_CORPUS to a directory of training images")
+endif()
+
+# A profile of older code would not match; start afresh.
+file(REMOVE_RECURSE "${PROFILE_DIR}" "${WORK_DIR}")
+file(MAKE_DIRECTORY "${PROFILE_DIR}" "${WORK_DIR}")
+
+function(train name)
+  message(STATUS "pgo-train: ${name}")
+  execute_process(COMMAND ${ARGN} RESULT_VARIABLE result OUTPUT_QUIET)
+  # Unreadable images in the corpus only fail their own conversion.
+  if(NOT result EQUAL 0)
+    message(WARNING "pgo-train: ${name} exited with ${result}")
+  endif()
+endfunction()
+
+set(batch "${CONVERTER}" --input-dir "${CORPUS}" -r)
+train("gray png" ${batch} --output-dir "${WORK_DIR}/gray" --format png)
+train("gray jpg, bt709" ${batch} --output-dir "${WORK_DIR}/jpg" --format jpg --luma bt709 --jpeg-quality 90)
+train("threshold" ${batch} --output-dir "${WORK_DIR}/threshold" --format png --bilevel threshold)
+train("resize, dither" ${batch} --output-dir "${WORK_DIR}/dither" --format png --resize 1024x1024
+      --bilevel floyd-steinberg)
+train("pipeline" ${batch} --output-dir "${WORK_DIR}/pipeline" --format png --pipeline --invert)
+if(BENCH)
+  train("benchmark" "${BENCH}" --corpus "${CORPUS}" --repeat 1)
+endif()
+
+file(GLOB raw "${PROFILE_DIR}/*.profraw")
+if(raw)
+  if(NOT PROFDATA)
+    message(FATAL_ERROR "llvm-profdata is needed to merge the Clang profile")
+  endif()
+  execute_process(COMMAND "${PROFDATA}" merge -o "${PROFILE_DIR}/default.profdata" ${raw} RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "pgo-train: merging the profile failed (${result})")
+  endif()
+endif()
+file(REMOVE_RECURSE "${WORK_DIR}")
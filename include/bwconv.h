@@ -0,0 +1,189 @@
+/**
+ * @file bwconv.h
+ * @brief C interface of the converter library: memory-to-memory conversion of encoded
+ *        images for embedding in other programs.
+ *
+ * A converter is created once from a set of options and then converts any number of
+ * encoded images (PNG, JPEG, GIF, BMP, ...) into encoded output, without touching the
+ * file system. Output buffers come from an allocator the caller supplies, so they land
+ * directly in the caller's own memory, such as a response buffer. A converter may be
+ * used by several threads at once; its pool of worker threads is shared by all of them.
+ * Converters with different options may be created and used while others convert.
+ *
+ * Functions report failures with a bwconv_status; bwconv_last_error then describes the
+ * failure. No C++ exception ever leaves the library.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef BWCONV_H
+#define BWCONV_H
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#if defined(BWCONV_BUILDING)
+#define BWCONV_API __declspec(dllexport)
+#elif defined(BWCONV_SHARED)
+#define BWCONV_API __declspec(dllimport)
+#else
+#define BWCONV_API
+#endif
+#else
+#define BWCONV_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Version of the interface. Grows when functions or option fields are added; existing
+ * ones keep their meaning.
+ */
+#define BWCONV_API_VERSION 1
+
+/**
+ * Results of the library functions.
+ */
+typedef enum bwconv_status
+{
+    BWCONV_OK = 0,                ///< Success.
+    BWCONV_INVALID_ARGUMENT = 1,  ///< A null pointer, an unknown format or an option out of range.
+    BWCONV_CONVERSION_FAILED = 2, ///< Decoding, processing or encoding failed, or a memory limit was hit.
+    BWCONV_OUT_OF_MEMORY = 3      ///< An allocation failed, including the caller's allocator.
+} bwconv_status;
+
+/**
+ * How color is weighted into gray.
+ */
+typedef enum bwconv_luma
+{
+    BWCONV_LUMA_AVERAGE = 0, ///< Mean of all channels, alpha included.
+    BWCONV_LUMA_BT601 = 1,   ///< BT.601 weights on the encoded values.
+    BWCONV_LUMA_BT709 = 2,   ///< BT.709 weights on the encoded values.
+    BWCONV_LUMA_LINEAR = 3   ///< BT.709 weights applied to linear light.
+} bwconv_luma;
+
+/**
+ * Reductions of the gray image to black and white.
+ */
+typedef enum bwconv_bilevel
+{
+    BWCONV_BILEVEL_NONE = 0,            ///< Keep the gray levels.
+    BWCONV_BILEVEL_THRESHOLD = 1,       ///< Fixed threshold, see bwconv_options::threshold.
+    BWCONV_BILEVEL_OTSU = 2,            ///< Threshold chosen per image.
+    BWCONV_BILEVEL_BAYER = 3,           ///< 8x8 ordered dither.
+    BWCONV_BILEVEL_FLOYD_STEINBERG = 4, ///< Floyd-Steinberg error diffusion.
+    BWCONV_BILEVEL_ATKINSON = 5         ///< Atkinson error diffusion.
+} bwconv_bilevel;
+
+/**
+ * Reconstruction filters of the resize step.
+ */
+typedef enum bwconv_filter
+{
+    BWCONV_FILTER_BOX = 0,      ///< Mean of the covered input pixels, weighted by overlap.
+    BWCONV_FILTER_BILINEAR = 1, ///< Triangle filter widened by the scale.
+    BWCONV_FILTER_LANCZOS3 = 2  ///< Three-lobed windowed sinc.
+} bwconv_filter;
+
+/**
+ * Settings of a converter. Initialise with bwconv_options_init before changing fields,
+ * so fields added by later versions keep their defaults. New fields are only appended:
+ * the library reads the first struct_size bytes and defaults the fields beyond them, so
+ * programs built against an earlier header keep working.
+ */
+typedef struct bwconv_options
+{
+    size_t struct_size;          ///< sizeof(bwconv_options) of the caller's header, set by bwconv_options_init.
+    unsigned int threads;        ///< Worker threads besides the caller's; 0 for one fewer than the CPUs.
+    bwconv_luma luma;            ///< Gray conversion. Default BWCONV_LUMA_AVERAGE.
+    int premultiply_alpha;       ///< Nonzero to composite over black, for the weighted luma modes.
+    int invert;                  ///< Nonzero to invert the gray image.
+    bwconv_bilevel bilevel;      ///< Reduction to black and white. Default BWCONV_BILEVEL_NONE.
+    int threshold;               ///< Gray level from which BWCONV_BILEVEL_THRESHOLD is white, 1 to 255.
+    int resize_width;            ///< Largest output width, 0 for no bound.
+    int resize_height;           ///< Largest output height, 0 for no bound; both 0 to keep the size.
+    bwconv_filter resize_filter; ///< Filter of the resize. Default BWCONV_FILTER_BILINEAR.
+    int jpeg_quality;            ///< JPEG quality, 1 to 100. Default 100.
+    int png_level;               ///< Deflate level of PNG output, 0 to 9. Default 8.
+    size_t memory_limit;         ///< Largest decoded image in bytes, 0 for no limit.
+} bwconv_options;
+
+/**
+ * Allocator of output buffers.
+ */
+typedef struct bwconv_allocator
+{
+    void* (*allocate)(void* user, size_t size); ///< Returns size bytes, or NULL on failure.
+    void* user;                                 ///< Passed to allocate.
+} bwconv_allocator;
+
+/**
+ * A converter; opaque.
+ */
+typedef struct bwconv_converter bwconv_converter;
+
+/**
+ * @return The version string of the library.
+ */
+BWCONV_API const char* bwconv_version(void);
+
+/**
+ * Sets every option to its default.
+ *
+ * @param options The options to initialise.
+ */
+BWCONV_API void bwconv_options_init(bwconv_options* options);
+
+/**
+ * Creates a converter.
+ *
+ * @param options Its settings, or NULL for the defaults.
+ * @param converter Receives the converter, to be passed to bwconv_destroy.
+ * @return BWCONV_OK, or the reason of the failure.
+ */
+BWCONV_API bwconv_status bwconv_create(const bwconv_options* options, bwconv_converter** converter);
+
+/**
+ * Destroys a converter once no conversion is running on it.
+ *
+ * @param converter The converter, or NULL.
+ */
+BWCONV_API void bwconv_destroy(bwconv_converter* converter);
+
+/**
+ * Converts an encoded image.
+ *
+ * @param converter The converter.
+ * @param input The encoded input.
+ * @param input_size Its length in bytes.
+ * @param format Output format by extension, such as "png", "jpg", "bmp", "pbm" or "gif".
+ * @param allocator Allocator of the output, or NULL for malloc.
+ * @param output Receives the encoded output; NULL on failure.
+ * @param output_size Receives its length in bytes.
+ * @return BWCONV_OK, or the reason of the failure.
+ */
+BWCONV_API bwconv_status bwconv_convert(bwconv_converter* converter, const void* input, size_t input_size,
+                                        const char* format, const bwconv_allocator* allocator, void** output,
+                                        size_t* output_size);
+
+/**
+ * Frees an output of bwconv_convert made without an allocator.
+ *
+ * @param output The output, or NULL.
+ */
+BWCONV_API void bwconv_free(void* output);
+
+/**
+ * @return Description of the last failure on the calling thread, or an empty string.
+ */
+BWCONV_API const char* bwconv_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BWCONV_H
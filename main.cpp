@@ -9,15 +9,29 @@
  * 
  */
 
-#define STB_IMAGE_IMPLEMENTATION
-#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "batch_converter.hpp"
+#include "batch_manifest.hpp"
+#include "buffer_pool.hpp"
+#include "conversion_server.hpp"
+#include "encoder_options.hpp"
+#include "image_converter.hpp"
+#include "numa.hpp"
+#include "opencl_processor.hpp"
+#include "processor_factory.hpp"
+#include "result_cache.hpp"
+#include "staged_converter.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
 
 #include <CLI/CLI.hpp>
 #include <algorithm>
 #include <cctype>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <limits>
 #include <memory>
-#include <stb_image.h>
-#include <stb_image_write.h>
 #include <stdexcept>
 #include <string>
 #include <thread>
@@ -25,321 +39,461 @@
 
 namespace
 {
-    namespace SaveFile
-    {
-        /**
-         * @class SaveStrategy
-         * @brief Abstract base class for implementing different image saving strategies.
-         *
-         * SaveStrategy defines a common interface for all concrete image saving strategies.
-         * It allows for polymorphic saving of images in various formats like PNG, JPEG, BMP, TGA, etc.
-         * This class follows the Strategy design pattern.
-         */
-        class SaveStrategy
-        {
-        public:
-            /**
-             * Virtual destructor for SaveStrategy.
-             */
-            virtual ~SaveStrategy() = default;
-
-            /**
-             * Pure virtual function to save an image.
-             *
-             * @param path The file path where the image will be saved.
-             * @param img The image data in the form of a vector of unsigned chars.
-             * @param width The width of the image in pixels.
-             * @param height The height of the image in pixels.
-             */
-            virtual void Save(const std::string& path, const std::vector<unsigned char>& img, int width,
-                              int height) = 0;
-        };
-
-        /**
-         * @class PngSaveStrategy
-         * @brief Concrete strategy for saving images in PNG format.
-         *
-         * Inherits from SaveStrategy and implements the Save function to handle PNG image saving.
-         */
-        class PngSaveStrategy : public SaveStrategy
-        {
-        public:
-            /**
-             * Saves an image in PNG format.
-             * Overrides the Save method from SaveStrategy.
-             */
-            void Save(const std::string& path, const std::vector<unsigned char>& img, int width, int height) override
-            {
-                stbi_write_png(path.c_str(), width, height, 1, img.data(), width);
-            }
-        };
-
-        /**
-         * @class JpegSaveStrategy
-         * @brief Concrete strategy for saving images in JPEG format.
-         *
-         * Inherits from SaveStrategy and implements the Save function to handle JPEG image saving.
-         */
-        class JpegSaveStrategy : public SaveStrategy
-        {
-        public:
-            /**
-             * Saves an image in JPEG format.
-             * Overrides the Save method from SaveStrategy.
-             */
-            void Save(const std::string& path, const std::vector<unsigned char>& img, int width, int height) override
-            {
-                stbi_write_jpg(path.c_str(), width, height, 1, img.data(), 100);
-            }
-        };
-
-        /**
-         * @class BmpSaveStrategy
-         * @brief Concrete strategy for saving images in BMP format.
-         *
-         * Inherits from SaveStrategy and implements the Save function to handle BMP image saving.
-         */
-        class BmpSaveStrategy : public SaveStrategy
-        {
-        public:
-            /**
-             * Saves an image in BMP format.
-             * Overrides the Save method from SaveStrategy.
-             */
-            void Save(const std::string& path, const std::vector<unsigned char>& img, int width, int height) override
-            {
-                stbi_write_bmp(path.c_str(), width, height, 1, img.data());
-            }
-        };
-
-        /**
-         * @class TgaSaveStrategy
-         * @brief Concrete strategy for saving images in TGA format.
-         *
-         * Inherits from SaveStrategy and implements the Save function to handle TGA image saving.
-         */
-        class TgaSaveStrategy : public SaveStrategy
-        {
-        public:
-            /**
-             * Saves an image in TGA format.
-             * Overrides the Save method from SaveStrategy.
-             */
-            void Save(const std::string& path, const std::vector<unsigned char>& img, int width, int height) override
-            {
-                stbi_write_tga(path.c_str(), width, height, 1, img.data());
-            }
-        };
-
-    } // namespace SaveFile
-
     /**
-     * @class ImageProcessor
-     * @brief Abstract base class for image processing strategies.
+     * Parses a byte count with an optional K, M or G suffix (powers of 1024).
      *
-     * This class serves as an interface for different image processing techniques.
-     * It defines a common interface for all concrete image processing classes.
-     * The ProcessImage function must be implemented by all derived classes
-     * to perform specific image processing operations.
+     * @param text The text to parse, e.g. "512M".
+     * @return The number of bytes.
+     * @throws std::runtime_error if the text is not a valid size.
      */
-    class ImageProcessor
+    std::size_t ParseByteSize(const std::string& text)
     {
-    public:
-        /**
-         * Pure virtual function for processing an image.
-         *
-         * @param img The image to be processed, represented as a vector of unsigned chars.
-         * @param width The width of the image in pixels.
-         * @param height The height of the image in pixels.
-         * @param channels The number of color channels in the image.
-         */
-        virtual void ProcessImage(std::vector<unsigned char>& img, int width, int height, int channels) = 0;
-        /**
-         * @brief Virtual destructor for the ImageProcessor class.
-         */
-        virtual ~ImageProcessor() = default;
-    };
+        std::size_t digits = 0;
+        while (digits < text.size() && std::isdigit(static_cast<unsigned char>(text[digits]))) {
+            ++digits;
+        }
+        std::string suffix = text.substr(digits);
+        std::transform(suffix.begin(), suffix.end(), suffix.begin(), ::toupper);
+        if (digits == 0 || suffix.size() > 2 || (suffix.size() == 2 && suffix[1] != 'B')) {
+            throw std::runtime_error("Invalid size: " + text);
+        }
+
+        int shift;
+        switch (suffix.empty() ? 'B' : suffix[0]) {
+        case 'G':
+            shift = 30;
+            break;
+        case 'M':
+            shift = 20;
+            break;
+        case 'K':
+            shift = 10;
+            break;
+        case 'B':
+            shift = 0;
+            break;
+        default:
+            throw std::runtime_error("Invalid size: " + text);
+        }
+
+        unsigned long long value;
+        try {
+            value = std::stoull(text.substr(0, digits));
+        } catch (const std::out_of_range&) {
+            throw std::runtime_error("Invalid size: " + text);
+        }
+        if (value > (std::numeric_limits<std::size_t>::max() >> shift)) {
+            throw std::runtime_error("Invalid size: " + text);
+        }
+        return static_cast<std::size_t>(value) << shift;
+    }
 
     /**
-     * @class BlackAndWhiteProcessor
-     * @brief Concrete class for converting images to black and white.
+     * Parses a bounding box such as "640x480"; either side may be 0 for no bound.
      *
-     * Inherits from ImageProcessor and implements the ProcessImage function
-     * to convert color images into black and white images.
-     * This class uses multithreading to improve the performance of the conversion process.
+     * @param text The text to parse.
+     * @param options Receives the width and height.
+     * @throws std::runtime_error if the text is not a valid box.
      */
-    class BlackAndWhiteProcessor : public ImageProcessor
+    void ParseBoundingBox(const std::string& text, bwconv::ResizeOptions& options)
     {
-    public:
-        /**
-         * Processes the image to convert it to black and white.
-         * Overrides the ProcessImage method from ImageProcessor.
-         *
-         * The function converts the color image to grayscale by averaging
-         * the color channels for each pixel. It uses multithreading to
-         * process different segments of the image concurrently.
-         *
-         * @param img Reference to the image vector that will be processed.
-         * @param width The width of the image in pixels.
-         * @param height The height of the image in pixels.
-         * @param channels The number of color channels in the image.
-         */
-        void ProcessImage(std::vector<unsigned char>& img, int width, int height, int channels) override
-        {
-            std::vector<unsigned char> outputImage(width * height);
-
-            auto processPixel = [&](int start, int end) -> void {
-                for (int i = start; i < end; i += channels) {
-                    int grayScale = 0;
-                    for (int j = 0; j < channels; ++j) {
-                        grayScale += img[i + j];
-                    }
-                    grayScale /= channels;
-                    outputImage[i / channels] = static_cast<unsigned char>(grayScale);
-                }
-            };
-
-            unsigned int nThreads = std::thread::hardware_concurrency();
-            std::vector<std::thread> threads(nThreads);
-            int pixels = width * height;
-            int chunkSize = pixels / nThreads;
-
-            for (unsigned int i = 0; i < nThreads; ++i) {
-                int start = i * chunkSize * channels;
-                int end = (i == nThreads - 1) ? pixels * channels : (i + 1) * chunkSize * channels;
-                threads[i] = std::thread(processPixel, start, end);
-            }
-
-            for (auto& th : threads) {
-                if (th.joinable()) {
-                    th.join();
-                }
-            }
-
-            img = std::move(outputImage);
+        std::size_t separator = text.find_first_of("xX");
+        std::string width = text.substr(0, separator);
+        std::string height = separator == std::string::npos ? std::string() : text.substr(separator + 1);
+        auto isNumber = [](const std::string& part) {
+            return !part.empty() && part.size() <= 6 &&
+                   std::all_of(part.begin(), part.end(), [](unsigned char c) { return std::isdigit(c) != 0; });
+        };
+        if (!isNumber(width) || !isNumber(height) || (std::stoi(width) == 0 && std::stoi(height) == 0)) {
+            throw std::runtime_error("Invalid size: " + text + " (expected WIDTHxHEIGHT)");
         }
-    };
+        options.width = std::stoi(width);
+        options.height = std::stoi(height);
+    }
 
     /**
-     * @class ImageConverter
-     * @brief Converts images between different formats and applies processing.
+     * Parses the thread counts of the pipeline stages, such as "1,4,1,4,1".
      *
-     * The ImageConverter class is responsible for loading an image, applying
-     * processing to it via an ImageProcessor, and then saving it in a desired format.
-     * It supports multiple image formats for saving, including PNG, JPEG, BMP, and TGA.
+     * @param text Five positive counts for read, decode, process, encode and write.
+     * @param options Receives the counts.
+     * @throws std::runtime_error if the text is not a valid list.
      */
-    class ImageConverter
+    void ParseStageThreads(const std::string& text, bwconv::StagedOptions& options)
     {
-    public:
-        /**
-         * Constructor for ImageConverter.
-         * Initializes the converter with paths and an image processor.
-         *
-         * @param inputPath Path to the input image file.
-         * @param outputPath Path where the converted image will be saved.
-         * @param processor A unique pointer to an ImageProcessor for image processing.
-         */
-        ImageConverter(const std::string& inputPath, const std::string& outputPath,
-                       std::unique_ptr<ImageProcessor> processor)
-            : inputPath(inputPath), outputPath(outputPath), processor(std::move(processor))
-        {
-            using namespace SaveFile;
-            strategies["png"] = std::make_unique<PngSaveStrategy>();
-            strategies["jpg"] = std::make_unique<JpegSaveStrategy>();
-            strategies["jpeg"] = std::make_unique<JpegSaveStrategy>();
-            strategies["bmp"] = std::make_unique<BmpSaveStrategy>();
-            strategies["tga"] = std::make_unique<TgaSaveStrategy>();
+        std::size_t start = 0;
+        for (std::size_t s = 0; s < options.workers.size(); ++s) {
+            std::size_t end = s + 1 < options.workers.size() ? text.find(',', start) : text.size();
+            std::string count = end == std::string::npos ? std::string() : text.substr(start, end - start);
+            if (count.empty() || count.size() > 4 ||
+                !std::all_of(count.begin(), count.end(), [](unsigned char c) { return std::isdigit(c) != 0; }) ||
+                std::stoi(count) == 0) {
+                throw std::runtime_error("Invalid stage threads: " + text + " (expected R,D,P,E,W)");
+            }
+            options.workers[s] = std::stoi(count);
+            start = end + 1;
         }
+    }
+} // namespace
 
-        /**
-         * Converts the image from the input path, processes it, and saves it to the output path.
-         * This function will load the image, apply the processing, and then save it
-         * in the format determined by the output file's extension.
-         *
-         * @throws std::runtime_error if image loading, processing, or saving fails.
-         */
-        void ConvertImage()
-        {
-            int width, height, channels;
-            unsigned char* imgData = stbi_load(inputPath.c_str(), &width, &height, &channels, 0);
-            if (imgData == nullptr) {
-                throw std::runtime_error("Error loading image");
-            }
+int main(int argc, const char* argv[])
+{
+    CLI::App app;
 
-            std::unique_ptr<unsigned char[], void (*)(void*)> img(imgData, stbi_image_free);
-            
-            std::vector<unsigned char> imageVector(img.get(), img.get() + width * height * channels);
+    std::string inputFilePath, outputFilePath;
+    unsigned int threads = std::thread::hardware_concurrency();
+    bool pin = false;
+    bool numa = false;
+    std::size_t grainRows = 0;
+    bwconv::GrayOptions gray;
+    std::string luma = "avg";
+    std::string alpha = "ignore";
+    std::string crop;
+    std::string resize;
+    std::string resizeFilter = "bilinear";
+    bool autoContrast = false;
+    double autoContrastClip = 0.5;
+    bool invert = false;
+    std::string bilevel;
+    int threshold = 128;
+    std::string maxMemory;
+    bool stream = false;
+    bool atomic = false;
+    bool highBitDepth = false;
+    bool allFrames = false;
+    std::string bufferPool = "256M";
+    bool hugePages = false;
+    std::string cacheDir;
+    std::string cacheSize = "1G";
+    std::string statsFormat;
+    std::string tracePath;
+    bool histograms = false;
+    bwconv::EncoderOptions encoder;
+    std::string pngFilter = "adaptive";
+    std::string encoderBackend = "auto";
+    std::string decoderBackend = "auto";
+    bwconv::BatchOptions batch;
+    bool incremental = false;
+    std::string manifestPath;
+    bool hashInputs = false;
+    bool stagedPipeline = false;
+    std::string stageThreads;
+    std::size_t queueDepth = 0;
+    bwconv::Serve::ServerOptions server;
+#if defined(BWCONV_HAVE_OPENCL)
+    bool gpu = false;
+    std::size_t gpuMinPixels = bwconv::GpuOptions().minPixels;
+#endif
+    auto input = app.add_option("-i, --input", inputFilePath, "Input image file path");
+    auto output = app.add_option("-o,--output", outputFilePath, "Output image file path");
+    auto inputDir = app.add_option("--input-dir", batch.inputDir, "Directory of input images (batch mode)")
+                        ->check(CLI::ExistingDirectory);
+    auto listFile = app.add_option("--list", batch.listFile,
+                                   "File listing input images, one per line, each optionally followed by a tab and "
+                                   "a --crop region (batch mode)")
+                        ->check(CLI::ExistingFile);
+    auto outputDir = app.add_option("--output-dir", batch.outputDir, "Directory for converted images (batch mode)");
+    app.add_option("--glob", batch.glob, "Only convert inputs whose file name matches this pattern")->needs(outputDir);
+    app.add_option("--format", batch.format, "Output format extension in batch mode (default: keep input's)")
+        ->needs(outputDir);
+    app.add_flag("-r,--recursive", batch.recursive, "Scan the input directory recursively")->needs(inputDir);
+    auto incrementalFlag = app.add_flag("--incremental", incremental,
+                                        "Skip batch inputs that are unchanged since the run recorded in the manifest")
+                               ->needs(outputDir);
+    app.add_option("--manifest", manifestPath, "Manifest of --incremental (default: <output-dir>/.bwconv-manifest)")
+        ->needs(incrementalFlag);
+    app.add_flag("--hash-inputs", hashInputs, "With --incremental, compare inputs by content hash, not mtime")
+        ->needs(incrementalFlag);
+    auto pipelineFlag = app.add_flag("--pipeline", stagedPipeline,
+                                     "Run batches as stages with threads and queues of their own; --stats reports them")
+                            ->needs(outputDir);
+    app.add_option("--stage-threads", stageThreads,
+                   "Threads of the --pipeline stages read,decode,process,encode,write (default: 1,N,N/4,N,1)")
+        ->needs(pipelineFlag);
+    app.add_option("--queue-depth", queueDepth, "Capacity of the queues between --pipeline stages (default: N)")
+        ->check(CLI::Range(std::size_t(1), std::size_t(65536)))
+        ->needs(pipelineFlag);
+    auto serve = app.add_option("--serve", server.endpoint,
+                                "Serve conversions over HTTP on a port, host:port or unix:<socket path>");
+    app.add_option("--max-pending", server.maxPending,
+                   "Connections admitted beyond the busy workers in --serve mode (default: 2 per thread)")
+        ->needs(serve);
+    app.add_option("--request-timeout", server.requestTimeoutSeconds,
+                   "Seconds a --serve client may take to send a whole request (default: 60)")
+        ->check(CLI::Range(1, 86400))
+        ->needs(serve);
+    app.add_option("-j,--threads", threads, "Number of threads (default: all cores)")->check(CLI::Range(1u, 4096u));
+    app.add_flag("--pin", pin, "Bind every thread to a CPU of its own");
+    app.add_flag("--numa", numa,
+                 "Spread threads over the NUMA nodes, keep their tasks and buffers node-local, shard batches per node");
+    app.add_option("--grain", grainRows, "Rows per work tile (default: sized to the L2 cache)");
+    auto decodeGray = app.add_flag("--decode-gray", gray.decodeGray,
+                                   "Decode straight to luminance (BT.601 weights) instead of averaging the channels");
+    auto lumaOption = app.add_option("--luma", luma,
+                                     "Gray weights: avg (mean of all channels), bt601, bt709 or linear (sRGB-decoded)")
+                          ->check(CLI::IsMember({"avg", "bt601", "bt709", "linear"}));
+    app.add_option("--alpha", alpha, "Alpha with --luma bt601/bt709/linear: ignore, or premultiply (over black)")
+        ->check(CLI::IsMember({"ignore", "premultiply"}))
+        ->needs(lumaOption);
+    decodeGray->excludes(lumaOption);
+    app.add_option("--crop", crop,
+                   "Convert only the region X,Y,WIDTH,HEIGHT of every input, skipping the rest while decoding "
+                   "where the format allows (before --resize)");
+    auto resizeOption = app.add_option("--resize", resize,
+                                       "Shrink to fit WIDTHxHEIGHT (0 for no bound), keeping the aspect ratio");
+    app.add_option("--resize-filter", resizeFilter, "Filter of --resize: box, bilinear or lanczos (default: bilinear)")
+        ->check(CLI::IsMember({"box", "bilinear", "lanczos"}))
+        ->needs(resizeOption);
+    auto autoContrastFlag = app.add_flag("--auto-contrast", autoContrast,
+                                         "Stretch the gray levels of every image to the full range (before --invert)");
+    app.add_option("--auto-contrast-clip", autoContrastClip,
+                   "Percent of the darkest and of the brightest pixels --auto-contrast ignores (default: 0.5)")
+        ->check(CLI::Range(0.0, 49.9))
+        ->needs(autoContrastFlag);
+    app.add_flag("--invert", invert, "Invert the gray image (before --bilevel)");
+    app.add_option("--bilevel", bilevel,
+                   "Reduce to black and white: threshold, otsu, bayer, floyd-steinberg or atkinson")
+        ->check(CLI::IsMember({"threshold", "otsu", "bayer", "floyd-steinberg", "atkinson"}));
+    app.add_option("--threshold", threshold, "Gray level from which --bilevel threshold makes pixels white")
+        ->check(CLI::Range(1, 255));
+    app.add_option("--max-memory", maxMemory,
+                   "Stream images whose pixels exceed this size (e.g. 512M) in bands that fit in it; with "
+                   "--high-bit-depth, 16-bit PNGs stay 16-bit");
+    app.add_flag("--stream", stream, "Always convert in bands of rows (PNG, JPEG, BMP and TGA)");
+    app.add_flag("--atomic", atomic, "Write outputs to a temporary file and rename them into place");
+    app.add_flag("--high-bit-depth", highBitDepth,
+                 "Keep 16-bit and HDR inputs at full precision, also when streaming 16-bit PNGs; PNG outputs are then "
+                 "16-bit");
+    app.add_flag("--all-frames", allFrames,
+                 "Convert every frame of GIF inputs: a .gif output is animated, others get name-0001.ext, ...");
+    app.add_option("--buffer-pool", bufferPool,
+                   "Bytes of freed image buffers kept for reuse by later images, 0 to disable (default: 256M)");
+    app.add_flag("--huge-pages", hugePages, "Back image buffers of 2 MiB and more with transparent huge pages");
+    auto cacheOption = app.add_option("--cache", cacheDir,
+                                      "Directory caching outputs by input hash and settings; hits are copied");
+    app.add_option("--cache-size", cacheSize, "Bytes of outputs the --cache directory keeps (default: 1G)")
+        ->needs(cacheOption);
+    app.add_option("--jpeg-quality", encoder.jpegQuality, "JPEG quality, 1-100 (default: 100)")
+        ->check(CLI::Range(1, 100));
+    app.add_option("--png-level", encoder.pngLevel, "PNG deflate level, 0 (fastest) to 9 (smallest) (default: 8)")
+        ->check(CLI::Range(0, 9));
+    app.add_option("--png-filter", pngFilter, "PNG row filter: adaptive, none, sub, up, average or paeth")
+        ->check(CLI::IsMember({"adaptive", "none", "sub", "up", "average", "paeth"}));
+    app.add_option("--encoder", encoderBackend,
+                   "PNG/JPEG encoder: auto (zlib and libjpeg when available) or stb (portable)")
+        ->check(CLI::IsMember({"auto", "stb"}));
+    app.add_option("--decoder", decoderBackend,
+                   "Decoder: auto (libjpeg, libpng and libwebp when available) or stb (portable)")
+        ->check(CLI::IsMember({"auto", "stb"}));
+#if defined(BWCONV_HAVE_OPENCL)
+    auto gpuFlag = app.add_flag("--gpu", gpu,
+                                "Offload gray, resize, invert, threshold and bayer to an OpenCL GPU if there is one");
+    app.add_option("--gpu-min-pixels", gpuMinPixels, "Process images with fewer pixels on the CPU (default: 1048576)")
+        ->needs(gpuFlag);
+#endif
+    app.add_option("--stats", statsFormat, "Print per-image stage timings, I/O and memory to stdout (text or json)")
+        ->check(CLI::IsMember({"text", "json"}));
+    app.add_option("--trace", tracePath, "Write a Chrome trace-event file of every conversion stage");
+    auto histogramsFlag =
+        app.add_flag("--histograms", histograms, "Write the gray histogram and statistics of every output to <output>.json");
 
-            processor->ProcessImage(imageVector, width, height, channels);
+    input->excludes(inputDir)->excludes(listFile)->excludes(outputDir)->needs(output);
+    output->excludes(outputDir)->needs(input);
+    outputDir->excludes(input);
+    serve->excludes(input)->excludes(inputDir)->excludes(listFile)->excludes(outputDir);
+    histogramsFlag->excludes(serve)->excludes(cacheOption);
 
-            SaveImage(outputPath, imageVector, width, height);
+    CLI11_PARSE(app, argc, argv);
+
+    bool batchMode = !batch.inputDir.empty() || !batch.listFile.empty();
+    bool serveMode = !server.endpoint.empty();
+    if (!serveMode && (batchMode == batch.outputDir.empty() || (!batchMode && inputFilePath.empty()))) {
+        std::cerr << "Error: use either -i/-o, --input-dir/--list with --output-dir, or --serve" << std::endl;
+        return 1;
+    }
+
+    static const char* const filters[] = {"none", "sub", "up", "average", "paeth"};
+    for (int i = 0; i < 5; ++i) {
+        if (pngFilter == filters[i]) {
+            encoder.pngFilter = static_cast<bwconv::PngFilter>(i);
         }
+    }
+    static const char* const lumaModes[] = {"avg", "bt601", "bt709", "linear"};
+    for (int i = 0; i < 4; ++i) {
+        if (luma == lumaModes[i]) {
+            gray.luma = static_cast<bwconv::LumaMode>(i);
+        }
+    }
+    gray.alpha = alpha == "premultiply" ? bwconv::AlphaMode::Premultiply : bwconv::AlphaMode::Ignore;
+    encoder.backend = encoderBackend == "stb" ? bwconv::EncoderBackend::Stb : bwconv::EncoderBackend::Auto;
 
-    private:
-        std::string inputPath;                     ///< Path to the input image.
-        std::string outputPath;                    ///< Path to save the converted image.
-        std::unique_ptr<ImageProcessor> processor; ///< Unique pointer to the image processor.
-        std::unordered_map<std::string, std::unique_ptr<SaveFile::SaveStrategy>>
-            strategies; ///< Map of file extension to corresponding save strategies.
+    std::vector<std::unique_ptr<bwconv::Stats::StatsSink>> statsSinks;
+    if (statsFormat == "text") {
+        statsSinks.push_back(std::make_unique<bwconv::Stats::TextStatsSink>(std::cout));
+    } else if (statsFormat == "json") {
+        statsSinks.push_back(std::make_unique<bwconv::Stats::JsonLinesStatsSink>(std::cout));
+    }
+    if (!tracePath.empty()) {
+        statsSinks.push_back(std::make_unique<bwconv::Stats::ChromeTraceSink>(tracePath));
+    }
+    if (histograms) {
+        statsSinks.push_back(std::make_unique<bwconv::Stats::HistogramSidecarSink>());
+    }
 
-        /**
-         * Saves the processed image to the specified path.
-         *
-         * @param path Path where the image will be saved.
-         * @param img Processed image data.
-         * @param width Width of the image.
-         * @param height Height of the image.
-         * @throws std::runtime_error if the image format is unsupported.
-         */
+    int status = 0;
+    try {
+        // A single conversion runs on the main thread, which takes part in ParallelFor,
+        // so the pool only needs the remaining threads.
+        threads = std::max(1u, threads);
+        auto placement = bwconv::Numa::PlanPlacement(bwconv::Numa::DetectTopology(), threads, pin, numa);
+        if (!batchMode && !serveMode) {
+            bwconv::Numa::PlaceCurrentThread(placement.front());
+            placement.erase(placement.begin());
+        }
+        bwconv::ThreadPool pool(placement);
+        bwconv::ProcessingOptions processing;
+        processing.gray = gray;
+        processing.grainRows = grainRows;
+        processing.resize = !resize.empty();
+        if (processing.resize) {
+            ParseBoundingBox(resize, processing.resizeOptions);
+            processing.resizeOptions.filter = resizeFilter == "box" ? bwconv::ResizeFilter::Box
+                                              : resizeFilter == "lanczos" ? bwconv::ResizeFilter::Lanczos3
+                                                                          : bwconv::ResizeFilter::Bilinear;
+        }
+        processing.autoContrast = autoContrast;
+        processing.autoContrastClip = autoContrastClip / 100;
+        processing.invert = invert;
+        processing.bilevel = bilevel == "threshold"         ? bwconv::BilevelMode::Threshold
+                             : bilevel == "otsu"            ? bwconv::BilevelMode::Otsu
+                             : bilevel == "bayer"           ? bwconv::BilevelMode::Bayer
+                             : bilevel == "floyd-steinberg" ? bwconv::BilevelMode::FloydSteinberg
+                             : bilevel == "atkinson"        ? bwconv::BilevelMode::Atkinson
+                                                            : bwconv::BilevelMode::None;
+        processing.threshold = threshold;
+        processing.histogram = histograms;
+        auto pipeline = bwconv::CreateProcessorPipeline(pool, processing);
 
-        void SaveImage(const std::string& path, const std::vector<unsigned char>& img, int width, int height)
-        {
-            std::string extension = GetFileExtension(path);
-            auto it = strategies.find(extension);
-            if (it != strategies.end()) {
-                it->second->Save(path, img, width, height);
+        std::unique_ptr<bwconv::ImageProcessor> processor = std::move(pipeline);
+#if defined(BWCONV_HAVE_OPENCL)
+        if (gpu) {
+            // The device runs the same steps; the CPU pipeline takes what it cannot run well.
+            bwconv::GpuProgram program;
+            program.gray = gray;
+            program.resize = processing.resize;
+            program.resizeOptions = processing.resizeOptions;
+            for (int v = 0; v < 256; ++v) {
+                int value = invert ? 255 - v : v;
+                if (bilevel == "threshold") {
+                    value = value >= threshold ? 255 : 0;
+                }
+                program.lookup[v] = static_cast<unsigned char>(value);
+            }
+            program.bayer = bilevel == "bayer";
+            program.bilevel = bilevel == "threshold" || program.bayer;
+            bwconv::GpuOptions gpuOptions;
+            gpuOptions.minPixels = gpuMinPixels;
+            if (gray.luma == bwconv::LumaMode::Linear || autoContrast || histograms ||
+                (!bilevel.empty() && !program.bilevel)) {
+                std::cerr << "Warning: --luma linear, --auto-contrast, --histograms, --bilevel otsu and error "
+                             "diffusion run on the CPU only"
+                          << std::endl;
             } else {
-                throw std::runtime_error("Unsupported image format");
+                try {
+                    processor = std::make_unique<bwconv::OpenClProcessor>(processor, program, gpuOptions);
+                } catch (const std::exception& e) {
+                    std::cerr << "Warning: " << e.what() << "; processing on the CPU" << std::endl;
+                }
             }
         }
-        /**
-         * Extracts the file extension from the given file name.
-         *
-         * @param fileName Name of the file.
-         * @return Lowercase string of the file extension.
-         * @throws std::runtime_error if the file extension cannot be determined.
-         */
-        std::string GetFileExtension(const std::string& fileName)
-        {
-            size_t dotPos = fileName.find_last_of('.');
-            if (dotPos == std::string::npos)
-                throw std::runtime_error("An error was encountered while finding the file extension.");
+#endif
 
-            auto ext = fileName.substr(dotPos + 1);
-            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-            return ext;
-        }
-    };
-} // namespace
+        std::size_t memoryLimit = maxMemory.empty() ? 0 : ParseByteSize(maxMemory);
+        bwconv::BufferPoolOptions poolOptions;
+        poolOptions.capacity = ParseByteSize(bufferPool);
+        poolOptions.hugePages = hugePages;
+        bwconv::BufferPool::Global().Configure(poolOptions);
 
-int main(int argc, const char* argv[])
-{
-    CLI::App app;
+        std::unique_ptr<bwconv::ResultCache> cache;
+        if (!cacheDir.empty()) {
+            cache = std::make_unique<bwconv::ResultCache>(cacheDir, ParseByteSize(cacheSize));
+        }
 
-    std::string inputFilePath, outputFilePath;
-    app.add_option("-i, --input", inputFilePath, "Input image file path")->required();
-    app.add_option("-o,--output", outputFilePath, "Output image file path")->required();
+        bwconv::ImageConverter converter(inputFilePath, outputFilePath, std::move(processor));
+        converter.SetResultCache(cache.get());
+        converter.SetMemoryLimit(memoryLimit, stream);
+        converter.SetAtomicWrites(atomic);
+        converter.SetHighBitDepth(highBitDepth);
+        converter.SetAllFrames(allFrames ? &pool : nullptr);
+        converter.SetEncoderOptions(encoder);
+        converter.SetDecoderBackend(decoderBackend == "stb" ? bwconv::DecoderBackend::Stb
+                                                            : bwconv::DecoderBackend::Auto);
+        if (!crop.empty()) {
+            batch.crop = bwconv::CropRegion::Parse(crop);
+            converter.SetCrop(batch.crop);
+        }
+        for (auto& sink : statsSinks) {
+            converter.AddStatsSink(*sink);
+        }
 
-    CLI11_PARSE(app, argc, argv);
+        if (serveMode) {
+            bwconv::Serve::ConversionServer(converter, pool, server).Run();
+        } else if (!batchMode) {
+            converter.ConvertImage();
+        } else {
+            std::unique_ptr<bwconv::BatchConverter> batchConverter;
+            bwconv::StagedBatchConverter* staged = nullptr;
+            if (stagedPipeline) {
+                // Decoding and encoding run one image per thread; processing spreads each
+                // image over the pool on its own.
+                int n = static_cast<int>(threads);
+                bwconv::StagedOptions stagedOptions;
+                stagedOptions.workers = {{1, n, std::max(1, n / 4), n, 1}};
+                if (!stageThreads.empty()) {
+                    ParseStageThreads(stageThreads, stagedOptions);
+                }
+                stagedOptions.queueDepth = queueDepth != 0 ? queueDepth : std::max<std::size_t>(2, threads);
+                auto owned = std::make_unique<bwconv::StagedBatchConverter>(converter, pool, stagedOptions);
+                staged = owned.get();
+                batchConverter = std::move(owned);
+            } else {
+                batchConverter = std::make_unique<bwconv::BatchConverter>(converter, pool);
+            }
+            std::vector<bwconv::BatchJob> jobs = bwconv::CollectBatchJobs(batch, &pool);
+            std::size_t failed = 0;
+            if (incremental) {
+                if (manifestPath.empty()) {
+                    std::filesystem::create_directories(batch.outputDir);
+                    manifestPath = (std::filesystem::path(batch.outputDir) / ".bwconv-manifest").string();
+                }
+                std::size_t skipped = 0;
+                failed = bwconv::RunIncremental(*batchConverter, converter, pool, std::move(jobs), manifestPath,
+                                                hashInputs, skipped);
+                if (skipped != 0) {
+                    std::cerr << "Skipped " << skipped << " up-to-date image(s)" << std::endl;
+                }
+            } else {
+                failed = batchConverter->Run(jobs);
+            }
+            if (staged != nullptr && !statsFormat.empty()) {
+                staged->PrintReport(std::cerr);
+            }
+            if (failed != 0) {
+                std::cerr << "Error: " << failed << " image(s) failed to convert" << std::endl;
+                status = 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        status = 1;
+    }
 
     try {
-        auto processor = std::make_unique<BlackAndWhiteProcessor>();
-        ImageConverter converter(inputFilePath, outputFilePath, std::move(processor));
-        converter.ConvertImage();
+        for (auto& sink : statsSinks) {
+            sink->Finish();
+        }
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
-        return 1;
+        status = 1;
     }
-
-    return 0;
+    return status;
 }
@@ -0,0 +1,116 @@
+/**
+ * @file auto_contrast_processor.hpp
+ * @brief Gray conversion followed by a contrast stretch chosen per image from the histogram
+ *        counted during the conversion.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "black_and_white_processor.hpp"
+#include "histogram.hpp"
+#include "image_processor.hpp"
+#include "lookup_processor.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+namespace bwconv
+{
+    /**
+     * @class AutoContrastProcessor
+     * @brief Converts images to gray and stretches their levels to the full range.
+     *
+     * The gray levels are counted while the gray conversion writes them, so choosing the
+     * stretch costs no extra pass over the image. The darkest and brightest clip fraction
+     * of the samples are ignored, so a few specks of dust or glare do not decide the range;
+     * the levels between are mapped linearly onto 0 to 255 by a LookupProcessor. Wide
+     * samples keep their type; they are counted at the 8-bit level they round to.
+     */
+    class AutoContrastProcessor : public ImageProcessor
+    {
+    public:
+        /**
+         * @param pool The thread pool used to process tiles of the image concurrently.
+         * @param clip Fraction of the samples ignored at either end, 0 to below 0.5.
+         * @param grainRows Rows per tile; zero picks a tile size that fits in the L2 cache.
+         * @param options Settings of the gray conversion.
+         * @throws std::runtime_error if clip is out of range.
+         */
+        explicit AutoContrastProcessor(ThreadPool& pool, double clip = 0.005, std::size_t grainRows = 0,
+                                       const GrayOptions& options = GrayOptions())
+            : pool(pool), clip(clip), grainRows(grainRows), gray(pool, grainRows, options)
+        {
+            if (!(clip >= 0 && clip < 0.5)) {
+                throw std::runtime_error("Auto-contrast clip must be at least 0 and below 0.5");
+            }
+        }
+
+        int DesiredChannels() const override { return gray.DesiredChannels(); }
+
+        std::string Fingerprint() const override
+        {
+            return gray.Fingerprint() + ";autocontrast:" + std::to_string(clip);
+        }
+
+        /**
+         * Counts the gray levels into the conversion record, see
+         * BlackAndWhiteProcessor::SetCollectHistogram. They are the levels before the stretch.
+         */
+        void SetCollectHistogram(bool collect) { gray.SetCollectHistogram(collect); }
+
+        /**
+         * Converts the image to gray and stretches it, in place.
+         *
+         * @param img View of the image to be processed; describes the gray result on return.
+         */
+        void ProcessImage(ImageView& img) override
+        {
+            HistogramCollector levels;
+            gray.Convert(img, &levels);
+            Histogram histogram = levels.Merge();
+            if (histogram.Total() == 0) {
+                return;
+            }
+            int low = histogram.Percentile(clip);
+            int high = std::max(low, histogram.Percentile(1 - clip));
+            LookupProcessor(pool, StretchTable(low, high, img.sample), grainRows).ProcessImage(img);
+        }
+
+        /**
+         * @param low Level mapped to black.
+         * @param high Level mapped to white.
+         * @param sample Type of the samples the table is applied to. Float samples are linear
+         *               light, counted gamma-encoded, so their table works on linear levels.
+         * @return Table mapping [low, high] linearly onto [0, 255], or the identity if the
+         *         range is empty.
+         */
+        static std::array<unsigned char, 256> StretchTable(int low, int high, SampleType sample = SampleType::U8)
+        {
+            std::array<unsigned char, 256> table{};
+            double from = low, to = high;
+            if (sample == SampleType::F32) {
+                from = 255 * std::pow(low / 255.0, 2.2);
+                to = 255 * std::pow(high / 255.0, 2.2);
+            }
+            for (int v = 0; v < 256; ++v) {
+                double stretched = to > from ? (v - from) * 255 / (to - from) : v;
+                table[v] = static_cast<unsigned char>(std::clamp(std::lround(stretched), 0L, 255L));
+            }
+            return table;
+        }
+
+    private:
+        ThreadPool& pool;            ///< Pool shared with the rest of the conversion.
+        double clip;                 ///< Fraction of the samples ignored at either end.
+        std::size_t grainRows;       ///< Rows per tile, zero for automatic.
+        BlackAndWhiteProcessor gray; ///< The gray conversion, which counts the levels.
+    };
+} // namespace bwconv
@@ -0,0 +1,289 @@
+/**
+ * @file batch_converter.hpp
+ * @brief Converts many images concurrently on a shared thread pool.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "crop_region.hpp"
+#include "image_converter.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @struct BatchJob
+     * @brief A single input/output pair scheduled by the BatchConverter.
+     */
+    struct BatchJob
+    {
+        std::string input;  ///< Path of the image to read.
+        std::string output; ///< Path of the image to write.
+        CropRegion crop;    ///< Region of the input to convert.
+    };
+
+    /**
+     * @struct BatchOptions
+     * @brief Describes where batch inputs come from and where results go.
+     */
+    struct BatchOptions
+    {
+        std::string inputDir;  ///< Directory scanned for inputs; list entries are relative to it.
+        std::string listFile;  ///< Optional file with one input path per line.
+        std::string outputDir; ///< Directory receiving the converted images.
+        std::string glob;      ///< Filename pattern ('*' and '?') selecting inputs.
+        std::string format;    ///< Output extension; empty keeps the input's extension.
+        bool recursive = false; ///< Descend into subdirectories of inputDir.
+        CropRegion crop;       ///< Region converted of inputs whose list entry names none.
+    };
+
+    /**
+     * Matches a file name against a shell-style pattern supporting '*' and '?'.
+     *
+     * @param pattern The pattern to match.
+     * @param name The file name to test.
+     * @return true if the whole name matches the pattern.
+     */
+    inline bool MatchesGlob(const std::string& pattern, const std::string& name)
+    {
+        std::size_t p = 0, n = 0, starP = std::string::npos, starN = 0;
+        while (n < name.size()) {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+                ++p;
+                ++n;
+            } else if (p < pattern.size() && pattern[p] == '*') {
+                starP = p++;
+                starN = n;
+            } else if (starP != std::string::npos) {
+                p = starP + 1;
+                n = ++starN;
+            } else {
+                return false;
+            }
+        }
+        while (p < pattern.size() && pattern[p] == '*') {
+            ++p;
+        }
+        return p == pattern.size();
+    }
+
+    /**
+     * Builds the list of batch jobs described by the options.
+     * Inputs found in the input directory keep their relative layout below the
+     * output directory; list entries outside the input directory keep only their file name.
+     *
+     * A list entry may name a region of its input after a tab, as "page.png<TAB>x,y,w,h",
+     * and an input may be listed once per region. The second and later entries of an
+     * input get outputs of their own, numbered like page-2.png.
+     *
+     * With a pool, recursive scans list the directories of every level of the tree in
+     * parallel, which keeps trees of millions of files from waiting on one directory
+     * read at a time.
+     *
+     * @param options The batch description.
+     * @param pool Optional pool for scanning directories concurrently.
+     * @return The jobs in discovery order.
+     * @throws std::runtime_error if the list file cannot be read or names an invalid region.
+     */
+    inline std::vector<BatchJob> CollectBatchJobs(const BatchOptions& options, ThreadPool* pool = nullptr)
+    {
+        namespace fs = std::filesystem;
+        std::vector<fs::path> inputs;
+        std::vector<CropRegion> crops; // Regions of the list entries, in the order of inputs.
+
+        if (!options.listFile.empty()) {
+            std::ifstream list(options.listFile);
+            if (!list) {
+                throw std::runtime_error("Unable to read list file " + options.listFile);
+            }
+            std::string line;
+            while (std::getline(list, line)) {
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                if (line.empty() || line[0] == '#') {
+                    continue;
+                }
+                std::size_t tab = line.find('\t');
+                crops.push_back(tab == std::string::npos ? options.crop : CropRegion::Parse(line.substr(tab + 1)));
+                fs::path entry(line.substr(0, tab));
+                inputs.push_back(entry.is_relative() && !options.inputDir.empty() ? options.inputDir / entry : entry);
+            }
+        } else {
+            auto consider = [&](const fs::directory_entry& entry) {
+                if (entry.is_regular_file()) {
+                    inputs.push_back(entry.path());
+                }
+            };
+            if (options.recursive && pool != nullptr) {
+                std::vector<fs::path> level{fs::path(options.inputDir)};
+                while (!level.empty()) {
+                    std::vector<std::vector<fs::path>> files(level.size()), directories(level.size());
+                    pool->ParallelFor(0, level.size(), 1, [&](std::size_t first, std::size_t last) {
+                        for (std::size_t i = first; i < last; ++i) {
+                            for (const auto& entry : fs::directory_iterator(level[i])) {
+                                if (entry.is_directory() && !entry.is_symlink()) {
+                                    directories[i].push_back(entry.path());
+                                } else if (entry.is_regular_file()) {
+                                    files[i].push_back(entry.path());
+                                }
+                            }
+                        }
+                    });
+                    level.clear();
+                    for (std::size_t i = 0; i < files.size(); ++i) {
+                        inputs.insert(inputs.end(), files[i].begin(), files[i].end());
+                        level.insert(level.end(), directories[i].begin(), directories[i].end());
+                    }
+                }
+            } else if (options.recursive) {
+                for (const auto& entry : fs::recursive_directory_iterator(options.inputDir)) {
+                    consider(entry);
+                }
+            } else {
+                for (const auto& entry : fs::directory_iterator(options.inputDir)) {
+                    consider(entry);
+                }
+            }
+            std::sort(inputs.begin(), inputs.end());
+        }
+
+        std::vector<BatchJob> jobs;
+        jobs.reserve(inputs.size());
+        std::unordered_map<std::string, int> listed; // Entries seen per input.
+        for (std::size_t i = 0; i < inputs.size(); ++i) {
+            const fs::path& input = inputs[i];
+            if (!options.glob.empty() && !MatchesGlob(options.glob, input.filename().string())) {
+                continue;
+            }
+
+            fs::path relative = input.filename();
+            if (!options.inputDir.empty()) {
+                fs::path candidate = input.lexically_relative(options.inputDir);
+                if (!candidate.empty() && *candidate.begin() != "..") {
+                    relative = candidate;
+                }
+            }
+            if (!options.format.empty()) {
+                relative.replace_extension(options.format);
+            }
+            int count = ++listed[input.string()];
+            if (count > 1) {
+                relative.replace_filename(relative.stem().string() + "-" + std::to_string(count) +
+                                          relative.extension().string());
+            }
+            jobs.push_back({input.string(), (fs::path(options.outputDir) / relative).string(),
+                            crops.empty() ? options.crop : crops[i]});
+        }
+        return jobs;
+    }
+
+    /**
+     * @class BatchConverter
+     * @brief Schedules whole files across a shared thread pool.
+     *
+     * Every job runs as one pool task, so while one worker decodes a file another is
+     * processing or encoding a different one. The number of queued files is bounded
+     * to keep memory proportional to the pool size rather than to the batch size.
+     * On a pool placed on several NUMA nodes, every job goes to the node with the fewest
+     * unfinished jobs, so each file is decoded, processed and encoded by the workers of
+     * one node in memory local to them.
+     */
+    class BatchConverter
+    {
+    public:
+        /**
+         * Constructor for BatchConverter.
+         *
+         * @param converter The converter shared by all jobs.
+         * @param pool The pool the jobs run on.
+         */
+        BatchConverter(ImageConverter& converter, ThreadPool& pool)
+            : converter(converter), pool(pool), maxInFlight(2 * static_cast<std::size_t>(pool.Size()))
+        {
+        }
+
+        virtual ~BatchConverter() = default;
+
+        /**
+         * Converts every job and waits for completion. Failures are reported to
+         * stderr and do not stop the remaining jobs.
+         *
+         * @param jobs The jobs to run.
+         * @param finished Optional callback invoked with the index of every job and whether it
+         *                 succeeded, once it has finished; invocations never overlap.
+         * @return The number of jobs that failed.
+         */
+        virtual std::size_t Run(const std::vector<BatchJob>& jobs,
+                                const std::function<void(std::size_t, bool)>& finished = nullptr)
+        {
+            std::size_t failed = 0;
+            std::size_t inFlight = 0;
+            std::mutex mutex;
+            std::condition_variable changed;
+            std::vector<std::size_t> nodeLoad(static_cast<std::size_t>(pool.Nodes()));
+
+            for (std::size_t index = 0; index < jobs.size(); ++index) {
+                int node;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [&] { return inFlight < maxInFlight; });
+                    ++inFlight;
+                    node = static_cast<int>(std::min_element(nodeLoad.begin(), nodeLoad.end()) - nodeLoad.begin());
+                    ++nodeLoad[node];
+                }
+
+                pool.Submit([&, index, node] {
+                    const BatchJob& job = jobs[index];
+                    std::string error;
+                    try {
+                        auto parent = std::filesystem::path(job.output).parent_path();
+                        if (!parent.empty()) {
+                            std::filesystem::create_directories(parent);
+                        }
+                        converter.ConvertImage(job.input, job.output, job.crop);
+                    } catch (const std::exception& e) {
+                        error = e.what();
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error.empty()) {
+                        std::cerr << "Error: " << job.input << ": " << error << std::endl;
+                        ++failed;
+                    }
+                    if (finished) {
+                        finished(index, error.empty());
+                    }
+                    --inFlight;
+                    --nodeLoad[node];
+                    changed.notify_all();
+                }, node);
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return inFlight == 0; });
+            return failed;
+        }
+
+    protected:
+        ImageConverter& converter; ///< Converter shared by all jobs.
+        ThreadPool& pool;          ///< Pool executing the jobs.
+        std::size_t maxInFlight;   ///< Upper bound of submitted but unfinished jobs.
+    };
+} // namespace bwconv
@@ -0,0 +1,234 @@
+/**
+ * @file batch_manifest.hpp
+ * @brief Record of the inputs of a batch run, letting the next run skip unchanged images.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "batch_converter.hpp"
+#include "hash.hpp"
+#include "image_converter.hpp"
+#include "mapped_file.hpp"
+#include "save_strategy.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @struct ManifestEntry
+     * @brief The state of an input and the settings it was converted with.
+     */
+    struct ManifestEntry
+    {
+        std::uint64_t size = 0;        ///< Input size in bytes.
+        std::int64_t modified = 0;     ///< Input modification time in file clock ticks.
+        std::uint64_t contentHash = 0; ///< XXH64 of the input, or 0 if not hashed.
+        std::uint64_t settings = 0;    ///< XXH64 of ImageConverter::OutputSettings.
+        std::string output;            ///< Path of the output.
+    };
+
+    /**
+     * @class BatchManifest
+     * @brief Remembers, per input and output path, what the last run of a batch converted.
+     *
+     * The manifest is a text file with one tab-separated line per input and output, so an
+     * input cut into several regions by a list file has a line per region. A job is up to
+     * date when its input has the recorded size and modification time (or content hash),
+     * the settings and the output path are unchanged and the output still exists; such
+     * jobs are skipped. After the run the manifest is replaced atomically by one that
+     * describes this run's up-to-date and successfully converted inputs, so failed images
+     * are retried next time. Paths containing tabs or line breaks are never recorded.
+     */
+    class BatchManifest
+    {
+    public:
+        /**
+         * Reads the manifest; a missing or unreadable file is an empty manifest.
+         *
+         * @param path Path of the manifest file.
+         */
+        explicit BatchManifest(const std::string& path) : path(path)
+        {
+            std::ifstream file(path);
+            std::string line;
+            if (!std::getline(file, line) || line != kHeader) {
+                return;
+            }
+            while (std::getline(file, line)) {
+                std::istringstream fields(line);
+                ManifestEntry entry;
+                std::string input;
+                if (fields >> entry.size >> entry.modified >> std::hex >> entry.contentHash >> entry.settings &&
+                    fields.get() == '\t' && std::getline(fields, input, '\t') && std::getline(fields, entry.output)) {
+                    std::string key = Key(input, entry.output);
+                    entries[key] = std::move(entry);
+                }
+            }
+        }
+
+        /**
+         * Describes the current state of every job's input, in parallel.
+         *
+         * @param jobs The jobs.
+         * @param converter The converter, whose settings are recorded.
+         * @param pool Pool for examining inputs concurrently.
+         * @param hashContents Also hash every input, so that rewritten but identical files
+         *                     are recognized and touched files are not re-converted.
+         * @return One entry per job; an entry with settings 0 is never up to date.
+         */
+        static std::vector<ManifestEntry> Describe(const std::vector<BatchJob>& jobs, const ImageConverter& converter,
+                                                   ThreadPool& pool, bool hashContents)
+        {
+            namespace fs = std::filesystem;
+            std::vector<ManifestEntry> current(jobs.size());
+            pool.ParallelFor(0, jobs.size(), 64, [&](std::size_t first, std::size_t last) {
+                for (std::size_t i = first; i < last; ++i) {
+                    ManifestEntry& entry = current[i];
+                    entry.output = jobs[i].output;
+                    std::error_code sizeError, timeError;
+                    entry.size = fs::file_size(jobs[i].input, sizeError);
+                    entry.modified = fs::last_write_time(jobs[i].input, timeError).time_since_epoch().count();
+                    bool missing = sizeError || timeError;
+                    std::string settings;
+                    try {
+                        settings = converter.OutputSettings(jobs[i].output, jobs[i].crop);
+                        if (hashContents && !missing) {
+                            MappedFile file(jobs[i].input);
+                            entry.contentHash = Xxh64(file.Data(), file.Size());
+                        }
+                    } catch (const std::exception&) {
+                        settings.clear();
+                    }
+                    entry.settings = missing || settings.empty() ? 0 : Xxh64(settings.data(), settings.size()) | 1;
+                }
+            });
+            return current;
+        }
+
+        /**
+         * @param input Path of a job's input.
+         * @param current The input's state from Describe.
+         * @return true if the output from the last run is still valid.
+         */
+        bool UpToDate(const std::string& input, const ManifestEntry& current) const
+        {
+            auto found = entries.find(Key(input, current.output));
+            if (current.settings == 0 || found == entries.end()) {
+                return false;
+            }
+            const ManifestEntry& last = found->second;
+            bool sameInput = current.contentHash != 0 ? last.contentHash == current.contentHash
+                                                      : last.modified == current.modified;
+            std::error_code error;
+            return sameInput && last.size == current.size && last.settings == current.settings &&
+                   last.output == current.output && std::filesystem::exists(current.output, error);
+        }
+
+        /**
+         * Replaces the manifest file by one listing the given inputs.
+         *
+         * @param inputs Input paths.
+         * @param states Their entries, in the same order.
+         * @throws std::runtime_error if the file cannot be written.
+         */
+        void Save(const std::vector<std::string>& inputs, const std::vector<ManifestEntry>& states) const
+        {
+            std::ostringstream text;
+            text << kHeader << '\n';
+            for (std::size_t i = 0; i < inputs.size(); ++i) {
+                const ManifestEntry& entry = states[i];
+                if (inputs[i].find_first_of("\t\r\n") != std::string::npos ||
+                    entry.output.find_first_of("\t\r\n") != std::string::npos) {
+                    continue;
+                }
+                text << entry.size << '\t' << entry.modified << '\t' << std::hex << entry.contentHash << '\t'
+                     << entry.settings << std::dec << '\t' << inputs[i] << '\t' << entry.output << '\n';
+            }
+            std::string data = text.str();
+            SaveFile::WriteFile(path, reinterpret_cast<const unsigned char*>(data.data()), data.size(), true);
+        }
+
+    private:
+        static constexpr const char* kHeader = "# bwconv manifest 1";
+
+        std::string path;                                       ///< Path of the manifest file.
+        std::unordered_map<std::string, ManifestEntry> entries; ///< Last run's entries by Key.
+
+        /**
+         * @return The key of a job's entry; neither path of a recorded line contains a tab.
+         */
+        static std::string Key(const std::string& input, const std::string& output) { return input + '\t' + output; }
+    };
+
+    /**
+     * Runs a batch, converting only the jobs whose inputs, settings or outputs changed
+     * since the run recorded in the manifest, and records this run.
+     *
+     * @param batch The converter running the jobs.
+     * @param converter The converter, whose settings are recorded.
+     * @param pool Pool for examining inputs concurrently.
+     * @param jobs All jobs of the batch.
+     * @param manifestPath Path of the manifest file.
+     * @param hashContents Compare inputs by content hash instead of modification time.
+     * @param skipped Receives the number of up-to-date jobs.
+     * @return The number of jobs that failed.
+     * @throws std::runtime_error if the manifest cannot be written.
+     */
+    inline std::size_t RunIncremental(BatchConverter& batch, const ImageConverter& converter, ThreadPool& pool,
+                                      std::vector<BatchJob> jobs, const std::string& manifestPath, bool hashContents,
+                                      std::size_t& skipped)
+    {
+        namespace fs = std::filesystem;
+        // The manifest may lie below the input directory; it is never an input.
+        fs::path manifestFile = fs::absolute(manifestPath).lexically_normal();
+        jobs.erase(std::remove_if(jobs.begin(), jobs.end(),
+                                  [&](const BatchJob& job) {
+                                      return fs::absolute(job.input).lexically_normal() == manifestFile;
+                                  }),
+                   jobs.end());
+
+        BatchManifest manifest(manifestPath);
+        std::vector<ManifestEntry> states = BatchManifest::Describe(jobs, converter, pool, hashContents);
+        std::vector<char> valid(jobs.size(), 0);
+        std::vector<BatchJob> stale;
+        std::vector<std::size_t> staleIndex;
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+            if (manifest.UpToDate(jobs[i].input, states[i])) {
+                valid[i] = 1;
+            } else {
+                stale.push_back(jobs[i]);
+                staleIndex.push_back(i);
+            }
+        }
+        skipped = jobs.size() - stale.size();
+
+        std::size_t failed = batch.Run(stale, [&](std::size_t index, bool ok) {
+            valid[staleIndex[index]] = ok && states[staleIndex[index]].settings != 0;
+        });
+
+        std::vector<std::string> inputs;
+        std::vector<ManifestEntry> recorded;
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+            if (valid[i]) {
+                inputs.push_back(jobs[i].input);
+                recorded.push_back(states[i]);
+            }
+        }
+        manifest.Save(inputs, recorded);
+        return failed;
+    }
+} // namespace bwconv
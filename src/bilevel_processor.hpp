@@ -0,0 +1,440 @@
+/**
+ * @file bilevel_processor.hpp
+ * @brief Processors reducing images to pure black and white: thresholding, ordered
+ *        dithering and error diffusion.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "black_and_white_processor.hpp"
+#include "buffer_pool.hpp"
+#include "histogram.hpp"
+#include "image_processor.hpp"
+#include "row_stage.hpp"
+#include "sample_conversion.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @class BilevelProcessor
+     * @brief Base class of processors whose output has only the values 0 and 255.
+     *
+     * The image is first converted to gray by a BlackAndWhiteProcessor, then Binarize
+     * replaces every gray sample by black or white. The result is marked bilevel, which
+     * lets the PNG and PBM encoders store one bit per pixel.
+     */
+    class BilevelProcessor : public ImageProcessor
+    {
+    public:
+        /**
+         * @param pool The thread pool used to process tiles of the image concurrently.
+         * @param grainRows Rows per tile; zero picks a tile size that fits in the L2 cache.
+         * @param options Settings of the preceding gray conversion.
+         */
+        explicit BilevelProcessor(ThreadPool& pool, std::size_t grainRows = 0,
+                                  const GrayOptions& options = GrayOptions())
+            : pool(pool), grainRows(grainRows), gray(pool, grainRows, options)
+        {
+        }
+
+        int DesiredChannels() const override { return gray.DesiredChannels(); }
+
+        /**
+         * The gray conversion's fingerprint followed by BinarizeFingerprint.
+         */
+        std::string Fingerprint() const override
+        {
+            std::string binarize = BinarizeFingerprint();
+            return binarize.empty() ? std::string() : gray.Fingerprint() + ";" + binarize;
+        }
+
+        /**
+         * The gray conversion followed by BinarizeStage, if the subclass has one.
+         */
+        std::vector<const RowStage*> RowStages() const override
+        {
+            const RowStage* binarize = BinarizeStage();
+            if (binarize == nullptr) {
+                return {};
+            }
+            std::vector<const RowStage*> stages = gray.RowStages();
+            stages.push_back(binarize);
+            return stages;
+        }
+
+        /**
+         * Counts the gray levels into the conversion record, see
+         * BlackAndWhiteProcessor::SetCollectHistogram.
+         */
+        void SetCollectHistogram(bool collect) { gray.SetCollectHistogram(collect); }
+
+        /**
+         * Converts the image to gray and then to black and white, in place. Gray samples of
+         * wider types are rounded to bytes before binarization, whose levels are 8-bit. The
+         * histogram Binarize may need is counted during the gray conversion.
+         *
+         * @param img View of the image to be processed; describes the bilevel result on return.
+         */
+        void ProcessImage(ImageView& img) override
+        {
+            HistogramCollector levels;
+            gray.Convert(img, UsesHistogram() ? &levels : nullptr);
+            ConvertSamplesInPlace(img, SampleType::U8);
+            Binarize(img, UsesHistogram() ? levels.Merge() : Histogram());
+            img.bilevel = true;
+        }
+
+    protected:
+        /**
+         * Replaces every sample of a packed gray image by 0 or 255.
+         *
+         * @param img The gray image; its samples are overwritten.
+         * @param histogram Its gray levels if UsesHistogram, else empty.
+         */
+        virtual void Binarize(const ImageView& img, const Histogram& histogram) = 0;
+
+        /**
+         * @return true if Binarize needs the histogram of the gray image.
+         */
+        virtual bool UsesHistogram() const { return false; }
+
+        /**
+         * @return The per-row equivalent of Binarize, or nullptr if it needs the whole image.
+         */
+        virtual const RowStage* BinarizeStage() const { return nullptr; }
+
+        /**
+         * @return Description of the settings of Binarize, see ImageProcessor::Fingerprint;
+         *         empty if results must not be reused.
+         */
+        virtual std::string BinarizeFingerprint() const { return std::string(); }
+
+        /**
+         * Applies a stage to every row of a packed gray image in parallel tiles.
+         *
+         * @param img The gray image; its samples are overwritten.
+         * @param stage The stage, which must keep a single channel.
+         */
+        void ApplyStage(const ImageView& img, const RowStage& stage)
+        {
+            RowFunction function = stage.Bind(1);
+            if (!function) {
+                return;
+            }
+            ForEachTile(img, [&](std::size_t firstRow, std::size_t lastRow) {
+                for (std::size_t y = firstRow; y < lastRow; ++y) {
+                    unsigned char* row = img.Row(static_cast<int>(y));
+                    function(row, row, img.width, img.top + static_cast<int>(y));
+                }
+            });
+        }
+
+        /**
+         * Runs body over tiles of rows on the pool, reporting thread utilization.
+         *
+         * @param img The image whose rows are processed.
+         * @param body Callable invoked as body(firstRow, lastRow).
+         */
+        void ForEachTile(const ImageView& img, const std::function<void(std::size_t, std::size_t)>& body)
+        {
+            std::size_t grain = grainRows != 0 ? grainRows
+                                               : std::max<std::size_t>(1, kTileBytes / std::max<std::size_t>(
+                                                                                           1, img.RowBytes()));
+            Run(0, static_cast<std::size_t>(img.height), grain, body);
+        }
+
+        /**
+         * ThreadPool::ParallelFor that reports thread utilization to the current conversion.
+         */
+        void Run(std::size_t begin, std::size_t end, std::size_t grain,
+                 const std::function<void(std::size_t, std::size_t)>& body)
+        {
+            Stats::ConversionStats* stats = Stats::ConversionStats::Current();
+            std::vector<double> busy;
+            pool.ParallelFor(begin, end, grain, body, stats != nullptr ? &busy : nullptr);
+            if (stats != nullptr) {
+                stats->AddWorkerBusy(busy);
+            }
+        }
+
+        ThreadPool& pool; ///< Pool shared with the rest of the conversion.
+
+    private:
+        /// Bytes touched per tile when the grain is chosen automatically.
+        static constexpr std::size_t kTileBytes = 256 * 1024;
+
+        std::size_t grainRows;       ///< Rows per tile, zero for automatic.
+        BlackAndWhiteProcessor gray; ///< The gray conversion preceding binarization.
+    };
+
+    /**
+     * @class ThresholdProcessor
+     * @brief Makes every pixel at or above a threshold white and the rest black.
+     *
+     * The threshold is either fixed or chosen per image with Otsu's method, which picks the
+     * level that maximises the between-class variance of the gray histogram. The histogram
+     * is counted while the gray conversion writes the levels, so it takes no pass of its own.
+     */
+    class ThresholdProcessor : public BilevelProcessor
+    {
+    public:
+        /**
+         * @param pool The thread pool used to process tiles of the image concurrently.
+         * @param level Threshold 1 to 255; zero chooses it per image with Otsu's method.
+         * @param grainRows Rows per tile; zero picks a tile size that fits in the L2 cache.
+         * @param options Settings of the preceding gray conversion.
+         */
+        explicit ThresholdProcessor(ThreadPool& pool, int level = 128, std::size_t grainRows = 0,
+                                    const GrayOptions& options = GrayOptions())
+            : BilevelProcessor(pool, grainRows, options), level(level), stage(ThresholdTable(level))
+        {
+        }
+
+        /**
+         * A fixed threshold is a per-pixel operation; Otsu's method needs the whole image.
+         */
+        bool IsRowLocal() const override { return level != 0; }
+
+    protected:
+        void Binarize(const ImageView& img, const Histogram& histogram) override
+        {
+            if (level != 0) {
+                ApplyStage(img, stage);
+            } else {
+                ApplyStage(img, LookupStage(ThresholdTable(histogram.OtsuLevel())));
+            }
+        }
+
+        bool UsesHistogram() const override { return level == 0; }
+
+        const RowStage* BinarizeStage() const override { return level != 0 ? &stage : nullptr; }
+
+        std::string BinarizeFingerprint() const override
+        {
+            return level != 0 ? "threshold:" + std::to_string(level) : "otsu";
+        }
+
+    private:
+        int level;         ///< Fixed threshold, or 0 for Otsu's method.
+        LookupStage stage; ///< Lookup of the fixed threshold.
+
+        /**
+         * @return Table making values from the threshold on white and the rest black.
+         */
+        static std::array<unsigned char, 256> ThresholdTable(int threshold)
+        {
+            std::array<unsigned char, 256> table{};
+            for (int v = 0; v < 256; ++v) {
+                table[v] = v >= threshold ? 255 : 0;
+            }
+            return table;
+        }
+    };
+
+    /**
+     * @class OrderedDitherProcessor
+     * @brief Dithers with an 8x8 Bayer matrix: each pixel is compared with a threshold that
+     *        depends on its position, which renders gray levels as regular dot patterns.
+     */
+    class OrderedDitherProcessor : public BilevelProcessor
+    {
+    public:
+        using BilevelProcessor::BilevelProcessor;
+
+        /**
+         * The threshold depends only on the pixel's position. Streamed bands carry their first
+         * row in ImageView::top, so the pattern continues across them.
+         */
+        bool IsRowLocal() const override { return true; }
+
+    protected:
+        void Binarize(const ImageView& img, const Histogram&) override { ApplyStage(img, stage); }
+
+        const RowStage* BinarizeStage() const override { return &stage; }
+
+        std::string BinarizeFingerprint() const override { return "bayer8"; }
+
+    private:
+        /**
+         * Compares every sample of a gray row with the threshold at its position.
+         */
+        class DitherStage : public RowStage
+        {
+        public:
+            bool ProducesBilevel() const override { return true; }
+
+            RowFunction Bind(int) const override
+            {
+                return [](const unsigned char* src, unsigned char* dst, int width, int y) {
+                    static const unsigned char bayer[8][8] = {
+                        {0, 32, 8, 40, 2, 34, 10, 42},  {48, 16, 56, 24, 50, 18, 58, 26},
+                        {12, 44, 4, 36, 14, 46, 6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+                        {3, 35, 11, 43, 1, 33, 9, 41},  {51, 19, 59, 27, 49, 17, 57, 25},
+                        {15, 47, 7, 39, 13, 45, 5, 37}, {63, 31, 55, 23, 61, 29, 53, 21}};
+                    const unsigned char* pattern = bayer[y & 7];
+                    for (int x = 0; x < width; ++x) {
+                        // Thresholds 2, 6, ..., 254 are centred in the 64 intervals of [0, 256).
+                        dst[x] = src[x] >= pattern[x & 7] * 4 + 2 ? 255 : 0;
+                    }
+                };
+            }
+        };
+
+        DitherStage stage; ///< The dither of a single row.
+    };
+
+    /**
+     * Error diffusion kernels.
+     */
+    enum class DiffusionKernel
+    {
+        FloydSteinberg, ///< 7/16 right, 3/16, 5/16 and 1/16 below.
+        Atkinson        ///< 1/8 to six neighbours over two rows; drops 1/4 of the error for crisper output.
+    };
+
+    /**
+     * @class ErrorDiffusionProcessor
+     * @brief Dithers by error diffusion: each pixel's quantisation error is distributed to
+     *        neighbours that have not been processed yet.
+     *
+     * Every pixel depends on pixels of the rows above, which looks inherently serial but only
+     * constrains the order in a wavefront: pixel x of row y may be processed as soon as row
+     * y - 1 has passed x + 1 (rows further up are then even further ahead). Rows are claimed
+     * in order by the participants of a ParallelFor and processed in blocks of kBlock
+     * columns; before each block a row waits until the row above has published the next one.
+     * With n participants n rows are in flight, staggered by two blocks each, so the output
+     * is identical to a serial scan at any thread count.
+     *
+     * Errors are accumulated in a ring of integer rows, one per row in flight plus the rows
+     * being diffused into, in units of 1/16 (Floyd-Steinberg) or 1/8 (Atkinson).
+     */
+    class ErrorDiffusionProcessor : public BilevelProcessor
+    {
+    public:
+        /**
+         * @param pool The thread pool used to process rows concurrently.
+         * @param kernel Distribution of the error.
+         * @param grainRows Rows per tile of the gray conversion; zero sizes tiles to the L2 cache.
+         * @param options Settings of the preceding gray conversion.
+         */
+        explicit ErrorDiffusionProcessor(ThreadPool& pool, DiffusionKernel kernel = DiffusionKernel::FloydSteinberg,
+                                         std::size_t grainRows = 0, const GrayOptions& options = GrayOptions())
+            : BilevelProcessor(pool, grainRows, options), kernel(kernel)
+        {
+        }
+
+    protected:
+        std::string BinarizeFingerprint() const override
+        {
+            return kernel == DiffusionKernel::Atkinson ? "atkinson" : "floyd-steinberg";
+        }
+
+        void Binarize(const ImageView& img, const Histogram&) override
+        {
+            if (img.width == 0 || img.height == 0) {
+                return;
+            }
+            const std::size_t height = static_cast<std::size_t>(img.height);
+            const std::size_t blocks = (static_cast<std::size_t>(img.width) + kBlock - 1) / kBlock;
+            const std::size_t depth = kernel == DiffusionKernel::Atkinson ? 2 : 1;
+            const std::size_t participants = std::min<std::size_t>(pool.Size() + 1, height);
+            const std::size_t ringRows = participants + depth + 2;
+            // Two columns of padding on either side absorb the writes beyond the edges.
+            const std::size_t errorStride = static_cast<std::size_t>(img.width) + 4;
+            PooledVector<std::int32_t> errors(ringRows * errorStride, 0);
+            std::unique_ptr<std::atomic<std::size_t>[]> progress(new std::atomic<std::size_t>[height]);
+            for (std::size_t y = 0; y < height; ++y) {
+                progress[y].store(0, std::memory_order_relaxed);
+            }
+            auto errorRow = [&](std::size_t y) { return errors.data() + (y % ringRows) * errorStride + 2; };
+
+            auto processRow = [&](std::size_t y) {
+                // The row diffused into last reuses the ring slot of a row that must be complete.
+                if (y + depth >= ringRows) {
+                    WaitFor(progress[y + depth - ringRows], blocks);
+                }
+                std::fill_n(errorRow(y + depth) - 2, errorStride, 0);
+
+                unsigned char* row = img.Row(static_cast<int>(y));
+                std::int32_t* current = errorRow(y);
+                std::int32_t* next = errorRow(y + 1);
+                std::int32_t* afterNext = errorRow(y + 2);
+                for (std::size_t block = 0; block < blocks; ++block) {
+                    if (y > 0) {
+                        WaitFor(progress[y - 1], std::min(blocks, block + 2));
+                    }
+                    int first = static_cast<int>(block * kBlock);
+                    int last = std::min(img.width, first + static_cast<int>(kBlock));
+                    if (kernel == DiffusionKernel::FloydSteinberg) {
+                        for (int x = first; x < last; ++x) {
+                            int value = row[x] + ((current[x] + 8) >> 4);
+                            int error = value - (value >= 128 ? 255 : 0);
+                            row[x] = value >= 128 ? 255 : 0;
+                            current[x + 1] += error * 7;
+                            next[x - 1] += error * 3;
+                            next[x] += error * 5;
+                            next[x + 1] += error;
+                        }
+                    } else {
+                        for (int x = first; x < last; ++x) {
+                            int value = row[x] + ((current[x] + 4) >> 3);
+                            int error = value - (value >= 128 ? 255 : 0);
+                            row[x] = value >= 128 ? 255 : 0;
+                            current[x + 1] += error;
+                            current[x + 2] += error;
+                            next[x - 1] += error;
+                            next[x] += error;
+                            next[x + 1] += error;
+                            afterNext[x] += error;
+                        }
+                    }
+                    progress[y].store(block + 1, std::memory_order_release);
+                }
+            };
+
+            // Each participant claims the lowest unprocessed row, so every row a participant
+            // waits for has been claimed by a running participant and the wavefront cannot stall.
+            std::atomic<std::size_t> nextRow{0};
+            Run(0, participants, 1, [&](std::size_t, std::size_t) {
+                for (std::size_t y; (y = nextRow.fetch_add(1)) < height;) {
+                    processRow(y);
+                }
+            });
+        }
+
+    private:
+        /// Columns a row publishes at a time; at least 3 so that neighbouring rows never write
+        /// to the same error entries concurrently.
+        static constexpr std::size_t kBlock = 256;
+
+        DiffusionKernel kernel; ///< Distribution of the error.
+
+        /**
+         * Waits until a row has published at least the given number of blocks.
+         */
+        static void WaitFor(const std::atomic<std::size_t>& rowProgress, std::size_t blocks)
+        {
+            for (int spins = 0; rowProgress.load(std::memory_order_acquire) < blocks; ++spins) {
+                if (spins >= 64) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    };
+} // namespace bwconv
@@ -0,0 +1,340 @@
+/**
+ * @file black_and_white_processor.hpp
+ * @brief Parallel, in-place grayscale conversion.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "histogram.hpp"
+#include "image_processor.hpp"
+#include "kernels.hpp"
+#include "row_stage.hpp"
+#include "sample_conversion.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "wide_kernels.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * Settings of the gray conversion.
+     */
+    struct GrayOptions
+    {
+        LumaMode luma = LumaMode::Average;   ///< How color is weighted into gray.
+        AlphaMode alpha = AlphaMode::Ignore; ///< Alpha handling of the weighted modes.
+        bool decodeGray = false;             ///< Let the decoder produce BT.601 luminance.
+    };
+
+    /**
+     * @class BlackAndWhiteProcessor
+     * @brief Concrete class for converting images to black and white.
+     *
+     * Inherits from ImageProcessor and implements the ProcessImage function
+     * to convert color images into black and white images.
+     * This class uses multithreading to improve the performance of the conversion process.
+     */
+    class BlackAndWhiteProcessor : public ImageProcessor
+    {
+    public:
+        /**
+         * Constructor for BlackAndWhiteProcessor.
+         *
+         * @param pool The thread pool used to process tiles of the image concurrently.
+         * @param grainRows Rows per tile; zero picks a tile size that fits in the L2 cache.
+         * @param decodeGray Ask the decoder for luminance directly instead of averaging
+         *                   the channels. The decoder's luma weights (BT.601) are used then.
+         */
+        explicit BlackAndWhiteProcessor(ThreadPool& pool, std::size_t grainRows = 0, bool decodeGray = false)
+            : BlackAndWhiteProcessor(pool, grainRows, GrayOptions{LumaMode::Average, AlphaMode::Ignore, decodeGray})
+        {
+        }
+
+        /**
+         * Constructor selecting the luma weights.
+         *
+         * @param pool The thread pool used to process tiles of the image concurrently.
+         * @param grainRows Rows per tile; zero picks a tile size that fits in the L2 cache.
+         * @param options Luma mode, alpha handling and decoder luminance.
+         */
+        BlackAndWhiteProcessor(ThreadPool& pool, std::size_t grainRows, const GrayOptions& options)
+            : pool(pool), grainRows(grainRows), options(options), stage(options)
+        {
+        }
+
+        /**
+         * Requests single-channel decoding when luminance decoding is enabled, which makes
+         * ProcessImage a no-op and lets JPEG decoding skip chroma upsampling and conversion.
+         */
+        int DesiredChannels() const override { return options.decodeGray ? 1 : 0; }
+
+        /**
+         * Gray conversion is a per-pixel operation, so bands can be processed separately.
+         */
+        bool IsRowLocal() const override { return true; }
+
+        std::string Fingerprint() const override
+        {
+            return "gray:" + std::to_string(static_cast<int>(options.luma)) + ":" +
+                   std::to_string(static_cast<int>(options.alpha)) + (options.decodeGray ? ":decoded" : "");
+        }
+
+        std::vector<const RowStage*> RowStages() const override { return {&stage}; }
+
+        /**
+         * Counts the gray levels of every converted image into the histogram of its
+         * conversion record (Stats::ConversionStats::GrayHistogram), in the same pass that
+         * writes them. Without a record installed nothing is counted.
+         *
+         * @param collect Whether to count.
+         */
+        void SetCollectHistogram(bool collect)
+        {
+            collectHistogram = collect;
+            stage.collect = collect;
+        }
+
+        /**
+         * Processes the image to convert it to black and white.
+         * Overrides the ProcessImage method from ImageProcessor.
+         *
+         * The function converts the color image to grayscale by averaging
+         * the color channels for each pixel, or by weighing them with the selected
+         * luma mode, using the fastest kernel the CPU supports. The gray rows are written
+         * over the input rows, so no second buffer is allocated. The result is a packed
+         * single-channel view with the input's sample type, so 16-bit and float images
+         * keep their precision.
+         *
+         * Writing in place orders the work in waves, see ForEachRowInPlace.
+         *
+         * @param img View of the image to be processed; describes the gray result on return.
+         */
+        void ProcessImage(ImageView& img) override { Convert(img, nullptr); }
+
+        /**
+         * Converts the image to gray as ProcessImage does, counting the gray levels while
+         * they are written. Wide samples are counted at the 8-bit level they round to.
+         *
+         * @param img View of the image to be processed; describes the gray result on return.
+         * @param histogram Receives the gray levels, or nullptr. Besides it, the conversion
+         *                  record is counted into if SetCollectHistogram enabled that.
+         */
+        void Convert(ImageView& img, HistogramCollector* histogram)
+        {
+            Stats::ConversionStats* stats = collectHistogram ? Stats::ConversionStats::Current() : nullptr;
+            HistogramCollector* record = stats != nullptr ? &stats->GrayHistogram() : nullptr;
+            if (histogram == nullptr) {
+                histogram = record;
+                record = nullptr;
+            }
+
+            ImageView output{img.data, img.width, img.height,
+                             static_cast<std::size_t>(img.width) * SampleBytes(img.sample), 1};
+            output.sample = img.sample;
+            output.top = img.top;
+            if (img.channels == 1 && img.stride == output.stride) {
+                if (histogram != nullptr) {
+                    CountRows(img, *histogram);
+                }
+            } else if (img.sample == SampleType::U16) {
+                ConvertRows<std::uint16_t>(img, output, WideKernel<std::uint16_t>(img.channels), histogram);
+            } else if (img.sample == SampleType::F32) {
+                ConvertRows<float>(img, output, WideKernel<float>(img.channels), histogram);
+            } else {
+                Kernels::GrayKernel kernel = Kernels::SelectGrayKernel(img.channels, options.luma, options.alpha);
+                int channels = img.channels;
+                ConvertRows<unsigned char>(img, output,
+                                           [kernel, channels](const unsigned char* src, unsigned char* dst,
+                                                              std::size_t pixels) {
+                                               if (kernel != nullptr) {
+                                                   kernel(src, dst, pixels);
+                                               } else {
+                                                   Kernels::GrayScalar(src, dst, pixels, channels);
+                                               }
+                                           },
+                                           histogram);
+            }
+            if (record != nullptr) {
+                record->Add(histogram->Merge());
+            }
+            img = output;
+        }
+
+        /**
+         * Counts gray samples, rounding wide ones to 8 bits as ConvertSamples does.
+         *
+         * @param samples The samples.
+         * @param sample Their type.
+         * @param count Number of samples.
+         * @param histogram Receives the levels.
+         */
+        static void CountSamples(const void* samples, SampleType sample, std::size_t count,
+                                 HistogramCollector& histogram)
+        {
+            const unsigned char* bytes = static_cast<const unsigned char*>(samples);
+            if (sample == SampleType::U8) {
+                histogram.Add(bytes, count);
+                return;
+            }
+            unsigned char narrow[kCountPixels];
+            for (std::size_t done = 0; done < count; done += kCountPixels) {
+                std::size_t chunk = std::min(kCountPixels, count - done);
+                ConvertSamples(bytes + done * SampleBytes(sample), sample, narrow, SampleType::U8, chunk);
+                histogram.Add(narrow, chunk);
+            }
+        }
+
+    private:
+        /**
+         * The conversion of a single row, for fusion in a ProcessorPipeline.
+         */
+        class GrayStage : public RowStage
+        {
+        public:
+            explicit GrayStage(const GrayOptions& options) : options(options) {}
+
+            int OutputChannels(int) const override { return 1; }
+
+            /**
+             * When counting, the row is counted right after it is written, while it is in L1.
+             */
+            RowFunction Bind(int channels) const override
+            {
+                Stats::ConversionStats* stats = collect ? Stats::ConversionStats::Current() : nullptr;
+                HistogramCollector* histogram = stats != nullptr ? &stats->GrayHistogram() : nullptr;
+                if (channels == 1) {
+                    if (histogram == nullptr) {
+                        return RowFunction();
+                    }
+                    return [histogram](const unsigned char* src, unsigned char* dst, int width, int) {
+                        if (src != dst) {
+                            std::memmove(dst, src, static_cast<std::size_t>(width));
+                        }
+                        histogram->Add(dst, static_cast<std::size_t>(width));
+                    };
+                }
+                Kernels::GrayKernel kernel = Kernels::SelectGrayKernel(channels, options.luma, options.alpha);
+                return [kernel, channels, histogram](const unsigned char* src, unsigned char* dst, int width, int) {
+                    if (kernel != nullptr) {
+                        kernel(src, dst, static_cast<std::size_t>(width));
+                    } else {
+                        Kernels::GrayScalar(src, dst, static_cast<std::size_t>(width), channels);
+                    }
+                    if (histogram != nullptr) {
+                        histogram->Add(dst, static_cast<std::size_t>(width));
+                    }
+                };
+            }
+
+            bool collect = false; ///< Count the rows into the conversion record's histogram.
+
+        private:
+            GrayOptions options; ///< Luma mode and alpha handling.
+        };
+
+        /// Bytes read and written per tile when the grain is chosen automatically.
+        static constexpr std::size_t kTileBytes = 256 * 1024;
+
+        /// Pixels converted before they are counted, small enough to be counted from L1.
+        static constexpr std::size_t kCountPixels = 4096;
+
+        ThreadPool& pool;              ///< Pool shared with the rest of the conversion.
+        std::size_t grainRows;         ///< Rows per tile, zero for automatic.
+        GrayOptions options;           ///< Luma mode, alpha handling and decoder luminance.
+        GrayStage stage;               ///< The per-row conversion offered to pipelines.
+        bool collectHistogram = false; ///< Count gray levels into the conversion record.
+
+        /**
+         * @param channels Channels per input pixel.
+         * @return The gray kernel for 16-bit or float samples.
+         * @throws std::runtime_error if no kernel handles the channel count.
+         */
+        template <typename T>
+        Kernels::WideGrayKernel<T> WideKernel(int channels) const
+        {
+            Kernels::WideGrayKernel<T> kernel = Kernels::SelectWideGrayKernel<T>(channels, options.luma, options.alpha);
+            if (kernel == nullptr) {
+                throw std::runtime_error("Unsupported channel count for high bit depth input");
+            }
+            return kernel;
+        }
+
+        /**
+         * Converts every row of input into the packed single-channel output in place.
+         *
+         * @param input View of the color image.
+         * @param output View of the gray result over the same memory.
+         * @param kernel Callable invoked as kernel(src, dst, pixels) on samples of type T.
+         * @param histogram Receives the gray levels, or nullptr.
+         */
+        template <typename T, typename Kernel>
+        void ConvertRows(const ImageView& input, const ImageView& output, Kernel kernel,
+                         HistogramCollector* histogram) const
+        {
+            const int channels = input.channels;
+            auto processRows = [&](std::size_t firstRow, std::size_t lastRow) -> void {
+                for (std::size_t y = firstRow; y < lastRow;) {
+                    // Packed rows are handed to the kernel as one run.
+                    std::size_t rows = input.IsPacked() ? lastRow - y : 1;
+                    const T* src = reinterpret_cast<const T*>(input.Row(static_cast<int>(y)));
+                    T* dst = reinterpret_cast<T*>(output.Row(static_cast<int>(y)));
+                    std::size_t pixels = rows * static_cast<std::size_t>(input.width);
+                    if (histogram == nullptr) {
+                        kernel(src, dst, pixels);
+                    } else {
+                        for (std::size_t done = 0; done < pixels; done += kCountPixels) {
+                            std::size_t count = std::min(kCountPixels, pixels - done);
+                            kernel(src + done * channels, dst + done, count);
+                            CountSamples(dst + done, output.sample, count, *histogram);
+                        }
+                    }
+                    y += rows;
+                }
+            };
+
+            std::size_t grain = TileRows(input.RowBytes() + output.RowBytes());
+            ForEachRowInPlace(pool, static_cast<std::size_t>(input.height), input.stride, output.stride, grain,
+                              processRows);
+        }
+
+        /**
+         * Counts the rows of a single-channel image that needs no conversion.
+         *
+         * @param img View of the gray image.
+         * @param histogram Receives the gray levels.
+         */
+        void CountRows(const ImageView& img, HistogramCollector& histogram) const
+        {
+            ForEachRowInPlace(pool, static_cast<std::size_t>(img.height), img.stride, img.stride,
+                              TileRows(img.RowBytes()), [&](std::size_t firstRow, std::size_t lastRow) {
+                                  for (std::size_t y = firstRow; y < lastRow; ++y) {
+                                      CountSamples(img.Row(static_cast<int>(y)), img.sample,
+                                                   static_cast<std::size_t>(img.width), histogram);
+                                  }
+                              });
+        }
+
+        /**
+         * @param rowBytes Bytes touched per row, input and output combined.
+         * @return The number of rows per tile.
+         */
+        std::size_t TileRows(std::size_t rowBytes) const
+        {
+            if (grainRows != 0) {
+                return grainRows;
+            }
+            return std::max<std::size_t>(1, kTileBytes / std::max<std::size_t>(1, rowBytes));
+        }
+    };
+} // namespace bwconv
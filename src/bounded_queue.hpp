@@ -0,0 +1,203 @@
+/**
+ * @file bounded_queue.hpp
+ * @brief Lock-free bounded multi-producer multi-consumer queue connecting pipeline stages.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+namespace bwconv
+{
+    /**
+     * @class BoundedQueue
+     * @brief Fixed-capacity MPMC queue after Dmitry Vyukov's design: every cell carries a
+     *        sequence number that tells producers and consumers whether it is theirs, so a
+     *        push or pop is a single compare-and-swap on the tail or head and never locks.
+     *
+     * TryPush and TryPop never block. Push blocks while the queue is full, which is how a
+     * slow stage holds back the stages feeding it, and Pop blocks while it is empty until
+     * the queue is closed. Blocked callers spin briefly, then yield, then sleep for
+     * growing intervals of up to a millisecond, so idle stages cost no CPU.
+     *
+     * @tparam T Movable, default-constructible element type.
+     */
+    template <typename T>
+    class BoundedQueue
+    {
+    public:
+        /**
+         * @param capacity Least number of elements the queue holds; rounded up to a power of two.
+         */
+        explicit BoundedQueue(std::size_t capacity)
+        {
+            std::size_t size = 2;
+            while (size < capacity) {
+                size *= 2;
+            }
+            mask = size - 1;
+            cells = std::make_unique<Cell[]>(size);
+            for (std::size_t i = 0; i < size; ++i) {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        BoundedQueue(const BoundedQueue&) = delete;
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        /**
+         * @return The number of elements the queue holds.
+         */
+        std::size_t Capacity() const { return mask + 1; }
+
+        /**
+         * @return The number of queued elements; exact only while no other thread uses the queue.
+         */
+        std::size_t Size() const
+        {
+            std::size_t head = dequeuePosition.load(std::memory_order_relaxed);
+            std::size_t tail = enqueuePosition.load(std::memory_order_relaxed);
+            return tail > head ? std::min(tail - head, Capacity()) : 0;
+        }
+
+        /**
+         * Appends an element unless the queue is full.
+         *
+         * @param value The element; moved from only on success.
+         * @return false if the queue is full.
+         */
+        bool TryPush(T& value)
+        {
+            std::size_t position = enqueuePosition.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell& cell = cells[position & mask];
+                std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+                auto difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+                if (difference == 0) {
+                    if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        cell.value = std::move(value);
+                        cell.sequence.store(position + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (difference < 0) {
+                    return false;
+                } else {
+                    position = enqueuePosition.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /**
+         * Removes the oldest element unless the queue is empty.
+         *
+         * @param value Receives the element.
+         * @return false if the queue is empty.
+         */
+        bool TryPop(T& value)
+        {
+            std::size_t position = dequeuePosition.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell& cell = cells[position & mask];
+                std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+                auto difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position + 1);
+                if (difference == 0) {
+                    if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        value = std::move(cell.value);
+                        cell.sequence.store(position + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (difference < 0) {
+                    return false;
+                } else {
+                    position = dequeuePosition.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /**
+         * Appends an element, waiting while the queue is full.
+         *
+         * @param value The element.
+         */
+        void Push(T& value)
+        {
+            for (Backoff backoff; !TryPush(value);) {
+                backoff.Wait();
+            }
+        }
+
+        /**
+         * Removes the oldest element, waiting while the queue is empty and open.
+         *
+         * @param value Receives the element.
+         * @return false once the queue is closed and drained.
+         */
+        bool Pop(T& value)
+        {
+            for (Backoff backoff; !TryPop(value);) {
+                // Pushes finished before Close are visible once the flag is.
+                if (closed.load(std::memory_order_acquire)) {
+                    return TryPop(value);
+                }
+                backoff.Wait();
+            }
+            return true;
+        }
+
+        /**
+         * Tells consumers that no more elements will be pushed. Call after the last push.
+         */
+        void Close() { closed.store(true, std::memory_order_release); }
+
+    private:
+        /**
+         * A slot of the ring and the sequence number saying whose turn it is.
+         */
+        struct Cell
+        {
+            std::atomic<std::size_t> sequence{0}; ///< position for a producer, position + 1 for a consumer.
+            T value{};                            ///< The element while queued.
+        };
+
+        /**
+         * Waiting strategy of the blocking calls.
+         */
+        class Backoff
+        {
+        public:
+            void Wait()
+            {
+                if (++rounds <= kSpins) {
+                    return;
+                }
+                if (rounds <= kSpins + kYields) {
+                    std::this_thread::yield();
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(sleep));
+                sleep = std::min(sleep * 2, 1000);
+            }
+
+        private:
+            static constexpr int kSpins = 64;  ///< Rounds of busy waiting.
+            static constexpr int kYields = 16; ///< Rounds of yielding after spinning.
+            int rounds = 0;                    ///< Failed attempts so far.
+            int sleep = 16;                    ///< Next sleep in microseconds.
+        };
+
+        std::unique_ptr<Cell[]> cells;                           ///< The ring.
+        std::size_t mask = 0;                                    ///< Capacity minus one.
+        alignas(64) std::atomic<std::size_t> enqueuePosition{0}; ///< Next position to push to.
+        alignas(64) std::atomic<std::size_t> dequeuePosition{0}; ///< Next position to pop from.
+        alignas(64) std::atomic<bool> closed{false};             ///< No more pushes will come.
+    };
+} // namespace bwconv
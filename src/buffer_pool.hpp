@@ -0,0 +1,416 @@
+/**
+ * @file buffer_pool.hpp
+ * @brief Size-classed pool recycling the large buffers of successive conversions.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "numa.hpp"
+#include "platform.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * Settings of the buffer pool.
+     */
+    struct BufferPoolOptions
+    {
+        std::size_t capacity = 256u << 20; ///< Bytes of free buffers kept for reuse; 0 disables pooling.
+        bool hugePages = false;            ///< Back buffers of 2 MiB and more with transparent huge pages.
+    };
+
+    /**
+     * @class BufferPool
+     * @brief malloc replacement that keeps large freed buffers for the next conversion.
+     *
+     * Every conversion of a batch allocates the same kinds of buffers: the decoded pixels,
+     * the decoders' and encoders' working memory and the encoder output. Returning them to
+     * the C allocator unmaps them, so the next image page-faults fresh memory in again.
+     * The pool instead rounds requests of 64 KiB and more up to a size class, a quarter of
+     * a power of two apart, and keeps freed blocks in per-class free lists up to a cap.
+     * A request takes the smallest free block of its class or of a class at most twice as
+     * large, so images of similar size reuse each other's buffers and a steady-state batch
+     * allocates nothing from the heap per image. Smaller requests go to malloc.
+     *
+     * With huge pages, new blocks of 2 MiB and more are mapped separately and advised as
+     * MADV_HUGEPAGE, which cuts page faults and TLB misses when kernels stream over images.
+     *
+     * Every block carries a header recording its size, so it can be released and resized
+     * without the caller passing the size back, like memory from malloc.
+     *
+     * Free blocks are also kept per NUMA node: a block belongs to the node of the thread
+     * that allocated it, whose first touch placed its pages, and is only handed out again
+     * to threads of that node. Without node placement every thread is on node 0.
+     */
+    class BufferPool
+    {
+    public:
+        /**
+         * @struct Counters
+         * @brief Effectiveness of the pool since it was created.
+         */
+        struct Counters
+        {
+            std::uint64_t reused = 0;    ///< Pooled requests served from a free list.
+            std::uint64_t allocated = 0; ///< Pooled requests that needed new memory.
+            std::size_t retained = 0;    ///< Bytes of free blocks currently kept.
+        };
+
+        BufferPool() = default;
+
+        ~BufferPool() { Trim(0); }
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        /**
+         * @return The pool every allocation of the converter goes through. It is never
+         *         destroyed, so blocks can be freed from static destructors.
+         */
+        static BufferPool& Global()
+        {
+            static BufferPool* pool = new BufferPool();
+            return *pool;
+        }
+
+        /**
+         * Changes the cap and the huge-page backing; free blocks beyond the new cap are
+         * released. Blocks in use keep the backing they were allocated with.
+         *
+         * @param options The settings.
+         */
+        void Configure(const BufferPoolOptions& options)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            settings = options;
+            TrimLocked(options.capacity);
+        }
+
+        /**
+         * @param bytes Size of the block.
+         * @return A block aligned like malloc's, or nullptr if no memory is available.
+         */
+        void* Allocate(std::size_t bytes)
+        {
+            if (bytes > kMaxBytes) {
+                return nullptr;
+            }
+            std::size_t total = kHeader + bytes;
+            Header header{bytes, 0, 0, Numa::CurrentNode()};
+            unsigned char* block = nullptr;
+            if (total >= kMinPooled) {
+                header.classBytes = ClassBytes(total);
+                block = Take(header);
+            } else {
+                block = static_cast<unsigned char*>(std::malloc(total));
+            }
+            if (block == nullptr) {
+                return nullptr;
+            }
+            std::memcpy(block, &header, sizeof(header));
+            return block + kHeader;
+        }
+
+        /**
+         * Keeps a pooled block for reuse if the cap allows, or releases it.
+         *
+         * @param data A block from Allocate or Reallocate, or nullptr.
+         */
+        void Free(void* data)
+        {
+            if (data == nullptr) {
+                return;
+            }
+            unsigned char* block = static_cast<unsigned char*>(data) - kHeader;
+            Header header = HeaderOf(data);
+            if (header.classBytes == 0) {
+                std::free(block);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (counters.retained + header.classBytes <= settings.capacity) {
+                    freeLists[{header.node, header.classBytes}].push_back(FreeBlock{block, header.mappedBytes});
+                    counters.retained += header.classBytes;
+                    return;
+                }
+            }
+            Release(block, header.mappedBytes);
+        }
+
+        /**
+         * Resizes a block like realloc. Pooled blocks are resized in place as long as the
+         * size fits their class; the spare bytes come back when the block is freed. Only
+         * with pooling disabled does a block shrinking below half its class move to a
+         * smaller one, which returns the memory to the system right away.
+         *
+         * @param data A block from Allocate or Reallocate, or nullptr.
+         * @param bytes The new size.
+         * @return The resized block, or nullptr if no memory is available; data stays valid then.
+         */
+        void* Reallocate(void* data, std::size_t bytes)
+        {
+            if (data == nullptr) {
+                return Allocate(bytes);
+            }
+            Header header = HeaderOf(data);
+            std::size_t total = kHeader + bytes;
+            unsigned char* block = static_cast<unsigned char*>(data) - kHeader;
+            bool pooling;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pooling = settings.capacity != 0;
+            }
+            if (header.classBytes != 0 && total <= header.classBytes && (pooling || total * 2 > header.classBytes)) {
+                header.size = bytes;
+                std::memcpy(block, &header, sizeof(header));
+                return data;
+            }
+            if (header.classBytes == 0 && total < kMinPooled) {
+                auto* resized = static_cast<unsigned char*>(std::realloc(block, total));
+                if (resized == nullptr) {
+                    return nullptr;
+                }
+                header.size = bytes;
+                std::memcpy(resized, &header, sizeof(header));
+                return resized + kHeader;
+            }
+            void* moved = Allocate(bytes);
+            if (moved == nullptr) {
+                return nullptr;
+            }
+            std::memcpy(moved, data, std::min(header.size, bytes));
+            Free(data);
+            return moved;
+        }
+
+        /**
+         * @param data A block from Allocate or Reallocate, or nullptr.
+         * @return The size it was requested with.
+         */
+        static std::size_t SizeOf(const void* data) { return data != nullptr ? HeaderOf(data).size : 0; }
+
+        /**
+         * Releases free blocks until at most the given number of bytes is retained.
+         *
+         * @param keep Bytes of free blocks to keep.
+         */
+        void Trim(std::size_t keep)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            TrimLocked(keep);
+        }
+
+        /**
+         * @return How often the pool could serve requests, and the bytes it holds.
+         */
+        Counters Statistics() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return counters;
+        }
+
+    private:
+        /**
+         * Bookkeeping in front of every block.
+         */
+        struct Header
+        {
+            std::size_t size;        ///< Bytes requested by the caller.
+            std::size_t classBytes;  ///< Bytes of the block including the header; 0 if from malloc.
+            std::size_t mappedBytes; ///< Length of the block's own mapping; 0 if from malloc.
+            int node;                ///< Node of the thread that allocated the block.
+        };
+
+        /**
+         * A block in a free list.
+         */
+        struct FreeBlock
+        {
+            unsigned char* block;    ///< Start of the block, at its header.
+            std::size_t mappedBytes; ///< Length of its mapping; 0 if from malloc.
+        };
+
+        /// Space for the header that keeps the payload aligned like malloc's.
+        static constexpr std::size_t kHeader =
+            (sizeof(Header) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+        /// Smallest block, header included, served by the size classes.
+        static constexpr std::size_t kMinPooled = 64 * 1024;
+        /// Size of a transparent huge page.
+        static constexpr std::size_t kHugePage = 2u << 20;
+        /// Largest request before the class rounding could overflow.
+        static constexpr std::size_t kMaxBytes = (~static_cast<std::size_t>(0) >> 2) - kHugePage;
+
+        mutable std::mutex mutex;   ///< Guards the members below.
+        BufferPoolOptions settings; ///< Cap and huge-page backing.
+        Counters counters;          ///< Reuse statistics.
+        /// Free blocks by node and class size.
+        std::map<std::pair<int, std::size_t>, std::vector<FreeBlock>> freeLists;
+
+        static Header HeaderOf(const void* data)
+        {
+            Header header;
+            std::memcpy(&header, static_cast<const unsigned char*>(data) - kHeader, sizeof(header));
+            return header;
+        }
+
+        /**
+         * @param total Bytes of a block including the header; at least kMinPooled.
+         * @return The size of its class: total rounded up to a quarter of its power of two.
+         */
+        static std::size_t ClassBytes(std::size_t total)
+        {
+            std::size_t power = kMinPooled;
+            while (power * 2 <= total) {
+                power *= 2;
+            }
+            std::size_t quarter = power / 4;
+            return (total + quarter - 1) / quarter * quarter;
+        }
+
+        /**
+         * Takes a free block of the header's node and class, or of a class at most twice as
+         * large, and allocates a new block otherwise. Updates the header's class and mapping.
+         *
+         * @return The block, or nullptr if no memory is available.
+         */
+        unsigned char* Take(Header& header)
+        {
+            bool hugePages;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto fits = [&](decltype(freeLists)::iterator entry) {
+                    return entry != freeLists.end() && entry->first.first == header.node &&
+                           entry->first.second <= header.classBytes * 2;
+                };
+                auto candidate = freeLists.lower_bound({header.node, header.classBytes});
+                while (fits(candidate) && candidate->second.empty()) {
+                    ++candidate;
+                }
+                if (fits(candidate)) {
+                    FreeBlock taken = candidate->second.back();
+                    candidate->second.pop_back();
+                    counters.retained -= candidate->first.second;
+                    ++counters.reused;
+                    header.classBytes = candidate->first.second;
+                    header.mappedBytes = taken.mappedBytes;
+                    return taken.block;
+                }
+                ++counters.allocated;
+                hugePages = settings.hugePages;
+            }
+#if defined(BWCONV_POSIX) && defined(MAP_ANONYMOUS)
+            if (hugePages && header.classBytes >= kHugePage) {
+                std::size_t length = (header.classBytes + kHugePage - 1) / kHugePage * kHugePage;
+                void* mapping = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mapping != MAP_FAILED) {
+#if defined(MADV_HUGEPAGE)
+                    ::madvise(mapping, length, MADV_HUGEPAGE);
+#endif
+                    header.mappedBytes = length;
+                    return static_cast<unsigned char*>(mapping);
+                }
+            }
+#else
+            (void)hugePages;
+#endif
+            return static_cast<unsigned char*>(std::malloc(header.classBytes));
+        }
+
+        /**
+         * Returns a block to the system.
+         */
+        static void Release(unsigned char* block, std::size_t mappedBytes)
+        {
+#if defined(BWCONV_POSIX) && defined(MAP_ANONYMOUS)
+            if (mappedBytes != 0) {
+                ::munmap(block, mappedBytes);
+                return;
+            }
+#else
+            (void)mappedBytes;
+#endif
+            std::free(block);
+        }
+
+        /**
+         * Releases free blocks, the largest of each node first, until at most keep bytes are
+         * retained. The caller holds the mutex.
+         */
+        void TrimLocked(std::size_t keep)
+        {
+            for (auto entry = freeLists.rbegin(); entry != freeLists.rend() && counters.retained > keep; ++entry) {
+                while (!entry->second.empty() && counters.retained > keep) {
+                    Release(entry->second.back().block, entry->second.back().mappedBytes);
+                    entry->second.pop_back();
+                    counters.retained -= entry->first.second;
+                }
+            }
+        }
+    };
+
+    /**
+     * @class PoolAllocator
+     * @brief Standard allocator drawing from the global BufferPool, for scratch containers
+     *        of processors and encoders that would otherwise reallocate for every image.
+     */
+    template <typename T>
+    class PoolAllocator
+    {
+    public:
+        using value_type = T;
+
+        PoolAllocator() = default;
+
+        template <typename U>
+        PoolAllocator(const PoolAllocator<U>&) noexcept
+        {
+        }
+
+        T* allocate(std::size_t count)
+        {
+            if (count > static_cast<std::size_t>(-1) / sizeof(T)) {
+                throw std::bad_alloc();
+            }
+            void* data = BufferPool::Global().Allocate(count * sizeof(T));
+            if (data == nullptr) {
+                throw std::bad_alloc();
+            }
+            return static_cast<T*>(data);
+        }
+
+        void deallocate(T* data, std::size_t) noexcept { BufferPool::Global().Free(data); }
+
+        template <typename U>
+        bool operator==(const PoolAllocator<U>&) const noexcept
+        {
+            return true;
+        }
+
+        template <typename U>
+        bool operator!=(const PoolAllocator<U>&) const noexcept
+        {
+            return false;
+        }
+    };
+
+    /**
+     * Vector whose storage comes from the global BufferPool.
+     */
+    template <typename T>
+    using PooledVector = std::vector<T, PoolAllocator<T>>;
+} // namespace bwconv
@@ -0,0 +1,240 @@
+/**
+ * @file bwconv_c_api.cpp
+ * @brief Implementation of the C interface declared in include/bwconv.h on top of
+ *        ImageConverter::ConvertMemory.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "bwconv.h"
+
+#include "encoder_options.hpp"
+#include "image_converter.hpp"
+#include "processor_factory.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(BWCONV_VERSION_STRING)
+#define BWCONV_VERSION_STRING "0.1"
+#endif
+
+/**
+ * The converter behind the opaque handle: a pool and a converter whose pipeline runs on it.
+ */
+struct bwconv_converter
+{
+    explicit bwconv_converter(unsigned int threads) : pool(threads) {}
+
+    bwconv::ThreadPool pool;                           ///< Workers shared by all callers.
+    std::unique_ptr<bwconv::ImageConverter> converter; ///< Converter running on pool.
+};
+
+namespace
+{
+    /**
+     * Message of the last failure on this thread, returned by bwconv_last_error.
+     */
+    thread_local std::string lastError;
+
+    /**
+     * Records a failure for bwconv_last_error.
+     *
+     * @param status The status to return.
+     * @param message Its description.
+     * @return status.
+     */
+    bwconv_status Fail(bwconv_status status, const std::string& message)
+    {
+        lastError = message;
+        return status;
+    }
+
+    /**
+     * Runs body, turning exceptions into statuses so that none crosses the C boundary.
+     *
+     * @param body The work, returning the status on success paths.
+     * @return The status of body, or of the exception it threw.
+     */
+    template <typename Body>
+    bwconv_status Guarded(Body&& body)
+    {
+        try {
+            return body();
+        } catch (const std::bad_alloc&) {
+            return Fail(BWCONV_OUT_OF_MEMORY, "Out of memory");
+        } catch (const std::exception& e) {
+            return Fail(BWCONV_CONVERSION_FAILED, e.what());
+        } catch (...) {
+            return Fail(BWCONV_CONVERSION_FAILED, "Unknown error");
+        }
+    }
+
+    /**
+     * Translates and checks the C options.
+     *
+     * @param options The C options.
+     * @param processing Receives the processing steps.
+     * @param encoder Receives the encoder settings.
+     * @throws std::invalid_argument if an option is out of range.
+     */
+    void TranslateOptions(const bwconv_options& options, bwconv::ProcessingOptions& processing,
+                          bwconv::EncoderOptions& encoder)
+    {
+        if (options.luma < BWCONV_LUMA_AVERAGE || options.luma > BWCONV_LUMA_LINEAR) {
+            throw std::invalid_argument("Unknown luma mode");
+        }
+        if (options.bilevel < BWCONV_BILEVEL_NONE || options.bilevel > BWCONV_BILEVEL_ATKINSON) {
+            throw std::invalid_argument("Unknown bilevel mode");
+        }
+        if (options.resize_filter < BWCONV_FILTER_BOX || options.resize_filter > BWCONV_FILTER_LANCZOS3) {
+            throw std::invalid_argument("Unknown resize filter");
+        }
+        if (options.threshold < 1 || options.threshold > 255) {
+            throw std::invalid_argument("Threshold must be between 1 and 255");
+        }
+        if (options.resize_width < 0 || options.resize_height < 0) {
+            throw std::invalid_argument("Resize bounds must not be negative");
+        }
+        if (options.jpeg_quality < 1 || options.jpeg_quality > 100) {
+            throw std::invalid_argument("JPEG quality must be between 1 and 100");
+        }
+        if (options.png_level < 0 || options.png_level > 9) {
+            throw std::invalid_argument("PNG level must be between 0 and 9");
+        }
+
+        // The C enumerators follow the order of the C++ ones.
+        processing.gray.luma = static_cast<bwconv::LumaMode>(options.luma);
+        processing.gray.alpha = options.premultiply_alpha ? bwconv::AlphaMode::Premultiply : bwconv::AlphaMode::Ignore;
+        processing.resize = options.resize_width != 0 || options.resize_height != 0;
+        processing.resizeOptions.width = options.resize_width;
+        processing.resizeOptions.height = options.resize_height;
+        processing.resizeOptions.filter = static_cast<bwconv::ResizeFilter>(options.resize_filter);
+        processing.invert = options.invert != 0;
+        processing.bilevel = static_cast<bwconv::BilevelMode>(options.bilevel);
+        processing.threshold = options.threshold;
+        encoder.jpegQuality = options.jpeg_quality;
+        encoder.pngLevel = options.png_level;
+    }
+} // namespace
+
+extern "C" {
+
+const char* bwconv_version(void) { return BWCONV_VERSION_STRING; }
+
+void bwconv_options_init(bwconv_options* options)
+{
+    if (options == nullptr) {
+        return;
+    }
+    bwconv::EncoderOptions encoder;
+    std::memset(options, 0, sizeof(*options));
+    options->struct_size = sizeof(*options);
+    options->luma = BWCONV_LUMA_AVERAGE;
+    options->bilevel = BWCONV_BILEVEL_NONE;
+    options->threshold = 128;
+    options->resize_filter = BWCONV_FILTER_BILINEAR;
+    options->jpeg_quality = encoder.jpegQuality;
+    options->png_level = encoder.pngLevel;
+}
+
+bwconv_status bwconv_create(const bwconv_options* options, bwconv_converter** converter)
+{
+    if (converter == nullptr) {
+        return Fail(BWCONV_INVALID_ARGUMENT, "No converter to return");
+    }
+    *converter = nullptr;
+    bwconv_options settings;
+    bwconv_options_init(&settings);
+    if (options != nullptr) {
+        // Callers built against an earlier header pass a shorter struct; the fields it lacks keep their defaults.
+        const std::size_t firstVersionSize = offsetof(bwconv_options, memory_limit) + sizeof(size_t);
+        if (options->struct_size < firstVersionSize || options->struct_size > sizeof(bwconv_options)) {
+            return Fail(BWCONV_INVALID_ARGUMENT, "Options were not initialised with bwconv_options_init");
+        }
+        std::memcpy(&settings, options, options->struct_size);
+    }
+
+    return Guarded([&]() -> bwconv_status {
+        bwconv::ProcessingOptions processing;
+        bwconv::EncoderOptions encoder;
+        try {
+            TranslateOptions(settings, processing, encoder);
+        } catch (const std::invalid_argument& e) {
+            return Fail(BWCONV_INVALID_ARGUMENT, e.what());
+        }
+
+        // Callers take part in every ParallelFor, so the pool only needs the remaining threads.
+        unsigned int threads = settings.threads;
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency()) - 1;
+        }
+        auto created = std::make_unique<bwconv_converter>(threads);
+        created->converter =
+            std::make_unique<bwconv::ImageConverter>(bwconv::CreateProcessorPipeline(created->pool, processing));
+        created->converter->SetEncoderOptions(encoder);
+        created->converter->SetMemoryLimit(settings.memory_limit);
+        *converter = created.release();
+        return BWCONV_OK;
+    });
+}
+
+void bwconv_destroy(bwconv_converter* converter) { delete converter; }
+
+bwconv_status bwconv_convert(bwconv_converter* converter, const void* input, size_t input_size, const char* format,
+                             const bwconv_allocator* allocator, void** output, size_t* output_size)
+{
+    if (output != nullptr) {
+        *output = nullptr;
+    }
+    if (output_size != nullptr) {
+        *output_size = 0;
+    }
+    if (converter == nullptr || input == nullptr || format == nullptr || output == nullptr ||
+        output_size == nullptr || (allocator != nullptr && allocator->allocate == nullptr)) {
+        return Fail(BWCONV_INVALID_ARGUMENT, "Missing argument");
+    }
+    std::string extension(format);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    static const char* const kFormats[] = {"png", "jpg", "jpeg", "bmp", "tga", "pbm", "gif"};
+    if (std::none_of(std::begin(kFormats), std::end(kFormats),
+                     [&](const char* known) { return extension == known; })) {
+        return Fail(BWCONV_INVALID_ARGUMENT, "Unsupported output format: " + extension);
+    }
+
+    return Guarded([&]() -> bwconv_status {
+        // Outputs of similar size follow each other on a thread, so the buffer is kept.
+        thread_local std::vector<unsigned char> encoded;
+        encoded.clear();
+        converter->converter->ConvertMemory(static_cast<const unsigned char*>(input), input_size, extension,
+                                            encoded);
+
+        std::size_t size = std::max<std::size_t>(encoded.size(), 1);
+        void* block = allocator != nullptr ? allocator->allocate(allocator->user, size) : std::malloc(size);
+        if (block == nullptr) {
+            return Fail(BWCONV_OUT_OF_MEMORY, "The allocator returned no memory");
+        }
+        std::memcpy(block, encoded.data(), encoded.size());
+        *output = block;
+        *output_size = encoded.size();
+        return BWCONV_OK;
+    });
+}
+
+void bwconv_free(void* output) { std::free(output); }
+
+const char* bwconv_last_error(void) { return lastError.c_str(); }
+
+} // extern "C"
@@ -0,0 +1,671 @@
+/**
+ * @file conversion_server.hpp
+ * @brief Long-running service that converts images sent over HTTP on a TCP or Unix socket.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "buffer_pool.hpp"
+#include "image_converter.hpp"
+#include "platform.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(BWCONV_POSIX)
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#endif
+
+namespace bwconv::Serve
+{
+    /**
+     * @struct ServerOptions
+     * @brief Where the service listens and how much work it admits.
+     */
+    struct ServerOptions
+    {
+        std::string endpoint;                  ///< "unix:<path>", a path, "<port>" or "<host>:<port>".
+        std::size_t maxPending = 0;            ///< Connections queued behind busy workers; 0 for 2 per thread.
+        std::size_t maxBodyBytes = 256u << 20; ///< Largest request body accepted.
+        int ioTimeoutSeconds = 30;             ///< Limit for every read from and write to a client.
+        int requestTimeoutSeconds = 60;        ///< Limit for receiving a whole request, headers and body.
+    };
+
+    /**
+     * @struct HttpRequest
+     * @brief A parsed request; header names are lower case.
+     */
+    struct HttpRequest
+    {
+        std::string method;                         ///< Request method, e.g. "POST".
+        std::string path;                           ///< Target without the query.
+        std::map<std::string, std::string> query;   ///< Decoded query parameters.
+        std::map<std::string, std::string> headers; ///< Header values by lower-case name.
+        PooledVector<unsigned char> body;           ///< Request body.
+    };
+
+    /**
+     * @class HttpError
+     * @brief Ends a request with an error status; the message becomes the response body.
+     */
+    class HttpError : public std::runtime_error
+    {
+    public:
+        /**
+         * @param status HTTP status code.
+         * @param message Description for the client.
+         */
+        HttpError(int status, const std::string& message) : std::runtime_error(message), status(status) {}
+
+        int status; ///< HTTP status code.
+    };
+
+    /**
+     * Decodes %XX escapes and '+' in a URL query component.
+     *
+     * @param text The encoded component.
+     * @return The decoded text.
+     * @throws HttpError if an escape is malformed.
+     */
+    inline std::string DecodeUrlComponent(const std::string& text)
+    {
+        auto hex = [](char c) {
+            int digit = std::tolower(static_cast<unsigned char>(c));
+            return digit <= '9' ? digit - '0' : digit - 'a' + 10;
+        };
+        std::string decoded;
+        decoded.reserve(text.size());
+        for (std::size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == '+') {
+                decoded += ' ';
+            } else if (text[i] != '%') {
+                decoded += text[i];
+            } else if (i + 2 < text.size() && std::isxdigit(static_cast<unsigned char>(text[i + 1])) &&
+                       std::isxdigit(static_cast<unsigned char>(text[i + 2]))) {
+                decoded += static_cast<char>(hex(text[i + 1]) * 16 + hex(text[i + 2]));
+                i += 2;
+            } else {
+                throw HttpError(400, "Malformed escape in query");
+            }
+        }
+        return decoded;
+    }
+
+    /**
+     * Splits a query string into its decoded parameters.
+     *
+     * @param query The text after '?'.
+     * @return Value of every parameter; later duplicates win.
+     */
+    inline std::map<std::string, std::string> ParseQuery(const std::string& query)
+    {
+        std::map<std::string, std::string> parameters;
+        std::size_t start = 0;
+        while (start < query.size()) {
+            std::size_t end = std::min(query.find('&', start), query.size());
+            std::string pair = query.substr(start, end - start);
+            std::size_t equals = pair.find('=');
+            if (!pair.empty()) {
+                parameters[DecodeUrlComponent(pair.substr(0, equals))] =
+                    equals == std::string::npos ? std::string() : DecodeUrlComponent(pair.substr(equals + 1));
+            }
+            start = end + 1;
+        }
+        return parameters;
+    }
+
+    /**
+     * @param format Output extension without the dot.
+     * @return The media type of the format, or nullptr if there is no encoder for it.
+     */
+    inline const char* MediaType(const std::string& format)
+    {
+        static const std::map<std::string, const char*> types = {
+            {"png", "image/png"}, {"jpg", "image/jpeg"},  {"jpeg", "image/jpeg"},
+            {"bmp", "image/bmp"}, {"tga", "image/x-tga"}, {"pbm", "image/x-portable-bitmap"},
+            {"gif", "image/gif"},
+        };
+        auto found = types.find(format);
+        return found != types.end() ? found->second : nullptr;
+    }
+
+    /**
+     * @param status HTTP status code.
+     * @return Its reason phrase.
+     */
+    inline const char* ReasonPhrase(int status)
+    {
+        switch (status) {
+        case 100:
+            return "Continue";
+        case 200:
+            return "OK";
+        case 204:
+            return "No Content";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 408:
+            return "Request Timeout";
+        case 411:
+            return "Length Required";
+        case 413:
+            return "Payload Too Large";
+        case 422:
+            return "Unprocessable Entity";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 501:
+            return "Not Implemented";
+        default:
+            return "Internal Server Error";
+        }
+    }
+
+    /**
+     * Set by SIGINT and SIGTERM; the server stops accepting and drains its connections.
+     */
+    inline volatile std::sig_atomic_t stopRequested = 0;
+
+    /**
+     * @class ConversionServer
+     * @brief Converts images posted over HTTP/1.1, keeping the process, its thread pool,
+     *        buffer pool and encoders warm between requests.
+     *
+     * Routes:
+     * - GET /health answers "ok".
+     * - POST /convert?format=png takes an encoded image as body and answers the converted
+     *   image in the requested format.
+     * - POST /convert?input=a.jpg&output=b.png converts between files the server can reach
+     *   and answers 204.
+     *
+     * Every connection carries one request and runs as a task on the thread pool, so the
+     * pool's workers bound the concurrent conversions and processing inside a conversion
+     * still spreads over idle workers. Once the workers are busy and maxPending connections
+     * wait behind them the server stops accepting, leaving further clients in the listen
+     * backlog, which keeps memory bounded by the number of admitted requests.
+     */
+    class ConversionServer
+    {
+    public:
+        /**
+         * Constructor for ConversionServer.
+         *
+         * @param converter The converter shared by all requests.
+         * @param pool The pool running the connections.
+         * @param options Endpoint and limits.
+         */
+        ConversionServer(ImageConverter& converter, ThreadPool& pool, const ServerOptions& options)
+            : converter(converter), pool(pool), options(options)
+        {
+            if (this->options.maxPending == 0) {
+                this->options.maxPending = 2 * static_cast<std::size_t>(pool.Size());
+            }
+        }
+
+        ConversionServer(const ConversionServer&) = delete;
+        ConversionServer& operator=(const ConversionServer&) = delete;
+
+        ~ConversionServer() { Close(); }
+
+        /**
+         * Serves requests until SIGINT or SIGTERM, then waits for admitted requests to finish.
+         *
+         * @throws std::runtime_error if the endpoint cannot be opened.
+         */
+        void Run()
+        {
+#if defined(BWCONV_POSIX)
+            Listen();
+            std::signal(SIGPIPE, SIG_IGN);
+            struct sigaction action = {};
+            action.sa_handler = [](int) { stopRequested = 1; };
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGINT, &action, nullptr);
+            sigaction(SIGTERM, &action, nullptr);
+
+            std::size_t limit = pool.Size() + options.maxPending;
+            while (stopRequested == 0) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (!changed.wait_for(lock, std::chrono::milliseconds(200), [&] { return inFlight < limit; })) {
+                        continue;
+                    }
+                }
+                // Polling with a timeout lets a signal delivered to a worker stop the loop too.
+                pollfd listening = {listenFd, POLLIN, 0};
+                if (poll(&listening, 1, 200) <= 0) {
+                    continue;
+                }
+                int client = accept(listenFd, nullptr, nullptr);
+                if (client < 0) {
+                    continue;
+                }
+                timeval timeout = {options.ioTimeoutSeconds, 0};
+                setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++inFlight;
+                }
+                // Connections are dealt to the pool's NUMA nodes in turn.
+                pool.Submit([this, client] {
+                    HandleConnection(client);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    --inFlight;
+                    changed.notify_all();
+                }, static_cast<int>(accepted++ % static_cast<std::size_t>(pool.Nodes())));
+            }
+
+            Close();
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return inFlight == 0; });
+#else
+            throw std::runtime_error("Service mode needs POSIX sockets");
+#endif
+        }
+
+    private:
+#if defined(BWCONV_POSIX)
+        /**
+         * Opens the listening socket described by the endpoint.
+         *
+         * @throws std::runtime_error if the endpoint is malformed or cannot be bound.
+         */
+        void Listen()
+        {
+            const std::string& endpoint = options.endpoint;
+            // Clients beyond the admitted ones wait here, so the backlog is kept long.
+            int backlog = SOMAXCONN;
+            if (endpoint.rfind("unix:", 0) == 0 || endpoint.find('/') != std::string::npos) {
+                socketPath = endpoint.rfind("unix:", 0) == 0 ? endpoint.substr(5) : endpoint;
+                sockaddr_un address = {};
+                address.sun_family = AF_UNIX;
+                if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+                    throw std::runtime_error("Invalid socket path " + socketPath);
+                }
+                std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+                // A socket left behind by a previous server is replaced; other files are not.
+                struct stat info;
+                if (lstat(socketPath.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+                    unlink(socketPath.c_str());
+                }
+                listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+                    listen(listenFd, backlog) != 0) {
+                    std::string reason = std::strerror(errno);
+                    Close();
+                    throw std::runtime_error("Unable to listen on " + socketPath + ": " + reason);
+                }
+                return;
+            }
+
+            std::size_t colon = endpoint.rfind(':');
+            std::string host = colon == std::string::npos ? "127.0.0.1" : endpoint.substr(0, colon);
+            std::string port = colon == std::string::npos ? endpoint : endpoint.substr(colon + 1);
+            addrinfo hints = {};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            addrinfo* addresses = nullptr;
+            int failure = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addresses);
+            if (failure != 0) {
+                throw std::runtime_error("Invalid endpoint " + endpoint + ": " + gai_strerror(failure));
+            }
+            std::string reason = "no address";
+            for (addrinfo* a = addresses; a != nullptr && listenFd < 0; a = a->ai_next) {
+                listenFd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                int on = 1;
+                if (listenFd >= 0 && (setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+                                      bind(listenFd, a->ai_addr, a->ai_addrlen) != 0 ||
+                                      listen(listenFd, backlog) != 0)) {
+                    reason = std::strerror(errno);
+                    close(listenFd);
+                    listenFd = -1;
+                }
+            }
+            freeaddrinfo(addresses);
+            if (listenFd < 0) {
+                throw std::runtime_error("Unable to listen on " + endpoint + ": " + reason);
+            }
+        }
+
+        /**
+         * Answers one connection and closes it.
+         *
+         * @param client The connected socket.
+         */
+        void HandleConnection(int client)
+        {
+            try {
+                HttpRequest request;
+                try {
+                    ReadRequest(client, request);
+                    Dispatch(client, request);
+                } catch (const HttpError& e) {
+                    Respond(client, e.status, "text/plain", std::string(e.what()) + "\n");
+                }
+            } catch (const std::exception& e) {
+                // The client went away or timed out; there is nobody left to answer.
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            Disconnect(client);
+        }
+
+        /**
+         * Receives the next bytes of a request. The per-read timeout alone would let a client
+         * that trickles bytes hold a worker indefinitely, so every read also waits no longer
+         * than the request's deadline.
+         *
+         * @param client The connected socket.
+         * @param buffer Receives the bytes.
+         * @param size Largest number of bytes to receive.
+         * @param deadline Time by which the whole request must have arrived.
+         * @param what What is being read, for the error message of a closed connection.
+         * @return Number of bytes received, at least 1.
+         * @throws HttpError if the client closes the connection or the deadline or a read times out.
+         */
+        static std::size_t Receive(int client, void* buffer, std::size_t size,
+                                   std::chrono::steady_clock::time_point deadline, const char* what)
+        {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline -
+                                                                                  std::chrono::steady_clock::now());
+            pollfd readable = {client, POLLIN, 0};
+            if (remaining.count() <= 0 || poll(&readable, 1, static_cast<int>(remaining.count())) == 0) {
+                throw HttpError(408, "Request timed out");
+            }
+            ssize_t received = recv(client, buffer, size, 0);
+            if (received <= 0) {
+                throw HttpError(received == 0 ? 400 : 408, std::string("Incomplete ") + what);
+            }
+            return static_cast<std::size_t>(received);
+        }
+
+        /**
+         * Reads the request line, headers and body of a request.
+         *
+         * @param client The connected socket.
+         * @param request Receives the request.
+         * @throws HttpError if the request is malformed, exceeds the limits or arrives too slowly.
+         */
+        void ReadRequest(int client, HttpRequest& request)
+        {
+            const std::size_t maxHeaderBytes = 64u << 10;
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(options.requestTimeoutSeconds);
+            std::string head;
+            std::size_t end;
+            char chunk[4096];
+            while ((end = head.find("\r\n\r\n")) == std::string::npos) {
+                if (head.size() > maxHeaderBytes) {
+                    throw HttpError(431, "Request headers are too large");
+                }
+                head.append(chunk, Receive(client, chunk, sizeof(chunk), deadline, "request"));
+            }
+
+            std::size_t lineEnd = head.find("\r\n");
+            std::string line = head.substr(0, lineEnd);
+            std::size_t first = line.find(' '), second = line.rfind(' ');
+            if (first == std::string::npos || second == first || line.compare(second + 1, 5, "HTTP/") != 0) {
+                throw HttpError(400, "Malformed request line");
+            }
+            request.method = line.substr(0, first);
+            std::string target = line.substr(first + 1, second - first - 1);
+            std::size_t question = target.find('?');
+            request.path = target.substr(0, question);
+            if (question != std::string::npos) {
+                request.query = ParseQuery(target.substr(question + 1));
+            }
+
+            for (std::size_t start = lineEnd + 2; start < end;) {
+                std::size_t stop = head.find("\r\n", start);
+                std::string field = head.substr(start, stop - start);
+                std::size_t colon = field.find(':');
+                if (colon == std::string::npos) {
+                    throw HttpError(400, "Malformed header");
+                }
+                std::string name = field.substr(0, colon);
+                std::transform(name.begin(), name.end(), name.begin(),
+                               [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                std::size_t valueStart = std::min(field.find_first_not_of(" \t", colon + 1), field.size());
+                std::size_t valueEnd = field.find_last_not_of(" \t") + 1;
+                request.headers[name] = field.substr(valueStart, std::max(valueStart, valueEnd) - valueStart);
+                start = stop + 2;
+            }
+
+            if (request.headers.count("transfer-encoding") != 0) {
+                throw HttpError(501, "Chunked request bodies are not supported; send Content-Length");
+            }
+            auto length = request.headers.find("content-length");
+            if (length == request.headers.end()) {
+                return;
+            }
+            std::size_t bodyBytes = 0;
+            try {
+                std::size_t parsed = 0;
+                bodyBytes = std::stoull(length->second, &parsed);
+                if (parsed != length->second.size()) {
+                    throw std::invalid_argument("trailing characters");
+                }
+            } catch (const std::exception&) {
+                throw HttpError(400, "Invalid Content-Length");
+            }
+            if (bodyBytes > options.maxBodyBytes) {
+                throw HttpError(413, "Request body exceeds " + std::to_string(options.maxBodyBytes) + " bytes");
+            }
+            auto expect = request.headers.find("expect");
+            if (expect != request.headers.end() && expect->second == "100-continue") {
+                static const char continueLine[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                Write(client, continueLine, sizeof(continueLine) - 1, nullptr, 0);
+            }
+
+            std::size_t buffered = std::min(bodyBytes, head.size() - end - 4);
+            request.body.resize(bodyBytes);
+            std::memcpy(request.body.data(), head.data() + end + 4, buffered);
+            while (buffered < bodyBytes) {
+                buffered += Receive(client, request.body.data() + buffered, bodyBytes - buffered, deadline,
+                                    "request body");
+            }
+        }
+
+        /**
+         * Routes a request and sends the response.
+         *
+         * @param client The connected socket.
+         * @param request The request.
+         * @throws HttpError for requests that cannot be served.
+         */
+        void Dispatch(int client, HttpRequest& request)
+        {
+            if (request.path == "/health") {
+                if (request.method != "GET" && request.method != "HEAD") {
+                    throw HttpError(405, "Use GET");
+                }
+                Respond(client, 200, "text/plain", "ok\n");
+                return;
+            }
+            if (request.path != "/convert") {
+                throw HttpError(404, "Unknown path " + request.path);
+            }
+            if (request.method != "POST") {
+                throw HttpError(405, "Use POST");
+            }
+
+            auto input = request.query.find("input");
+            if (input != request.query.end()) {
+                auto output = request.query.find("output");
+                if (output == request.query.end() || output->second.empty() || input->second.empty()) {
+                    throw HttpError(400, "Converting files needs both input and output");
+                }
+                try {
+                    converter.ConvertImage(input->second, output->second);
+                } catch (const std::exception& e) {
+                    throw HttpError(422, e.what());
+                }
+                Respond(client, 204, nullptr, std::string());
+                return;
+            }
+
+            auto format = request.query.find("format");
+            std::string extension = format != request.query.end() ? format->second : "png";
+            std::transform(extension.begin(), extension.end(), extension.begin(),
+                           [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+            const char* mediaType = MediaType(extension);
+            if (mediaType == nullptr) {
+                throw HttpError(400, "Unsupported output format " + extension);
+            }
+            if (request.body.empty()) {
+                throw HttpError(request.headers.count("content-length") != 0 ? 400 : 411, "Missing image in body");
+            }
+
+            // Encoded outputs of similar size follow each other, so every worker keeps its buffer.
+            thread_local std::vector<unsigned char> encoded;
+            encoded.clear();
+            try {
+                converter.ConvertMemory(request.body.data(), request.body.size(), extension, encoded);
+            } catch (const std::exception& e) {
+                throw HttpError(422, e.what());
+            }
+            PooledVector<unsigned char>().swap(request.body);
+            Respond(client, 200, mediaType, encoded.data(), encoded.size());
+        }
+
+        /**
+         * Sends a response with a text body.
+         */
+        void Respond(int client, int status, const char* contentType, const std::string& body)
+        {
+            Respond(client, status, contentType, reinterpret_cast<const unsigned char*>(body.data()), body.size());
+        }
+
+        /**
+         * Sends a response and announces that the connection closes after it.
+         *
+         * @param client The connected socket.
+         * @param status HTTP status code.
+         * @param contentType Media type of the body, or nullptr without a body.
+         * @param body The body.
+         * @param size Size of the body in bytes.
+         */
+        void Respond(int client, int status, const char* contentType, const unsigned char* body, std::size_t size)
+        {
+            std::string head = "HTTP/1.1 " + std::to_string(status) + " " + ReasonPhrase(status) + "\r\n";
+            if (contentType != nullptr) {
+                head += std::string("Content-Type: ") + contentType + "\r\n";
+            }
+            if (status == 405) {
+                head += "Allow: GET, POST\r\n";
+            }
+            if (status != 204) {
+                head += "Content-Length: " + std::to_string(size) + "\r\n";
+            }
+            head += "Connection: close\r\n\r\n";
+            Write(client, head.data(), head.size(), body, size);
+        }
+
+        /**
+         * Writes a header and a body with as few system calls as possible, so that a small
+         * header never waits for the client's delayed acknowledgement.
+         *
+         * @throws std::runtime_error if the client stops reading.
+         */
+        static void Write(int client, const char* head, std::size_t headSize, const unsigned char* body,
+                          std::size_t bodySize)
+        {
+            iovec parts[2] = {{const_cast<char*>(head), headSize},
+                              {const_cast<unsigned char*>(body), bodySize}};
+            iovec* next = parts;
+            int count = bodySize != 0 ? 2 : 1;
+            while (count > 0) {
+                ssize_t written = writev(client, next, count);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error(std::string("Unable to send response: ") + std::strerror(errno));
+                }
+                auto remaining = static_cast<std::size_t>(written);
+                while (count > 0 && remaining >= next->iov_len) {
+                    remaining -= next->iov_len;
+                    ++next;
+                    --count;
+                }
+                if (count > 0) {
+                    next->iov_base = static_cast<char*>(next->iov_base) + remaining;
+                    next->iov_len -= remaining;
+                }
+            }
+        }
+
+        /**
+         * Closes a connection after the response. Request bytes that were never read, as
+         * after a rejected body, are drained briefly first: closing a socket with unread
+         * data resets the connection and could discard the response before the client
+         * reads it.
+         */
+        static void Disconnect(int client)
+        {
+            shutdown(client, SHUT_WR);
+            timeval timeout = {1, 0};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            char chunk[4096];
+            std::size_t drained = 0;
+            ssize_t received;
+            while (drained < (1u << 20) && (received = recv(client, chunk, sizeof(chunk), 0)) > 0) {
+                drained += static_cast<std::size_t>(received);
+            }
+            close(client);
+        }
+#endif
+
+        /**
+         * Closes the listening socket and removes the Unix socket file.
+         */
+        void Close()
+        {
+#if defined(BWCONV_POSIX)
+            if (listenFd >= 0) {
+                close(listenFd);
+                listenFd = -1;
+                if (!socketPath.empty()) {
+                    unlink(socketPath.c_str());
+                }
+            }
+#endif
+        }
+
+        ImageConverter& converter;       ///< Converter shared by all requests.
+        ThreadPool& pool;                ///< Pool running the connections.
+        ServerOptions options;           ///< Endpoint and limits.
+        int listenFd = -1;               ///< Listening socket.
+        std::string socketPath;          ///< Path of a Unix socket, removed on close.
+        std::size_t inFlight = 0;        ///< Admitted connections not yet answered.
+        std::size_t accepted = 0;        ///< Connections accepted so far.
+        std::mutex mutex;                ///< Guards inFlight.
+        std::condition_variable changed; ///< Signalled when a connection finishes.
+    };
+} // namespace bwconv::Serve
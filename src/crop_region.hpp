@@ -0,0 +1,132 @@
+/**
+ * @file crop_region.hpp
+ * @brief Rectangles of an image that a conversion is restricted to.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "image_view.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace bwconv
+{
+    /**
+     * @struct CropRegion
+     * @brief A rectangle in the pixels of the full-size image; the default is the whole image.
+     */
+    struct CropRegion
+    {
+        int x = 0;      ///< Left column.
+        int y = 0;      ///< Top row.
+        int width = 0;  ///< Width in pixels; 0 with height 0 for the whole image.
+        int height = 0; ///< Height in pixels.
+
+        /**
+         * @return true if the region stands for the whole image.
+         */
+        bool IsWhole() const { return width == 0 && height == 0; }
+
+        /**
+         * @param imageWidth Width of the image.
+         * @param imageHeight Height of the image.
+         * @return The part of the region inside the image; the whole image for a whole region.
+         * @throws std::runtime_error if the region lies entirely outside the image.
+         */
+        CropRegion ClippedTo(int imageWidth, int imageHeight) const
+        {
+            if (IsWhole()) {
+                return CropRegion{0, 0, imageWidth, imageHeight};
+            }
+            CropRegion clipped;
+            clipped.x = std::max(x, 0);
+            clipped.y = std::max(y, 0);
+            clipped.width = std::min(x + width, imageWidth) - clipped.x;
+            clipped.height = std::min(y + height, imageHeight) - clipped.y;
+            if (clipped.width <= 0 || clipped.height <= 0) {
+                throw std::runtime_error("Crop region " + ToString() + " lies outside the " +
+                                         std::to_string(imageWidth) + "x" + std::to_string(imageHeight) + " image");
+            }
+            return clipped;
+        }
+
+        /**
+         * @return The region as "x,y,w,h", the form Parse reads.
+         */
+        std::string ToString() const
+        {
+            return std::to_string(x) + "," + std::to_string(y) + "," + std::to_string(width) + "," +
+                   std::to_string(height);
+        }
+
+        /**
+         * Parses a region such as "120,80,640,480": left, top, width and height in pixels.
+         *
+         * @param text The text to parse.
+         * @return The region.
+         * @throws std::runtime_error if the text is not a region with a positive size.
+         */
+        static CropRegion Parse(const std::string& text)
+        {
+            int values[4] = {};
+            std::size_t start = 0;
+            for (int i = 0; i < 4; ++i) {
+                std::size_t end = i < 3 ? text.find(',', start) : text.size();
+                std::string part = end == std::string::npos ? std::string() : text.substr(start, end - start);
+                if (part.empty() || part.size() > 6 ||
+                    !std::all_of(part.begin(), part.end(), [](unsigned char c) { return std::isdigit(c) != 0; })) {
+                    throw std::runtime_error("Invalid crop region: " + text + " (expected X,Y,WIDTH,HEIGHT)");
+                }
+                values[i] = std::stoi(part);
+                start = end + 1;
+            }
+            if (values[2] == 0 || values[3] == 0) {
+                throw std::runtime_error("Invalid crop region: " + text + " (empty)");
+            }
+            return CropRegion{values[0], values[1], values[2], values[3]};
+        }
+    };
+
+    /**
+     * @param img An image.
+     * @param region A region inside it, see CropRegion::ClippedTo.
+     * @return A view of the region sharing the image's memory.
+     */
+    inline ImageView CropView(const ImageView& img, const CropRegion& region)
+    {
+        ImageView cropped = img;
+        cropped.data = img.Row(region.y) + static_cast<std::size_t>(region.x) * img.channels * SampleBytes(img.sample);
+        cropped.width = region.width;
+        cropped.height = region.height;
+        return cropped;
+    }
+
+    /**
+     * Moves the rows of a cropped view to the start of the buffer they live in, without
+     * padding, so the region can be used like a decoded image of its own. Rows only move
+     * towards the start, and each is moved once, so the cost is that of the region.
+     *
+     * @param buffer Start of the buffer holding the view.
+     * @param img View inside the buffer; describes the packed region on return.
+     */
+    inline void PackToFront(unsigned char* buffer, ImageView& img)
+    {
+        if (img.data == buffer && img.IsPacked()) {
+            return;
+        }
+        std::size_t rowBytes = img.RowBytes();
+        for (int y = 0; y < img.height; ++y) {
+            std::memmove(buffer + rowBytes * y, img.Row(y), rowBytes);
+        }
+        img.data = buffer;
+        img.stride = rowBytes;
+    }
+} // namespace bwconv
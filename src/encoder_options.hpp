@@ -0,0 +1,51 @@
+/**
+ * @file encoder_options.hpp
+ * @brief Quality and speed settings shared by the whole-image and streaming encoders.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+namespace bwconv
+{
+    /**
+     * PNG row filters. Adaptive picks, per row, the filter with the smallest sum of
+     * absolute residuals, as stb_image_write and libpng do by default.
+     */
+    enum class PngFilter
+    {
+        Adaptive = -1,
+        None = 0,
+        Sub = 1,
+        Up = 2,
+        Average = 3,
+        Paeth = 4
+    };
+
+    /**
+     * Which implementation encodes PNG and JPEG.
+     */
+    enum class EncoderBackend
+    {
+        Auto, ///< zlib for PNG and libjpeg for JPEG when the build found them, otherwise stb.
+        Stb   ///< Always stb_image_write.
+    };
+
+    /**
+     * @struct EncoderOptions
+     * @brief Per-format encoder settings.
+     *
+     * The default quality, level and filter match the original stb output settings. The default
+     * backend may pick zlib or libjpeg, so the bytes written only match the original when
+     * backend is EncoderBackend::Stb.
+     */
+    struct EncoderOptions
+    {
+        int jpegQuality = 100;                   ///< JPEG quality, 1 to 100.
+        int pngLevel = 8;                        ///< Deflate level, 0 (store) to 9 (smallest).
+        PngFilter pngFilter = PngFilter::Adaptive; ///< Row filter of PNG output.
+        EncoderBackend backend = EncoderBackend::Auto; ///< Encoder implementation.
+    };
+} // namespace bwconv
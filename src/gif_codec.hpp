@@ -0,0 +1,520 @@
+/**
+ * @file gif_codec.hpp
+ * @brief Frame-by-frame GIF decoding and gray GIF encoding for animated inputs.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "image_view.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace bwconv::Gif
+{
+    /**
+     * @param bytes The encoded file.
+     * @param size Size of the file in bytes.
+     * @return true if the file starts with a GIF signature.
+     */
+    inline bool IsGif(const unsigned char* bytes, std::size_t size)
+    {
+        return size >= 6 && std::memcmp(bytes, "GIF8", 4) == 0 && (bytes[4] == '7' || bytes[4] == '9') &&
+               bytes[5] == 'a';
+    }
+
+    /**
+     * @class FrameReader
+     * @brief Decodes the frames of a GIF one at a time, composited as a viewer shows them.
+     *
+     * stbi_load_gif_from_memory returns all frames of an animation in one buffer; this
+     * reader keeps only the canvas (and a copy of it while a frame asks to be restored),
+     * so decoding uses the same memory for any number of frames. Frames are returned as
+     * RGB, with transparent areas showing the background color. Truncated data ends the
+     * animation after the last complete frame, as browsers do.
+     */
+    class FrameReader
+    {
+    public:
+        /**
+         * Reads the header. The file must outlive the reader.
+         *
+         * @param bytes The encoded file.
+         * @param size Size of the file in bytes.
+         * @throws std::runtime_error if the file is not a GIF.
+         */
+        FrameReader(const unsigned char* bytes, std::size_t size) : bytes(bytes), size(size)
+        {
+            if (!IsGif(bytes, size) || size < 13) {
+                throw std::runtime_error("Invalid GIF file");
+            }
+            position = 6;
+            width = Word();
+            height = Word();
+            int packed = Byte();
+            int backgroundIndex = Byte();
+            Byte();
+            if (width == 0 || height == 0) {
+                throw std::runtime_error("Invalid GIF file");
+            }
+            if (packed & 0x80) {
+                globalColors = 2 << (packed & 7);
+                ReadPalette(globalPalette.data(), globalColors);
+                if (backgroundIndex < globalColors) {
+                    std::memcpy(background, &globalPalette[backgroundIndex * 3], 3);
+                }
+            }
+            canvas.resize(static_cast<std::size_t>(width) * height * 3);
+            FillRect(0, 0, width, height);
+        }
+
+        /**
+         * @return Width of the canvas in pixels.
+         */
+        int Width() const { return width; }
+
+        /**
+         * @return Height of the canvas in pixels.
+         */
+        int Height() const { return height; }
+
+        /**
+         * @return The number of times the animation repeats, 0 for forever, or -1 if the
+         *         file does not say, which means it plays once. Known once a frame was read.
+         */
+        int LoopCount() const { return loopCount; }
+
+        /**
+         * Decodes the next frame.
+         *
+         * @param rgb Receives Width() * Height() * 3 bytes.
+         * @param delay Receives how long the frame is shown, in hundredths of a second.
+         * @return false if there are no more frames.
+         */
+        bool Next(unsigned char* rgb, int& delay)
+        {
+            int disposal = 0, transparent = -1;
+            delay = 0;
+            while (position < size) {
+                int block = Byte();
+                if (block == 0x3B) {
+                    break;
+                }
+                if (block == 0x21) {
+                    int label = Byte();
+                    if (label == 0xF9 && Peek() >= 4) {
+                        std::size_t end = position + 1 + Peek();
+                        Byte();
+                        int flags = Byte();
+                        delay = Word();
+                        int index = Byte();
+                        disposal = (flags >> 2) & 7;
+                        transparent = (flags & 1) ? index : -1;
+                        position = end;
+                    } else if (label == 0xFF && Peek() == 11 && position + 12 <= size &&
+                               std::memcmp(bytes + position + 1, "NETSCAPE2.0", 11) == 0) {
+                        position += 12;
+                        if (Peek() >= 3 && position + 4 <= size && bytes[position + 1] == 1) {
+                            loopCount = bytes[position + 2] | (bytes[position + 3] << 8);
+                        }
+                    }
+                    SkipSubBlocks();
+                    continue;
+                }
+                if (block != 0x2C) {
+                    break;
+                }
+                if (!ReadImage(transparent, disposal)) {
+                    break;
+                }
+                std::memcpy(rgb, canvas.data(), canvas.size());
+                return true;
+            }
+            position = size;
+            return false;
+        }
+
+    private:
+        /// Largest code of the LZW code table.
+        static constexpr int kMaxCodes = 4096;
+
+        const unsigned char* bytes;                     ///< The encoded file.
+        std::size_t size;                               ///< Size of the file.
+        std::size_t position = 0;                       ///< Offset of the next unread byte.
+        int width = 0;                                  ///< Canvas width.
+        int height = 0;                                 ///< Canvas height.
+        int loopCount = -1;                             ///< NETSCAPE2.0 repetitions, -1 if absent.
+        std::array<unsigned char, 768> globalPalette{}; ///< Global color table.
+        int globalColors = 0;                           ///< Entries of the global color table.
+        unsigned char background[3] = {0, 0, 0};        ///< Background color.
+        std::vector<unsigned char> canvas;              ///< The composited image, RGB.
+        std::vector<unsigned char> saved;               ///< Canvas to restore after the last frame.
+        std::vector<unsigned char> indices;             ///< Color indices of the last frame.
+        int lastDisposal = 0;                           ///< Disposal method of the last frame.
+        int lastX = 0, lastY = 0;                       ///< Position of the last frame.
+        int lastWidth = 0, lastHeight = 0;              ///< Size of the last frame.
+
+        int Byte() { return position < size ? bytes[position++] : 0; }
+        int Peek() const { return position < size ? bytes[position] : 0; }
+        int Word()
+        {
+            int low = Byte();
+            return low | (Byte() << 8);
+        }
+
+        void ReadPalette(unsigned char* palette, int colors)
+        {
+            std::size_t count = std::min<std::size_t>(static_cast<std::size_t>(colors) * 3, size - position);
+            std::memcpy(palette, bytes + position, count);
+            position += count;
+        }
+
+        void SkipSubBlocks()
+        {
+            while (position < size) {
+                int length = Byte();
+                if (length == 0) {
+                    return;
+                }
+                position = std::min(size, position + length);
+            }
+        }
+
+        /**
+         * Fills a rectangle of the canvas, clipped to it, with the background color.
+         */
+        void FillRect(int x, int y, int w, int h)
+        {
+            for (int row = std::max(0, y); row < std::min(height, y + h); ++row) {
+                unsigned char* p = &canvas[(static_cast<std::size_t>(row) * width + std::max(0, x)) * 3];
+                for (int col = std::max(0, x); col < std::min(width, x + w); ++col, p += 3) {
+                    std::memcpy(p, background, 3);
+                }
+            }
+        }
+
+        /**
+         * Reads an image descriptor and its data and draws the frame onto the canvas,
+         * after disposing of the previous frame.
+         *
+         * @return false if the image is truncated before its data.
+         */
+        bool ReadImage(int transparent, int disposal)
+        {
+            int x = Word(), y = Word(), w = Word(), h = Word();
+            int packed = Byte();
+            std::array<unsigned char, 768> localPalette{};
+            const unsigned char* palette = globalPalette.data();
+            int colors = globalColors;
+            if (packed & 0x80) {
+                colors = 2 << (packed & 7);
+                ReadPalette(localPalette.data(), colors);
+                palette = localPalette.data();
+            }
+            int minCodeSize = Byte();
+            if (position >= size || minCodeSize < 1 || minCodeSize > 11) {
+                return false;
+            }
+
+            if (lastDisposal == 2) {
+                FillRect(lastX, lastY, lastWidth, lastHeight);
+            } else if (lastDisposal == 3 && saved.size() == canvas.size()) {
+                canvas = saved;
+            }
+            if (disposal == 3) {
+                saved = canvas;
+            }
+            lastDisposal = disposal;
+            lastX = x, lastY = y, lastWidth = w, lastHeight = h;
+
+            indices.assign(static_cast<std::size_t>(w) * h, 0);
+            DecodeLzw(minCodeSize, indices.data(), indices.size());
+
+            bool interlaced = (packed & 0x40) != 0;
+            for (int i = 0; i < h; ++i) {
+                int row = interlaced ? InterlacedRow(i, h) : i;
+                int canvasY = y + row;
+                if (canvasY < 0 || canvasY >= height) {
+                    continue;
+                }
+                const unsigned char* src = &indices[static_cast<std::size_t>(i) * w];
+                for (int col = 0; col < w; ++col) {
+                    int canvasX = x + col;
+                    int index = src[col];
+                    if (canvasX >= width || index == transparent) {
+                        continue;
+                    }
+                    unsigned char* dst = &canvas[(static_cast<std::size_t>(canvasY) * width + canvasX) * 3];
+                    if (index < colors) {
+                        std::memcpy(dst, palette + index * 3, 3);
+                    } else {
+                        dst[0] = dst[1] = dst[2] = 0;
+                    }
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @param i Index of a row in the order it is stored.
+         * @param h Height of the frame.
+         * @return The row it stands for in an interlaced frame.
+         */
+        static int InterlacedRow(int i, int h)
+        {
+            static const int starts[] = {0, 4, 2, 1};
+            static const int steps[] = {8, 8, 4, 2};
+            for (int pass = 0; pass < 4; ++pass) {
+                int rows = (h - starts[pass] + steps[pass] - 1) / steps[pass];
+                if (i < rows) {
+                    return starts[pass] + i * steps[pass];
+                }
+                i -= rows;
+            }
+            return 0;
+        }
+
+        /**
+         * Decodes LZW data from the sub-blocks at the current position. Missing pixels keep
+         * index 0; the position is left after the block terminator.
+         */
+        void DecodeLzw(int minCodeSize, unsigned char* out, std::size_t count)
+        {
+            std::vector<std::uint16_t> prefix(kMaxCodes);
+            std::vector<unsigned char> suffix(kMaxCodes), stack(kMaxCodes + 1);
+            const int clear = 1 << minCodeSize, end = clear + 1;
+            int codeSize = minCodeSize + 1, next = clear + 2, old = -1;
+            unsigned char first = 0;
+            for (int code = 0; code < clear; ++code) {
+                suffix[code] = static_cast<unsigned char>(code);
+            }
+
+            std::uint32_t bits = 0;
+            int bitCount = 0, blockLeft = 0;
+            std::size_t written = 0;
+            while (written < count) {
+                while (bitCount < codeSize) {
+                    if (blockLeft == 0) {
+                        blockLeft = Byte();
+                        if (blockLeft == 0) {
+                            return;
+                        }
+                    }
+                    bits |= static_cast<std::uint32_t>(Byte()) << bitCount;
+                    bitCount += 8;
+                    --blockLeft;
+                }
+                int code = static_cast<int>(bits & ((1u << codeSize) - 1));
+                bits >>= codeSize;
+                bitCount -= codeSize;
+
+                if (code == clear) {
+                    codeSize = minCodeSize + 1;
+                    next = clear + 2;
+                    old = -1;
+                    continue;
+                }
+                if (code == end) {
+                    break;
+                }
+                if (old < 0) {
+                    if (code > clear) {
+                        break;
+                    }
+                    out[written++] = first = static_cast<unsigned char>(code);
+                    old = code;
+                    continue;
+                }
+
+                int in = code, depth = 0;
+                if (code >= next) {
+                    if (code > next) {
+                        break;
+                    }
+                    stack[depth++] = first;
+                    code = old;
+                }
+                while (code > clear && depth < kMaxCodes) {
+                    stack[depth++] = suffix[code];
+                    code = prefix[code];
+                }
+                first = suffix[code];
+                stack[depth++] = first;
+                if (next < kMaxCodes) {
+                    prefix[next] = static_cast<std::uint16_t>(old);
+                    suffix[next] = first;
+                    if (++next == (1 << codeSize) && codeSize < 12) {
+                        ++codeSize;
+                    }
+                }
+                while (depth > 0 && written < count) {
+                    out[written++] = stack[--depth];
+                }
+                old = in;
+            }
+            position = std::min(size, position + blockLeft);
+            SkipSubBlocks();
+        }
+    };
+
+    /**
+     * Appends the header of a GIF without a global color table.
+     *
+     * @param width Width of the canvas.
+     * @param height Height of the canvas.
+     * @param loopCount Repetitions of the animation, 0 for forever, or -1 to play once.
+     * @param out Buffer the header is appended to.
+     */
+    inline void AppendHeader(int width, int height, int loopCount, std::vector<unsigned char>& out)
+    {
+        if (width > 0xFFFF || height > 0xFFFF) {
+            throw std::runtime_error("Image is too large for GIF");
+        }
+        const unsigned char header[] = {'G', 'I', 'F', '8', '9', 'a',
+                                        static_cast<unsigned char>(width), static_cast<unsigned char>(width >> 8),
+                                        static_cast<unsigned char>(height), static_cast<unsigned char>(height >> 8),
+                                        0, 0, 0};
+        out.insert(out.end(), std::begin(header), std::end(header));
+        if (loopCount >= 0) {
+            const unsigned char loop[] = {0x21, 0xFF, 11,  'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1,
+                                          static_cast<unsigned char>(loopCount),
+                                          static_cast<unsigned char>(loopCount >> 8), 0};
+            out.insert(out.end(), std::begin(loop), std::end(loop));
+        }
+    }
+
+    /**
+     * Appends the trailer that ends a GIF.
+     */
+    inline void AppendTrailer(std::vector<unsigned char>& out) { out.push_back(0x3B); }
+
+    /**
+     * Appends a single-channel image as a GIF frame with a gray color table: two entries for
+     * bilevel images, which compress several times better, and 256 otherwise.
+     *
+     * @param img The image; 8-bit single-channel.
+     * @param delay How long the frame is shown, in hundredths of a second.
+     * @param out Buffer the frame is appended to.
+     * @throws std::runtime_error if the image is not 8-bit gray or too large.
+     */
+    inline void AppendFrame(const ImageView& img, int delay, std::vector<unsigned char>& out)
+    {
+        if (img.channels != 1 || img.sample != SampleType::U8) {
+            throw std::runtime_error("GIF output requires an 8-bit single-channel image");
+        }
+        if (img.width > 0xFFFF || img.height > 0xFFFF) {
+            throw std::runtime_error("Image is too large for GIF");
+        }
+        int depth = img.bilevel ? 1 : 8;
+        const unsigned char control[] = {0x21, 0xF9, 4, 0x04, static_cast<unsigned char>(delay),
+                                         static_cast<unsigned char>(delay >> 8), 0, 0};
+        out.insert(out.end(), std::begin(control), std::end(control));
+        const unsigned char descriptor[] = {0x2C, 0, 0, 0, 0,
+                                            static_cast<unsigned char>(img.width),
+                                            static_cast<unsigned char>(img.width >> 8),
+                                            static_cast<unsigned char>(img.height),
+                                            static_cast<unsigned char>(img.height >> 8),
+                                            static_cast<unsigned char>(0x80 | (depth - 1))};
+        out.insert(out.end(), std::begin(descriptor), std::end(descriptor));
+        for (int i = 0; i < (1 << depth); ++i) {
+            unsigned char level = static_cast<unsigned char>(depth == 1 ? i * 255 : i);
+            out.insert(out.end(), {level, level, level});
+        }
+
+        // LZW with a hash table from (prefix, pixel) to code, written in sub-blocks of 255.
+        const int minCodeSize = std::max(2, depth);
+        const int clear = 1 << minCodeSize, end = clear + 1;
+        constexpr int kHashSize = 8192;
+        std::vector<std::int32_t> keys(kHashSize, -1);
+        std::vector<std::uint16_t> codes(kHashSize);
+        int codeSize = minCodeSize + 1, next = clear + 2;
+
+        out.push_back(static_cast<unsigned char>(minCodeSize));
+        std::size_t blockStart = out.size();
+        out.push_back(0);
+        std::uint32_t bits = 0;
+        int bitCount = 0;
+        auto emit = [&](int code) {
+            bits |= static_cast<std::uint32_t>(code) << bitCount;
+            bitCount += codeSize;
+            while (bitCount >= 8) {
+                out.push_back(static_cast<unsigned char>(bits));
+                bits >>= 8;
+                bitCount -= 8;
+                if (out.size() - blockStart == 256) {
+                    out[blockStart] = 255;
+                    blockStart = out.size();
+                    out.push_back(0);
+                }
+            }
+        };
+        // The decoder adds a code for every code after the first, one step behind.
+        auto grow = [&]() {
+            if (++next == (1 << codeSize) + 1 && codeSize < 12) {
+                ++codeSize;
+            }
+        };
+
+        emit(clear);
+        int prefix = -1;
+        for (int y = 0; y < img.height; ++y) {
+            const unsigned char* row = img.Row(y);
+            for (int x = 0; x < img.width; ++x) {
+                int pixel = depth == 1 ? row[x] >> 7 : row[x];
+                if (prefix < 0) {
+                    prefix = pixel;
+                    continue;
+                }
+                std::int32_t key = (prefix << 8) | pixel;
+                std::uint32_t slot = (static_cast<std::uint32_t>(key) * 2654435761u) >> 19;
+                while (keys[slot] != -1 && keys[slot] != key) {
+                    slot = (slot + 1) & (kHashSize - 1);
+                }
+                if (keys[slot] == key) {
+                    prefix = codes[slot];
+                    continue;
+                }
+                emit(prefix);
+                if (next < 4096) {
+                    keys[slot] = key;
+                    codes[slot] = static_cast<std::uint16_t>(next);
+                    grow();
+                }
+                if (next == 4096) {
+                    emit(clear);
+                    std::fill(keys.begin(), keys.end(), -1);
+                    codeSize = minCodeSize + 1;
+                    next = clear + 2;
+                    prefix = pixel;
+                    continue;
+                }
+                prefix = pixel;
+            }
+        }
+        if (prefix >= 0) {
+            emit(prefix);
+            if (next < 4096) {
+                grow();
+            }
+        }
+        emit(end);
+        if (bitCount > 0) {
+            out.push_back(static_cast<unsigned char>(bits));
+        }
+        std::size_t length = out.size() - blockStart - 1;
+        if (length == 0) {
+            out.back() = 0;
+        } else {
+            out[blockStart] = static_cast<unsigned char>(length);
+            out.push_back(0);
+        }
+    }
+} // namespace bwconv::Gif
@@ -0,0 +1,248 @@
+/**
+ * @file histogram.hpp
+ * @brief Gray-level histograms counted by many threads at once, and the statistics and
+ *        thresholds derived from them.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace bwconv
+{
+    /**
+     * @struct Histogram
+     * @brief Number of samples at each of the 256 gray levels.
+     */
+    struct Histogram
+    {
+        std::array<std::uint64_t, 256> counts{}; ///< Samples per level.
+
+        /**
+         * Adds the counts of another histogram.
+         */
+        void Merge(const Histogram& other)
+        {
+            for (int v = 0; v < 256; ++v) {
+                counts[v] += other.counts[v];
+            }
+        }
+
+        /**
+         * @return The number of samples counted.
+         */
+        std::uint64_t Total() const
+        {
+            std::uint64_t total = 0;
+            for (std::uint64_t count : counts) {
+                total += count;
+            }
+            return total;
+        }
+
+        /**
+         * @return The mean level, 0 for an empty histogram.
+         */
+        double Mean() const
+        {
+            double sum = 0;
+            for (int v = 0; v < 256; ++v) {
+                sum += static_cast<double>(v) * counts[v];
+            }
+            std::uint64_t total = Total();
+            return total != 0 ? sum / static_cast<double>(total) : 0;
+        }
+
+        /**
+         * @return The standard deviation of the levels, i.e. the RMS contrast in levels.
+         */
+        double StandardDeviation() const
+        {
+            double mean = Mean(), sum = 0;
+            for (int v = 0; v < 256; ++v) {
+                sum += (v - mean) * (v - mean) * static_cast<double>(counts[v]);
+            }
+            std::uint64_t total = Total();
+            return total != 0 ? std::sqrt(sum / static_cast<double>(total)) : 0;
+        }
+
+        /**
+         * @param fraction Share of the samples, 0 to 1.
+         * @return The lowest level at or below which at least that share of the samples lies.
+         */
+        int Percentile(double fraction) const
+        {
+            double target = fraction * static_cast<double>(Total());
+            std::uint64_t below = 0;
+            for (int v = 0; v < 256; ++v) {
+                below += counts[v];
+                if (below != 0 && static_cast<double>(below) >= target) {
+                    return v;
+                }
+            }
+            return 255;
+        }
+
+        /**
+         * @return The darkest level present, 255 for an empty histogram.
+         */
+        int Min() const { return Percentile(0); }
+
+        /**
+         * @return The brightest level present, 0 for an empty histogram.
+         */
+        int Max() const
+        {
+            int v = 255;
+            while (v > 0 && counts[v] == 0) {
+                --v;
+            }
+            return v;
+        }
+
+        /**
+         * Otsu's method: the threshold that maximises the between-class variance.
+         *
+         * @return The lowest level of the white class, 1 to 256.
+         */
+        int OtsuLevel() const
+        {
+            double total = static_cast<double>(Total());
+            double sum = 0;
+            for (int v = 0; v < 256; ++v) {
+                sum += static_cast<double>(v) * counts[v];
+            }
+
+            double below = 0, sumBelow = 0, bestVariance = -1;
+            int best = 0;
+            for (int t = 0; t < 256; ++t) {
+                below += counts[t];
+                sumBelow += static_cast<double>(t) * counts[t];
+                double above = total - below;
+                if (below == 0 || above == 0) {
+                    continue;
+                }
+                double meanDifference = sumBelow / below - (sum - sumBelow) / above;
+                double variance = below * above * meanDifference * meanDifference;
+                if (variance > bestVariance) {
+                    bestVariance = variance;
+                    best = t;
+                }
+            }
+            return best + 1;
+        }
+    };
+
+    /**
+     * @class HistogramCollector
+     * @brief Counts gray levels from any number of threads without synchronisation.
+     *
+     * Every thread counts into a histogram of its own, which it finds through a thread-local
+     * cache after the first use, so counting takes no lock and no atomic operation. Merge
+     * sums the threads' histograms once the counting threads have been joined. A thread's
+     * histogram spreads consecutive samples over four tables, so runs of equal samples,
+     * common in scanned pages, do not wait on the increment of the same counter.
+     */
+    class HistogramCollector
+    {
+    public:
+        HistogramCollector() : id(NextId()) {}
+
+        HistogramCollector(const HistogramCollector&) = delete;
+        HistogramCollector& operator=(const HistogramCollector&) = delete;
+
+        /**
+         * Counts samples on the calling thread. May be called concurrently.
+         *
+         * @param samples The 8-bit samples.
+         * @param count Number of samples.
+         */
+        void Add(const unsigned char* samples, std::size_t count)
+        {
+            Lanes& lanes = Local();
+            std::size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                ++lanes[0][samples[i]];
+                ++lanes[1][samples[i + 1]];
+                ++lanes[2][samples[i + 2]];
+                ++lanes[3][samples[i + 3]];
+            }
+            for (; i < count; ++i) {
+                ++lanes[0][samples[i]];
+            }
+        }
+
+        /**
+         * Adds finished counts on the calling thread. May be called concurrently.
+         */
+        void Add(const Histogram& histogram)
+        {
+            Lanes& lanes = Local();
+            for (int v = 0; v < 256; ++v) {
+                lanes[0][v] += histogram.counts[v];
+            }
+        }
+
+        /**
+         * @return The sum of every thread's counts. Call once the counting threads are joined.
+         */
+        Histogram Merge() const
+        {
+            Histogram histogram;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& entry : threads) {
+                for (const auto& lane : entry.second) {
+                    for (int v = 0; v < 256; ++v) {
+                        histogram.counts[v] += lane[v];
+                    }
+                }
+            }
+            return histogram;
+        }
+
+    private:
+        using Lanes = std::array<std::array<std::uint64_t, 256>, 4>;
+
+        /**
+         * @return The calling thread's tables, created on its first use of the collector.
+         */
+        Lanes& Local()
+        {
+            struct Cache
+            {
+                std::uint64_t owner = 0; ///< id of the collector the tables belong to.
+                Lanes* lanes = nullptr;  ///< The tables.
+            };
+            thread_local Cache cache;
+            if (cache.owner != id) {
+                std::lock_guard<std::mutex> lock(mutex);
+                cache.lanes = &threads[std::this_thread::get_id()];
+                cache.owner = id;
+            }
+            return *cache.lanes;
+        }
+
+        /**
+         * @return An identifier no other collector of the process has, even one at the same address.
+         */
+        static std::uint64_t NextId()
+        {
+            static std::atomic<std::uint64_t> next{1};
+            return next.fetch_add(1);
+        }
+
+        std::uint64_t id;                         ///< Identifies the collector in the thread caches.
+        mutable std::mutex mutex;                 ///< Guards threads.
+        std::map<std::thread::id, Lanes> threads; ///< Tables of every thread that counted.
+    };
+} // namespace bwconv
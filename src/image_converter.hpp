@@ -0,0 +1,1066 @@
+/**
+ * @file image_converter.hpp
+ * @brief Loads, processes and saves single images.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "crop_region.hpp"
+#include "encoder_options.hpp"
+#include "gif_codec.hpp"
+#include "image_processor.hpp"
+#include "load_strategy.hpp"
+#include "mapped_file.hpp"
+#include "result_cache.hpp"
+#include "save_strategy.hpp"
+#include "stats.hpp"
+#include "streaming.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stb_image.h>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * Resizes a buffer returned by stb_image with the allocator stb_image was built with.
+     * Defined next to the stb_image implementation, where that allocator is known.
+     *
+     * @param image Buffer returned by stb_image or a LoadFile::LoadStrategy.
+     * @param bytes New size in bytes.
+     * @return The resized buffer, or nullptr on failure (the original buffer is kept).
+     */
+    void* ResizeDecodedImage(void* image, std::size_t bytes);
+
+    /**
+     * @class ImageConverter
+     * @brief Converts images between different formats and applies processing.
+     *
+     * The ImageConverter class is responsible for loading an image, applying
+     * processing to it via an ImageProcessor, and then saving it in a desired format.
+     * It supports multiple image formats for saving, including PNG, JPEG, BMP, TGA and PBM.
+     */
+    class ImageConverter
+    {
+    public:
+        /**
+         * Constructor for ImageConverter.
+         * Initializes the converter with paths and an image processor.
+         *
+         * @param inputPath Path to the input image file.
+         * @param outputPath Path where the converted image will be saved.
+         * @param processor A unique pointer to an ImageProcessor for image processing.
+         */
+        ImageConverter(const std::string& inputPath, const std::string& outputPath,
+                       std::unique_ptr<ImageProcessor> processor)
+            : inputPath(inputPath), outputPath(outputPath), processor(std::move(processor)),
+              loaders(LoadFile::CreateLoadStrategies(DecoderBackend::Auto))
+        {
+            SetEncoderOptions(EncoderOptions());
+        }
+
+        /**
+         * Constructor for a reusable ImageConverter without fixed paths.
+         * Paths are passed to ConvertImage(inputPath, outputPath) instead, which lets
+         * a single converter serve a whole batch.
+         *
+         * @param processor A unique pointer to an ImageProcessor for image processing.
+         */
+        explicit ImageConverter(std::unique_ptr<ImageProcessor> processor)
+            : ImageConverter(std::string(), std::string(), std::move(processor))
+        {
+        }
+
+        /**
+         * Converts the image from the input path, processes it, and saves it to the output path.
+         * This function will load the image, apply the processing, and then save it
+         * in the format determined by the output file's extension.
+         *
+         * @throws std::runtime_error if image loading, processing, or saving fails.
+         */
+        void ConvertImage() { ConvertImage(inputPath, outputPath); }
+
+        /**
+         * Converts a single image between the given paths.
+         * The converter holds no per-image state, so this method may be called
+         * concurrently from several threads as long as the processor allows it.
+         *
+         * @param source Path to the input image file.
+         * @param destination Path where the converted image will be saved.
+         * @throws std::runtime_error if image loading, processing, or saving fails.
+         */
+        void ConvertImage(const std::string& source, const std::string& destination)
+        {
+            ConvertImage(source, destination, crop);
+        }
+
+        /**
+         * Converts a region of an image between the given paths; the output has the size
+         * of the region. Decoders skip as much of the rest of the input as the format
+         * allows, see LoadFile::LoadStrategy::DecodeRegion, so the work grows with the
+         * region rather than with the image.
+         *
+         * @param source Path to the input image file.
+         * @param destination Path where the converted image will be saved.
+         * @param region The region, clipped to the image; a whole region converts everything.
+         * @throws std::runtime_error if the region lies outside the image, or if image
+         *         loading, processing, or saving fails.
+         */
+        void ConvertImage(const std::string& source, const std::string& destination, const CropRegion& region)
+        {
+            Measured(source, destination, [&] { Convert(source, destination, region); });
+        }
+
+        /**
+         * Decoded pixels and the view the processor is applied to.
+         */
+        struct DecodedImage
+        {
+            std::unique_ptr<unsigned char[], void (*)(void*)> pixels{nullptr, stbi_image_free}; ///< Decode buffer.
+            ImageView view;                                                                    ///< The image.
+            std::size_t decodedBytes = 0;                                                      ///< Decoded size.
+        };
+
+        /**
+         * @struct StagedImage
+         * @brief A file conversion split into the steps of ConvertImage, for pipelines that
+         *        give every step threads of its own.
+         *
+         * StageRead, StageDecode, StageProcess, StageEncode and StageWrite are called in this
+         * order, from any threads but never concurrently for one item, and FinishStaged ends
+         * the conversion whether a stage failed or not. A stage that completes the conversion
+         * by itself, such as a cache hit or a streamed image, marks the item done and the
+         * later stages skip it. Like ConvertImage, different items may be converted at once.
+         */
+        struct StagedImage
+        {
+            std::string source;                 ///< Path to the input image file.
+            std::string destination;            ///< Path where the converted image will be saved.
+            CropRegion crop;                    ///< Region of the input to convert.
+            bool done = false;                  ///< Completed by an earlier stage.
+            std::string cacheKey;               ///< Result cache key of the conversion, or empty.
+            std::unique_ptr<MappedFile> file;   ///< The encoded input until it is decoded.
+            DecodedImage image;                 ///< The decoded and then processed pixels.
+            std::vector<unsigned char> encoded; ///< The encoded output until it is written.
+            Stats::ConversionStats stats;       ///< Measurements, taken if there are stats sinks.
+        };
+
+        /**
+         * Maps the input and serves the conversion from the result cache if it can.
+         *
+         * @param item The conversion, with source and destination set.
+         * @throws std::runtime_error if the input cannot be read or the output format is unsupported.
+         */
+        void StageRead(StagedImage& item)
+        {
+            item.stats.input = item.source;
+            item.stats.output = item.destination;
+            item.stats.start = Stats::WallSeconds();
+            Stats::ScopedRecord record(Record(item));
+            {
+                Stats::ScopedStage stage(Stats::Stage::Read);
+                item.file = std::make_unique<MappedFile>(item.source);
+                item.cacheKey = CacheKeyOf(item.file->Data(), item.file->Size(), item.destination, item.crop);
+            }
+            if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                stats->bytesRead = item.file->Size();
+            }
+            if (!item.cacheKey.empty() && resultCache->Fetch(item.cacheKey, item.destination)) {
+                item.stats.cached = true;
+                item.file.reset();
+                item.done = true;
+                return;
+            }
+            // Resolve the encoder first so that unsupported outputs fail before decoding.
+            GetSaveStrategy(item.destination);
+            if (item.file->Size() > static_cast<std::size_t>(std::numeric_limits<int>::max())) {
+                throw std::runtime_error("Input file is too large");
+            }
+        }
+
+        /**
+         * Decodes the input and releases it. Inputs that are streamed or converted frame by
+         * frame are converted completely here.
+         *
+         * @param item The conversion.
+         * @throws std::runtime_error if decoding or a complete conversion fails.
+         */
+        void StageDecode(StagedImage& item)
+        {
+            if (item.done) {
+                return;
+            }
+            Stats::ScopedRecord record(Record(item));
+            const unsigned char* bytes = item.file->Data();
+            std::size_t length = item.file->Size();
+            if (!alwaysStream && framePool != nullptr && Gif::IsGif(bytes, length)) {
+                ConvertFrames(bytes, length, item.destination, item.crop);
+                item.done = true;
+            } else if (alwaysStream || ExceedsMemoryLimit(bytes, length)) {
+                item.file.reset();
+                ConvertStreaming(item.source, item.destination, item.crop);
+                item.done = true;
+            } else {
+                item.image = Decode(bytes, length, item.crop);
+            }
+            item.file.reset();
+            if (item.done) {
+                StoreResult(item);
+            }
+        }
+
+        /**
+         * Applies the processor to the decoded image.
+         *
+         * @param item The conversion.
+         */
+        void StageProcess(StagedImage& item)
+        {
+            if (item.done) {
+                return;
+            }
+            Stats::ScopedRecord record(Record(item), HeldBytes(item));
+            Process(item.image);
+        }
+
+        /**
+         * Encodes the processed image and releases its pixels.
+         *
+         * @param item The conversion.
+         * @throws std::runtime_error if encoding fails.
+         */
+        void StageEncode(StagedImage& item)
+        {
+            if (item.done) {
+                return;
+            }
+            Stats::ScopedRecord record(Record(item), HeldBytes(item));
+            {
+                Stats::ScopedStage stage(Stats::Stage::Encode);
+                GetSaveStrategy(item.destination).Encode(item.image.view, item.encoded);
+            }
+            record.Hold(item.encoded.size());
+            item.image = DecodedImage();
+        }
+
+        /**
+         * Writes the encoded image and adds it to the result cache.
+         *
+         * @param item The conversion.
+         * @throws std::runtime_error if writing fails.
+         */
+        void StageWrite(StagedImage& item)
+        {
+            if (item.done) {
+                return;
+            }
+            Stats::ScopedRecord record(Record(item), HeldBytes(item));
+            {
+                Stats::ScopedStage stage(Stats::Stage::Write);
+                SaveFile::WriteFile(item.destination, item.encoded.data(), item.encoded.size(), atomicWrites);
+            }
+            if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                stats->bytesWritten += item.encoded.size();
+            }
+            std::vector<unsigned char>().swap(item.encoded);
+            item.done = true;
+            StoreResult(item);
+        }
+
+        /**
+         * Reports a staged conversion to the stats sinks. Its CPU time is the sum of the
+         * stages', since they ran on different threads.
+         *
+         * @param item The conversion.
+         * @param error Message of the stage that failed, or empty on success.
+         */
+        void FinishStaged(StagedImage& item, const std::string& error)
+        {
+            if (statsSinks.empty()) {
+                return;
+            }
+            item.stats.error = error;
+            item.stats.total.wall = Stats::WallSeconds() - item.stats.start;
+            item.stats.total.cpu = 0;
+            for (const Stats::StageTime& time : item.stats.stages) {
+                item.stats.total.cpu += time.cpu;
+            }
+            ReportStats(item.stats);
+        }
+
+        /**
+         * Converts an encoded image held in memory into an encoded image in memory, as
+         * ConvertImage does for files. Like ConvertImage it may be called concurrently.
+         *
+         * @param bytes The encoded input.
+         * @param size Size of the input in bytes.
+         * @param format Extension of the output format, such as "png".
+         * @param out Buffer the encoded output is appended to.
+         * @throws std::runtime_error if decoding, processing or encoding fails, or if the
+         *         image exceeds the memory limit, since only files can be streamed.
+         */
+        void ConvertMemory(const unsigned char* bytes, std::size_t size, const std::string& format,
+                           std::vector<unsigned char>& out)
+        {
+            Measured("<memory>", "<memory>." + format, [&] {
+                SaveFile::SaveStrategy& strategy = GetSaveStrategy("." + format);
+                if (size > static_cast<std::size_t>(std::numeric_limits<int>::max())) {
+                    throw std::runtime_error("Input is too large");
+                }
+                if (ExceedsMemoryLimit(bytes, size)) {
+                    throw std::runtime_error("Image exceeds the memory limit");
+                }
+                DecodedImage image = Decode(bytes, size, crop);
+                if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                    stats->bytesRead = size;
+                }
+                Process(image);
+                std::size_t start = out.size();
+                {
+                    Stats::ScopedStage stage(Stats::Stage::Encode);
+                    strategy.Encode(image.view, out);
+                }
+                if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                    stats->bytesWritten += out.size() - start;
+                }
+            });
+        }
+
+        /**
+         * Selects JPEG quality, PNG level and filter, and the encoder backend. The strategies
+         * are rebuilt, so this must not be called while conversions are running.
+         *
+         * @param options The encoder settings.
+         */
+        void SetEncoderOptions(const EncoderOptions& options)
+        {
+            encoderOptions = options;
+            for (const char* extension : {"png", "jpg", "jpeg", "bmp", "tga", "pbm", "gif"}) {
+                strategies[extension] = SaveFile::CreateSaveStrategy(extension, options);
+            }
+        }
+
+        /**
+         * Selects the decoders. The strategies are rebuilt, so this must not be called while
+         * conversions are running.
+         *
+         * @param backend Whether libjpeg, libpng and libwebp may be used where available.
+         */
+        void SetDecoderBackend(DecoderBackend backend)
+        {
+            decoderBackend = backend;
+            loaders = LoadFile::CreateLoadStrategies(backend);
+        }
+
+        /**
+         * Adds a receiver of per-image telemetry. Without sinks no measurements are taken.
+         * The sink must outlive the converter's use and is shared by concurrent conversions.
+         *
+         * @param sink The sink to report to.
+         */
+        void AddStatsSink(Stats::StatsSink& sink) { statsSinks.push_back(&sink); }
+
+        /**
+         * Bounds the memory used for pixel data. Images whose decoded size exceeds the limit
+         * are converted in bands of rows that fit in it, which requires a row-local processor
+         * and formats with streaming support on both ends.
+         *
+         * @param bytes The limit, or 0 for no limit.
+         * @param always Stream every image, using the limit (or 64 MiB) as band budget.
+         */
+        void SetMemoryLimit(std::size_t bytes, bool always = false)
+        {
+            memoryLimit = bytes;
+            alwaysStream = always;
+        }
+
+        /**
+         * Makes every output appear atomically: images are written to a temporary file
+         * next to the destination and renamed into place once complete.
+         *
+         * @param enabled Whether to publish outputs with a rename.
+         */
+        void SetAtomicWrites(bool enabled) { atomicWrites = enabled; }
+
+        /**
+         * Keeps 16-bit and HDR inputs at full precision through processing instead of
+         * decoding them to 8 bits. PNG outputs are then written with 16 bits per sample;
+         * other formats are narrowed when encoded. Streamed 16-bit PNG inputs stay 16-bit
+         * through their bands.
+         *
+         * @param enabled Whether to decode wide samples.
+         */
+        void SetHighBitDepth(bool enabled) { highBitDepth = enabled; }
+
+        /**
+         * Looks up every file conversion in a cache of earlier results, keyed by the input's
+         * bytes and all settings that determine the output, and copies a cached output
+         * instead of converting. New outputs are added. Conversions are only cached when
+         * the processor has a fingerprint.
+         *
+         * @param cache The cache, shared by concurrent conversions, or nullptr for none. It
+         *              must outlive the converter's use.
+         */
+        void SetResultCache(ResultCache* cache) { resultCache = cache; }
+
+        /**
+         * Restricts the conversions that are given no region of their own, including
+         * ConvertMemory's, to a region of the input.
+         *
+         * @param region The region, or a whole region to convert entire images.
+         */
+        void SetCrop(const CropRegion& region) { crop = region; }
+
+        /**
+         * Converts every frame of GIF inputs instead of only the first. Frames are processed
+         * and encoded concurrently on the pool, a window of one frame per participant at a
+         * time, so memory depends on the pool size rather than on the frame count. A GIF
+         * output becomes an animation with the input's timing; other formats get a file
+         * per frame, see FramePath.
+         *
+         * @param pool The pool for the frames, or nullptr to convert the first frame only.
+         *             It must outlive the converter's use.
+         */
+        void SetAllFrames(ThreadPool* pool) { framePool = pool; }
+
+        /**
+         * @param destination The output path given for a multi-frame input.
+         * @param index Index of a frame, from 0.
+         * @return The path of the frame's file: the destination's stem followed by the
+         *         frame number from 1 in four digits, e.g. out-0001.png.
+         */
+        static std::string FramePath(const std::string& destination, std::size_t index)
+        {
+            std::filesystem::path path(destination);
+            std::string number = std::to_string(index + 1);
+            number.insert(0, number.size() < 4 ? 4 - number.size() : 0, '0');
+            path.replace_filename(path.stem().string() + "-" + number + path.extension().string());
+            return path.string();
+        }
+
+        /**
+         * Describes everything besides the input that determines an output: the processor's
+         * fingerprint, the output format, the region and the encoder, decoder and streaming
+         * settings.
+         *
+         * @param destination Path of the output.
+         * @return The description, or an empty string if the processor has no fingerprint.
+         */
+        std::string OutputSettings(const std::string& destination) const { return OutputSettings(destination, crop); }
+
+        /**
+         * @param destination Path of the output.
+         * @param region Region of the input converted.
+         * @return The description of OutputSettings(destination) for a conversion of the region.
+         */
+        std::string OutputSettings(const std::string& destination, const CropRegion& region) const
+        {
+            std::string fingerprint = processor->Fingerprint();
+            if (fingerprint.empty()) {
+                return std::string();
+            }
+            // Bump the version whenever an encoder or decoder changes its output.
+            return "v1;" + fingerprint + ";" + GetFileExtension(destination) +
+                   ";q" + std::to_string(encoderOptions.jpegQuality) + ";z" + std::to_string(encoderOptions.pngLevel) +
+                   ";f" + std::to_string(static_cast<int>(encoderOptions.pngFilter)) +
+                   ";e" + std::to_string(static_cast<int>(encoderOptions.backend)) +
+                   ";d" + std::to_string(static_cast<int>(decoderBackend)) + (highBitDepth ? ";wide" : "") +
+                   ";m" + std::to_string(memoryLimit) + (alwaysStream ? ";stream" : "") +
+                   (framePool != nullptr ? ";frames" : "") + (region.IsWhole() ? "" : ";crop" + region.ToString());
+        }
+
+    private:
+        /// Band budget of --stream when no --max-memory is given.
+        static constexpr std::size_t kDefaultStreamBudget = 64u << 20;
+
+        std::string inputPath;                     ///< Path to the input image.
+        std::string outputPath;                    ///< Path to save the converted image.
+        std::unique_ptr<ImageProcessor> processor; ///< Unique pointer to the image processor.
+        std::unordered_map<std::string, std::unique_ptr<SaveFile::SaveStrategy>>
+            strategies; ///< Map of file extension to corresponding save strategies.
+        std::vector<std::unique_ptr<LoadFile::LoadStrategy>> loaders; ///< Decoders in the order they are tried.
+        std::size_t memoryLimit = 0; ///< Pixel memory limit in bytes, 0 for none.
+        bool alwaysStream = false;   ///< Stream every image regardless of its size.
+        bool atomicWrites = false;   ///< Publish outputs with a rename.
+        bool highBitDepth = false;   ///< Decode 16-bit and HDR inputs at full precision.
+        EncoderOptions encoderOptions; ///< Settings of the encoders.
+        DecoderBackend decoderBackend = DecoderBackend::Auto; ///< Selected decoders.
+        ResultCache* resultCache = nullptr; ///< Cache of earlier outputs, if any.
+        ThreadPool* framePool = nullptr;    ///< Pool converting the frames of GIFs, if all are converted.
+        CropRegion crop;                    ///< Region converted when a conversion names none.
+        std::vector<Stats::StatsSink*> statsSinks; ///< Receivers of per-image telemetry.
+
+        /**
+         * Passes a finished record to every sink.
+         */
+        void ReportStats(const Stats::ConversionStats& stats)
+        {
+            for (Stats::StatsSink* sink : statsSinks) {
+                sink->Record(stats);
+            }
+        }
+
+        /**
+         * Runs a conversion, measuring it for the stats sinks if there are any.
+         *
+         * @param source Name of the input in the record.
+         * @param destination Name of the output in the record.
+         * @param body The conversion.
+         */
+        template <typename Body>
+        void Measured(const std::string& source, const std::string& destination, Body body)
+        {
+            if (statsSinks.empty()) {
+                body();
+                return;
+            }
+
+            Stats::ConversionStats stats;
+            stats.input = source;
+            stats.output = destination;
+            try {
+                Stats::ScopedConversion scope(stats);
+                body();
+            } catch (const std::exception& e) {
+                stats.error = e.what();
+                ReportStats(stats);
+                throw;
+            }
+            ReportStats(stats);
+        }
+
+        /**
+         * @param bytes The encoded input.
+         * @param length Size of the input.
+         * @return true if the decoded pixels would exceed the memory limit.
+         */
+        bool ExceedsMemoryLimit(const unsigned char* bytes, std::size_t length) const
+        {
+            if (memoryLimit == 0) {
+                return false;
+            }
+            int desiredChannels = processor->DesiredChannels();
+            int infoWidth, infoHeight, infoChannels;
+            int sampleBytes = 1;
+            if (highBitDepth) {
+                int intLength = static_cast<int>(length);
+                sampleBytes = stbi_is_hdr_from_memory(bytes, intLength)
+                                  ? 4
+                                  : (stbi_is_16_bit_from_memory(bytes, intLength) ? 2 : 1);
+            }
+            return LoadFile::FindLoadStrategy(loaders, bytes, length)
+                       .Info(bytes, length, infoWidth, infoHeight, infoChannels) &&
+                   static_cast<std::size_t>(infoWidth) * infoHeight *
+                           (desiredChannels != 0 ? desiredChannels : infoChannels) * sampleBytes >
+                       memoryLimit;
+        }
+
+        /**
+         * Decodes an encoded image with the channels the processor asks for, shrunk in the
+         * decoder as far as the processor allows.
+         *
+         * @param bytes The encoded input.
+         * @param length Size of the input.
+         * @param region Region of the input wanted; the image is that region on return.
+         * @return The decoded image.
+         * @throws std::runtime_error if no decoder can read the input or the region lies
+         *         outside it.
+         */
+        DecodedImage Decode(const unsigned char* bytes, std::size_t length, const CropRegion& region) const
+        {
+            int desiredChannels = processor->DesiredChannels();
+            int width, height, channels;
+            SampleType sample = SampleType::U8;
+            DecodedImage image;
+            CropRegion placed = region; // Receives the region's place in the decoded pixels.
+            {
+                Stats::ScopedStage decodeStage(Stats::Stage::Decode);
+                auto reduction = [this](int fileWidth, int fileHeight) {
+                    return processor->DecodeReduction(fileWidth, fileHeight);
+                };
+                image.pixels.reset(LoadFile::DecodeImage(loaders, bytes, length, width, height, channels,
+                                                         desiredChannels, highBitDepth ? &sample : nullptr,
+                                                         reduction, region.IsWhole() ? nullptr : &placed));
+            }
+            if (!image.pixels) {
+                throw std::runtime_error("Error loading image");
+            }
+            if (desiredChannels != 0) {
+                channels = desiredChannels;
+            }
+            if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                stats->width = width;
+                stats->height = height;
+                stats->channels = channels;
+            }
+
+            image.view = ImageView{image.pixels.get(), width, height,
+                                   static_cast<std::size_t>(width) * channels * SampleBytes(sample), channels};
+            image.view.sample = sample;
+            image.decodedBytes = image.view.stride * height;
+            if (!region.IsWhole()) {
+                image.view = CropView(image.view, placed.ClippedTo(width, height));
+                PackToFront(image.pixels.get(), image.view);
+                Shrink(image);
+            }
+            return image;
+        }
+
+        /**
+         * Applies the processor to a decoded image.
+         */
+        void Process(DecodedImage& image)
+        {
+            {
+                Stats::ScopedStage processStage(Stats::Stage::Process);
+                processor->ProcessImage(image.view);
+            }
+            Shrink(image);
+        }
+
+        /**
+         * Gives back the part of the decode buffer behind the image once the image, the
+         * result of processing or a decoded region, occupies half of it or less. Without the
+         * buffer pool the rest is returned to the system before encoding, which allocates
+         * buffers of its own; with it the whole block is reused by the next image.
+         */
+        static void Shrink(DecodedImage& image)
+        {
+            ImageView& view = image.view;
+            std::size_t resultBytes = view.stride * view.height;
+            if (view.data == image.pixels.get() && resultBytes <= image.decodedBytes / 2) {
+                if (void* shrunk = ResizeDecodedImage(image.pixels.get(), resultBytes)) {
+                    image.pixels.release();
+                    image.pixels.reset(static_cast<unsigned char*>(shrunk));
+                    view.data = image.pixels.get();
+                    image.decodedBytes = resultBytes;
+                }
+            }
+        }
+
+        /**
+         * Converts a single image, or copies its output from the result cache; the body of
+         * ConvertImage.
+         *
+         * @param source Path to the input image file.
+         * @param destination Path where the converted image will be saved.
+         * @param region Region of the input to convert.
+         * @throws std::runtime_error if image loading, processing, or saving fails.
+         */
+        void Convert(const std::string& source, const std::string& destination, const CropRegion& region)
+        {
+            std::string key = CacheKey(source, destination, region);
+            if (!key.empty() && resultCache->Fetch(key, destination)) {
+                if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                    stats->cached = true;
+                }
+                return;
+            }
+            ConvertFile(source, destination, region);
+            if (!key.empty()) {
+                resultCache->Store(key, destination);
+            }
+        }
+
+        /**
+         * @param source Path to the input image file.
+         * @param destination Path of the output.
+         * @param region Region of the input converted.
+         * @return The result cache's key of the conversion, or an empty string if it is not cached.
+         */
+        std::string CacheKey(const std::string& source, const std::string& destination, const CropRegion& region)
+        {
+            if (resultCache == nullptr || OutputSettings(destination, region).empty()) {
+                return std::string();
+            }
+            Stats::ScopedStage stage(Stats::Stage::Read);
+            MappedFile file(source);
+            if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                stats->bytesRead = file.Size();
+            }
+            return CacheKeyOf(file.Data(), file.Size(), destination, region);
+        }
+
+        /**
+         * @param bytes The encoded input.
+         * @param length Size of the input.
+         * @param destination Path of the output.
+         * @param region Region of the input converted.
+         * @return The result cache's key of the conversion, or an empty string if it is not cached.
+         */
+        std::string CacheKeyOf(const unsigned char* bytes, std::size_t length, const std::string& destination,
+                               const CropRegion& region) const
+        {
+            std::string settings = resultCache != nullptr ? OutputSettings(destination, region) : std::string();
+            // A frame sequence has no single output to cache.
+            if (settings.empty() ||
+                (framePool != nullptr && Gif::IsGif(bytes, length) && GetFileExtension(destination) != "gif")) {
+                return std::string();
+            }
+            return ResultCache::Key(bytes, length, settings);
+        }
+
+        /**
+         * @return The record a staged conversion's stages report to, or nullptr without sinks.
+         */
+        Stats::ConversionStats* Record(StagedImage& item) const
+        {
+            return statsSinks.empty() ? nullptr : &item.stats;
+        }
+
+        /**
+         * @return Bytes of decoded pixels and encoded output that a staged conversion holds
+         *         between stages, for the peak of the stage that takes it over.
+         */
+        static std::uint64_t HeldBytes(const StagedImage& item)
+        {
+            return (item.image.pixels ? item.image.decodedBytes : 0) + item.encoded.size();
+        }
+
+        /**
+         * Adds the output of a completed staged conversion to the result cache.
+         */
+        void StoreResult(const StagedImage& item)
+        {
+            if (!item.cacheKey.empty()) {
+                resultCache->Store(item.cacheKey, item.destination);
+            }
+        }
+
+        /**
+         * Converts a single image.
+         *
+         * @param source Path to the input image file.
+         * @param destination Path where the converted image will be saved.
+         * @param region Region of the input to convert.
+         * @throws std::runtime_error if image loading, processing, or saving fails.
+         */
+        void ConvertFile(const std::string& source, const std::string& destination, const CropRegion& region)
+        {
+            // Resolve the encoder first so that unsupported outputs fail before decoding.
+            SaveFile::SaveStrategy& strategy = GetSaveStrategy(destination);
+            if (alwaysStream) {
+                ConvertStreaming(source, destination, region);
+                return;
+            }
+
+            DecodedImage image;
+            {
+                // The encoded file is released as soon as it has been decoded.
+                std::optional<Stats::ScopedStage> readStage(std::in_place, Stats::Stage::Read);
+                MappedFile file(source);
+                readStage.reset();
+                if (file.Size() > static_cast<std::size_t>(std::numeric_limits<int>::max())) {
+                    throw std::runtime_error("Input file is too large");
+                }
+                if (framePool != nullptr && Gif::IsGif(file.Data(), file.Size())) {
+                    ConvertFrames(file.Data(), file.Size(), destination, region);
+                    return;
+                }
+                if (ExceedsMemoryLimit(file.Data(), file.Size())) {
+                    ConvertStreaming(source, destination, region);
+                    return;
+                }
+                image = Decode(file.Data(), file.Size(), region);
+                if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                    stats->bytesRead = file.Size();
+                }
+            }
+            Process(image);
+            strategy.Save(destination, image.view, atomicWrites);
+        }
+
+        /**
+         * Converts every frame of a GIF. A window of frames is decoded in order, processed
+         * and encoded concurrently, and written in order before the next window is decoded.
+         *
+         * @param bytes The encoded input.
+         * @param length Size of the input.
+         * @param destination Path of the animation, or the pattern of the frame files.
+         * @param region Region of every frame to convert.
+         * @throws std::runtime_error if decoding, processing, encoding or writing fails.
+         */
+        void ConvertFrames(const unsigned char* bytes, std::size_t length, const std::string& destination,
+                           const CropRegion& region)
+        {
+            struct Frame
+            {
+                PooledVector<unsigned char> pixels; ///< The decoded frame, processed in place.
+                int delay = 0;                      ///< Display time in hundredths of a second.
+                ImageView view;                     ///< The processed frame.
+                std::vector<unsigned char> encoded; ///< The frame's GIF blocks, for animations.
+            };
+
+            SaveFile::SaveStrategy& strategy = GetSaveStrategy(destination);
+            bool animation = GetFileExtension(destination) == "gif";
+            int desiredChannels = processor->DesiredChannels();
+            Gif::FrameReader reader(bytes, length);
+            std::size_t frameBytes = static_cast<std::size_t>(reader.Width()) * reader.Height() * 3;
+            // Frames are composited over the previous ones, so each is decoded whole.
+            CropRegion wanted = region.ClippedTo(reader.Width(), reader.Height());
+            std::vector<Frame> window(framePool->Size() + 1);
+
+            std::string target = animation && atomicWrites ? SaveFile::TemporaryPath(destination) : destination;
+            std::unique_ptr<std::FILE, int (*)(std::FILE*)> out(nullptr, std::fclose);
+            std::size_t frames = 0, written = 0;
+            // Frames processed on the workers count gray levels through records of their own
+            // that share the conversion's histogram.
+            Stats::ConversionStats* stats = Stats::ConversionStats::Current();
+            std::shared_ptr<HistogramCollector> histogram;
+            if (stats != nullptr) {
+                stats->GrayHistogram();
+                histogram = stats->histogram;
+            }
+            try {
+                for (bool more = true; more;) {
+                    std::size_t count = 0;
+                    {
+                        Stats::ScopedStage stage(Stats::Stage::Decode);
+                        for (; count < window.size(); ++count) {
+                            window[count].pixels.resize(frameBytes);
+                            if (!reader.Next(window[count].pixels.data(), window[count].delay)) {
+                                more = false;
+                                break;
+                            }
+                        }
+                    }
+                    {
+                        Stats::ScopedStage stage(Stats::Stage::Process);
+                        framePool->ParallelFor(0, count, 1, [&](std::size_t first, std::size_t last) {
+                            Stats::ConversionStats frameStats;
+                            frameStats.histogram = histogram;
+                            std::optional<Stats::ScopedRecord> record;
+                            if (histogram && Stats::ConversionStats::Current() == nullptr) {
+                                record.emplace(&frameStats);
+                            }
+                            for (std::size_t i = first; i < last; ++i) {
+                                Frame& frame = window[i];
+                                frame.view = ImageView{frame.pixels.data(), reader.Width(), reader.Height(),
+                                                       static_cast<std::size_t>(reader.Width()) * 3, 3};
+                                frame.view = CropView(frame.view, wanted);
+                                PackToFront(frame.pixels.data(), frame.view);
+                                if (desiredChannels == 1) {
+                                    Streaming::ReduceToLuma(frame.view);
+                                }
+                                processor->ProcessImage(frame.view);
+                                if (animation) {
+                                    frame.encoded.clear();
+                                    Gif::AppendFrame(frame.view, frame.delay, frame.encoded);
+                                } else {
+                                    strategy.Save(FramePath(destination, frames + i), frame.view, atomicWrites);
+                                }
+                            }
+                        });
+                    }
+                    if (animation && count != 0) {
+                        Stats::ScopedStage stage(Stats::Stage::Write);
+                        std::vector<unsigned char> header;
+                        if (!out) {
+                            out.reset(std::fopen(target.c_str(), "wb"));
+                            if (!out) {
+                                throw std::runtime_error("Error writing " + destination);
+                            }
+                            Gif::AppendHeader(window[0].view.width, window[0].view.height, reader.LoopCount(), header);
+                        }
+                        for (std::size_t i = 0; i < count; ++i) {
+                            header.insert(header.end(), window[i].encoded.begin(), window[i].encoded.end());
+                        }
+                        if (std::fwrite(header.data(), 1, header.size(), out.get()) != header.size()) {
+                            throw std::runtime_error("Error writing " + destination);
+                        }
+                        written += header.size();
+                    }
+                    frames += count;
+                }
+                if (frames == 0) {
+                    throw std::runtime_error("GIF has no frames");
+                }
+                if (animation) {
+                    std::vector<unsigned char> trailer;
+                    Gif::AppendTrailer(trailer);
+                    if (std::fwrite(trailer.data(), 1, trailer.size(), out.get()) != trailer.size() ||
+                        std::fclose(out.release()) != 0) {
+                        throw std::runtime_error("Error writing " + destination);
+                    }
+                    written += trailer.size();
+                    if (target != destination && std::rename(target.c_str(), destination.c_str()) != 0) {
+                        throw std::runtime_error("Error writing " + destination);
+                    }
+                }
+            } catch (...) {
+                out.reset();
+                if (target != destination) {
+                    std::remove(target.c_str());
+                }
+                throw;
+            }
+
+            if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                stats->width = reader.Width();
+                stats->height = reader.Height();
+                stats->channels = 3;
+                stats->bytesRead = length;
+                stats->bytesWritten += written;
+            }
+        }
+
+        /**
+         * Converts an image band by band so that only one band of rows is held in memory.
+         *
+         * Rows above a region are skipped, without decoding where the reader allows, and
+         * reading stops below it.
+         *
+         * @param source Path to the input image file.
+         * @param destination Path where the converted image will be saved.
+         * @param region Region of the input to convert.
+         * @throws std::runtime_error if the processor or either format cannot stream.
+         */
+        void ConvertStreaming(const std::string& source, const std::string& destination, const CropRegion& region)
+        {
+            if (!processor->IsRowLocal()) {
+                throw std::runtime_error("The selected processing cannot be streamed");
+            }
+            int desiredChannels = processor->DesiredChannels();
+            auto reader = Streaming::OpenRowReader(source, desiredChannels, highBitDepth);
+            if (!reader) {
+                throw std::runtime_error("Input format cannot be streamed");
+            }
+            CropRegion wanted = region.ClippedTo(reader->Width(), reader->Height());
+            int left = reader->CropColumns(wanted.x, wanted.width);
+
+            std::size_t budget = memoryLimit != 0 ? memoryLimit : kDefaultStreamBudget;
+            std::size_t rowBytes =
+                static_cast<std::size_t>(reader->Width()) * reader->Channels() * SampleBytes(reader->Sample());
+            if (rowBytes > budget) {
+                throw std::runtime_error("A single row exceeds the memory limit");
+            }
+            int bandRows = static_cast<int>(std::min<std::size_t>(budget / rowBytes, wanted.height));
+            PooledVector<unsigned char> band(rowBytes * bandRows);
+            PooledVector<unsigned char> narrowed;
+
+            // The rows are written as they are produced, so a failure part way leaves a
+            // truncated file; it is removed, and with atomic writes never seen at all. The writer
+            // is created with the first processed band, which tells whether the output is bilevel.
+            std::string target = atomicWrites ? SaveFile::TemporaryPath(destination) : destination;
+            std::unique_ptr<Streaming::RowWriter> writer;
+            try {
+                if (wanted.y > 0) {
+                    Stats::ScopedStage stage(Stats::Stage::Decode);
+                    reader->SkipRows(wanted.y);
+                }
+                for (int y = 0; y < wanted.height; y += bandRows) {
+                    int rows = std::min(bandRows, wanted.height - y);
+                    {
+                        Stats::ScopedStage stage(Stats::Stage::Decode);
+                        reader->ReadRows(band.data(), rowBytes, rows);
+                    }
+
+                    ImageView view{band.data(), reader->Width(), rows, rowBytes, reader->Channels()};
+                    view.sample = reader->Sample();
+                    view = CropView(view, CropRegion{left, 0, wanted.width, rows});
+                    PackToFront(band.data(), view);
+                    // Position-dependent processing such as ordered dithering continues its pattern.
+                    view.top = y;
+                    {
+                        Stats::ScopedStage stage(Stats::Stage::Process);
+                        if (desiredChannels == 1 && view.channels > 1) {
+                            Streaming::ReduceToLuma(view);
+                        }
+                        processor->ProcessImage(view);
+                    }
+                    if (view.channels != 1) {
+                        throw std::runtime_error("Streaming output must have a single channel");
+                    }
+                    Stats::ScopedStage stage(Stats::Stage::Encode);
+                    if (!writer) {
+                        writer = Streaming::CreateRowWriter(target, GetFileExtension(destination), wanted.width,
+                                                            wanted.height, encoderOptions, view.bilevel, view.sample);
+                        if (!writer) {
+                            throw std::runtime_error("Output format cannot be streamed");
+                        }
+                    }
+                    // Formats without 16-bit samples are narrowed as the whole-image encoders do.
+                    ImageView output = ConvertedView(view, writer->Sample(), narrowed);
+                    writer->WriteRows(output.data, output.stride, rows);
+                }
+                {
+                    Stats::ScopedStage stage(Stats::Stage::Encode);
+                    writer->Finish();
+                }
+                writer.reset();
+                if (target != destination && std::rename(target.c_str(), destination.c_str()) != 0) {
+                    throw std::runtime_error("Error saving image " + destination);
+                }
+            } catch (...) {
+                bool created = writer != nullptr;
+                writer.reset();
+                if (created || target != destination) {
+                    std::remove(target.c_str());
+                }
+                throw;
+            }
+
+            if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                std::error_code error;
+                stats->streamed = true;
+                stats->width = reader->Width();
+                stats->height = reader->Height();
+                stats->channels = reader->Channels();
+                stats->bytesRead = std::filesystem::file_size(source, error);
+                stats->bytesWritten = std::filesystem::file_size(destination, error);
+                stats->peakBytes += band.size() + narrowed.size();
+            }
+        }
+
+        /**
+         * Looks up the save strategy for the specified path.
+         *
+         * @param path Path where the image will be saved.
+         * @return The strategy registered for the file extension.
+         * @throws std::runtime_error if the image format is unsupported.
+         */
+        SaveFile::SaveStrategy& GetSaveStrategy(const std::string& path)
+        {
+            std::string extension = GetFileExtension(path);
+            auto it = strategies.find(extension);
+            if (it != strategies.end()) {
+                return *it->second;
+            } else {
+                throw std::runtime_error("Unsupported image format");
+            }
+        }
+        /**
+         * Extracts the file extension from the given file name.
+         *
+         * @param fileName Name of the file.
+         * @return Lowercase string of the file extension.
+         * @throws std::runtime_error if the file extension cannot be determined.
+         */
+        std::string GetFileExtension(const std::string& fileName) const
+        {
+            size_t dotPos = fileName.find_last_of('.');
+            if (dotPos == std::string::npos)
+                throw std::runtime_error("An error was encountered while finding the file extension.");
+
+            auto ext = fileName.substr(dotPos + 1);
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            return ext;
+        }
+    };
+} // namespace bwconv
@@ -0,0 +1,98 @@
+/**
+ * @file image_processor.hpp
+ * @brief Interface of the processing step applied to every image.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "image_view.hpp"
+
+#include <string>
+#include <vector>
+
+namespace bwconv
+{
+    class RowStage;
+
+    /**
+     * @class ImageProcessor
+     * @brief Abstract base class for image processing strategies.
+     *
+     * This class serves as an interface for different image processing techniques.
+     * It defines a common interface for all concrete image processing classes.
+     * The ProcessImage function must be implemented by all derived classes
+     * to perform specific image processing operations.
+     */
+    class ImageProcessor
+    {
+    public:
+        /**
+         * Pure virtual function for processing an image in place.
+         *
+         * The result is written into the memory of the view, which is updated to describe
+         * it. A processor may therefore only produce images that fit into the input's rows,
+         * such as fewer channels per pixel.
+         *
+         * @param img View of the image to be processed; describes the result on return.
+         */
+        virtual void ProcessImage(ImageView& img) = 0;
+
+        /**
+         * Number of channels the processor wants the decoder to produce.
+         * Decoders can often produce fewer channels much faster than they can
+         * produce the file's own layout, e.g. a JPEG decoder can skip chroma.
+         *
+         * @return The channel count, or 0 to keep the channels stored in the file.
+         */
+        virtual int DesiredChannels() const { return 0; }
+
+        /**
+         * Factor by which the decoder may shrink both dimensions before processing, for
+         * processors whose result is smaller than their input. JPEG decoders scale by 1/2,
+         * 1/4 or 1/8 in the DCT domain, which skips most of the decoding work.
+         *
+         * @param width Width stored in the file.
+         * @param height Height stored in the file.
+         * @return The largest acceptable factor; 1 to decode at full size.
+         */
+        virtual int DecodeReduction(int width, int height) const
+        {
+            (void)width, (void)height;
+            return 1;
+        }
+
+        /**
+         * Tells whether every output row depends only on the same input row, which allows
+         * the image to be processed in independent bands (see Streaming).
+         *
+         * @return true if ProcessImage may be applied to horizontal bands separately.
+         */
+        virtual bool IsRowLocal() const { return false; }
+
+        /**
+         * Describes the processor as a sequence of per-pixel steps, which a ProcessorPipeline
+         * fuses with the steps of neighbouring processors into a single pass over the image.
+         * Applying the stages in order must give the same result as ProcessImage.
+         *
+         * @return The stages, owned by the processor, or an empty list if ProcessImage has
+         *         to run on the whole image.
+         */
+        virtual std::vector<const RowStage*> RowStages() const { return {}; }
+
+        /**
+         * Describes the settings that determine the output, so that results can be cached
+         * (see ResultCache). Processors with equal fingerprints must produce equal images.
+         *
+         * @return The description, or an empty string if results must not be reused.
+         */
+        virtual std::string Fingerprint() const { return std::string(); }
+
+        /**
+         * @brief Virtual destructor for the ImageProcessor class.
+         */
+        virtual ~ImageProcessor() = default;
+    };
+} // namespace bwconv
@@ -0,0 +1,99 @@
+/**
+ * @file image_view.hpp
+ * @brief Non-owning view of an interleaved image of 8-bit, 16-bit or float samples.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace bwconv
+{
+    /**
+     * Type of the samples of an image.
+     */
+    enum class SampleType
+    {
+        U8,  ///< Bytes, 0 to 255.
+        U16, ///< Unsigned 16-bit integers in native byte order, 0 to 65535.
+        F32  ///< Floats in linear light, nominally 0 to 1, as stb_image decodes HDR files.
+    };
+
+    /**
+     * @param sample A sample type.
+     * @return Bytes per sample.
+     */
+    inline std::size_t SampleBytes(SampleType sample)
+    {
+        return sample == SampleType::U8 ? 1 : (sample == SampleType::U16 ? 2 : 4);
+    }
+
+    /**
+     * @struct ImageView
+     * @brief Non-owning view of an interleaved image.
+     *
+     * Processors and save strategies work on views so that image data is never
+     * copied between stages. The memory stays owned by whoever decoded it.
+     * Samples are bytes unless the image was decoded at high bit depth.
+     */
+    struct ImageView
+    {
+        unsigned char* data = nullptr;      ///< First byte of the top row.
+        int width = 0;                      ///< Width in pixels.
+        int height = 0;                     ///< Height in pixels.
+        std::size_t stride = 0;             ///< Distance between rows in bytes.
+        int channels = 0;                   ///< Interleaved channels per pixel.
+        bool bilevel = false;               ///< Every sample is 0 or 255, so one bit per pixel suffices.
+        SampleType sample = SampleType::U8; ///< Type of every sample.
+        int top = 0;                        ///< Index of the first row in the whole image, for bands of it.
+
+        /**
+         * @return Bytes of pixel data per row, excluding padding.
+         */
+        std::size_t RowBytes() const { return static_cast<std::size_t>(width) * channels * SampleBytes(sample); }
+
+        /**
+         * @return true if rows follow each other without padding.
+         */
+        bool IsPacked() const { return stride == RowBytes(); }
+
+        /**
+         * @param y Row index.
+         * @return Pointer to the first byte of the row.
+         */
+        unsigned char* Row(int y) const { return data + static_cast<std::size_t>(y) * stride; }
+    };
+
+    /**
+     * Packs a single-channel row into one bit per pixel, most significant bit first, as
+     * 1-bit PNG and PBM store it. Samples of 128 and above count as white; the last byte
+     * is padded with zero bits.
+     *
+     * @param row The 8-bit samples.
+     * @param width Number of pixels.
+     * @param whiteBit Bit value of white pixels: 1 for PNG, 0 for PBM, where 1 is black.
+     * @param dst Receives (width + 7) / 8 bytes.
+     */
+    inline void PackBilevelRow(const unsigned char* row, int width, int whiteBit, unsigned char* dst)
+    {
+        unsigned char flip = whiteBit != 0 ? 0x00 : 0xFF;
+        int x = 0;
+        for (; x + 8 <= width; x += 8, ++dst) {
+            unsigned char bits = 0;
+            for (int i = 0; i < 8; ++i) {
+                bits = static_cast<unsigned char>((bits << 1) | (row[x + i] >> 7));
+            }
+            *dst = bits ^ flip;
+        }
+        if (x < width) {
+            unsigned char bits = 0;
+            for (int i = 0; i < 8; ++i) {
+                bits = static_cast<unsigned char>((bits << 1) | (x + i < width ? (row[x + i] >> 7) ^ (flip & 1) : 0));
+            }
+            *dst = bits;
+        }
+    }
+} // namespace bwconv
@@ -0,0 +1,750 @@
+/**
+ * @file kernels.hpp
+ * @brief Grayscale conversion and thresholding kernels.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BWCONV_X86_SIMD 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define BWCONV_NEON_SIMD 1
+#include <arm_neon.h>
+#endif
+
+namespace bwconv
+{
+    /**
+     * How color is weighted into gray.
+     */
+    enum class LumaMode
+    {
+        Average, ///< Mean of all channels, alpha included; the converter's historical output.
+        Bt601,   ///< 0.299 R + 0.587 G + 0.114 B on the encoded values, as JPEG and stb_image use.
+        Bt709,   ///< 0.2126 R + 0.7152 G + 0.0722 B on the encoded values (HDTV).
+        Linear   ///< BT.709 weights applied to linear light, i.e. after decoding sRGB; re-encoded after.
+    };
+
+    /**
+     * What the weighted luma modes do with an alpha channel. Average counts alpha as a channel.
+     */
+    enum class AlphaMode
+    {
+        Ignore,     ///< Use the color as stored.
+        Premultiply ///< Scale the luma by alpha, i.e. composite over black.
+    };
+
+    /**
+     * @namespace Kernels
+     * @brief Grayscale conversion kernels specialised per channel count and instruction set.
+     *
+     * Average kernels convert a run of interleaved pixels into one byte per pixel equal to
+     * the truncated average of the pixel's channels. The specialised kernels produce exactly
+     * the same bytes as GrayScalar; division by three is replaced by a multiply-high that is
+     * exact for every possible sum of three bytes.
+     *
+     * BT.601 and BT.709 kernels compute (wr R + wg G + wb B + 128) >> 8 with weights in
+     * units of 1/256 summing to 256, which fits 16-bit lanes, and premultiply by rounding
+     * y * a / 255. All instruction sets produce the bytes of LumaPortable. Linear luma looks
+     * up every channel in an sRGB decoding table and re-encodes through a second table.
+     */
+    namespace Kernels
+    {
+        /**
+         * Signature shared by the channel-specialised kernels.
+         *
+         * @param src Interleaved input pixels.
+         * @param dst Output, one byte per pixel.
+         * @param pixels Number of pixels to convert.
+         */
+        using GrayKernel = void (*)(const unsigned char* src, unsigned char* dst, std::size_t pixels);
+
+        /**
+         * Portable reference kernel for any channel count.
+         *
+         * @param src Interleaved input pixels.
+         * @param dst Output, one byte per pixel.
+         * @param pixels Number of pixels to convert.
+         * @param channels The number of color channels per pixel.
+         */
+        inline void GrayScalar(const unsigned char* src, unsigned char* dst, std::size_t pixels, int channels)
+        {
+            for (std::size_t i = 0; i < pixels; ++i) {
+                int grayScale = 0;
+                for (int j = 0; j < channels; ++j) {
+                    grayScale += src[i * channels + j];
+                }
+                grayScale /= channels;
+                dst[i] = static_cast<unsigned char>(grayScale);
+            }
+        }
+
+        /**
+         * Portable kernel with the channel count fixed at compile time. The inner loop is
+         * fully unrolled and the division becomes a multiply, which leaves a loop the
+         * compiler can auto-vectorise on targets without hand-written kernels.
+         *
+         * @tparam Channels The number of color channels per pixel, 1 to 4.
+         */
+        template <int Channels>
+        void GrayPortable(const unsigned char* src, unsigned char* dst, std::size_t pixels)
+        {
+            static_assert(Channels >= 1 && Channels <= 4, "stb_image yields 1 to 4 channels");
+            for (std::size_t i = 0; i < pixels; ++i) {
+                unsigned int grayScale = 0;
+                for (int j = 0; j < Channels; ++j) {
+                    grayScale += src[i * Channels + j];
+                }
+                dst[i] = static_cast<unsigned char>(grayScale / Channels);
+            }
+        }
+
+        /**
+         * Single-channel input is already gray; the conversion is a copy.
+         */
+        inline void GrayCopy(const unsigned char* src, unsigned char* dst, std::size_t pixels)
+        {
+            if (src != dst) {
+                std::memmove(dst, src, pixels);
+            }
+        }
+
+        /// Multiplier for which (sum * kDivideBy3) >> 16 == sum / 3 holds for every sum <= 765.
+        constexpr unsigned short kDivideBy3 = 21846;
+
+        /**
+         * Luma weights in units of 1/256, summing to 256.
+         */
+        template <LumaMode Mode>
+        struct LumaWeights;
+
+        template <>
+        struct LumaWeights<LumaMode::Bt601>
+        {
+            static constexpr unsigned char r = 77, g = 150, b = 29;
+        };
+
+        template <>
+        struct LumaWeights<LumaMode::Bt709>
+        {
+            static constexpr unsigned char r = 54, g = 183, b = 19;
+        };
+
+        /**
+         * Rounds y * a / 255 exactly for bytes y and a.
+         */
+        inline unsigned int MultiplyAlpha(unsigned int y, unsigned int a)
+        {
+            unsigned int t = y * a + 128;
+            return (t + (t >> 8)) >> 8;
+        }
+
+        /**
+         * Portable weighted luma kernel. Gray+alpha input keeps its gray channel.
+         *
+         * @tparam Channels The number of color channels per pixel, 2 to 4.
+         * @tparam Mode Bt601 or Bt709.
+         * @tparam Premultiply Scale the result by the alpha channel, if any.
+         */
+        template <int Channels, LumaMode Mode, bool Premultiply>
+        void LumaPortable(const unsigned char* src, unsigned char* dst, std::size_t pixels)
+        {
+            static_assert(Channels >= 2 && Channels <= 4, "single-channel input is copied");
+            using W = LumaWeights<Mode>;
+            for (std::size_t i = 0; i < pixels; ++i) {
+                const unsigned char* p = src + i * Channels;
+                unsigned int y = p[0];
+                if constexpr (Channels >= 3) {
+                    y = (p[0] * W::r + p[1] * W::g + p[2] * W::b + 128) >> 8;
+                }
+                if constexpr (Premultiply && Channels % 2 == 0) {
+                    y = MultiplyAlpha(y, p[Channels - 1]);
+                }
+                dst[i] = static_cast<unsigned char>(y);
+            }
+        }
+
+        /**
+         * Tables converting between sRGB bytes and linear light.
+         */
+        struct LinearTables
+        {
+            /// Bits of the linear value indexing the encoding table.
+            static constexpr int kEncodeBits = 14;
+
+            std::uint16_t toLinear[256];                 ///< sRGB byte to linear light in units of 1/65535.
+            unsigned char toSrgb[1 << kEncodeBits]; ///< Linear light, top kEncodeBits bits, to sRGB byte.
+
+            /**
+             * @return The tables, computed on first use.
+             */
+            static const LinearTables& Get()
+            {
+                static const LinearTables tables;
+                return tables;
+            }
+
+        private:
+            LinearTables()
+            {
+                for (int v = 0; v < 256; ++v) {
+                    double c = v / 255.0;
+                    double linear = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+                    toLinear[v] = static_cast<std::uint16_t>(std::lround(linear * 65535));
+                }
+                for (int i = 0; i < (1 << kEncodeBits); ++i) {
+                    double linear = (i + 0.5) / (1 << kEncodeBits);
+                    double c = linear <= 0.0031308 ? linear * 12.92 : 1.055 * std::pow(linear, 1 / 2.4) - 0.055;
+                    toSrgb[i] = static_cast<unsigned char>(std::lround(std::fmin(1.0, c) * 255));
+                }
+            }
+        };
+
+        /**
+         * Linear-light luma kernel: BT.709 weights in units of 1/65536 on decoded sRGB.
+         *
+         * @tparam Channels The number of color channels per pixel, 2 to 4.
+         * @tparam Premultiply Scale the linear result by the alpha channel, if any.
+         */
+        template <int Channels, bool Premultiply>
+        void LumaLinear(const unsigned char* src, unsigned char* dst, std::size_t pixels)
+        {
+            static_assert(Channels >= 2 && Channels <= 4, "single-channel input is copied");
+            const LinearTables& tables = LinearTables::Get();
+            for (std::size_t i = 0; i < pixels; ++i) {
+                const unsigned char* p = src + i * Channels;
+                std::uint32_t y = tables.toLinear[p[0]];
+                if constexpr (Channels >= 3) {
+                    y = (tables.toLinear[p[0]] * 13933u + tables.toLinear[p[1]] * 46871u +
+                         tables.toLinear[p[2]] * 4732u + 32768u) >>
+                        16;
+                }
+                if constexpr (Premultiply && Channels % 2 == 0) {
+                    y = (y * p[Channels - 1] + 127) / 255;
+                }
+                dst[i] = tables.toSrgb[y >> (16 - LinearTables::kEncodeBits)];
+            }
+        }
+
+#if defined(BWCONV_X86_SIMD)
+        /**
+         * pshufb masks gathering channel c of 16 RGB pixels: kShuffle3[c][k] picks the bytes
+         * of that channel found in the k-th 16-byte block and zeroes every other lane.
+         */
+        alignas(16) inline constexpr unsigned char kShuffle3Bytes[3][3][16] = {
+            {{0, 3, 6, 9, 12, 15, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+             {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 2, 5, 8, 11, 14, 0x80, 0x80, 0x80, 0x80, 0x80},
+             {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 1, 4, 7, 10, 13}},
+            {{1, 4, 7, 10, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+             {0x80, 0x80, 0x80, 0x80, 0x80, 0, 3, 6, 9, 12, 15, 0x80, 0x80, 0x80, 0x80, 0x80},
+             {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 2, 5, 8, 11, 14}},
+            {{2, 5, 8, 11, 14, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+             {0x80, 0x80, 0x80, 0x80, 0x80, 1, 4, 7, 10, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+             {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0, 3, 6, 9, 12, 15}},
+        };
+        inline const auto& kShuffle3 = reinterpret_cast<const __m128i (&)[3][3]>(kShuffle3Bytes);
+
+        /**
+         * SSE4.1 kernels, 16 pixels per iteration.
+         */
+        template <int Channels>
+        __attribute__((target("sse4.1"))) void GraySse41(const unsigned char* src, unsigned char* dst,
+                                                          std::size_t pixels)
+        {
+            const __m128i ones = _mm_set1_epi8(1);
+            std::size_t i = 0;
+            for (; i + 16 <= pixels; i += 16) {
+                const unsigned char* p = src + i * Channels;
+                __m128i gray;
+                if constexpr (Channels == 2) {
+                    __m128i lo = _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), ones);
+                    __m128i hi = _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)), ones);
+                    gray = _mm_packus_epi16(_mm_srli_epi16(lo, 1), _mm_srli_epi16(hi, 1));
+                } else if constexpr (Channels == 3) {
+                    const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                    const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+                    const __m128i a2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32));
+                    const __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, kShuffle3[0][0]),
+                                                                _mm_shuffle_epi8(a1, kShuffle3[0][1])),
+                                                   _mm_shuffle_epi8(a2, kShuffle3[0][2]));
+                    const __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, kShuffle3[1][0]),
+                                                                _mm_shuffle_epi8(a1, kShuffle3[1][1])),
+                                                   _mm_shuffle_epi8(a2, kShuffle3[1][2]));
+                    const __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, kShuffle3[2][0]),
+                                                                _mm_shuffle_epi8(a1, kShuffle3[2][1])),
+                                                   _mm_shuffle_epi8(a2, kShuffle3[2][2]));
+                    const __m128i zero = _mm_setzero_si128();
+                    const __m128i divisor = _mm_set1_epi16(static_cast<short>(kDivideBy3));
+                    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_cvtepu8_epi16(r), _mm_cvtepu8_epi16(g)),
+                                               _mm_cvtepu8_epi16(b));
+                    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero)),
+                                               _mm_unpackhi_epi8(b, zero));
+                    gray = _mm_packus_epi16(_mm_mulhi_epu16(lo, divisor), _mm_mulhi_epu16(hi, divisor));
+                } else {
+                    static_assert(Channels == 4, "SSE4.1 kernels exist for 2, 3 and 4 channels");
+                    __m128i m0 = _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), ones);
+                    __m128i m1 = _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)), ones);
+                    __m128i m2 = _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32)), ones);
+                    __m128i m3 = _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48)), ones);
+                    gray = _mm_packus_epi16(_mm_srli_epi16(_mm_hadd_epi16(m0, m1), 2),
+                                            _mm_srli_epi16(_mm_hadd_epi16(m2, m3), 2));
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), gray);
+            }
+            GrayPortable<Channels>(src + i * Channels, dst + i, pixels - i);
+        }
+
+        /**
+         * AVX2 kernels, 32 pixels per iteration. In-lane pack instructions leave the
+         * results interleaved by 128-bit lane, which a final cross-lane permute undoes.
+         */
+        template <int Channels>
+        __attribute__((target("avx2"))) void GrayAvx2(const unsigned char* src, unsigned char* dst, std::size_t pixels)
+        {
+            const __m256i ones = _mm256_set1_epi8(1);
+            std::size_t i = 0;
+            for (; i + 32 <= pixels; i += 32) {
+                const unsigned char* p = src + i * Channels;
+                __m256i gray;
+                if constexpr (Channels == 2) {
+                    __m256i lo = _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), ones);
+                    __m256i hi =
+                        _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32)), ones);
+                    gray = _mm256_permute4x64_epi64(
+                        _mm256_packus_epi16(_mm256_srli_epi16(lo, 1), _mm256_srli_epi16(hi, 1)), 0xD8);
+                } else if constexpr (Channels == 3) {
+                    // Pixels 0-15 go to the low lane and 16-31 to the high lane, so the
+                    // per-lane shuffles of the SSE kernel apply unchanged.
+                    const __m256i a0 =
+                        _mm256_set_m128i(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48)),
+                                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+                    const __m256i a1 =
+                        _mm256_set_m128i(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 64)),
+                                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)));
+                    const __m256i a2 =
+                        _mm256_set_m128i(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 80)),
+                                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32)));
+                    const __m256i r = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_shuffle_epi8(a0, _mm256_broadcastsi128_si256(kShuffle3[0][0])),
+                                        _mm256_shuffle_epi8(a1, _mm256_broadcastsi128_si256(kShuffle3[0][1]))),
+                        _mm256_shuffle_epi8(a2, _mm256_broadcastsi128_si256(kShuffle3[0][2])));
+                    const __m256i g = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_shuffle_epi8(a0, _mm256_broadcastsi128_si256(kShuffle3[1][0])),
+                                        _mm256_shuffle_epi8(a1, _mm256_broadcastsi128_si256(kShuffle3[1][1]))),
+                        _mm256_shuffle_epi8(a2, _mm256_broadcastsi128_si256(kShuffle3[1][2])));
+                    const __m256i b = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_shuffle_epi8(a0, _mm256_broadcastsi128_si256(kShuffle3[2][0])),
+                                        _mm256_shuffle_epi8(a1, _mm256_broadcastsi128_si256(kShuffle3[2][1]))),
+                        _mm256_shuffle_epi8(a2, _mm256_broadcastsi128_si256(kShuffle3[2][2])));
+                    const __m256i zero = _mm256_setzero_si256();
+                    const __m256i divisor = _mm256_set1_epi16(static_cast<short>(kDivideBy3));
+                    __m256i lo = _mm256_add_epi16(
+                        _mm256_add_epi16(_mm256_unpacklo_epi8(r, zero), _mm256_unpacklo_epi8(g, zero)),
+                        _mm256_unpacklo_epi8(b, zero));
+                    __m256i hi = _mm256_add_epi16(
+                        _mm256_add_epi16(_mm256_unpackhi_epi8(r, zero), _mm256_unpackhi_epi8(g, zero)),
+                        _mm256_unpackhi_epi8(b, zero));
+                    gray = _mm256_packus_epi16(_mm256_mulhi_epu16(lo, divisor), _mm256_mulhi_epu16(hi, divisor));
+                } else {
+                    static_assert(Channels == 4, "AVX2 kernels exist for 2, 3 and 4 channels");
+                    __m256i m0 = _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), ones);
+                    __m256i m1 =
+                        _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32)), ones);
+                    __m256i m2 =
+                        _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 64)), ones);
+                    __m256i m3 =
+                        _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 96)), ones);
+                    __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_hadd_epi16(m0, m1), 2),
+                                                         _mm256_srli_epi16(_mm256_hadd_epi16(m2, m3), 2));
+                    gray = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), gray);
+            }
+            GraySse41<Channels>(src + i * Channels, dst + i, pixels - i);
+        }
+
+        /**
+         * pshufb mask grouping 4 RGBA pixels by channel: R0-3, G0-3, B0-3, A0-3.
+         */
+        alignas(16) inline constexpr unsigned char kShuffle4Bytes[16] = {0, 4, 8, 12, 1, 5, 9, 13,
+                                                                         2, 6, 10, 14, 3, 7, 11, 15};
+
+        /**
+         * Weighs eight 16-bit R, G and B lanes into luma, optionally premultiplied by alpha.
+         */
+        template <LumaMode Mode, bool Premultiply>
+        __attribute__((target("sse4.1"))) inline __m128i WeighSse41(__m128i r, __m128i g, __m128i b, __m128i a)
+        {
+            using W = LumaWeights<Mode>;
+            __m128i y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(W::r)),
+                                                    _mm_mullo_epi16(g, _mm_set1_epi16(W::g))),
+                                      _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(W::b)), _mm_set1_epi16(128)));
+            y = _mm_srli_epi16(y, 8);
+            if constexpr (Premultiply) {
+                __m128i t = _mm_add_epi16(_mm_mullo_epi16(y, a), _mm_set1_epi16(128));
+                y = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+            }
+            return y;
+        }
+
+        /**
+         * SSE4.1 weighted luma kernels for RGB and RGBA, 16 pixels per iteration.
+         */
+        template <int Channels, LumaMode Mode, bool Premultiply>
+        __attribute__((target("sse4.1"))) void LumaSse41(const unsigned char* src, unsigned char* dst,
+                                                          std::size_t pixels)
+        {
+            static_assert(Channels == 3 || Channels == 4, "SSE4.1 luma kernels exist for 3 and 4 channels");
+            constexpr bool kScale = Premultiply && Channels == 4; // RGB has no alpha to scale by.
+            const __m128i zero = _mm_setzero_si128();
+            std::size_t i = 0;
+            for (; i + 16 <= pixels; i += 16) {
+                const unsigned char* p = src + i * Channels;
+                const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+                const __m128i a2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32));
+                __m128i r, g, b, a = zero;
+                if constexpr (Channels == 3) {
+                    r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, kShuffle3[0][0]),
+                                                  _mm_shuffle_epi8(a1, kShuffle3[0][1])),
+                                     _mm_shuffle_epi8(a2, kShuffle3[0][2]));
+                    g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, kShuffle3[1][0]),
+                                                  _mm_shuffle_epi8(a1, kShuffle3[1][1])),
+                                     _mm_shuffle_epi8(a2, kShuffle3[1][2]));
+                    b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, kShuffle3[2][0]),
+                                                  _mm_shuffle_epi8(a1, kShuffle3[2][1])),
+                                     _mm_shuffle_epi8(a2, kShuffle3[2][2]));
+                } else {
+                    // Group each block by channel, then transpose the 4-byte groups.
+                    const __m128i mask = _mm_load_si128(reinterpret_cast<const __m128i*>(kShuffle4Bytes));
+                    const __m128i a3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48));
+                    __m128i t0 = _mm_unpacklo_epi32(_mm_shuffle_epi8(a0, mask), _mm_shuffle_epi8(a1, mask));
+                    __m128i t1 = _mm_unpackhi_epi32(_mm_shuffle_epi8(a0, mask), _mm_shuffle_epi8(a1, mask));
+                    __m128i t2 = _mm_unpacklo_epi32(_mm_shuffle_epi8(a2, mask), _mm_shuffle_epi8(a3, mask));
+                    __m128i t3 = _mm_unpackhi_epi32(_mm_shuffle_epi8(a2, mask), _mm_shuffle_epi8(a3, mask));
+                    r = _mm_unpacklo_epi64(t0, t2);
+                    g = _mm_unpackhi_epi64(t0, t2);
+                    b = _mm_unpacklo_epi64(t1, t3);
+                    a = _mm_unpackhi_epi64(t1, t3);
+                }
+                __m128i lo = WeighSse41<Mode, kScale>(_mm_cvtepu8_epi16(r), _mm_cvtepu8_epi16(g),
+                                                      _mm_cvtepu8_epi16(b), _mm_cvtepu8_epi16(a));
+                __m128i hi = WeighSse41<Mode, kScale>(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero),
+                                                      _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(a, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+            }
+            LumaPortable<Channels, Mode, Premultiply>(src + i * Channels, dst + i, pixels - i);
+        }
+
+        /**
+         * AVX2 counterpart of WeighSse41.
+         */
+        template <LumaMode Mode, bool Premultiply>
+        __attribute__((target("avx2"))) inline __m256i WeighAvx2(__m256i r, __m256i g, __m256i b, __m256i a)
+        {
+            using W = LumaWeights<Mode>;
+            __m256i y = _mm256_add_epi16(
+                _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(W::r)),
+                                 _mm256_mullo_epi16(g, _mm256_set1_epi16(W::g))),
+                _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(W::b)), _mm256_set1_epi16(128)));
+            y = _mm256_srli_epi16(y, 8);
+            if constexpr (Premultiply) {
+                __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(y, a), _mm256_set1_epi16(128));
+                y = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+            }
+            return y;
+        }
+
+        /**
+         * Loads 16 bytes into each 128-bit lane.
+         */
+        __attribute__((target("avx2"))) inline __m256i LoadLanesAvx2(const unsigned char* low,
+                                                                      const unsigned char* high)
+        {
+            return _mm256_set_m128i(_mm_loadu_si128(reinterpret_cast<const __m128i*>(high)),
+                                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(low)));
+        }
+
+        /**
+         * Gathers channel c of 16 RGB pixels per lane from three blocks, like kShuffle3 does for SSE.
+         */
+        __attribute__((target("avx2"))) inline __m256i GatherRgbAvx2(__m256i a0, __m256i a1, __m256i a2, int c)
+        {
+            return _mm256_or_si256(
+                _mm256_or_si256(_mm256_shuffle_epi8(a0, _mm256_broadcastsi128_si256(kShuffle3[c][0])),
+                                _mm256_shuffle_epi8(a1, _mm256_broadcastsi128_si256(kShuffle3[c][1]))),
+                _mm256_shuffle_epi8(a2, _mm256_broadcastsi128_si256(kShuffle3[c][2])));
+        }
+
+        /**
+         * AVX2 weighted luma kernels, 32 pixels per iteration. As in GrayAvx2, pixels 0-15 are
+         * loaded into the low lane and 16-31 into the high lane, so the in-lane shuffles,
+         * unpacks and packs of the SSE kernel leave the result in order.
+         */
+        template <int Channels, LumaMode Mode, bool Premultiply>
+        __attribute__((target("avx2"))) void LumaAvx2(const unsigned char* src, unsigned char* dst,
+                                                       std::size_t pixels)
+        {
+            static_assert(Channels == 3 || Channels == 4, "AVX2 luma kernels exist for 3 and 4 channels");
+            constexpr bool kScale = Premultiply && Channels == 4; // RGB has no alpha to scale by.
+            const __m256i zero = _mm256_setzero_si256();
+            std::size_t i = 0;
+            for (; i + 32 <= pixels; i += 32) {
+                const unsigned char* p = src + i * Channels;
+                const unsigned char* q = p + 16 * Channels;
+                const __m256i a0 = LoadLanesAvx2(p, q);
+                const __m256i a1 = LoadLanesAvx2(p + 16, q + 16);
+                const __m256i a2 = LoadLanesAvx2(p + 32, q + 32);
+                __m256i r, g, b, a = zero;
+                if constexpr (Channels == 3) {
+                    r = GatherRgbAvx2(a0, a1, a2, 0);
+                    g = GatherRgbAvx2(a0, a1, a2, 1);
+                    b = GatherRgbAvx2(a0, a1, a2, 2);
+                } else {
+                    const __m256i mask = _mm256_broadcastsi128_si256(
+                        _mm_load_si128(reinterpret_cast<const __m128i*>(kShuffle4Bytes)));
+                    const __m256i a3 = LoadLanesAvx2(p + 48, q + 48);
+                    __m256i s0 = _mm256_shuffle_epi8(a0, mask), s1 = _mm256_shuffle_epi8(a1, mask);
+                    __m256i s2 = _mm256_shuffle_epi8(a2, mask), s3 = _mm256_shuffle_epi8(a3, mask);
+                    __m256i t0 = _mm256_unpacklo_epi32(s0, s1), t1 = _mm256_unpackhi_epi32(s0, s1);
+                    __m256i t2 = _mm256_unpacklo_epi32(s2, s3), t3 = _mm256_unpackhi_epi32(s2, s3);
+                    r = _mm256_unpacklo_epi64(t0, t2);
+                    g = _mm256_unpackhi_epi64(t0, t2);
+                    b = _mm256_unpacklo_epi64(t1, t3);
+                    a = _mm256_unpackhi_epi64(t1, t3);
+                }
+                __m256i lo = WeighAvx2<Mode, kScale>(_mm256_unpacklo_epi8(r, zero), _mm256_unpacklo_epi8(g, zero),
+                                                     _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(a, zero));
+                __m256i hi = WeighAvx2<Mode, kScale>(_mm256_unpackhi_epi8(r, zero), _mm256_unpackhi_epi8(g, zero),
+                                                     _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(a, zero));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_packus_epi16(lo, hi));
+            }
+            LumaSse41<Channels, Mode, Premultiply>(src + i * Channels, dst + i, pixels - i);
+        }
+#elif defined(BWCONV_NEON_SIMD)
+        /**
+         * NEON kernels, 16 pixels per iteration using structured de-interleaving loads.
+         */
+        template <int Channels>
+        void GrayNeon(const unsigned char* src, unsigned char* dst, std::size_t pixels)
+        {
+            std::size_t i = 0;
+            for (; i + 16 <= pixels; i += 16) {
+                const unsigned char* p = src + i * Channels;
+                uint8x16_t gray;
+                if constexpr (Channels == 2) {
+                    uint8x16x2_t v = vld2q_u8(p);
+                    gray = vcombine_u8(vshrn_n_u16(vaddl_u8(vget_low_u8(v.val[0]), vget_low_u8(v.val[1])), 1),
+                                       vshrn_n_u16(vaddl_u8(vget_high_u8(v.val[0]), vget_high_u8(v.val[1])), 1));
+                } else if constexpr (Channels == 3) {
+                    uint8x16x3_t v = vld3q_u8(p);
+                    uint16x8_t lo = vaddw_u8(vaddl_u8(vget_low_u8(v.val[0]), vget_low_u8(v.val[1])),
+                                             vget_low_u8(v.val[2]));
+                    uint16x8_t hi = vaddw_u8(vaddl_u8(vget_high_u8(v.val[0]), vget_high_u8(v.val[1])),
+                                             vget_high_u8(v.val[2]));
+                    auto divide = [](uint16x8_t sum) {
+                        uint32x4_t a = vmull_n_u16(vget_low_u16(sum), kDivideBy3);
+                        uint32x4_t b = vmull_n_u16(vget_high_u16(sum), kDivideBy3);
+                        return vmovn_u16(vcombine_u16(vshrn_n_u32(a, 16), vshrn_n_u32(b, 16)));
+                    };
+                    gray = vcombine_u8(divide(lo), divide(hi));
+                } else {
+                    static_assert(Channels == 4, "NEON kernels exist for 2, 3 and 4 channels");
+                    uint8x16x4_t v = vld4q_u8(p);
+                    uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(v.val[0]), vget_low_u8(v.val[1])),
+                                              vaddl_u8(vget_low_u8(v.val[2]), vget_low_u8(v.val[3])));
+                    uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(v.val[0]), vget_high_u8(v.val[1])),
+                                              vaddl_u8(vget_high_u8(v.val[2]), vget_high_u8(v.val[3])));
+                    gray = vcombine_u8(vshrn_n_u16(lo, 2), vshrn_n_u16(hi, 2));
+                }
+                vst1q_u8(dst + i, gray);
+            }
+            GrayPortable<Channels>(src + i * Channels, dst + i, pixels - i);
+        }
+
+        /**
+         * NEON weighted luma kernels for RGB and RGBA, 16 pixels per iteration.
+         */
+        template <int Channels, LumaMode Mode, bool Premultiply>
+        void LumaNeon(const unsigned char* src, unsigned char* dst, std::size_t pixels)
+        {
+            static_assert(Channels == 3 || Channels == 4, "NEON luma kernels exist for 3 and 4 channels");
+            using W = LumaWeights<Mode>;
+            auto weigh = [](uint8x8_t r, uint8x8_t g, uint8x8_t b, uint8x8_t a) {
+                uint16x8_t sum = vmlal_u8(vmlal_u8(vmull_u8(r, vdup_n_u8(W::r)), g, vdup_n_u8(W::g)), b,
+                                          vdup_n_u8(W::b));
+                uint8x8_t y = vrshrn_n_u16(sum, 8);
+                if constexpr (Premultiply && Channels == 4) {
+                    uint16x8_t t = vaddq_u16(vmull_u8(y, a), vdupq_n_u16(128));
+                    y = vshrn_n_u16(vsraq_n_u16(t, t, 8), 8);
+                }
+                return y;
+            };
+            std::size_t i = 0;
+            for (; i + 16 <= pixels; i += 16) {
+                const unsigned char* p = src + i * Channels;
+                uint8x16_t r, g, b, a = vdupq_n_u8(0);
+                if constexpr (Channels == 3) {
+                    uint8x16x3_t v = vld3q_u8(p);
+                    r = v.val[0];
+                    g = v.val[1];
+                    b = v.val[2];
+                } else {
+                    uint8x16x4_t v = vld4q_u8(p);
+                    r = v.val[0];
+                    g = v.val[1];
+                    b = v.val[2];
+                    a = v.val[3];
+                }
+                vst1q_u8(dst + i, vcombine_u8(weigh(vget_low_u8(r), vget_low_u8(g), vget_low_u8(b), vget_low_u8(a)),
+                                              weigh(vget_high_u8(r), vget_high_u8(g), vget_high_u8(b),
+                                                    vget_high_u8(a))));
+            }
+            LumaPortable<Channels, Mode, Premultiply>(src + i * Channels, dst + i, pixels - i);
+        }
+#endif
+
+        /**
+         * Replaces every sample from level on by high and every other sample by low, which
+         * applies thresholds and other single-step lookup tables. dst may equal src.
+         *
+         * @param src The samples.
+         * @param dst Receives the results.
+         * @param samples Number of samples.
+         * @param level The first value mapped to high.
+         * @param low Result of values below level.
+         * @param high Result of values from level on.
+         */
+        inline void StepSamples(const unsigned char* src, unsigned char* dst, std::size_t samples,
+                                unsigned char level, unsigned char low, unsigned char high)
+        {
+            std::size_t i = 0;
+#if defined(BWCONV_X86_SIMD) && defined(__SSE2__)
+            const __m128i levels = _mm_set1_epi8(static_cast<char>(level));
+            const __m128i lows = _mm_set1_epi8(static_cast<char>(low));
+            const __m128i highs = _mm_set1_epi8(static_cast<char>(high));
+            for (; i + 16 <= samples; i += 16) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(v, levels), v);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                                 _mm_or_si128(_mm_and_si128(above, highs), _mm_andnot_si128(above, lows)));
+            }
+#elif defined(BWCONV_NEON_SIMD)
+            const uint8x16_t levels = vdupq_n_u8(level);
+            const uint8x16_t lows = vdupq_n_u8(low);
+            const uint8x16_t highs = vdupq_n_u8(high);
+            for (; i + 16 <= samples; i += 16) {
+                vst1q_u8(dst + i, vbslq_u8(vcgeq_u8(vld1q_u8(src + i), levels), highs, lows));
+            }
+#endif
+            for (; i < samples; ++i) {
+                dst[i] = src[i] >= level ? high : low;
+            }
+        }
+
+        /**
+         * Picks the fastest kernel for the channel count and luma mode on the running CPU,
+         * falling back to the portable instantiations when no SIMD kernel applies.
+         * CPU features are queried once; later calls are a table lookup.
+         *
+         * @param channels The number of color channels per pixel.
+         * @param luma How color is weighted into gray.
+         * @param alpha Alpha handling of the weighted modes; Average counts alpha as a channel.
+         * @return The kernel, or nullptr when only GrayScalar handles the channel count.
+         */
+        inline GrayKernel SelectGrayKernel(int channels, LumaMode luma = LumaMode::Average,
+                                           AlphaMode alpha = AlphaMode::Ignore)
+        {
+            struct Table
+            {
+                /// Indexed by luma mode, premultiplication and channel count.
+                GrayKernel kernels[4][2][5] = {};
+
+                Table()
+                {
+                    for (auto& byAlpha : kernels) {
+                        for (auto& byChannels : byAlpha) {
+                            byChannels[1] = GrayCopy;
+                        }
+                    }
+                    Set(LumaMode::Average, false, GrayPortable<2>, GrayPortable<3>, GrayPortable<4>);
+                    Set(LumaMode::Average, true, GrayPortable<2>, GrayPortable<3>, GrayPortable<4>);
+                    Set(LumaMode::Bt601, false, LumaPortable<2, LumaMode::Bt601, false>,
+                        LumaPortable<3, LumaMode::Bt601, false>, LumaPortable<4, LumaMode::Bt601, false>);
+                    Set(LumaMode::Bt601, true, LumaPortable<2, LumaMode::Bt601, true>,
+                        LumaPortable<3, LumaMode::Bt601, true>, LumaPortable<4, LumaMode::Bt601, true>);
+                    Set(LumaMode::Bt709, false, LumaPortable<2, LumaMode::Bt709, false>,
+                        LumaPortable<3, LumaMode::Bt709, false>, LumaPortable<4, LumaMode::Bt709, false>);
+                    Set(LumaMode::Bt709, true, LumaPortable<2, LumaMode::Bt709, true>,
+                        LumaPortable<3, LumaMode::Bt709, true>, LumaPortable<4, LumaMode::Bt709, true>);
+                    Set(LumaMode::Linear, false, LumaLinear<2, false>, LumaLinear<3, false>, LumaLinear<4, false>);
+                    Set(LumaMode::Linear, true, LumaLinear<2, true>, LumaLinear<3, true>, LumaLinear<4, true>);
+#if defined(BWCONV_X86_SIMD)
+                    __builtin_cpu_init();
+                    if (__builtin_cpu_supports("avx2")) {
+                        Set(LumaMode::Average, false, GrayAvx2<2>, GrayAvx2<3>, GrayAvx2<4>);
+                        Set(LumaMode::Average, true, GrayAvx2<2>, GrayAvx2<3>, GrayAvx2<4>);
+                        Set(LumaMode::Bt601, false, LumaAvx2<3, LumaMode::Bt601, false>,
+                            LumaAvx2<4, LumaMode::Bt601, false>);
+                        Set(LumaMode::Bt601, true, LumaAvx2<3, LumaMode::Bt601, true>,
+                            LumaAvx2<4, LumaMode::Bt601, true>);
+                        Set(LumaMode::Bt709, false, LumaAvx2<3, LumaMode::Bt709, false>,
+                            LumaAvx2<4, LumaMode::Bt709, false>);
+                        Set(LumaMode::Bt709, true, LumaAvx2<3, LumaMode::Bt709, true>,
+                            LumaAvx2<4, LumaMode::Bt709, true>);
+                    } else if (__builtin_cpu_supports("sse4.1")) {
+                        Set(LumaMode::Average, false, GraySse41<2>, GraySse41<3>, GraySse41<4>);
+                        Set(LumaMode::Average, true, GraySse41<2>, GraySse41<3>, GraySse41<4>);
+                        Set(LumaMode::Bt601, false, LumaSse41<3, LumaMode::Bt601, false>,
+                            LumaSse41<4, LumaMode::Bt601, false>);
+                        Set(LumaMode::Bt601, true, LumaSse41<3, LumaMode::Bt601, true>,
+                            LumaSse41<4, LumaMode::Bt601, true>);
+                        Set(LumaMode::Bt709, false, LumaSse41<3, LumaMode::Bt709, false>,
+                            LumaSse41<4, LumaMode::Bt709, false>);
+                        Set(LumaMode::Bt709, true, LumaSse41<3, LumaMode::Bt709, true>,
+                            LumaSse41<4, LumaMode::Bt709, true>);
+                    }
+#elif defined(BWCONV_NEON_SIMD)
+                    Set(LumaMode::Average, false, GrayNeon<2>, GrayNeon<3>, GrayNeon<4>);
+                    Set(LumaMode::Average, true, GrayNeon<2>, GrayNeon<3>, GrayNeon<4>);
+                    Set(LumaMode::Bt601, false, LumaNeon<3, LumaMode::Bt601, false>,
+                        LumaNeon<4, LumaMode::Bt601, false>);
+                    Set(LumaMode::Bt601, true, LumaNeon<3, LumaMode::Bt601, true>, LumaNeon<4, LumaMode::Bt601, true>);
+                    Set(LumaMode::Bt709, false, LumaNeon<3, LumaMode::Bt709, false>,
+                        LumaNeon<4, LumaMode::Bt709, false>);
+                    Set(LumaMode::Bt709, true, LumaNeon<3, LumaMode::Bt709, true>, LumaNeon<4, LumaMode::Bt709, true>);
+#endif
+                }
+
+                void Set(LumaMode luma, bool premultiply, GrayKernel two, GrayKernel three, GrayKernel four)
+                {
+                    GrayKernel* entry = kernels[static_cast<int>(luma)][premultiply ? 1 : 0];
+                    entry[2] = two;
+                    entry[3] = three;
+                    entry[4] = four;
+                }
+
+                /// Replaces the color kernels only; gray+alpha input has no color to weigh.
+                void Set(LumaMode luma, bool premultiply, GrayKernel three, GrayKernel four)
+                {
+                    GrayKernel* entry = kernels[static_cast<int>(luma)][premultiply ? 1 : 0];
+                    entry[3] = three;
+                    entry[4] = four;
+                }
+            };
+            static const Table table;
+            return (channels >= 1 && channels <= 4)
+                       ? table.kernels[static_cast<int>(luma)][alpha == AlphaMode::Premultiply ? 1 : 0][channels]
+                       : nullptr;
+        }
+    } // namespace Kernels
+} // namespace bwconv
@@ -0,0 +1,35 @@
+/**
+ * @file libjpeg_support.hpp
+ * @brief Shared pieces of the libjpeg-based decoders and encoders.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#if defined(BWCONV_HAVE_LIBJPEG)
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+
+// libjpeg-turbo 2.0 and newer decode only some columns of the scanlines and skip rows
+// without the IDCT; other libjpeg builds read and drop the rows outside a region.
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER)
+#define BWCONV_HAVE_JPEG_CROP 1
+#endif
+
+namespace bwconv
+{
+    /**
+     * Error manager that returns control to the failing libjpeg call site.
+     */
+    struct JpegErrorManager
+    {
+        jpeg_error_mgr base;
+        std::jmp_buf jump;
+
+        static void Exit(j_common_ptr cinfo) { std::longjmp(reinterpret_cast<JpegErrorManager*>(cinfo->err)->jump, 1); }
+    };
+} // namespace bwconv
+#endif
@@ -0,0 +1,853 @@
+/**
+ * @file load_strategy.hpp
+ * @brief Decoders turning an encoded file in memory into interleaved 8-bit, 16-bit or float pixels.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "crop_region.hpp"
+#include "image_view.hpp"
+#include "libjpeg_support.hpp"
+#include "sample_conversion.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stb_image.h>
+#include <string>
+#include <vector>
+
+#if defined(BWCONV_HAVE_LIBPNG)
+#include <png.h>
+#endif
+#if defined(BWCONV_HAVE_WEBP)
+#include <webp/decode.h>
+#endif
+
+namespace bwconv
+{
+    /**
+     * Which implementations decode inputs.
+     */
+    enum class DecoderBackend
+    {
+        Auto, ///< libjpeg, libpng and libwebp where the build found them, stb for the rest.
+        Stb   ///< Always stb_image.
+    };
+
+    namespace LoadFile
+    {
+        /**
+         * @class LoadStrategy
+         * @brief Abstract base class for image decoders, the counterpart of SaveFile::SaveStrategy.
+         *
+         * Strategies are selected by the file's leading bytes. Decoded pixels are allocated
+         * with Stats::Allocations, the allocator stb_image is built with, so buffers from every
+         * backend are released with stbi_image_free and can be resized alike.
+         */
+        class LoadStrategy
+        {
+        public:
+            /**
+             * Virtual destructor for LoadStrategy.
+             */
+            virtual ~LoadStrategy() = default;
+
+            /**
+             * @param bytes The encoded file.
+             * @param size Size of the file in bytes.
+             * @return true if the file's signature belongs to this decoder's format.
+             */
+            virtual bool Accepts(const unsigned char* bytes, std::size_t size) const = 0;
+
+            /**
+             * Reads the image dimensions without decoding the pixels.
+             *
+             * @return false if the header cannot be parsed.
+             */
+            virtual bool Info(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                              int& channels) const
+            {
+                return stbi_info_from_memory(bytes, static_cast<int>(size), &width, &height, &channels) != 0;
+            }
+
+            /**
+             * Pure virtual function to decode an image.
+             *
+             * @param bytes The encoded file.
+             * @param size Size of the file in bytes.
+             * @param width Receives the width in pixels.
+             * @param height Receives the height in pixels.
+             * @param channels Receives the channel count stored in the file.
+             * @param desiredChannels Channels of the returned pixels, or 0 for the file's own,
+             *                        with stb_image's conversion rules.
+             * @return The pixels, or nullptr if this decoder cannot handle the file, in which
+             *         case the next matching strategy is tried.
+             */
+            virtual unsigned char* Decode(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                          int& channels, int desiredChannels) = 0;
+
+            /**
+             * Decodes an image, shrunk if the decoder can do so cheaply. The parameters are
+             * those of Decode; width and height receive the dimensions of the result.
+             *
+             * @param reduction Called with the file's dimensions once they are known; returns
+             *                  the largest factor by which each dimension may be divided.
+             * @return The pixels, or nullptr as for Decode. The default decodes at full size.
+             */
+            virtual unsigned char* DecodeReduced(const unsigned char* bytes, std::size_t size, int& width,
+                                                 int& height, int& channels, int desiredChannels,
+                                                 const std::function<int(int, int)>& reduction)
+            {
+                (void)reduction;
+                return Decode(bytes, size, width, height, channels, desiredChannels);
+            }
+
+            /**
+             * Decodes the part of an image inside a region, skipping as much of the rest as
+             * the format allows. The parameters are those of DecodeReduced, except that the
+             * reduction is chosen for the region's dimensions rather than the file's.
+             *
+             * @param region On entry the wanted region in the file's pixels, which may reach
+             *               past the image; on return its place in the returned pixels,
+             *               which may hold more of the image around it and are reduced alike.
+             * @return The pixels, or nullptr as for Decode. The default decodes the whole
+             *         image at full size and leaves the region as it is.
+             * @throws std::runtime_error if the region lies outside the image.
+             */
+            virtual unsigned char* DecodeRegion(const unsigned char* bytes, std::size_t size, int& width,
+                                                int& height, int& channels, int desiredChannels,
+                                                const std::function<int(int, int)>& reduction, CropRegion& region)
+            {
+                (void)reduction, (void)region;
+                return Decode(bytes, size, width, height, channels, desiredChannels);
+            }
+
+            /**
+             * Decodes an image at its full precision when it has more than 8 bits per
+             * sample. The parameters are those of Decode.
+             *
+             * @param sample Receives the type of the returned samples, U16 or F32.
+             * @return The pixels, or nullptr if the file has 8-bit samples or this decoder
+             *         cannot keep them wider, in which case Decode is used.
+             */
+            virtual unsigned char* DecodeWide(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                              int& channels, int desiredChannels, SampleType& sample)
+            {
+                (void)bytes, (void)size, (void)width, (void)height, (void)channels, (void)desiredChannels;
+                (void)sample;
+                return nullptr;
+            }
+
+        protected:
+            /**
+             * Owner of a pixel buffer allocated like stb_image's.
+             */
+            using Pixels = std::unique_ptr<unsigned char[], void (*)(void*)>;
+
+            /**
+             * @param bytes Size of the buffer.
+             * @return An uninitialised buffer, or an empty one if the allocation failed.
+             */
+            static Pixels AllocatePixels(std::size_t bytes)
+            {
+                return Pixels(static_cast<unsigned char*>(Stats::Allocations::Allocate(bytes)),
+                              Stats::Allocations::Free);
+            }
+
+            /**
+             * Converts interleaved pixels between channel counts exactly as stb_image does for
+             * desired_channels: gray is replicated, missing alpha is opaque and luminance is
+             * (77 R + 150 G + 29 B) >> 8.
+             *
+             * @param pixels Buffer holding count pixels of from channels; replaced by the result.
+             * @param count Number of pixels.
+             * @param from Channels of the input.
+             * @param to Channels of the output.
+             * @return false if the allocation failed.
+             */
+            static bool ConvertChannels(Pixels& pixels, std::size_t count, int from, int to)
+            {
+                if (from == to) {
+                    return true;
+                }
+                Pixels converted = AllocatePixels(count * to);
+                if (!converted) {
+                    return false;
+                }
+                const unsigned char* src = pixels.get();
+                unsigned char* dst = converted.get();
+                for (std::size_t i = 0; i < count; ++i, src += from, dst += to) {
+                    unsigned char gray = from >= 3 ? static_cast<unsigned char>((src[0] * 77 + src[1] * 150 + src[2] * 29) >> 8)
+                                                   : src[0];
+                    unsigned char alpha = from == 2 ? src[1] : (from == 4 ? src[3] : 255);
+                    if (to <= 2) {
+                        dst[0] = gray;
+                    } else if (from >= 3) {
+                        std::memcpy(dst, src, 3);
+                    } else {
+                        dst[0] = dst[1] = dst[2] = gray;
+                    }
+                    if (to == 2 || to == 4) {
+                        dst[to - 1] = alpha;
+                    }
+                }
+                pixels = std::move(converted);
+                return true;
+            }
+        };
+
+        /**
+         * @class StbLoadStrategy
+         * @brief Decodes every format stb_image supports. Registered last as the fallback.
+         */
+        class StbLoadStrategy : public LoadStrategy
+        {
+        public:
+            bool Accepts(const unsigned char*, std::size_t) const override { return true; }
+
+            unsigned char* Decode(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                  int& channels, int desiredChannels) override
+            {
+                return stbi_load_from_memory(bytes, static_cast<int>(size), &width, &height, &channels,
+                                             desiredChannels);
+            }
+
+            /**
+             * Radiance HDR files decode to linear floats, 16-bit PNG and PNM to 16-bit samples.
+             */
+            unsigned char* DecodeWide(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                      int& channels, int desiredChannels, SampleType& sample) override
+            {
+                int length = static_cast<int>(size);
+                if (stbi_is_hdr_from_memory(bytes, length)) {
+                    sample = SampleType::F32;
+                    return reinterpret_cast<unsigned char*>(
+                        stbi_loadf_from_memory(bytes, length, &width, &height, &channels, desiredChannels));
+                }
+                if (stbi_is_16_bit_from_memory(bytes, length)) {
+                    sample = SampleType::U16;
+                    return reinterpret_cast<unsigned char*>(
+                        stbi_load_16_from_memory(bytes, length, &width, &height, &channels, desiredChannels));
+                }
+                return nullptr;
+            }
+        };
+
+#if defined(BWCONV_HAVE_LIBJPEG)
+        /**
+         * @class LibjpegLoadStrategy
+         * @brief Decodes baseline and progressive JPEG through libjpeg, whose libjpeg-turbo
+         *        flavour uses SIMD IDCT, upsampling and color conversion.
+         *
+         * Gray output is requested from libjpeg directly, which skips chroma decoding. CMYK
+         * files are left to stb_image.
+         */
+        class LibjpegLoadStrategy : public LoadStrategy
+        {
+        public:
+            bool Accepts(const unsigned char* bytes, std::size_t size) const override
+            {
+                return size >= 3 && bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF;
+            }
+
+            unsigned char* Decode(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                  int& channels, int desiredChannels) override
+            {
+                return DecodeReduced(bytes, size, width, height, channels, desiredChannels, nullptr);
+            }
+
+            /**
+             * Lets libjpeg scale by 1/2, 1/4 or 1/8 while decoding, which works on the DCT
+             * coefficients and skips most of the IDCT, upsampling and color conversion.
+             */
+            unsigned char* DecodeReduced(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                         int& channels, int desiredChannels,
+                                         const std::function<int(int, int)>& reduction) override
+            {
+                CropRegion region;
+                return DecodeRegion(bytes, size, width, height, channels, desiredChannels, reduction, region);
+            }
+
+            /**
+             * Rows above the region are skipped without the IDCT and decoding stops below it.
+             * Only the iMCU columns the region touches are decoded, so the result may start
+             * up to one iMCU left of the region and cover a little to its right.
+             */
+            unsigned char* DecodeRegion(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                        int& channels, int desiredChannels,
+                                        const std::function<int(int, int)>& reduction, CropRegion& region) override
+            {
+                Decompressor decompressor;
+                if (!decompressor.ReadHeader(bytes, size)) {
+                    return nullptr;
+                }
+                CropRegion wanted = region.ClippedTo(decompressor.FileWidth(), decompressor.FileHeight());
+                int factor = reduction ? reduction(wanted.width, wanted.height) : 1;
+                int denominator = factor >= 8 ? 8 : (factor >= 4 ? 4 : (factor >= 2 ? 2 : 1));
+                if (!decompressor.Start(desiredChannels == 1 || desiredChannels == 2, denominator)) {
+                    return nullptr;
+                }
+                // The region in scaled pixels, rounded outwards.
+                int left = wanted.x / denominator, top = wanted.y / denominator;
+                int right = (wanted.x + wanted.width + denominator - 1) / denominator;
+                int bottom = (wanted.y + wanted.height + denominator - 1) / denominator;
+                right = std::min(right, decompressor.Width());
+                bottom = std::min(bottom, decompressor.Height());
+                int first = left, columns = right - left;
+                if (!decompressor.CropColumns(first, columns)) {
+                    return nullptr;
+                }
+                width = columns;
+                height = bottom - top;
+                channels = decompressor.FileComponents();
+                int components = decompressor.OutputComponents();
+
+                std::size_t rowBytes = static_cast<std::size_t>(width) * components;
+                Pixels pixels = AllocatePixels(rowBytes * height);
+                if (!pixels || !decompressor.ReadRows(pixels.get(), rowBytes, top, height)) {
+                    return nullptr;
+                }
+                region = CropRegion{left - first, 0, right - left, height};
+                int target = desiredChannels != 0 ? desiredChannels : components;
+                if (!ConvertChannels(pixels, static_cast<std::size_t>(width) * height, components, target)) {
+                    return nullptr;
+                }
+                return pixels.release();
+            }
+
+        private:
+            /**
+             * @class Decompressor
+             * @brief libjpeg decompression from memory.
+             *
+             * libjpeg reports errors with longjmp, so every libjpeg call is made from a member
+             * function that sets the jump buffer and holds no objects with destructors.
+             */
+            class Decompressor
+            {
+            public:
+                Decompressor()
+                {
+                    cinfo.err = jpeg_std_error(&error.base);
+                    error.base.error_exit = JpegErrorManager::Exit;
+                    jpeg_create_decompress(&cinfo);
+                }
+
+                ~Decompressor() { jpeg_destroy_decompress(&cinfo); }
+
+                Decompressor(const Decompressor&) = delete;
+                Decompressor& operator=(const Decompressor&) = delete;
+
+                /**
+                 * Reads the header.
+                 *
+                 * @return false on errors and for CMYK files.
+                 */
+                bool ReadHeader(const unsigned char* bytes, std::size_t size)
+                {
+                    if (setjmp(error.jump)) {
+                        return false;
+                    }
+                    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(bytes), static_cast<unsigned long>(size));
+                    jpeg_read_header(&cinfo, TRUE);
+                    return cinfo.num_components == 1 || cinfo.num_components == 3;
+                }
+
+                /**
+                 * Starts decompression after ReadHeader.
+                 *
+                 * @param gray Request luminance only.
+                 * @param denominator Scale the image by 1 / denominator: 1, 2, 4 or 8.
+                 * @return false on errors.
+                 */
+                bool Start(bool gray, int denominator)
+                {
+                    if (setjmp(error.jump)) {
+                        return false;
+                    }
+                    cinfo.out_color_space = gray || cinfo.num_components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+                    cinfo.scale_num = 1;
+                    cinfo.scale_denom = static_cast<unsigned int>(denominator);
+                    jpeg_start_decompress(&cinfo);
+                    return true;
+                }
+
+                /**
+                 * Restricts decoding to some columns of the scaled image, after Start. The
+                 * range is widened to whole iMCUs; builds without libjpeg-turbo's cropping
+                 * decode every column.
+                 *
+                 * @param first First column; receives the first column decoded.
+                 * @param columns Number of columns; receives the number decoded.
+                 * @return false on errors.
+                 */
+                bool CropColumns(int& first, int& columns)
+                {
+                    if (setjmp(error.jump)) {
+                        return false;
+                    }
+#if defined(BWCONV_HAVE_JPEG_CROP)
+                    if (columns < Width()) {
+                        JDIMENSION offset = static_cast<JDIMENSION>(first), width = static_cast<JDIMENSION>(columns);
+                        jpeg_crop_scanline(&cinfo, &offset, &width);
+                        first = static_cast<int>(offset);
+                        columns = static_cast<int>(width);
+                        return true;
+                    }
+#endif
+                    first = 0;
+                    columns = Width();
+                    return true;
+                }
+
+                /**
+                 * Decodes scanlines [top, top + count) into rows of rowBytes bytes. Rows above
+                 * are skipped, and decoding is abandoned after the last row unless it is the
+                 * image's last.
+                 *
+                 * @return false if libjpeg reported an error.
+                 */
+                bool ReadRows(unsigned char* dst, std::size_t rowBytes, int top, int count)
+                {
+                    if (setjmp(error.jump)) {
+                        return false;
+                    }
+#if defined(BWCONV_HAVE_JPEG_CROP)
+                    if (top > 0) {
+                        jpeg_skip_scanlines(&cinfo, static_cast<JDIMENSION>(top));
+                    }
+#else
+                    // The first destination row serves as scratch for the rows above.
+                    while (cinfo.output_scanline < static_cast<JDIMENSION>(top)) {
+                        JSAMPROW row = dst;
+                        jpeg_read_scanlines(&cinfo, &row, 1);
+                    }
+#endif
+                    JDIMENSION end = static_cast<JDIMENSION>(top + count);
+                    JSAMPROW rows[16];
+                    while (cinfo.output_scanline < end) {
+                        JDIMENSION batch = 0;
+                        for (; batch < 16 && cinfo.output_scanline + batch < end; ++batch) {
+                            rows[batch] = dst + (cinfo.output_scanline + batch - top) * rowBytes;
+                        }
+                        jpeg_read_scanlines(&cinfo, rows, batch);
+                    }
+                    if (end == cinfo.output_height) {
+                        jpeg_finish_decompress(&cinfo);
+                    }
+                    return true;
+                }
+
+                int FileWidth() const { return static_cast<int>(cinfo.image_width); }
+                int FileHeight() const { return static_cast<int>(cinfo.image_height); }
+                int Width() const { return static_cast<int>(cinfo.output_width); }
+                int Height() const { return static_cast<int>(cinfo.output_height); }
+                int FileComponents() const { return cinfo.num_components; }
+                int OutputComponents() const { return cinfo.output_components; }
+
+            private:
+                jpeg_decompress_struct cinfo{}; ///< libjpeg decompression state.
+                JpegErrorManager error{};       ///< Error handler of cinfo.
+            };
+        };
+#endif
+
+#if defined(BWCONV_HAVE_LIBPNG)
+        /**
+         * @class LibpngLoadStrategy
+         * @brief Decodes PNG through libpng with the same expansions stb_image applies:
+         *        8 bits per channel, palettes expanded and tRNS turned into alpha. DecodeWide
+         *        keeps 16-bit samples.
+         */
+        class LibpngLoadStrategy : public LoadStrategy
+        {
+        public:
+            bool Accepts(const unsigned char* bytes, std::size_t size) const override
+            {
+                static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+                return size >= 8 && std::memcmp(bytes, signature, 8) == 0;
+            }
+
+            unsigned char* Decode(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                  int& channels, int desiredChannels) override
+            {
+                Reader reader(bytes, size);
+                if (!reader.ReadHeader(false)) {
+                    return nullptr;
+                }
+                Pixels pixels = ReadPixels(reader, width, height, channels);
+                int target = desiredChannels != 0 ? desiredChannels : channels;
+                if (!pixels || !ConvertChannels(pixels, static_cast<std::size_t>(width) * height, channels, target)) {
+                    return nullptr;
+                }
+                return pixels.release();
+            }
+
+            /**
+             * Decoding stops after the region's last row, and rows above it are decompressed
+             * into a single scratch row, which saves the memory and copies of the rest.
+             * Interlaced files spread every row over the whole file and decode completely.
+             */
+            unsigned char* DecodeRegion(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                        int& channels, int desiredChannels,
+                                        const std::function<int(int, int)>& reduction, CropRegion& region) override
+            {
+                (void)reduction;
+                Reader reader(bytes, size);
+                if (!reader.ReadHeader(false)) {
+                    return nullptr;
+                }
+                Pixels pixels(nullptr, Stats::Allocations::Free);
+                if (reader.interlaced) {
+                    pixels = ReadPixels(reader, width, height, channels);
+                } else {
+                    region = region.ClippedTo(reader.width, reader.height);
+                    pixels = ReadRegion(reader, region, width, height, channels);
+                    region.x = region.y = 0;
+                }
+                int target = desiredChannels != 0 ? desiredChannels : channels;
+                if (!pixels || !ConvertChannels(pixels, static_cast<std::size_t>(width) * height, channels, target)) {
+                    return nullptr;
+                }
+                return pixels.release();
+            }
+
+            /**
+             * 16-bit PNGs are decoded in native byte order. Channel conversions of 16-bit
+             * samples are left to stb_image.
+             */
+            unsigned char* DecodeWide(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                      int& channels, int desiredChannels, SampleType& sample) override
+            {
+                Reader reader(bytes, size);
+                if (!reader.ReadHeader(true) || reader.bitDepth != 16 ||
+                    (desiredChannels != 0 && desiredChannels != reader.channels)) {
+                    return nullptr;
+                }
+                sample = SampleType::U16;
+                return ReadPixels(reader, width, height, channels).release();
+            }
+
+        private:
+            /**
+             * @class Reader
+             * @brief libpng read state over a memory buffer. Like every libpng user here, it
+             *        calls libpng only from members that set the jump buffer.
+             */
+            class Reader
+            {
+            public:
+                Reader(const unsigned char* bytes, std::size_t size) : bytes(bytes), size(size)
+                {
+                    // Failures fall back to stb_image, so libpng's messages would only be noise.
+                    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, ErrorCallback, WarningCallback);
+                    info = png ? png_create_info_struct(png) : nullptr;
+                }
+
+                ~Reader() { png_destroy_read_struct(&png, &info, nullptr); }
+
+                Reader(const Reader&) = delete;
+                Reader& operator=(const Reader&) = delete;
+
+                /**
+                 * @param keep16 Keep 16-bit samples, in native byte order, instead of stripping them to 8 bits.
+                 */
+                bool ReadHeader(bool keep16)
+                {
+                    if (info == nullptr || setjmp(png_jmpbuf(png))) {
+                        return false;
+                    }
+                    png_set_read_fn(png, this, ReadCallback);
+                    png_read_info(png, info);
+                    png_set_expand(png);
+                    if (!keep16) {
+                        png_set_strip_16(png);
+                    } else if (IsLittleEndianHost()) {
+                        png_set_swap(png);
+                    }
+                    interlaced = png_set_interlace_handling(png) > 1;
+                    png_read_update_info(png, info);
+                    width = static_cast<int>(png_get_image_width(png, info));
+                    height = static_cast<int>(png_get_image_height(png, info));
+                    channels = png_get_channels(png, info);
+                    bitDepth = png_get_bit_depth(png, info);
+                    return true;
+                }
+
+                bool ReadImage(png_bytepp rows)
+                {
+                    if (setjmp(png_jmpbuf(png))) {
+                        return false;
+                    }
+                    png_read_image(png, rows);
+                    return true;
+                }
+
+                /**
+                 * Reads the next rows of a non-interlaced image.
+                 *
+                 * @param dst Destination of the first row.
+                 * @param stride Distance between destination rows; 0 to overwrite one row.
+                 * @param rows Number of rows.
+                 */
+                bool ReadRows(png_bytep dst, std::size_t stride, int rows)
+                {
+                    if (setjmp(png_jmpbuf(png))) {
+                        return false;
+                    }
+                    for (int r = 0; r < rows; ++r) {
+                        png_read_row(png, dst + stride * r, nullptr);
+                    }
+                    return true;
+                }
+
+                int width = 0;           ///< Width in pixels.
+                int height = 0;          ///< Height in pixels.
+                int channels = 0;        ///< Channels after expansion.
+                int bitDepth = 8;        ///< Bits per sample after expansion, 8 or 16.
+                bool interlaced = false; ///< Adam7 interlaced, so rows cannot be read one by one.
+
+            private:
+                const unsigned char* bytes;  ///< The encoded file.
+                std::size_t size;            ///< Size of the file.
+                std::size_t offset = 0;      ///< Bytes consumed by libpng.
+                png_structp png = nullptr;   ///< libpng read state.
+                png_infop info = nullptr;    ///< libpng image information.
+
+                static void ErrorCallback(png_structp png, png_const_charp) { png_longjmp(png, 1); }
+
+                static void WarningCallback(png_structp, png_const_charp) {}
+
+                static void ReadCallback(png_structp png, png_bytep out, png_size_t count)
+                {
+                    auto* reader = static_cast<Reader*>(png_get_io_ptr(png));
+                    if (count > reader->size - reader->offset) {
+                        png_error(png, "Unexpected end of PNG data");
+                    }
+                    std::memcpy(out, reader->bytes + reader->offset, count);
+                    reader->offset += count;
+                }
+            };
+
+            /**
+             * Reads the image whose header the reader has parsed.
+             *
+             * @return The pixels, or an empty buffer if they cannot be read.
+             */
+            static Pixels ReadPixels(Reader& reader, int& width, int& height, int& channels)
+            {
+                width = reader.width;
+                height = reader.height;
+                channels = reader.channels;
+
+                std::size_t rowBytes = static_cast<std::size_t>(width) * channels * (reader.bitDepth / 8);
+                Pixels pixels = AllocatePixels(rowBytes * height);
+                if (!pixels) {
+                    return pixels;
+                }
+                std::vector<png_bytep> rows(static_cast<std::size_t>(height));
+                for (int y = 0; y < height; ++y) {
+                    rows[y] = pixels.get() + rowBytes * y;
+                }
+                if (!reader.ReadImage(rows.data())) {
+                    pixels.reset();
+                }
+                return pixels;
+            }
+
+            /**
+             * Reads the rows of a region of a non-interlaced image whose header the reader
+             * has parsed, and nothing below them.
+             *
+             * @param region The region, inside the image.
+             * @return The region's pixels, or an empty buffer if they cannot be read.
+             */
+            static Pixels ReadRegion(Reader& reader, const CropRegion& region, int& width, int& height,
+                                     int& channels)
+            {
+                width = region.width;
+                height = region.height;
+                channels = reader.channels;
+
+                std::size_t pixelBytes = static_cast<std::size_t>(channels) * (reader.bitDepth / 8);
+                std::size_t rowBytes = static_cast<std::size_t>(width) * pixelBytes;
+                Pixels pixels = AllocatePixels(rowBytes * height);
+                if (!pixels) {
+                    return pixels;
+                }
+                std::vector<unsigned char> row(static_cast<std::size_t>(reader.width) * pixelBytes);
+                if (!reader.ReadRows(row.data(), 0, region.y)) {
+                    pixels.reset();
+                    return pixels;
+                }
+                if (width == reader.width) {
+                    if (!reader.ReadRows(pixels.get(), rowBytes, height)) {
+                        pixels.reset();
+                    }
+                    return pixels;
+                }
+                for (int y = 0; y < height; ++y) {
+                    if (!reader.ReadRows(row.data(), 0, 1)) {
+                        pixels.reset();
+                        return pixels;
+                    }
+                    std::memcpy(pixels.get() + rowBytes * y, row.data() + region.x * pixelBytes, rowBytes);
+                }
+                return pixels;
+            }
+        };
+#endif
+
+#if defined(BWCONV_HAVE_WEBP)
+        /**
+         * @class WebpLoadStrategy
+         * @brief Decodes lossy and lossless WebP through libwebp. stb_image has no WebP
+         *        support, so WebP inputs need a build with libwebp.
+         */
+        class WebpLoadStrategy : public LoadStrategy
+        {
+        public:
+            bool Accepts(const unsigned char* bytes, std::size_t size) const override
+            {
+                return size >= 12 && std::memcmp(bytes, "RIFF", 4) == 0 && std::memcmp(bytes + 8, "WEBP", 4) == 0;
+            }
+
+            bool Info(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                      int& channels) const override
+            {
+                WebPBitstreamFeatures features;
+                if (WebPGetFeatures(bytes, size, &features) != VP8_STATUS_OK) {
+                    return false;
+                }
+                width = features.width;
+                height = features.height;
+                channels = features.has_alpha ? 4 : 3;
+                return true;
+            }
+
+            unsigned char* Decode(const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                  int& channels, int desiredChannels) override
+            {
+                if (!Info(bytes, size, width, height, channels)) {
+                    return nullptr;
+                }
+                std::size_t rowBytes = static_cast<std::size_t>(width) * channels;
+                Pixels pixels = AllocatePixels(rowBytes * height);
+                if (!pixels) {
+                    return nullptr;
+                }
+                uint8_t* decoded = channels == 4 ? WebPDecodeRGBAInto(bytes, size, pixels.get(), rowBytes * height,
+                                                                      static_cast<int>(rowBytes))
+                                                 : WebPDecodeRGBInto(bytes, size, pixels.get(), rowBytes * height,
+                                                                     static_cast<int>(rowBytes));
+                if (decoded == nullptr) {
+                    return nullptr;
+                }
+                int target = desiredChannels != 0 ? desiredChannels : channels;
+                if (!ConvertChannels(pixels, static_cast<std::size_t>(width) * height, channels, target)) {
+                    return nullptr;
+                }
+                return pixels.release();
+            }
+        };
+#endif
+
+        /**
+         * Builds the decoders in the order they are tried.
+         *
+         * @param backend Whether optional libraries may be used.
+         * @return The strategies, ending with the stb fallback.
+         */
+        inline std::vector<std::unique_ptr<LoadStrategy>> CreateLoadStrategies(DecoderBackend backend)
+        {
+            std::vector<std::unique_ptr<LoadStrategy>> strategies;
+            if (backend == DecoderBackend::Auto) {
+#if defined(BWCONV_HAVE_LIBJPEG)
+                strategies.push_back(std::make_unique<LibjpegLoadStrategy>());
+#endif
+#if defined(BWCONV_HAVE_LIBPNG)
+                strategies.push_back(std::make_unique<LibpngLoadStrategy>());
+#endif
+            }
+#if defined(BWCONV_HAVE_WEBP)
+            // Not a speed-up but the only WebP decoder, so it is registered for either backend.
+            strategies.push_back(std::make_unique<WebpLoadStrategy>());
+#endif
+            strategies.push_back(std::make_unique<StbLoadStrategy>());
+            return strategies;
+        }
+
+        /**
+         * @return The first strategy accepting the file; the stb fallback accepts everything.
+         */
+        inline LoadStrategy& FindLoadStrategy(const std::vector<std::unique_ptr<LoadStrategy>>& strategies,
+                                              const unsigned char* bytes, std::size_t size)
+        {
+            for (const auto& strategy : strategies) {
+                if (strategy->Accepts(bytes, size)) {
+                    return *strategy;
+                }
+            }
+            return *strategies.back();
+        }
+
+        /**
+         * Decodes with the matching strategies in turn until one succeeds.
+         *
+         * @param sample If not null, files with more than 8 bits per sample are decoded at
+         *               full precision and the type of the returned samples is stored here.
+         * @param reduction If set, decoders that can shrink images cheaply divide the size by
+         *                  up to the factor it returns for the file's dimensions.
+         * @param region If not null, the region of the image that is all the caller needs;
+         *               decoders that can skip the rest do, see LoadStrategy::DecodeRegion.
+         *               Receives the place of the region in the returned pixels, to be
+         *               clipped to them.
+         * @return The pixels, to be released with stbi_image_free, or nullptr if no
+         *         strategy could decode the file.
+         */
+        inline unsigned char* DecodeImage(const std::vector<std::unique_ptr<LoadStrategy>>& strategies,
+                                          const unsigned char* bytes, std::size_t size, int& width, int& height,
+                                          int& channels, int desiredChannels, SampleType* sample = nullptr,
+                                          const std::function<int(int, int)>& reduction = nullptr,
+                                          CropRegion* region = nullptr)
+        {
+            if (sample != nullptr) {
+                *sample = SampleType::U8;
+                for (const auto& strategy : strategies) {
+                    SampleType wide = SampleType::U8;
+                    if (strategy->Accepts(bytes, size)) {
+                        if (unsigned char* pixels = strategy->DecodeWide(bytes, size, width, height, channels,
+                                                                         desiredChannels, wide)) {
+                            *sample = wide;
+                            return pixels;
+                        }
+                    }
+                }
+            }
+            for (const auto& strategy : strategies) {
+                if (!strategy->Accepts(bytes, size)) {
+                    continue;
+                }
+                if (region != nullptr) {
+                    CropRegion placed = *region;
+                    if (unsigned char* pixels = strategy->DecodeRegion(bytes, size, width, height, channels,
+                                                                       desiredChannels, reduction, placed)) {
+                        *region = placed;
+                        return pixels;
+                    }
+                } else if (unsigned char* pixels = strategy->DecodeReduced(bytes, size, width, height, channels,
+                                                                           desiredChannels, reduction)) {
+                    return pixels;
+                }
+            }
+            return nullptr;
+        }
+    } // namespace LoadFile
+} // namespace bwconv
@@ -0,0 +1,164 @@
+/**
+ * @file lookup_processor.hpp
+ * @brief Per-sample tone mapping through a lookup table.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "image_processor.hpp"
+#include "row_stage.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @class LookupProcessor
+     * @brief Replaces every sample by its entry in a 256-entry table, e.g. to invert an image.
+     *
+     * In a ProcessorPipeline the table is folded with neighbouring lookups, such as a fixed
+     * threshold, so a chain of them costs a single lookup per sample.
+     */
+    class LookupProcessor : public ImageProcessor
+    {
+    public:
+        /**
+         * @param pool The thread pool used to process tiles of the image concurrently.
+         * @param table Output value of every input value.
+         * @param grainRows Rows per tile; zero picks a tile size that fits in the L2 cache.
+         */
+        LookupProcessor(ThreadPool& pool, const std::array<unsigned char, 256>& table, std::size_t grainRows = 0)
+            : pool(pool), grainRows(grainRows), stage(table)
+        {
+        }
+
+        /**
+         * @return The table mapping v to 255 - v.
+         */
+        static std::array<unsigned char, 256> InvertTable()
+        {
+            std::array<unsigned char, 256> table{};
+            for (int v = 0; v < 256; ++v) {
+                table[v] = static_cast<unsigned char>(255 - v);
+            }
+            return table;
+        }
+
+        bool IsRowLocal() const override { return true; }
+
+        std::vector<const RowStage*> RowStages() const override { return {&stage}; }
+
+        /**
+         * The table in hexadecimal.
+         */
+        std::string Fingerprint() const override
+        {
+            static const char digits[] = "0123456789abcdef";
+            std::array<unsigned char, 256> table;
+            stage.Lookup(table);
+            std::string fingerprint = "lookup:";
+            for (unsigned char v : table) {
+                fingerprint += digits[v >> 4];
+                fingerprint += digits[v & 15];
+            }
+            return fingerprint;
+        }
+
+        /**
+         * Maps every sample of every channel through the table, in place. 16-bit and float
+         * samples fall between the entries and are mapped through the linear interpolation
+         * of the two nearest ones.
+         *
+         * @param img View of the image to be processed; its layout is kept.
+         */
+        void ProcessImage(ImageView& img) override
+        {
+            if (img.sample != SampleType::U8) {
+                ProcessWide(img);
+                return;
+            }
+            RowFunction function = stage.Bind(img.channels);
+            if (!function) {
+                return;
+            }
+            std::size_t grain = grainRows != 0 ? grainRows
+                                               : std::max<std::size_t>(1, kTileBytes / std::max<std::size_t>(
+                                                                                           1, img.RowBytes()));
+            const ImageView view = img;
+            ForEachRowInPlace(pool, static_cast<std::size_t>(img.height), img.stride, img.stride, grain,
+                              [&](std::size_t firstRow, std::size_t lastRow) {
+                                  for (std::size_t y = firstRow; y < lastRow; ++y) {
+                                      unsigned char* row = view.Row(static_cast<int>(y));
+                                      function(row, row, view.width, view.top + static_cast<int>(y));
+                                  }
+                              });
+            std::array<unsigned char, 256> table;
+            stage.Lookup(table);
+            // Of a bilevel input, only the entries of 0 and 255 are used.
+            auto isBilevel = [](unsigned char v) { return v == 0 || v == 255; };
+            img.bilevel = stage.ProducesBilevel() || (img.bilevel && isBilevel(table[0]) && isBilevel(table[255]));
+        }
+
+    private:
+        /**
+         * Applies the interpolated table to 16-bit or float samples, in place.
+         */
+        void ProcessWide(const ImageView& img)
+        {
+            std::array<unsigned char, 256> table;
+            stage.Lookup(table);
+            // 16-bit samples go through a table of every value, built once per image.
+            std::vector<std::uint16_t> wide;
+            if (img.sample == SampleType::U16) {
+                wide.resize(65536);
+                for (std::uint32_t v = 0; v < 65536; ++v) {
+                    std::uint32_t position = v * 255, index = position / 65535, fraction = position % 65535;
+                    std::uint32_t upper = table[std::min<std::uint32_t>(255, index + 1)];
+                    std::uint32_t scaled = table[index] * (65535 - fraction) + upper * fraction;
+                    wide[v] = static_cast<std::uint16_t>((scaled + 127) / 255);
+                }
+            }
+            std::size_t samples = static_cast<std::size_t>(img.width) * img.channels;
+            std::size_t grain = grainRows != 0 ? grainRows
+                                               : std::max<std::size_t>(1, kTileBytes / std::max<std::size_t>(
+                                                                                           1, img.RowBytes()));
+            ForEachRowInPlace(pool, static_cast<std::size_t>(img.height), img.stride, img.stride, grain,
+                              [&](std::size_t firstRow, std::size_t lastRow) {
+                                  for (std::size_t y = firstRow; y < lastRow; ++y) {
+                                      unsigned char* row = img.Row(static_cast<int>(y));
+                                      if (img.sample == SampleType::U16) {
+                                          auto* values = reinterpret_cast<std::uint16_t*>(row);
+                                          for (std::size_t i = 0; i < samples; ++i) {
+                                              values[i] = wide[values[i]];
+                                          }
+                                          continue;
+                                      }
+                                      auto* values = reinterpret_cast<float*>(row);
+                                      for (std::size_t i = 0; i < samples; ++i) {
+                                          float position = std::min(1.0f, std::max(0.0f, values[i])) * 255;
+                                          int index = std::min(254, static_cast<int>(position));
+                                          float fraction = position - index;
+                                          values[i] = (table[index] + (table[index + 1] - table[index]) * fraction) *
+                                                      (1.0f / 255);
+                                      }
+                                  }
+                              });
+        }
+
+        /// Bytes touched per tile when the grain is chosen automatically.
+        static constexpr std::size_t kTileBytes = 256 * 1024;
+
+        ThreadPool& pool;      ///< Pool shared with the rest of the conversion.
+        std::size_t grainRows; ///< Rows per tile, zero for automatic.
+        LookupStage stage;     ///< The table.
+    };
+} // namespace bwconv
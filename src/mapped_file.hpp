@@ -0,0 +1,119 @@
+/**
+ * @file mapped_file.hpp
+ * @brief Read-only access to the contents of an input file.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "platform.hpp"
+
+#include <cstddef>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @class MappedFile
+     * @brief Read-only access to the complete contents of a file.
+     *
+     * Decoders read from memory instead of through small stdio reads. Large files are
+     * memory-mapped with a sequential-access hint so the kernel reads ahead aggressively;
+     * small files are read with a single pread, which is cheaper than setting up and
+     * tearing down a mapping. Platforms without POSIX I/O fall back to one stream read.
+     */
+    class MappedFile
+    {
+    public:
+        /**
+         * Opens and loads the file.
+         *
+         * @param path Path to the file.
+         * @throws std::runtime_error if the file cannot be opened or read.
+         */
+        explicit MappedFile(const std::string& path)
+        {
+#if defined(BWCONV_POSIX)
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Unable to open " + path);
+            }
+            struct stat info;
+            if (::fstat(fd, &info) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Unable to open " + path);
+            }
+            size = static_cast<std::size_t>(info.st_size);
+
+            if (size >= kMapThreshold) {
+                void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    ::madvise(mapping, size, MADV_SEQUENTIAL);
+                    ::madvise(mapping, size, MADV_WILLNEED);
+                    mapped = static_cast<unsigned char*>(mapping);
+                    ::close(fd);
+                    return;
+                }
+            }
+
+            buffer.resize(size);
+            std::size_t done = 0;
+            while (done < size) {
+                ssize_t got = ::pread(fd, buffer.data() + done, size - done, static_cast<off_t>(done));
+                if (got <= 0) {
+                    ::close(fd);
+                    throw std::runtime_error("Unable to read " + path);
+                }
+                done += static_cast<std::size_t>(got);
+            }
+            ::close(fd);
+#else
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            if (!file) {
+                throw std::runtime_error("Unable to open " + path);
+            }
+            size = static_cast<std::size_t>(file.tellg());
+            buffer.resize(size);
+            file.seekg(0);
+            if (!file.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(size))) {
+                throw std::runtime_error("Unable to read " + path);
+            }
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile()
+        {
+#if defined(BWCONV_POSIX)
+            if (mapped != nullptr) {
+                ::munmap(mapped, size);
+            }
+#endif
+        }
+
+        /**
+         * @return The first byte of the file.
+         */
+        const unsigned char* Data() const { return mapped != nullptr ? mapped : buffer.data(); }
+
+        /**
+         * @return The file size in bytes.
+         */
+        std::size_t Size() const { return size; }
+
+    private:
+        /// Files at least this large are mapped instead of read.
+        static constexpr std::size_t kMapThreshold = 1u << 20;
+
+        unsigned char* mapped = nullptr;    ///< Mapping of large files.
+        std::vector<unsigned char> buffer;  ///< Contents of small files.
+        std::size_t size = 0;               ///< File size in bytes.
+    };
+} // namespace bwconv
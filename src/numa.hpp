@@ -0,0 +1,193 @@
+/**
+ * @file numa.hpp
+ * @brief Processor topology and the placement of worker threads on cores and NUMA nodes.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace bwconv::Numa
+{
+    /**
+     * Node of the calling thread: set for workers placed on a node, 0 everywhere else.
+     * The thread pool queues tasks and the buffer pool recycles memory per node.
+     */
+    inline thread_local int currentNode = 0;
+
+    /**
+     * @return The node of the calling thread.
+     */
+    inline int CurrentNode() { return currentNode; }
+
+    /**
+     * @struct Topology
+     * @brief The CPUs this process may run on, grouped by NUMA node.
+     */
+    struct Topology
+    {
+        std::vector<std::vector<int>> nodes; ///< CPU numbers of every node; never empty.
+    };
+
+    /**
+     * @struct WorkerPlacement
+     * @brief Where one thread runs.
+     */
+    struct WorkerPlacement
+    {
+        int node = 0;          ///< Node whose tasks and memory the thread prefers.
+        std::vector<int> cpus; ///< CPUs the thread is bound to; empty leaves it unbound.
+    };
+
+    /**
+     * Parses a Linux CPU list such as "0-3,8,10-11".
+     *
+     * @param list The list.
+     * @return The CPU numbers in order; malformed entries are skipped.
+     */
+    inline std::vector<int> ParseCpuList(const std::string& list)
+    {
+        std::vector<int> cpus;
+        std::size_t start = 0;
+        while (start < list.size()) {
+            std::size_t end = std::min(list.find(',', start), list.size());
+            std::string entry = list.substr(start, end - start);
+            std::size_t dash = entry.find('-');
+            try {
+                int first = std::stoi(entry.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(entry.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            } catch (const std::exception&) {
+            }
+            start = end + 1;
+        }
+        return cpus;
+    }
+
+    /**
+     * Reads the nodes from sysfs, keeping only the CPUs in the process's affinity mask.
+     * Without NUMA information (or outside Linux) all CPUs form one node.
+     *
+     * @return The topology.
+     */
+    inline Topology DetectTopology()
+    {
+        Topology topology;
+#if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        auto usable = [&](int cpu) { return !masked || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)); };
+
+        // Node numbers may have gaps, so probe well past the first missing one.
+        for (int node = 0, missing = 0; missing < 64; ++node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            if (!file || !std::getline(file, list)) {
+                ++missing;
+                continue;
+            }
+            missing = 0;
+            std::vector<int> cpus = ParseCpuList(list);
+            cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&](int cpu) { return !usable(cpu); }), cpus.end());
+            if (!cpus.empty()) {
+                topology.nodes.push_back(std::move(cpus));
+            }
+        }
+        if (topology.nodes.empty() && masked) {
+            topology.nodes.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    topology.nodes.back().push_back(cpu);
+                }
+            }
+        }
+#endif
+        if (topology.nodes.empty()) {
+            topology.nodes.emplace_back();
+            for (unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+                topology.nodes.back().push_back(static_cast<int>(cpu));
+            }
+        }
+        return topology;
+    }
+
+    /**
+     * Plans where threads run.
+     *
+     * With numa, threads are dealt to the nodes in turn so every node gets an equal share,
+     * and each thread belongs to its node: it prefers the node's tasks, and the memory it
+     * allocates and touches first is local to it. With pin, each thread is bound to a CPU
+     * of its own (of its node with numa), so its caches and memory stay put; with numa
+     * alone a thread may move between the CPUs of its node.
+     *
+     * @param topology The CPUs by node.
+     * @param threads Number of threads.
+     * @param pin Bind every thread to one CPU.
+     * @param numa Group the threads by node.
+     * @return The placement of every thread; unbound on node 0 if neither option is set.
+     */
+    inline std::vector<WorkerPlacement> PlanPlacement(const Topology& topology, unsigned int threads, bool pin,
+                                                      bool numa)
+    {
+        std::vector<WorkerPlacement> placement(threads);
+        std::vector<int> all;
+        for (const auto& cpus : topology.nodes) {
+            all.insert(all.end(), cpus.begin(), cpus.end());
+        }
+        std::size_t nodeCount = topology.nodes.size();
+        for (unsigned int i = 0; i < threads; ++i) {
+            if (numa) {
+                std::size_t node = i % nodeCount;
+                const std::vector<int>& cpus = topology.nodes[node];
+                placement[i].node = static_cast<int>(node);
+                placement[i].cpus = pin ? std::vector<int>{cpus[(i / nodeCount) % cpus.size()]} : cpus;
+            } else if (pin) {
+                placement[i].cpus = {all[i % all.size()]};
+            }
+        }
+        return placement;
+    }
+
+    /**
+     * Moves the calling thread to its place.
+     *
+     * @param placement Node and CPUs of the thread.
+     * @return false if the thread could not be bound; it then runs unbound on its node.
+     */
+    inline bool PlaceCurrentThread(const WorkerPlacement& placement)
+    {
+        currentNode = placement.node;
+        if (placement.cpus.empty()) {
+            return true;
+        }
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : placement.cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+} // namespace bwconv::Numa
@@ -0,0 +1,651 @@
+/**
+ * @file opencl_processor.hpp
+ * @brief Offloads gray conversion, resizing, lookups and ordered dithering to an OpenCL device.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#if defined(BWCONV_HAVE_OPENCL)
+#include "black_and_white_processor.hpp"
+#include "image_processor.hpp"
+#include "resize_processor.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__APPLE__)
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+namespace bwconv
+{
+    /**
+     * @struct GpuProgram
+     * @brief The processing an OpenClProcessor runs on the device: gray conversion, an
+     *        optional resize, a 256-entry lookup and an optional 8x8 Bayer dither, in
+     *        this order.
+     */
+    struct GpuProgram
+    {
+        GrayOptions gray;                                        ///< Gray conversion; linear luma is unsupported.
+        bool resize = false;                                     ///< Shrink to fit resizeOptions.
+        ResizeOptions resizeOptions;                             ///< Bounding box and filter of the resize.
+        std::array<unsigned char, 256> lookup = IdentityTable(); ///< Applied to every gray sample.
+        bool bayer = false;                                      ///< Dither like OrderedDitherProcessor.
+        bool bilevel = false;                                    ///< The result only has the values 0 and 255.
+
+        /**
+         * @return The table mapping every value to itself.
+         */
+        static std::array<unsigned char, 256> IdentityTable()
+        {
+            std::array<unsigned char, 256> table{};
+            for (int v = 0; v < 256; ++v) {
+                table[v] = static_cast<unsigned char>(v);
+            }
+            return table;
+        }
+    };
+
+    /**
+     * @struct GpuOptions
+     * @brief When and how an OpenClProcessor uses the device.
+     */
+    struct GpuOptions
+    {
+        std::size_t minPixels = 1u << 20; ///< Smaller images are processed on the CPU.
+        int bandRows = 256;               ///< Input rows per transfer.
+    };
+
+    /**
+     * @class OpenClProcessor
+     * @brief Runs a GpuProgram on the first OpenCL GPU and hands everything it cannot do
+     *        well to the equivalent CPU processor.
+     *
+     * The image is moved to the device in bands of rows. Every band is copied into a
+     * pinned staging buffer, from which the device reads it by DMA, and its result comes
+     * back the same way. Two bands are in flight on two command queues, so one band is
+     * transferred while the other is computed, and the host fills and empties the staging
+     * buffers of one queue while the device works on the other. A resize sends bands of the input rows that a range of output
+     * rows depends on, and accumulates on the device as ResizeProcessor does on the CPU.
+     *
+     * The CPU processor takes images below GpuOptions::minPixels, whose transfers would
+     * cost more than the device saves, images with 16-bit or float samples, and images
+     * that arrive while another conversion holds the device. A batch thus keeps the CPU
+     * busy next to the GPU instead of queueing on it.
+     *
+     * The integer steps match the CPU kernels bit for bit. The resize sums the same
+     * products in the same order with contraction disabled, but devices that flush
+     * denormals or round differently may differ in the last level, so resizing
+     * processors report a fingerprint of their own.
+     */
+    class OpenClProcessor : public ImageProcessor
+    {
+    public:
+        /**
+         * Sets up the device and compiles the kernels.
+         *
+         * @param fallback The CPU processor equal to the program; it also answers the
+         *                 decoder questions (DesiredChannels, DecodeReduction). It is only
+         *                 taken over once the device is set up, so it can be used on its own
+         *                 if the constructor throws.
+         * @param program What the device runs.
+         * @param options When and how the device is used.
+         * @throws std::runtime_error if there is no OpenCL GPU, the program uses linear luma,
+         *         or the kernels do not build.
+         */
+        OpenClProcessor(std::unique_ptr<ImageProcessor>& fallback, const GpuProgram& program,
+                        const GpuOptions& options = GpuOptions())
+            : program(program), options(options)
+        {
+            if (program.gray.luma == LumaMode::Linear) {
+                throw std::runtime_error("Linear luma is not supported by the OpenCL backend");
+            }
+            if (options.bandRows < 8) {
+                // Bands start on multiples of 8, so the dither pattern is the same as on the CPU.
+                this->options.bandRows = 8;
+            }
+            this->options.bandRows &= ~7;
+
+            cl_platform_id platforms[16];
+            cl_uint platformCount = 0;
+            Check(clGetPlatformIDs(16, platforms, &platformCount), "clGetPlatformIDs");
+            cl_device_id device = nullptr;
+            for (cl_uint i = 0; i < std::min<cl_uint>(platformCount, 16) && device == nullptr; ++i) {
+                cl_uint devices = 0;
+                if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &device, &devices) != CL_SUCCESS) {
+                    device = nullptr;
+                }
+            }
+            if (device == nullptr) {
+                throw std::runtime_error("No OpenCL GPU found");
+            }
+
+            cl_int status;
+            context.reset(clCreateContext(nullptr, 1, &device, nullptr, nullptr, &status));
+            Check(status, "clCreateContext");
+            for (Slot& slot : slots) {
+                slot.queue.reset(clCreateCommandQueue(context.get(), device, 0, &status));
+                Check(status, "clCreateCommandQueue");
+            }
+
+            const char* source = kSource;
+            programHandle.reset(clCreateProgramWithSource(context.get(), 1, &source, nullptr, &status));
+            Check(status, "clCreateProgramWithSource");
+            if (clBuildProgram(programHandle.get(), 1, &device, "-cl-std=CL1.2", nullptr, nullptr) != CL_SUCCESS) {
+                std::size_t length = 0;
+                clGetProgramBuildInfo(programHandle.get(), device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &length);
+                std::string log(length, '\0');
+                clGetProgramBuildInfo(programHandle.get(), device, CL_PROGRAM_BUILD_LOG, length, &log[0], nullptr);
+                throw std::runtime_error("OpenCL kernels failed to build: " + log);
+            }
+            for (Slot& slot : slots) {
+                slot.gray.reset(clCreateKernel(programHandle.get(), "gray_rows", &status));
+                Check(status, "clCreateKernel");
+                slot.vertical.reset(clCreateKernel(programHandle.get(), "resize_vertical", &status));
+                Check(status, "clCreateKernel");
+                slot.horizontal.reset(clCreateKernel(programHandle.get(), "resize_horizontal", &status));
+                Check(status, "clCreateKernel");
+            }
+            lookup.reset(clCreateBuffer(context.get(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 256,
+                                        const_cast<unsigned char*>(program.lookup.data()), &status));
+            Check(status, "clCreateBuffer");
+            this->fallback = std::move(fallback);
+        }
+
+        int DesiredChannels() const override { return fallback->DesiredChannels(); }
+
+        int DecodeReduction(int width, int height) const override { return fallback->DecodeReduction(width, height); }
+
+        bool IsRowLocal() const override { return fallback->IsRowLocal(); }
+
+        std::string Fingerprint() const override
+        {
+            std::string fingerprint = fallback->Fingerprint();
+            return program.resize && !fingerprint.empty() ? "opencl:" + fingerprint : fingerprint;
+        }
+
+        /**
+         * Runs the program on the device, or the CPU processor if the image is small, has
+         * wide samples or the device is busy. The result is written to the front of the
+         * image's memory.
+         *
+         * @param img View of the image to be processed; describes the result on return.
+         * @throws std::runtime_error if an OpenCL call fails.
+         */
+        void ProcessImage(ImageView& img) override
+        {
+            std::unique_lock<std::mutex> lock(deviceMutex, std::try_to_lock);
+            if (!lock.owns_lock() || img.sample != SampleType::U8 || img.channels < 1 || img.channels > 4 ||
+                static_cast<std::size_t>(img.width) * img.height < options.minPixels) {
+                fallback->ProcessImage(img);
+                return;
+            }
+
+            int outWidth = img.width, outHeight = img.height;
+            if (program.resize) {
+                ResizeProcessor::FitSize(img.width, img.height, program.resizeOptions, outWidth, outHeight);
+            }
+            if (outWidth != img.width || outHeight != img.height) {
+                Resize(img, outWidth, outHeight);
+            } else {
+                Convert(img);
+            }
+            int top = img.top;
+            img = ImageView{img.data, outWidth, outHeight, static_cast<std::size_t>(outWidth), 1};
+            img.bilevel = program.bilevel;
+            img.top = top;
+        }
+
+    private:
+        /// Releases an OpenCL object.
+        template <typename T, cl_int (*Release)(T)>
+        struct Releaser
+        {
+            void operator()(T handle) const { Release(handle); }
+        };
+
+        template <typename T, cl_int (*Release)(T)>
+        using Handle = std::unique_ptr<std::remove_pointer_t<T>, Releaser<T, Release>>;
+
+        using ContextHandle = Handle<cl_context, clReleaseContext>;
+        using QueueHandle = Handle<cl_command_queue, clReleaseCommandQueue>;
+        using ProgramHandle = Handle<cl_program, clReleaseProgram>;
+        using KernelHandle = Handle<cl_kernel, clReleaseKernel>;
+        using MemoryHandle = Handle<cl_mem, clReleaseMemObject>;
+        using EventHandle = Handle<cl_event, clReleaseEvent>;
+
+        /**
+         * A device buffer and the pinned host buffer it is transferred from or to.
+         */
+        struct Staged
+        {
+            MemoryHandle device;                 ///< The buffer the kernels use.
+            MemoryHandle pinned;                 ///< Page-locked host memory.
+            unsigned char* host = nullptr;       ///< pinned, mapped for the lifetime of the buffer.
+            std::size_t capacity = 0;            ///< Bytes of both buffers.
+            cl_command_queue mappedOn = nullptr; ///< Queue pinned was mapped with.
+
+            ~Staged() { Unmap(); }
+
+            void Unmap()
+            {
+                if (host != nullptr) {
+                    clEnqueueUnmapMemObject(mappedOn, pinned.get(), host, 0, nullptr, nullptr);
+                    clFinish(mappedOn);
+                    host = nullptr;
+                }
+            }
+        };
+
+        /**
+         * A command queue with its own kernels and buffers, carrying one band at a time.
+         */
+        struct Slot
+        {
+            QueueHandle queue;               ///< In-order queue of the band's transfers and kernels.
+            KernelHandle gray;               ///< gray_rows, with this slot's arguments.
+            KernelHandle vertical;           ///< resize_vertical, with this slot's arguments.
+            KernelHandle horizontal;         ///< resize_horizontal, with this slot's arguments.
+            Staged input;                    ///< Input rows of the band.
+            Staged output;                   ///< Result rows of the band.
+            MemoryHandle columns;            ///< Vertically resampled rows of a resize band.
+            std::size_t columnBytes = 0;     ///< Size of columns.
+            EventHandle done;                ///< Completion of the band's read-back, if one is in flight.
+            unsigned char* target = nullptr; ///< Where the band's result goes on the host.
+            std::size_t resultBytes = 0;     ///< Size of the band's result.
+        };
+
+        /**
+         * The taps of one dimension of a resize on the device.
+         */
+        struct DeviceTaps
+        {
+            ResizeProcessor::Contributions taps; ///< The taps on the host.
+            MemoryHandle first;                  ///< taps.first.
+            MemoryHandle count;                  ///< taps.count.
+            MemoryHandle weights;                ///< taps.weights.
+        };
+
+        static constexpr int kSlots = 2;
+
+        std::unique_ptr<ImageProcessor> fallback; ///< CPU processor equal to the program.
+        GpuProgram program;                       ///< What the device runs.
+        GpuOptions options;                       ///< When and how the device is used.
+        ContextHandle context;                    ///< Context of the device.
+        ProgramHandle programHandle;              ///< The compiled kernels.
+        MemoryHandle lookup;                      ///< program.lookup on the device.
+        std::array<Slot, kSlots> slots;           ///< Bands in flight.
+        std::mutex deviceMutex;                   ///< Held by the conversion using the device.
+
+        /**
+         * Turns an OpenCL status into an exception.
+         */
+        static void Check(cl_int status, const char* call)
+        {
+            if (status != CL_SUCCESS) {
+                throw std::runtime_error(std::string("OpenCL error ") + std::to_string(status) + " in " + call);
+            }
+        }
+
+        /**
+         * Makes a slot's buffer hold at least the given size, mapping its pinned half.
+         */
+        void Reserve(Slot& slot, Staged& staged, std::size_t bytes, cl_mem_flags access)
+        {
+            if (staged.capacity >= bytes) {
+                return;
+            }
+            staged.Unmap();
+            cl_int status;
+            staged.device.reset(clCreateBuffer(context.get(), access, bytes, nullptr, &status));
+            Check(status, "clCreateBuffer");
+            staged.pinned.reset(
+                clCreateBuffer(context.get(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes, nullptr, &status));
+            Check(status, "clCreateBuffer");
+            staged.host = static_cast<unsigned char*>(clEnqueueMapBuffer(slot.queue.get(), staged.pinned.get(), CL_TRUE,
+                                                                         CL_MAP_READ | CL_MAP_WRITE, 0, bytes, 0,
+                                                                         nullptr, nullptr, &status));
+            Check(status, "clEnqueueMapBuffer");
+            staged.mappedOn = slot.queue.get();
+            staged.capacity = bytes;
+        }
+
+        /**
+         * @return A read-only device buffer holding a copy of the data.
+         */
+        template <typename T>
+        MemoryHandle Upload(const std::vector<T>& data)
+        {
+            cl_int status;
+            MemoryHandle buffer(clCreateBuffer(context.get(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                               std::max<std::size_t>(1, data.size()) * sizeof(T),
+                                               const_cast<T*>(data.data()), &status));
+            Check(status, "clCreateBuffer");
+            return buffer;
+        }
+
+        /**
+         * Sets the arguments of a kernel in order.
+         */
+        template <typename... Arguments>
+        static void SetArguments(cl_kernel kernel, const Arguments&... arguments)
+        {
+            cl_uint index = 0;
+            (Check(clSetKernelArg(kernel, index++, sizeof(arguments), &arguments), "clSetKernelArg"), ...);
+        }
+
+        /**
+         * Waits for the band a slot carries, if any, and copies its result out of staging.
+         */
+        void Drain(Slot& slot)
+        {
+            if (!slot.done) {
+                return;
+            }
+            cl_event event = slot.done.get();
+            Check(clWaitForEvents(1, &event), "clWaitForEvents");
+            slot.done.reset();
+            std::memcpy(slot.target, slot.output.host, slot.resultBytes);
+        }
+
+        /**
+         * Copies rows of the image into a slot's pinned input, packed, so strided views are
+         * transferred in one piece too.
+         */
+        static void StageRows(Slot& slot, const ImageView& img, int first, int rows)
+        {
+            if (img.IsPacked()) {
+                std::memcpy(slot.input.host, img.Row(first), img.RowBytes() * rows);
+                return;
+            }
+            for (int r = 0; r < rows; ++r) {
+                std::memcpy(slot.input.host + img.RowBytes() * r, img.Row(first + r), img.RowBytes());
+            }
+        }
+
+        /**
+         * Queues a band's upload from the slot's staged input and its read-back around its
+         * kernels on the slot's queue.
+         *
+         * @param slot The slot.
+         * @param inputBytes Bytes of the band's input.
+         * @param enqueueKernels Callable queueing the band's kernels.
+         * @param target Where the result goes on the host.
+         * @param resultBytes Bytes of the band's result.
+         */
+        template <typename Kernels>
+        void Submit(Slot& slot, std::size_t inputBytes, Kernels enqueueKernels, unsigned char* target,
+                    std::size_t resultBytes)
+        {
+            cl_command_queue queue = slot.queue.get();
+            Check(clEnqueueWriteBuffer(queue, slot.input.device.get(), CL_FALSE, 0, inputBytes, slot.input.host, 0,
+                                       nullptr, nullptr),
+                  "clEnqueueWriteBuffer");
+            enqueueKernels(queue);
+            cl_event event;
+            Check(clEnqueueReadBuffer(queue, slot.output.device.get(), CL_FALSE, 0, resultBytes, slot.output.host, 0,
+                                      nullptr, &event),
+                  "clEnqueueReadBuffer");
+            slot.done.reset(event);
+            slot.target = target;
+            slot.resultBytes = resultBytes;
+            Check(clFlush(queue), "clFlush");
+        }
+
+        /**
+         * Waits for every slot, also when a band failed, so no transfer outlives the image.
+         */
+        void DrainAll()
+        {
+            for (Slot& slot : slots) {
+                if (slot.done) {
+                    cl_event event = slot.done.get();
+                    clWaitForEvents(1, &event);
+                    slot.done.reset();
+                }
+            }
+        }
+
+        /**
+         * Converts the image at its size. Every band's result is written over the front of
+         * the band's own input rows, which no later band reads.
+         */
+        void Convert(ImageView& img)
+        {
+            cl_int width = img.width, channels = img.channels, premultiply = Premultiply(), luma = Luma();
+            cl_int bayer = program.bayer ? 1 : 0;
+            cl_int stride = static_cast<cl_int>(img.RowBytes());
+            try {
+                for (int y = 0, band = 0; y < img.height; y += options.bandRows, ++band) {
+                    int rows = std::min(options.bandRows, img.height - y);
+                    Slot& slot = slots[band % kSlots];
+                    Drain(slot);
+                    std::size_t inputBytes = img.RowBytes() * rows;
+                    std::size_t resultBytes = static_cast<std::size_t>(img.width) * rows;
+                    Reserve(slot, slot.input, img.RowBytes() * options.bandRows, CL_MEM_READ_ONLY);
+                    Reserve(slot, slot.output, static_cast<std::size_t>(img.width) * options.bandRows,
+                            CL_MEM_WRITE_ONLY);
+                    StageRows(slot, img, y, rows);
+                    cl_int firstRow = img.top + y;
+                    cl_kernel kernel = slot.gray.get();
+                    SetArguments(kernel, slot.input.device.get(), stride, width, channels, luma, premultiply,
+                                 lookup.get(), bayer, firstRow, slot.output.device.get());
+                    std::size_t global[2] = {static_cast<std::size_t>(img.width), static_cast<std::size_t>(rows)};
+                    Submit(slot, inputBytes,
+                           [&](cl_command_queue queue) {
+                               Check(clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, global, nullptr, 0, nullptr,
+                                                            nullptr),
+                                     "clEnqueueNDRangeKernel");
+                           },
+                           img.data + static_cast<std::size_t>(img.width) * y, resultBytes);
+                }
+                for (Slot& slot : slots) {
+                    Drain(slot);
+                }
+            } catch (...) {
+                DrainAll();
+                throw;
+            }
+        }
+
+        /**
+         * Resizes the image. Bands of output rows are resampled from the input rows they
+         * depend on into a buffer, which is moved to the front of the image at the end.
+         */
+        void Resize(ImageView& img, int outWidth, int outHeight)
+        {
+            DeviceTaps horizontal = Taps(img.width, outWidth);
+            DeviceTaps vertical = Taps(img.height, outHeight);
+            std::vector<unsigned char> result(static_cast<std::size_t>(outWidth) * outHeight);
+            int bandOutput = std::max(1, static_cast<int>(static_cast<long long>(options.bandRows) * outHeight /
+                                                          img.height));
+            // Dithered bands start on multiples of 8 output rows.
+            bandOutput = std::max(8, bandOutput & ~7);
+
+            cl_int width = img.width, channels = img.channels, premultiply = Premultiply(), luma = Luma();
+            cl_int stride = static_cast<cl_int>(img.RowBytes()), bayer = program.bayer ? 1 : 0;
+            cl_int hTaps = horizontal.taps.taps, vTaps = vertical.taps.taps, outW = outWidth;
+            try {
+                for (int y = 0, band = 0; y < outHeight; y += bandOutput, ++band) {
+                    int rows = std::min(bandOutput, outHeight - y);
+                    int top = vertical.taps.first[y];
+                    int bottom = 0;
+                    for (int r = y; r < y + rows; ++r) {
+                        top = std::min(top, vertical.taps.first[r]);
+                        bottom = std::max(bottom, vertical.taps.first[r] + vertical.taps.count[r]);
+                    }
+                    Slot& slot = slots[band % kSlots];
+                    Drain(slot);
+                    std::size_t inputBytes = img.RowBytes() * (bottom - top);
+                    std::size_t resultBytes = static_cast<std::size_t>(outWidth) * rows;
+                    Reserve(slot, slot.input, inputBytes, CL_MEM_READ_ONLY);
+                    Reserve(slot, slot.output, resultBytes, CL_MEM_WRITE_ONLY);
+                    std::size_t columnBytes = sizeof(float) * img.width * rows;
+                    if (slot.columnBytes < columnBytes) {
+                        cl_int status;
+                        slot.columns.reset(
+                            clCreateBuffer(context.get(), CL_MEM_READ_WRITE, columnBytes, nullptr, &status));
+                        Check(status, "clCreateBuffer");
+                        slot.columnBytes = columnBytes;
+                    }
+                    StageRows(slot, img, top, bottom - top);
+
+                    cl_int firstOutput = y, topRow = top;
+                    SetArguments(slot.vertical.get(), slot.input.device.get(), stride, width, channels, luma,
+                                 premultiply, topRow, vertical.first.get(), vertical.count.get(),
+                                 vertical.weights.get(), vTaps, firstOutput, slot.columns.get());
+                    SetArguments(slot.horizontal.get(), slot.columns.get(), width, horizontal.first.get(),
+                                 horizontal.count.get(), horizontal.weights.get(), hTaps, outW, lookup.get(), bayer,
+                                 firstOutput, slot.output.device.get());
+                    std::size_t columnsGlobal[2] = {static_cast<std::size_t>(img.width),
+                                                    static_cast<std::size_t>(rows)};
+                    std::size_t outputGlobal[2] = {static_cast<std::size_t>(outWidth), static_cast<std::size_t>(rows)};
+                    Submit(slot, inputBytes,
+                           [&](cl_command_queue queue) {
+                               Check(clEnqueueNDRangeKernel(queue, slot.vertical.get(), 2, nullptr, columnsGlobal,
+                                                            nullptr, 0, nullptr, nullptr),
+                                     "clEnqueueNDRangeKernel");
+                               Check(clEnqueueNDRangeKernel(queue, slot.horizontal.get(), 2, nullptr, outputGlobal,
+                                                            nullptr, 0, nullptr, nullptr),
+                                     "clEnqueueNDRangeKernel");
+                           },
+                           result.data() + static_cast<std::size_t>(outWidth) * y, resultBytes);
+                }
+                for (Slot& slot : slots) {
+                    Drain(slot);
+                }
+            } catch (...) {
+                DrainAll();
+                throw;
+            }
+            std::memcpy(img.data, result.data(), result.size());
+        }
+
+        /**
+         * @return The taps of shrinking a dimension, on the host and on the device.
+         */
+        DeviceTaps Taps(int in, int out)
+        {
+            DeviceTaps taps;
+            taps.taps = ResizeProcessor::Weigh(in, out, program.resizeOptions.filter);
+            taps.first = Upload(taps.taps.first);
+            taps.count = Upload(taps.taps.count);
+            taps.weights = Upload(taps.taps.weights);
+            return taps;
+        }
+
+        /**
+         * @return The luma mode as the kernels number it: 0 average, 1 BT.601, 2 BT.709.
+         */
+        cl_int Luma() const
+        {
+            return program.gray.luma == LumaMode::Bt601 ? 1 : (program.gray.luma == LumaMode::Bt709 ? 2 : 0);
+        }
+
+        /**
+         * @return 1 if weighted luma is scaled by alpha.
+         */
+        cl_int Premultiply() const
+        {
+            return program.gray.luma != LumaMode::Average && program.gray.alpha == AlphaMode::Premultiply ? 1 : 0;
+        }
+
+        /// The kernels; each mirrors the CPU code named in its comment.
+        static constexpr const char* kSource = R"CL(
+#pragma OPENCL FP_CONTRACT OFF
+
+__constant uchar kBayer[64] = {
+    0, 32, 8, 40, 2, 34, 10, 42, 48, 16, 56, 24, 50, 18, 58, 26, 12, 44, 4, 36, 14, 46, 6, 38,
+    60, 28, 52, 20, 62, 30, 54, 22, 3, 35, 11, 43, 1, 33, 9, 41, 51, 19, 59, 27, 49, 17, 57, 25,
+    15, 47, 7, 39, 13, 45, 5, 37, 63, 31, 55, 23, 61, 29, 53, 21};
+
+/* Kernels::GrayScalar and Kernels::LumaPortable. */
+uint Gray(__global const uchar* p, int channels, int luma, int premultiply)
+{
+    if (channels == 1) {
+        return p[0];
+    }
+    if (luma == 0) {
+        uint sum = 0;
+        for (int c = 0; c < channels; ++c) {
+            sum += p[c];
+        }
+        return sum / channels;
+    }
+    uint y = p[0];
+    if (channels >= 3) {
+        y = luma == 1 ? (p[0] * 77u + p[1] * 150u + p[2] * 29u + 128u) >> 8
+                      : (p[0] * 54u + p[1] * 183u + p[2] * 19u + 128u) >> 8;
+    }
+    if (premultiply && channels % 2 == 0) {
+        uint t = y * p[channels - 1] + 128u;
+        y = (t + (t >> 8)) >> 8;
+    }
+    return y;
+}
+
+/* LookupStage followed by OrderedDitherProcessor's DitherStage. */
+uchar Finish(uint v, __global const uchar* lookup, int bayer, int x, int y)
+{
+    v = lookup[v];
+    if (bayer) {
+        v = v >= kBayer[(y & 7) * 8 + (x & 7)] * 4u + 2u ? 255u : 0u;
+    }
+    return (uchar)v;
+}
+
+__kernel void gray_rows(__global const uchar* src, int stride, int width, int channels, int luma, int premultiply,
+                        __global const uchar* lookup, int bayer, int firstRow, __global uchar* dst)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+    uint v = Gray(src + (size_t)y * stride + (size_t)x * channels, channels, luma, premultiply);
+    dst[(size_t)y * width + x] = Finish(v, lookup, bayer, x, firstRow + y);
+}
+
+/* The accumulation of ResizeProcessor::Resize: input rows in order, each weighted. */
+__kernel void resize_vertical(__global const uchar* src, int stride, int width, int channels, int luma,
+                              int premultiply, int top, __global const int* first, __global const int* count,
+                              __global const float* weights, int taps, int firstOutput, __global float* columns)
+{
+    int x = get_global_id(0), y = get_global_id(1), row = firstOutput + y;
+    float sum = 0.0f;
+    for (int k = 0; k < count[row]; ++k) {
+        __global const uchar* p = src + (size_t)(first[row] + k - top) * stride + (size_t)x * channels;
+        sum += weights[row * taps + k] * (float)Gray(p, channels, luma, premultiply);
+    }
+    columns[(size_t)y * width + x] = sum;
+}
+
+/* The horizontal pass of ResizeProcessor::Resize and its Narrow. */
+__kernel void resize_horizontal(__global const float* columns, int width, __global const int* first,
+                                __global const int* count, __global const float* weights, int taps, int outWidth,
+                                __global const uchar* lookup, int bayer, int firstOutput, __global uchar* dst)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+    __global const float* in = columns + (size_t)y * width + first[x];
+    __global const float* w = weights + (size_t)x * taps;
+    float sum = 0.0f;
+    for (int k = 0; k < count[x]; ++k) {
+        sum += w[k] * in[k];
+    }
+    uint v = (uint)(clamp(sum, 0.0f, 255.0f) + 0.5f);
+    dst[(size_t)y * outWidth + x] = Finish(v, lookup, bayer, x, firstOutput + y);
+}
+)CL";
+    };
+} // namespace bwconv
+#endif
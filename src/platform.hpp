@@ -0,0 +1,29 @@
+/**
+ * @file platform.hpp
+ * @brief Detection of the operating system and compiler facilities the converter can use.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BWCONV_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Compiles the function once per x86-64 microarchitecture level and lets the loader pick
+ * the best for the running CPU, so one binary vectorizes loops with AVX-512 or AVX2
+ * where they exist. Applied to loops the compiler vectorizes on its own; the hand-written
+ * kernels dispatch themselves. CMake enables it with BWCONV_MULTIVERSION.
+ */
+#if defined(BWCONV_MULTIVERSION) && defined(__GNUC__) && defined(__x86_64__)
+#define BWCONV_CLONES __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "arch=x86-64-v2", "default")))
+#else
+#define BWCONV_CLONES
+#endif
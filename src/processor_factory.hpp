@@ -0,0 +1,120 @@
+/**
+ * @file processor_factory.hpp
+ * @brief Builds the processing pipeline from a description of the steps, for the command
+ *        line and the C API alike.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "auto_contrast_processor.hpp"
+#include "bilevel_processor.hpp"
+#include "black_and_white_processor.hpp"
+#include "lookup_processor.hpp"
+#include "processor_pipeline.hpp"
+#include "resize_processor.hpp"
+#include "thread_pool.hpp"
+
+#include <cstddef>
+#include <memory>
+
+namespace bwconv
+{
+    /**
+     * Reductions of the gray image to black and white.
+     */
+    enum class BilevelMode
+    {
+        None,           ///< Keep the gray levels.
+        Threshold,      ///< Fixed threshold, see ThresholdProcessor.
+        Otsu,           ///< Threshold chosen per image.
+        Bayer,          ///< 8x8 ordered dither.
+        FloydSteinberg, ///< Floyd-Steinberg error diffusion.
+        Atkinson        ///< Atkinson error diffusion.
+    };
+
+    /**
+     * @struct ProcessingOptions
+     * @brief The steps applied to every image, in the order gray conversion (with resize),
+     *        auto-contrast, inversion and bilevel reduction.
+     */
+    struct ProcessingOptions
+    {
+        GrayOptions gray;                        ///< Settings of the gray conversion.
+        bool resize = false;                     ///< Shrink to fit resizeOptions.
+        ResizeOptions resizeOptions;             ///< Bounding box and filter of the resize.
+        bool autoContrast = false;               ///< Stretch the gray levels to the full range.
+        double autoContrastClip = 0.005;         ///< Fraction of samples auto-contrast ignores at either end.
+        bool invert = false;                     ///< Invert the gray image.
+        BilevelMode bilevel = BilevelMode::None; ///< Reduction to black and white.
+        int threshold = 128;                     ///< Level of BilevelMode::Threshold, 1 to 255.
+        std::size_t grainRows = 0;               ///< Rows per tile; zero sizes tiles to the L2 cache.
+        bool histogram = false;                  ///< Count the gray levels into the conversion record.
+    };
+
+    /**
+     * Builds the pipeline of the described steps. The steps are chained in a
+     * ProcessorPipeline, which fuses the per-pixel ones into one pass. Steps that need the
+     * gray histogram, auto-contrast and Otsu's method, do the gray conversion themselves
+     * when they come first, so the histogram is counted while the gray levels are written.
+     * If requested, the first step counts the gray levels for the conversion record as well.
+     *
+     * @param pool The pool the processors run on.
+     * @param options The steps.
+     * @return The pipeline.
+     * @throws std::runtime_error if the resize bounds or the auto-contrast clip are invalid.
+     */
+    inline std::unique_ptr<ProcessorPipeline> CreateProcessorPipeline(ThreadPool& pool,
+                                                                      const ProcessingOptions& options)
+    {
+        std::size_t grainRows = options.grainRows;
+        const GrayOptions& gray = options.gray;
+        auto pipeline = std::make_unique<ProcessorPipeline>(pool, grainRows);
+        bool otsuFirst = options.bilevel == BilevelMode::Otsu && !options.resize && !options.autoContrast &&
+                         !options.invert;
+        if (options.resize) {
+            // The gray conversion runs inside the resampler, so it never covers the full size.
+            auto resize = std::make_unique<ResizeProcessor>(pool, options.resizeOptions, grainRows, gray);
+            resize->SetCollectHistogram(options.histogram);
+            pipeline->Add(std::move(resize));
+        } else if (!options.autoContrast && !otsuFirst) {
+            auto grayProcessor = std::make_unique<BlackAndWhiteProcessor>(pool, grainRows, gray);
+            grayProcessor->SetCollectHistogram(options.histogram);
+            pipeline->Add(std::move(grayProcessor));
+        }
+        if (options.autoContrast) {
+            auto autoContrast =
+                std::make_unique<AutoContrastProcessor>(pool, options.autoContrastClip, grainRows, gray);
+            autoContrast->SetCollectHistogram(options.histogram && !options.resize);
+            pipeline->Add(std::move(autoContrast));
+        }
+        if (options.invert) {
+            pipeline->Add(std::make_unique<LookupProcessor>(pool, LookupProcessor::InvertTable(), grainRows));
+        }
+        switch (options.bilevel) {
+        case BilevelMode::Threshold:
+        case BilevelMode::Otsu: {
+            auto threshold = std::make_unique<ThresholdProcessor>(
+                pool, options.bilevel == BilevelMode::Otsu ? 0 : options.threshold, grainRows, gray);
+            threshold->SetCollectHistogram(options.histogram && otsuFirst);
+            pipeline->Add(std::move(threshold));
+            break;
+        }
+        case BilevelMode::Bayer:
+            pipeline->Add(std::make_unique<OrderedDitherProcessor>(pool, grainRows, gray));
+            break;
+        case BilevelMode::FloydSteinberg:
+        case BilevelMode::Atkinson: {
+            auto kernel = options.bilevel == BilevelMode::Atkinson ? DiffusionKernel::Atkinson
+                                                                   : DiffusionKernel::FloydSteinberg;
+            pipeline->Add(std::make_unique<ErrorDiffusionProcessor>(pool, kernel, grainRows, gray));
+            break;
+        }
+        case BilevelMode::None:
+            break;
+        }
+        return pipeline;
+    }
+} // namespace bwconv
@@ -0,0 +1,293 @@
+/**
+ * @file processor_pipeline.hpp
+ * @brief Chains processors and fuses their per-pixel steps into a single pass.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "image_processor.hpp"
+#include "row_stage.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @class ProcessorPipeline
+     * @brief Applies a sequence of processors to an image, touching every pixel once for
+     *        each run of processors that can be fused.
+     *
+     * When processors are added, the pipeline plans their execution. The RowStages of
+     * consecutive processors are joined into fused segments, and consecutive lookup stages
+     * are folded into a single table. Processors without row stages, such as error
+     * diffusion, separate the segments and run on the whole image. A fused segment moves
+     * through the image in tiles of rows. Each row passes through all of its stages while
+     * it is in the L1 cache and is then written to its final place. A segment made of a
+     * single processor runs that processor's own ProcessImage.
+     *
+     * Kernels are chosen once per segment and image. Nothing is decided per pixel.
+     */
+    class ProcessorPipeline : public ImageProcessor
+    {
+    public:
+        /**
+         * @param pool The thread pool used to process tiles of fused segments concurrently.
+         * @param grainRows Rows per tile; zero picks a tile size that fits in the L2 cache.
+         */
+        explicit ProcessorPipeline(ThreadPool& pool, std::size_t grainRows = 0) : pool(pool), grainRows(grainRows) {}
+
+        /**
+         * Appends a processor and plans the pipeline again. Must not be called while images
+         * are being processed.
+         *
+         * @param processor The processor to apply after those added before.
+         * @return The pipeline, for chaining.
+         */
+        ProcessorPipeline& Add(std::unique_ptr<ImageProcessor> processor)
+        {
+            processors.push_back(std::move(processor));
+            Plan();
+            return *this;
+        }
+
+        /**
+         * The decoder can only produce what the first processor would receive.
+         */
+        int DesiredChannels() const override { return processors.empty() ? 0 : processors.front()->DesiredChannels(); }
+
+        /**
+         * Later processors work on whatever size the first one produces.
+         */
+        int DecodeReduction(int width, int height) const override
+        {
+            return processors.empty() ? 1 : processors.front()->DecodeReduction(width, height);
+        }
+
+        /**
+         * The members' fingerprints in order; empty if any member's is.
+         */
+        std::string Fingerprint() const override
+        {
+            std::string fingerprint = "pipeline";
+            for (const auto& processor : processors) {
+                std::string member = processor->Fingerprint();
+                if (member.empty()) {
+                    return std::string();
+                }
+                fingerprint += "(" + member + ")";
+            }
+            return fingerprint;
+        }
+
+        bool IsRowLocal() const override
+        {
+            return std::all_of(processors.begin(), processors.end(),
+                               [](const std::unique_ptr<ImageProcessor>& p) { return p->IsRowLocal(); });
+        }
+
+        /**
+         * A pipeline planned as one fused segment can itself be fused into another pipeline.
+         */
+        std::vector<const RowStage*> RowStages() const override
+        {
+            if (plan.size() == 1 && !plan.front().stages.empty()) {
+                return plan.front().stages;
+            }
+            return {};
+        }
+
+        /**
+         * Runs the planned segments in order. Row stages work on bytes, so 16-bit and float
+         * images are passed through the processors one by one instead.
+         *
+         * @param img View of the image to be processed; describes the result on return.
+         * @throws std::runtime_error if a stage would add channels.
+         */
+        void ProcessImage(ImageView& img) override
+        {
+            for (const Segment& segment : plan) {
+                if (segment.members.size() == 1 || img.sample != SampleType::U8) {
+                    for (ImageProcessor* member : segment.members) {
+                        member->ProcessImage(img);
+                    }
+                } else {
+                    RunFused(segment, img);
+                }
+            }
+        }
+
+    private:
+        /**
+         * A run of processors applied as fused row stages, or a single processor.
+         */
+        struct Segment
+        {
+            std::vector<ImageProcessor*> members; ///< The processors the segment stands for.
+            std::vector<const RowStage*> stages;  ///< Their stages with lookups folded; empty if not fused.
+        };
+
+        /// Bytes read and written per tile when the grain is chosen automatically.
+        static constexpr std::size_t kTileBytes = 256 * 1024;
+
+        ThreadPool& pool;                                        ///< Pool shared with the rest of the conversion.
+        std::size_t grainRows;                                   ///< Rows per tile, zero for automatic.
+        std::vector<std::unique_ptr<ImageProcessor>> processors; ///< The processors in order.
+        std::vector<std::unique_ptr<LookupStage>> folded;        ///< Tables composed from consecutive lookups.
+        std::vector<Segment> plan;                               ///< Execution order decided by Plan.
+
+        /**
+         * Splits the processors into segments and folds consecutive lookup stages.
+         */
+        void Plan()
+        {
+            plan.clear();
+            folded.clear();
+            Segment fused;
+            std::array<unsigned char, 256> table{};
+            const RowStage* lookup = nullptr; // Last stage of fused while it is a lookup.
+            bool composed = false;            // table holds several lookups.
+            int channels = 0;                 // Channels after the stages so far, 0 while they depend on the input.
+
+            auto finishLookup = [&] {
+                if (composed) {
+                    folded.push_back(std::make_unique<LookupStage>(table));
+                    fused.stages.back() = folded.back().get();
+                }
+                lookup = nullptr;
+                composed = false;
+            };
+            auto finishFused = [&] {
+                finishLookup();
+                if (!fused.members.empty()) {
+                    plan.push_back(std::move(fused));
+                    fused = Segment();
+                }
+            };
+
+            for (const std::unique_ptr<ImageProcessor>& processor : processors) {
+                std::vector<const RowStage*> stages = processor->RowStages();
+                if (stages.empty()) {
+                    finishFused();
+                    plan.push_back(Segment{{processor.get()}, {}});
+                    channels = 0;
+                    continue;
+                }
+                fused.members.push_back(processor.get());
+                for (const RowStage* stage : stages) {
+                    // Stages known to leave the rows unchanged, such as the gray conversion of a
+                    // bilevel processor after another one, are dropped so lookups around them fold.
+                    if (channels != 0 && !stage->Bind(channels)) {
+                        continue;
+                    }
+                    channels = OutputChannels(*stage, channels);
+                    std::array<unsigned char, 256> next;
+                    if (!stage->Lookup(next)) {
+                        finishLookup();
+                        fused.stages.push_back(stage);
+                    } else if (lookup == nullptr) {
+                        table = next;
+                        lookup = stage;
+                        fused.stages.push_back(stage);
+                    } else {
+                        for (unsigned char& v : table) {
+                            v = next[v];
+                        }
+                        composed = true;
+                    }
+                }
+            }
+            finishFused();
+        }
+
+        /**
+         * @param stage A stage.
+         * @param channels Channels of its input, 0 if unknown.
+         * @return Channels of its output, 0 if unknown.
+         */
+        static int OutputChannels(const RowStage& stage, int channels)
+        {
+            if (channels != 0) {
+                return stage.OutputChannels(channels);
+            }
+            int out = stage.OutputChannels(1);
+            for (int c = 2; c <= 4; ++c) {
+                out = stage.OutputChannels(c) == out ? out : 0;
+            }
+            return out;
+        }
+
+        /**
+         * Applies the stages of a segment row by row. All but the last stage work in the
+         * input row; the last one writes the row to its place in the result, which may be
+         * narrower and is then packed, so rows are ordered as in ForEachRowInPlace.
+         */
+        void RunFused(const Segment& segment, ImageView& img)
+        {
+            std::vector<RowFunction> functions;
+            int channels = img.channels;
+            bool bilevel = img.bilevel;
+            for (const RowStage* stage : segment.stages) {
+                int outChannels = stage->OutputChannels(channels);
+                if (outChannels > channels) {
+                    throw std::runtime_error("A row stage cannot add channels");
+                }
+                RowFunction function = stage->Bind(channels);
+                std::array<unsigned char, 256> table;
+                if (stage->ProducesBilevel()) {
+                    bilevel = true;
+                } else if (stage->Lookup(table)) {
+                    // Of a bilevel input, only the entries of 0 and 255 are used.
+                    auto isBilevel = [](unsigned char v) { return v == 0 || v == 255; };
+                    bilevel = bilevel && isBilevel(table[0]) && isBilevel(table[255]);
+                } else if (function) {
+                    bilevel = false;
+                }
+                if (function) {
+                    functions.push_back(std::move(function));
+                    channels = outChannels;
+                }
+            }
+
+            ImageView input = img;
+            ImageView output = img;
+            if (channels != input.channels) {
+                output = ImageView{img.data, img.width, img.height, static_cast<std::size_t>(img.width) * channels,
+                                   channels};
+                output.top = img.top;
+            }
+            output.bilevel = bilevel;
+            if (functions.empty()) {
+                img = output;
+                return;
+            }
+
+            std::size_t grain = grainRows != 0 ? grainRows
+                                               : std::max<std::size_t>(1, kTileBytes / std::max<std::size_t>(
+                                                                                           1, input.RowBytes() +
+                                                                                                  output.RowBytes()));
+            const std::size_t last = functions.size() - 1;
+            ForEachRowInPlace(pool, static_cast<std::size_t>(input.height), input.stride, output.stride, grain,
+                              [&](std::size_t firstRow, std::size_t lastRow) {
+                                  for (std::size_t y = firstRow; y < lastRow; ++y) {
+                                      int row = static_cast<int>(y);
+                                      unsigned char* src = input.Row(row);
+                                      for (std::size_t i = 0; i < last; ++i) {
+                                          functions[i](src, src, input.width, input.top + row);
+                                      }
+                                      functions[last](src, output.Row(row), input.width, input.top + row);
+                                  }
+                              });
+            img = output;
+        }
+    };
+} // namespace bwconv
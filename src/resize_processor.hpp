@@ -0,0 +1,443 @@
+/**
+ * @file resize_processor.hpp
+ * @brief Grayscale conversion fused with downscaling, for thumbnails and previews.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "black_and_white_processor.hpp"
+#include "buffer_pool.hpp"
+#include "histogram.hpp"
+#include "image_processor.hpp"
+#include "kernels.hpp"
+#include "platform.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "wide_kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * Reconstruction filters of the resampler, from fastest to sharpest.
+     */
+    enum class ResizeFilter
+    {
+        Box,      ///< Mean of the input pixels each output pixel covers, weighted by overlap.
+        Bilinear, ///< Triangle filter, widened by the scale so downscaling does not alias.
+        Lanczos3  ///< Three-lobed windowed sinc; sharpest, with slight ringing at edges.
+    };
+
+    /**
+     * Settings of the resize step.
+     */
+    struct ResizeOptions
+    {
+        int width = 0;                                ///< Largest output width, 0 for no bound.
+        int height = 0;                               ///< Largest output height, 0 for no bound.
+        ResizeFilter filter = ResizeFilter::Bilinear; ///< The reconstruction filter.
+    };
+
+    /**
+     * @class ResizeProcessor
+     * @brief Converts images to gray and shrinks them to fit a bounding box in one pass.
+     *
+     * The output keeps the input's aspect ratio and is never larger than the input. The
+     * filter is separable: every input row is converted to gray while it is in the L1
+     * cache and added, weighted, to the full-width accumulators of the output rows it
+     * contributes to; a finished accumulator is then resampled horizontally. Full-size
+     * gray is never written, so the pass reads the decoded image once and writes only the
+     * small result. Tiles of output rows are resampled on the pool independently;
+     * neighbouring tiles share a few input rows, which both convert.
+     *
+     * The processor also tells JPEG decoders to shrink by up to 8 in the DCT domain while
+     * the result stays at least as large as the output, which removes most of the decoding
+     * work of thumbnails; the resampler then only covers the remaining factor.
+     */
+    class ResizeProcessor : public ImageProcessor
+    {
+    public:
+        /**
+         * @param pool The thread pool used to process tiles of the image concurrently.
+         * @param options Bounding box and filter.
+         * @param grainRows Output rows per tile; zero picks a tile size that fits in the L2 cache.
+         * @param gray Settings of the gray conversion.
+         * @throws std::runtime_error if the box has no bound or a negative one.
+         */
+        ResizeProcessor(ThreadPool& pool, const ResizeOptions& options, std::size_t grainRows = 0,
+                        const GrayOptions& gray = GrayOptions())
+            : pool(pool), options(options), grainRows(grainRows), gray(gray), fullSize(pool, grainRows, gray)
+        {
+            if (options.width < 0 || options.height < 0 || (options.width == 0 && options.height == 0)) {
+                throw std::runtime_error("Invalid resize bounds");
+            }
+        }
+
+        /**
+         * Computes the size of the output for an input.
+         *
+         * @param width Input width.
+         * @param height Input height.
+         * @param options The bounding box.
+         * @param outWidth Receives the output width.
+         * @param outHeight Receives the output height.
+         */
+        static void FitSize(int width, int height, const ResizeOptions& options, int& outWidth, int& outHeight)
+        {
+            double scale = 1.0;
+            if (options.width > 0) {
+                scale = std::min(scale, static_cast<double>(options.width) / width);
+            }
+            if (options.height > 0) {
+                scale = std::min(scale, static_cast<double>(options.height) / height);
+            }
+            outWidth = std::clamp(static_cast<int>(std::lround(width * scale)), 1, width);
+            outHeight = std::clamp(static_cast<int>(std::lround(height * scale)), 1, height);
+            // The bounding dimension is met exactly, without rounding drift.
+            if (options.width > 0 && options.width < width && scale == static_cast<double>(options.width) / width) {
+                outWidth = options.width;
+            }
+            if (options.height > 0 && options.height < height &&
+                scale == static_cast<double>(options.height) / height) {
+                outHeight = options.height;
+            }
+        }
+
+        /**
+         * Taps of a one-dimensional resampling: output pixel i is the sum over k below
+         * count[i] of weights[i * taps + k] times input pixel first[i] + k.
+         */
+        struct Contributions
+        {
+            std::vector<int> first;     ///< First input pixel of every output pixel.
+            std::vector<int> count;     ///< Number of input pixels of every output pixel.
+            std::vector<float> weights; ///< Normalized weights, taps per output pixel.
+            int taps = 0;               ///< Stride of weights.
+        };
+
+        /**
+         * Computes the taps of shrinking a dimension. The filter is stretched by the scale,
+         * so it averages over every input pixel an output pixel covers.
+         *
+         * @param in Input size.
+         * @param out Output size, at most in.
+         * @param filter The filter.
+         * @return The taps.
+         */
+        static Contributions Weigh(int in, int out, ResizeFilter filter)
+        {
+            double scale = static_cast<double>(in) / out;
+            double support = Support(filter) * scale;
+            Contributions c;
+            c.taps = static_cast<int>(std::ceil(support * 2)) + 3;
+            c.first.resize(out);
+            c.count.resize(out);
+            c.weights.assign(static_cast<std::size_t>(out) * c.taps, 0.0f);
+            for (int i = 0; i < out; ++i) {
+                double center = (i + 0.5) * scale;
+                int lo = std::max(0, static_cast<int>(std::floor(center - support)));
+                int hi = std::min(in, static_cast<int>(std::ceil(center + support)) + 1);
+                float* w = &c.weights[static_cast<std::size_t>(i) * c.taps];
+                float sum = 0.0f;
+                int used = 0;
+                for (int j = lo; j < hi && used < c.taps; ++j) {
+                    w[used] = filter == ResizeFilter::Box ? Coverage(j, center - support, center + support)
+                                                          : Kernel((j + 0.5 - center) / scale, filter);
+                    sum += w[used++];
+                }
+                // Trim zero weights so the inner loops skip them.
+                int start = 0;
+                while (start < used - 1 && w[start] == 0.0f) {
+                    ++start;
+                }
+                while (used > start + 1 && w[used - 1] == 0.0f) {
+                    --used;
+                }
+                std::memmove(w, w + start, sizeof(float) * (used - start));
+                std::fill(w + (used - start), w + c.taps, 0.0f);
+                c.first[i] = lo + start;
+                c.count[i] = used - start;
+                for (int k = 0; k < c.count[i]; ++k) {
+                    w[k] = sum != 0.0f ? w[k] / sum : 1.0f / c.count[i];
+                }
+            }
+            return c;
+        }
+
+        int DesiredChannels() const override { return fullSize.DesiredChannels(); }
+
+        std::string Fingerprint() const override
+        {
+            static const char* const filters[] = {"box-area", "bilinear", "lanczos3"};
+            return "resize:" + std::to_string(options.width) + "x" + std::to_string(options.height) + ":" +
+                   filters[static_cast<int>(options.filter)] + ":" + fullSize.Fingerprint();
+        }
+
+        /**
+         * Counts the gray levels of every output into the conversion record, see
+         * BlackAndWhiteProcessor::SetCollectHistogram. Each output row is counted as soon as
+         * it is resampled.
+         *
+         * @param collect Whether to count.
+         */
+        void SetCollectHistogram(bool collect)
+        {
+            collectHistogram = collect;
+            fullSize.SetCollectHistogram(collect);
+        }
+
+        /**
+         * Lets the decoder shrink by the largest power of two up to 8 that keeps both
+         * dimensions at least as large as the output.
+         */
+        int DecodeReduction(int width, int height) const override
+        {
+            int outWidth, outHeight;
+            FitSize(width, height, options, outWidth, outHeight);
+            int factor = 8;
+            while (factor > 1 &&
+                   ((width + factor - 1) / factor < outWidth || (height + factor - 1) / factor < outHeight)) {
+                factor /= 2;
+            }
+            return factor;
+        }
+
+        /**
+         * Converts the image to gray at its output size. The result is written to the front
+         * of the image's memory and keeps the input's sample type.
+         *
+         * @param img View of the image to be processed; describes the result on return.
+         * @throws std::runtime_error if no gray kernel handles the channel count.
+         */
+        void ProcessImage(ImageView& img) override
+        {
+            int outWidth, outHeight;
+            FitSize(img.width, img.height, options, outWidth, outHeight);
+            if (outWidth == img.width && outHeight == img.height) {
+                fullSize.ProcessImage(img);
+                return;
+            }
+
+            Stats::ConversionStats* stats = collectHistogram ? Stats::ConversionStats::Current() : nullptr;
+            HistogramCollector* histogram = stats != nullptr ? &stats->GrayHistogram() : nullptr;
+            if (img.sample == SampleType::U16) {
+                Resize<std::uint16_t>(img, outWidth, outHeight, WideRows<std::uint16_t>(img.channels), histogram);
+            } else if (img.sample == SampleType::F32) {
+                Resize<float>(img, outWidth, outHeight, WideRows<float>(img.channels), histogram);
+            } else {
+                Kernels::GrayKernel kernel = Kernels::SelectGrayKernel(img.channels, gray.luma, gray.alpha);
+                int channels = img.channels;
+                Resize<unsigned char>(img, outWidth, outHeight,
+                                      [kernel, channels](const unsigned char* src, unsigned char* dst,
+                                                         std::size_t pixels) {
+                                          if (kernel != nullptr) {
+                                              kernel(src, dst, pixels);
+                                          } else {
+                                              Kernels::GrayScalar(src, dst, pixels, channels);
+                                          }
+                                      },
+                                      histogram);
+            }
+        }
+
+    private:
+        /// Bytes of input rows per tile when the grain is chosen automatically.
+        static constexpr std::size_t kTileBytes = 256 * 1024;
+
+        ThreadPool& pool;                ///< Pool shared with the rest of the conversion.
+        ResizeOptions options;           ///< Bounding box and filter.
+        std::size_t grainRows;           ///< Output rows per tile, zero for automatic.
+        GrayOptions gray;                ///< Settings of the gray conversion.
+        BlackAndWhiteProcessor fullSize; ///< Gray conversion of images that need no resizing.
+        bool collectHistogram = false;   ///< Count output levels into the conversion record.
+
+        /**
+         * @param x Distance from the output pixel's center in units of the output grid.
+         * @param filter The filter; Weigh computes the box's area weights itself.
+         * @return The filter's weight at x.
+         */
+        static float Kernel(double x, ResizeFilter filter)
+        {
+            x = std::fabs(x);
+            switch (filter) {
+            case ResizeFilter::Box:
+                return x < 0.5 ? 1.0f : 0.0f;
+            case ResizeFilter::Bilinear:
+                return x < 1.0 ? static_cast<float>(1.0 - x) : 0.0f;
+            case ResizeFilter::Lanczos3:
+            default:
+                if (x < 1e-8) {
+                    return 1.0f;
+                }
+                if (x >= 3.0) {
+                    return 0.0f;
+                }
+                const double pi = 3.14159265358979323846;
+                return static_cast<float>(3.0 * std::sin(pi * x) * std::sin(pi * x / 3.0) / (pi * pi * x * x));
+            }
+        }
+
+        /**
+         * The box's weight of an input pixel: the part of it inside the output pixel, so
+         * pixels cut by the output's edge count in proportion.
+         *
+         * @param j The input pixel, spanning [j, j + 1).
+         * @param lo Left edge of the output pixel in input coordinates.
+         * @param hi Right edge of the output pixel in input coordinates.
+         * @return The overlap, from 0 to 1.
+         */
+        static float Coverage(int j, double lo, double hi)
+        {
+            return static_cast<float>(std::max(0.0, std::min(j + 1.0, hi) - std::max(static_cast<double>(j), lo)));
+        }
+
+        /**
+         * @return Half the width of a filter in units of the output grid.
+         */
+        static double Support(ResizeFilter filter)
+        {
+            return filter == ResizeFilter::Box ? 0.5 : (filter == ResizeFilter::Bilinear ? 1.0 : 3.0);
+        }
+
+        /**
+         * @param channels Channels per input pixel.
+         * @return The gray kernel for 16-bit or float samples; unused for gray input.
+         * @throws std::runtime_error if no kernel handles the channel count.
+         */
+        template <typename T>
+        Kernels::WideGrayKernel<T> WideRows(int channels) const
+        {
+            Kernels::WideGrayKernel<T> kernel = Kernels::SelectWideGrayKernel<T>(channels, gray.luma, gray.alpha);
+            if (kernel == nullptr && channels != 1) {
+                throw std::runtime_error("Unsupported channel count for high bit depth input");
+            }
+            return kernel;
+        }
+
+        /**
+         * @return value rounded and clamped to the range of T; floats pass unchanged.
+         */
+        template <typename T>
+        static T Narrow(float value)
+        {
+            if constexpr (std::is_same_v<T, float>) {
+                return value;
+            } else {
+                constexpr float top = static_cast<float>(std::numeric_limits<T>::max());
+                return static_cast<T>(std::clamp(value, 0.0f, top) + 0.5f);
+            }
+        }
+
+        /**
+         * Adds a weighted gray row to a row of column sums.
+         *
+         * @param column The sums.
+         * @param src The gray row.
+         * @param weight Weight of the row.
+         * @param width Samples per row.
+         */
+        template <typename T>
+        BWCONV_CLONES static void Accumulate(float* column, const T* src, float weight, std::size_t width)
+        {
+            for (std::size_t x = 0; x < width; ++x) {
+                column[x] += weight * static_cast<float>(src[x]);
+            }
+        }
+
+        /**
+         * Resamples the gray image into a buffer and moves it to the front of the image.
+         *
+         * @param img View of the color image; describes the result on return.
+         * @param outWidth Output width.
+         * @param outHeight Output height.
+         * @param convert Callable invoked as convert(src, dst, pixels) turning a row of img
+         *                into gray samples of type T.
+         * @param histogram Receives the output levels, or nullptr.
+         */
+        template <typename T, typename Convert>
+        void Resize(ImageView& img, int outWidth, int outHeight, Convert convert, HistogramCollector* histogram) const
+        {
+            Contributions horizontal = Weigh(img.width, outWidth, options.filter);
+            Contributions vertical = Weigh(img.height, outHeight, options.filter);
+            PooledVector<T> result(static_cast<std::size_t>(outWidth) * outHeight);
+            bool direct = img.channels == 1;
+
+            auto resampleRows = [&](std::size_t firstRow, std::size_t lastRow) {
+                int top = vertical.first[firstRow];
+                int bottom = vertical.first[lastRow - 1] + vertical.count[lastRow - 1];
+                for (std::size_t y = firstRow; y < lastRow; ++y) {
+                    top = std::min(top, vertical.first[y]);
+                    bottom = std::max(bottom, vertical.first[y] + vertical.count[y]);
+                }
+
+                // Every gray input row is added to the output rows it contributes to at full
+                // width, which vectorizes across x; each finished row is then narrowed.
+                std::size_t tileRows = lastRow - firstRow;
+                PooledVector<float> columns(tileRows * img.width, 0.0f);
+                PooledVector<T> grayRow(direct ? 0 : static_cast<std::size_t>(img.width));
+                for (int r = top; r < bottom; ++r) {
+                    const T* src = reinterpret_cast<const T*>(img.Row(r));
+                    if (!direct) {
+                        convert(src, grayRow.data(), static_cast<std::size_t>(img.width));
+                        src = grayRow.data();
+                    }
+                    for (std::size_t y = firstRow; y < lastRow; ++y) {
+                        int k = r - vertical.first[y];
+                        if (k < 0 || k >= vertical.count[y]) {
+                            continue;
+                        }
+                        Accumulate(&columns[(y - firstRow) * img.width], src, vertical.weights[y * vertical.taps + k],
+                                   static_cast<std::size_t>(img.width));
+                    }
+                }
+
+                const int* first = horizontal.first.data();
+                const int* count = horizontal.count.data();
+                const float* weights = horizontal.weights.data();
+                for (std::size_t y = firstRow; y < lastRow; ++y) {
+                    const float* column = &columns[(y - firstRow) * img.width];
+                    T* out = &result[y * outWidth];
+                    for (int x = 0; x < outWidth; ++x) {
+                        const float* in = column + first[x];
+                        const float* w = weights + static_cast<std::size_t>(x) * horizontal.taps;
+                        float sum = 0.0f;
+                        for (int k = 0; k < count[x]; ++k) {
+                            sum += w[k] * in[k];
+                        }
+                        out[x] = Narrow<T>(sum);
+                    }
+                    if (histogram != nullptr) {
+                        BlackAndWhiteProcessor::CountSamples(out, img.sample, static_cast<std::size_t>(outWidth),
+                                                             *histogram);
+                    }
+                }
+            };
+
+            std::size_t grain = grainRows;
+            if (grain == 0) {
+                std::size_t rowsPerOutput = (static_cast<std::size_t>(img.height) + outHeight - 1) / outHeight;
+                grain = std::max<std::size_t>(1, kTileBytes / std::max<std::size_t>(1, img.RowBytes() * rowsPerOutput));
+            }
+            pool.ParallelFor(0, static_cast<std::size_t>(outHeight), grain, resampleRows);
+
+            // The result is smaller than any input row range, so it fits in front.
+            std::memcpy(img.data, result.data(), result.size() * sizeof(T));
+            SampleType sample = img.sample;
+            img = ImageView{img.data, outWidth, outHeight, static_cast<std::size_t>(outWidth) * sizeof(T), 1};
+            img.sample = sample;
+        }
+    };
+} // namespace bwconv
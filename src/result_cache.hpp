@@ -0,0 +1,197 @@
+/**
+ * @file result_cache.hpp
+ * @brief On-disk cache of converted images keyed by the hash of their input and settings.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "hash.hpp"
+#include "save_strategy.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @class ResultCache
+     * @brief Directory of converted images that lets identical conversions be skipped.
+     *
+     * An entry is named by a 128-bit key, two XXH64 hashes of the encoded input and of the
+     * settings that determine the output, and holds the output file. Entries are written
+     * to a temporary file and renamed into place, and read by copying them to a temporary
+     * file next to the destination that is renamed over it, so any number of threads and
+     * processes can share a directory without locks: a reader sees a whole entry or none.
+     *
+     * The directory is bounded by a size. Every use of an entry updates its modification
+     * time; once the entries stored by this process push the size seen at the last scan
+     * over the bound, the directory is scanned again and the least recently used entries
+     * are removed until a quarter of the bound is free. Processes sharing a directory
+     * evict independently, so it may briefly exceed the bound by their recent stores.
+     */
+    class ResultCache
+    {
+    public:
+        /**
+         * @param directory Directory of the entries; created if missing.
+         * @param capacity Bytes of entries to keep.
+         * @throws std::filesystem::filesystem_error if the directory cannot be created.
+         */
+        ResultCache(const std::string& directory, std::uintmax_t capacity) : directory(directory), capacity(capacity)
+        {
+            std::filesystem::create_directories(this->directory);
+        }
+
+        /**
+         * @param bytes The encoded input.
+         * @param size Size of the input in bytes.
+         * @param settings Everything besides the input that determines the output.
+         * @return The key of the conversion, as 32 hexadecimal digits.
+         */
+        static std::string Key(const unsigned char* bytes, std::size_t size, const std::string& settings)
+        {
+            std::uint64_t settingsHash = Xxh64(settings.data(), settings.size());
+            std::uint64_t words[2] = {Xxh64(bytes, size, settingsHash), Xxh64(bytes, size, ~settingsHash)};
+            static const char digits[] = "0123456789abcdef";
+            std::string key;
+            for (std::uint64_t word : words) {
+                for (int shift = 60; shift >= 0; shift -= 4) {
+                    key += digits[(word >> shift) & 15];
+                }
+            }
+            return key;
+        }
+
+        /**
+         * Copies the cached output of a conversion to its destination, replacing any file there.
+         *
+         * @param key Key of the conversion.
+         * @param destination Path of the output.
+         * @return true on a hit, false if there is no entry or it could not be copied.
+         */
+        bool Fetch(const std::string& key, const std::string& destination)
+        {
+            namespace fs = std::filesystem;
+            fs::path entry = EntryPath(key, destination);
+            std::string temporary = SaveFile::TemporaryPath(destination);
+            std::error_code error;
+            if (!fs::copy_file(entry, temporary, fs::copy_options::overwrite_existing, error) ||
+                std::rename(temporary.c_str(), destination.c_str()) != 0) {
+                fs::remove(temporary, error);
+                return false;
+            }
+            fs::last_write_time(entry, fs::file_time_type::clock::now(), error);
+            return true;
+        }
+
+        /**
+         * Adds the output of a conversion. Failures only cost the entry, so they are ignored.
+         *
+         * @param key Key of the conversion.
+         * @param output Path of the output just written.
+         */
+        void Store(const std::string& key, const std::string& output)
+        {
+            namespace fs = std::filesystem;
+            fs::path entry = EntryPath(key, output);
+            std::error_code error;
+            fs::create_directories(entry.parent_path(), error);
+            std::string temporary = SaveFile::TemporaryPath(entry.string());
+            std::uintmax_t size = fs::file_size(output, error);
+            if (error || !fs::copy_file(output, temporary, error) ||
+                std::rename(temporary.c_str(), entry.string().c_str()) != 0) {
+                fs::remove(temporary, error);
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!scanned) {
+                Evict();
+            } else {
+                used += size;
+                if (used > capacity) {
+                    Evict();
+                }
+            }
+        }
+
+    private:
+        /**
+         * @return Where the entry of a key and an output's extension lives. Keys are spread
+         *         over 256 subdirectories to keep directories small.
+         */
+        std::filesystem::path EntryPath(const std::string& key, const std::string& output) const
+        {
+            return directory / key.substr(0, 2) / (key + std::filesystem::path(output).extension().string());
+        }
+
+        /**
+         * Scans the directory and, if it exceeds the capacity, removes the least recently
+         * used entries until at most three quarters of the capacity are used. Temporary
+         * files of writers that died are removed once they are a day old. The caller holds
+         * the mutex.
+         */
+        void Evict()
+        {
+            namespace fs = std::filesystem;
+            std::vector<std::tuple<fs::file_time_type, std::uintmax_t, fs::path>> entries;
+            std::error_code error;
+            used = 0;
+            auto stale = fs::file_time_type::clock::now() - std::chrono::hours(24);
+            for (fs::recursive_directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+                if (!it->is_regular_file(error)) {
+                    error.clear();
+                    continue;
+                }
+                fs::file_time_type time = it->last_write_time(error);
+                std::uintmax_t size = it->file_size(error);
+                if (error) {
+                    error.clear();
+                    continue;
+                }
+                if (it->path().filename().string().find(".tmp") != std::string::npos) {
+                    if (time < stale) {
+                        fs::remove(it->path(), error);
+                        error.clear();
+                    }
+                    continue;
+                }
+                entries.emplace_back(time, size, it->path());
+                used += size;
+            }
+            scanned = true;
+
+            if (used <= capacity) {
+                return;
+            }
+            std::sort(entries.begin(), entries.end());
+            std::uintmax_t target = capacity / 4 * 3;
+            for (const auto& [time, size, path] : entries) {
+                if (used <= target) {
+                    break;
+                }
+                // An entry another process removed first counts as removed all the same.
+                fs::remove(path, error);
+                used -= size;
+            }
+        }
+
+        std::filesystem::path directory; ///< Directory of the entries.
+        std::uintmax_t capacity;         ///< Bytes of entries to keep.
+        std::mutex mutex;                ///< Guards the members below.
+        std::uintmax_t used = 0;         ///< Bytes of entries at the last scan plus those stored since.
+        bool scanned = false;            ///< Whether the directory has been scanned.
+    };
+} // namespace bwconv
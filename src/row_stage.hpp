@@ -0,0 +1,182 @@
+/**
+ * @file row_stage.hpp
+ * @brief Per-pixel processing steps that a ProcessorPipeline fuses into a single pass, and
+ *        the in-place row traversal they share with the processors.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "kernels.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * Processes one row from src into dst, which may be the same memory.
+     * Invoked as function(src, dst, width, y) with the row's index in the whole image, that is
+     * ImageView::top plus its index within the view, so that a band is processed like those rows.
+     */
+    using RowFunction = std::function<void(const unsigned char*, unsigned char*, int, int)>;
+
+    /**
+     * @class RowStage
+     * @brief Per-pixel part of an ImageProcessor: every output row depends only on the same
+     *        input row and never has more bytes than it.
+     *
+     * Processors that consist of such steps list them in ImageProcessor::RowStages, which
+     * lets a ProcessorPipeline run several processors row by row in one traversal while the
+     * row is still in the cache, instead of one full pass over the image per processor.
+     */
+    class RowStage
+    {
+    public:
+        /**
+         * @param channels Channels per input pixel.
+         * @return Channels per output pixel; at most the input's.
+         */
+        virtual int OutputChannels(int channels) const { return channels; }
+
+        /**
+         * Describes stages that map every sample through a table, independent of its
+         * position and channel. Consecutive table stages are folded into one.
+         *
+         * @param table Receives the output value of every input value.
+         * @return true if the stage is such a lookup.
+         */
+        virtual bool Lookup(std::array<unsigned char, 256>& table) const
+        {
+            (void)table;
+            return false;
+        }
+
+        /**
+         * @return true if every output sample is 0 or 255 whatever the input.
+         */
+        virtual bool ProducesBilevel() const { return false; }
+
+        /**
+         * Selects the row function for an input layout. Called once per image, so the
+         * choice of kernel is not repeated for every row.
+         *
+         * @param channels Channels per input pixel.
+         * @return The row function, or an empty function if the stage leaves such rows unchanged.
+         */
+        virtual RowFunction Bind(int channels) const = 0;
+
+        virtual ~RowStage() = default;
+    };
+
+    /**
+     * @class LookupStage
+     * @brief Replaces every sample by its entry in a 256-entry table.
+     */
+    class LookupStage : public RowStage
+    {
+    public:
+        /**
+         * @param table Output value of every input value.
+         */
+        explicit LookupStage(const std::array<unsigned char, 256>& table) : table(table) {}
+
+        bool Lookup(std::array<unsigned char, 256>& out) const override
+        {
+            out = table;
+            return true;
+        }
+
+        bool ProducesBilevel() const override
+        {
+            return std::all_of(table.begin(), table.end(), [](unsigned char v) { return v == 0 || v == 255; });
+        }
+
+        /**
+         * Tables that are a single step, such as thresholds, are applied with a SIMD
+         * comparison instead of a lookup per sample.
+         */
+        RowFunction Bind(int channels) const override
+        {
+            bool identity = true;
+            int step = 0;
+            for (int v = 0; v < 256; ++v) {
+                identity = identity && table[v] == v;
+                step = table[v] != table[0] && step == 0 ? v : step;
+            }
+            if (identity) {
+                return RowFunction();
+            }
+            bool isStep = step != 0 && std::all_of(table.begin() + step, table.end(),
+                                                   [&](unsigned char v) { return v == table[step]; });
+            if (isStep) {
+                unsigned char level = static_cast<unsigned char>(step), low = table[0], high = table[step];
+                return [level, low, high, channels](const unsigned char* src, unsigned char* dst, int width, int) {
+                    Kernels::StepSamples(src, dst, static_cast<std::size_t>(width) * channels, level, low, high);
+                };
+            }
+            const unsigned char* values = table.data();
+            return [values, channels](const unsigned char* src, unsigned char* dst, int width, int) {
+                std::size_t samples = static_cast<std::size_t>(width) * channels;
+                for (std::size_t i = 0; i < samples; ++i) {
+                    dst[i] = values[src[i]];
+                }
+            };
+        }
+
+    private:
+        std::array<unsigned char, 256> table; ///< Output value of every input value.
+    };
+
+    /**
+     * Runs body over all rows of an image that is rewritten in place, where each input row
+     * of inStride bytes is replaced by an output row of outStride bytes.
+     *
+     * With equal strides every row is independent. With shorter output rows the work is
+     * ordered in waves. The first rows are converted by one thread, which is safe because a
+     * row's output never lies behind its own input. Once rows [0, a) are done, rows [a, b)
+     * can run in parallel as long as their output ends before their input starts, i.e.
+     * b * outStride <= a * inStride. Each wave is therefore larger than the previous one by
+     * the stride ratio, and the thread pool distributes its row tiles by range stealing.
+     * Thread utilization is reported to the current conversion.
+     *
+     * @param pool The pool running the tiles.
+     * @param height Number of rows.
+     * @param inStride Distance between input rows in bytes.
+     * @param outStride Distance between output rows in bytes; at most inStride.
+     * @param grain Rows per tile.
+     * @param body Callable invoked as body(firstRow, lastRow).
+     */
+    inline void ForEachRowInPlace(ThreadPool& pool, std::size_t height, std::size_t inStride, std::size_t outStride,
+                                  std::size_t grain, const std::function<void(std::size_t, std::size_t)>& body)
+    {
+        Stats::ConversionStats* stats = Stats::ConversionStats::Current();
+        std::vector<double> busy;
+        std::size_t done = 0;
+        if (outStride < inStride) {
+            done = std::min(height, grain);
+            double start = stats != nullptr ? Stats::WallSeconds() : 0;
+            body(0, done);
+            if (stats != nullptr) {
+                stats->AddWorkerBusy({Stats::WallSeconds() - start});
+            }
+        }
+        while (done < height) {
+            std::size_t next = outStride < inStride
+                                   ? std::min(height, std::max(done + 1, done * inStride / outStride))
+                                   : height;
+            pool.ParallelFor(done, next, grain, body, stats != nullptr ? &busy : nullptr);
+            if (stats != nullptr) {
+                stats->AddWorkerBusy(busy);
+            }
+            done = next;
+        }
+    }
+} // namespace bwconv
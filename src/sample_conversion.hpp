@@ -0,0 +1,120 @@
+/**
+ * @file sample_conversion.hpp
+ * @brief Narrowing of 16-bit and float images to the sample types of encoders.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "buffer_pool.hpp"
+#include "image_view.hpp"
+#include "wide_kernels.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace bwconv
+{
+    /**
+     * @return true if 16-bit samples are stored least significant byte first.
+     */
+    inline bool IsLittleEndianHost()
+    {
+        const std::uint16_t probe = 1;
+        unsigned char first;
+        std::memcpy(&first, &probe, 1);
+        return first == 1;
+    }
+
+    /**
+     * Converts a run of samples to a type that is at most as wide. Float samples are
+     * encoded with gamma 1/2.2 as stb_image does for HDR files, 16-bit samples are
+     * rounded to bytes. dst may equal src.
+     *
+     * @param src The samples.
+     * @param from Their type.
+     * @param dst Receives the converted samples.
+     * @param to The type to convert to.
+     * @param samples Number of samples.
+     * @throws std::runtime_error if to is wider than from.
+     */
+    inline void ConvertSamples(const unsigned char* src, SampleType from, unsigned char* dst, SampleType to,
+                               std::size_t samples)
+    {
+        if (from == to) {
+            std::memmove(dst, src, samples * SampleBytes(from));
+        } else if (from == SampleType::U16 && to == SampleType::U8) {
+            Kernels::NarrowSamples(reinterpret_cast<const std::uint16_t*>(src), dst, samples);
+        } else if (from == SampleType::F32 && to == SampleType::U16) {
+            Kernels::EncodeSamples(reinterpret_cast<const float*>(src), reinterpret_cast<std::uint16_t*>(dst),
+                                   samples);
+        } else if (from == SampleType::F32 && to == SampleType::U8) {
+            // Through 16 bits in chunks, so dst needs no room for the intermediate samples.
+            std::uint16_t chunk[256];
+            const float* floats = reinterpret_cast<const float*>(src);
+            for (std::size_t i = 0; i < samples; i += 256) {
+                std::size_t count = std::min<std::size_t>(256, samples - i);
+                Kernels::EncodeSamples(floats + i, chunk, count);
+                Kernels::NarrowSamples(chunk, dst + i, count);
+            }
+        } else {
+            throw std::runtime_error("Samples can only be converted to a narrower type");
+        }
+    }
+
+    /**
+     * Converts an image to a narrower sample type in place. Rows are packed afterwards;
+     * a view that already has the type is left as it is.
+     *
+     * @param img View of the image; describes the result on return.
+     * @param to The type to convert to.
+     * @throws std::runtime_error if to is wider than the image's samples.
+     */
+    inline void ConvertSamplesInPlace(ImageView& img, SampleType to)
+    {
+        if (img.sample == to) {
+            return;
+        }
+        ImageView output = img;
+        output.sample = to;
+        output.stride = output.RowBytes();
+        // Every output sample lies at or before its input sample, so forward order is safe.
+        std::size_t samples = static_cast<std::size_t>(img.width) * img.channels;
+        for (int y = 0; y < img.height; ++y) {
+            ConvertSamples(img.Row(y), img.sample, output.Row(y), to, samples);
+        }
+        img = output;
+    }
+
+    /**
+     * Returns a view of the image with the requested sample type, converting into buffer
+     * when needed. Encoders that cannot store wide samples narrow their input this way.
+     *
+     * @param img View of the image.
+     * @param to The sample type required.
+     * @param buffer Receives the packed converted rows when a copy is needed.
+     * @return img itself if its samples already have the type, else a view of buffer.
+     * @throws std::runtime_error if to is wider than the image's samples.
+     */
+    inline ImageView ConvertedView(const ImageView& img, SampleType to, PooledVector<unsigned char>& buffer)
+    {
+        if (img.sample == to) {
+            return img;
+        }
+        ImageView output = img;
+        output.sample = to;
+        output.stride = output.RowBytes();
+        buffer.resize(output.stride * img.height);
+        output.data = buffer.data();
+        std::size_t samples = static_cast<std::size_t>(img.width) * img.channels;
+        for (int y = 0; y < img.height; ++y) {
+            ConvertSamples(img.Row(y), img.sample, output.Row(y), to, samples);
+        }
+        return output;
+    }
+} // namespace bwconv
@@ -0,0 +1,781 @@
+/**
+ * @file save_strategy.hpp
+ * @brief Encoders writing a processed image to disk.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "buffer_pool.hpp"
+#include "encoder_options.hpp"
+#include "gif_codec.hpp"
+#include "image_view.hpp"
+#include "libjpeg_support.hpp"
+#include "platform.hpp"
+#include "sample_conversion.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stb_image_write.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(BWCONV_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace bwconv
+{
+    namespace SaveFile
+    {
+        /**
+         * @param path A file's final path.
+         * @return A path next to it that no other thread or process uses, for writing the
+         *         file before it is renamed into place.
+         */
+        inline std::string TemporaryPath(const std::string& path)
+        {
+            static std::atomic<unsigned long> temporaryCounter{0};
+#if defined(BWCONV_POSIX)
+            return path + ".tmp" + std::to_string(::getpid()) + "." + std::to_string(temporaryCounter.fetch_add(1));
+#else
+            return path + ".tmp" + std::to_string(temporaryCounter.fetch_add(1));
+#endif
+        }
+
+        /**
+         * Writes a complete file with as few system calls as possible.
+         *
+         * With atomic set, the data goes to a temporary file in the same directory which
+         * is then renamed over the destination, so readers never observe a partial file.
+         *
+         * @param path Destination path.
+         * @param data First byte to write.
+         * @param size Number of bytes.
+         * @param atomic Publish the file with a rename.
+         * @throws std::runtime_error if the file cannot be written.
+         */
+        inline void WriteFile(const std::string& path, const unsigned char* data, std::size_t size, bool atomic)
+        {
+            std::string target = atomic ? TemporaryPath(path) : path;
+
+            bool ok = true;
+#if defined(BWCONV_POSIX)
+            int fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0) {
+                throw std::runtime_error("Error saving image " + path);
+            }
+            for (std::size_t done = 0; ok && done < size;) {
+                ssize_t written = ::write(fd, data + done, size - done);
+                ok = written > 0;
+                done += ok ? static_cast<std::size_t>(written) : 0;
+            }
+            ok = (::close(fd) == 0) && ok;
+#else
+            {
+                std::ofstream file(target, std::ios::binary | std::ios::trunc);
+                ok = file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size)) && file.flush();
+            }
+#endif
+            if (ok && atomic) {
+                ok = std::rename(target.c_str(), path.c_str()) == 0;
+            }
+            if (!ok) {
+                std::remove(target.c_str());
+                throw std::runtime_error("Error saving image " + path);
+            }
+        }
+
+        /**
+         * @class SaveStrategy
+         * @brief Abstract base class for implementing different image saving strategies.
+         *
+         * SaveStrategy defines a common interface for all concrete image saving strategies.
+         * It allows for polymorphic saving of images in various formats like PNG, JPEG, BMP, TGA, etc.
+         * This class follows the Strategy design pattern.
+         *
+         * Concrete strategies only encode into memory. Save then writes the encoded bytes
+         * with a single write call, which keeps small writes away from network filesystems.
+         */
+        class SaveStrategy
+        {
+        public:
+            /**
+             * Virtual destructor for SaveStrategy.
+             */
+            virtual ~SaveStrategy() = default;
+
+            /**
+             * Pure virtual function to encode an image. Views of 16-bit or float samples are
+             * narrowed to what the format stores, see ConvertedView.
+             *
+             * @param img View of the image to encode.
+             * @param out Buffer the encoded file is appended to.
+             * @throws std::runtime_error if the encoder fails.
+             */
+            virtual void Encode(const ImageView& img, std::vector<unsigned char>& out) = 0;
+
+            /**
+             * Encodes an image and writes it to a file.
+             * The encode buffer is kept per thread and reused by later images.
+             *
+             * @param path The file path where the image will be saved.
+             * @param img View of the image to save.
+             * @param atomic Write to a temporary file and rename it into place.
+             * @throws std::runtime_error if encoding or writing fails.
+             */
+            void Save(const std::string& path, const ImageView& img, bool atomic = false)
+            {
+                thread_local std::vector<unsigned char> encoded;
+                encoded.clear();
+                {
+                    Stats::ScopedStage stage(Stats::Stage::Encode);
+                    Encode(img, encoded);
+                }
+                {
+                    Stats::ScopedStage stage(Stats::Stage::Write);
+                    WriteFile(path, encoded.data(), encoded.size(), atomic);
+                }
+                if (Stats::ConversionStats* stats = Stats::ConversionStats::Current()) {
+                    stats->bytesWritten += encoded.size();
+                }
+                if (encoded.capacity() > kMaxRetainedBuffer) {
+                    std::vector<unsigned char>().swap(encoded);
+                }
+            }
+
+        protected:
+            /**
+             * stb_image_write callback appending the encoder output to a vector.
+             */
+            static void Append(void* context, void* data, int size)
+            {
+                auto& out = *static_cast<std::vector<unsigned char>*>(context);
+                out.insert(out.end(), static_cast<unsigned char*>(data), static_cast<unsigned char*>(data) + size);
+            }
+
+            /**
+             * Returns the pixels of the view without row padding, as required by encoders that
+             * take no stride. Packed views are returned as they are.
+             *
+             * @param img The view to pack.
+             * @param scratch Buffer receiving the packed rows when a copy is needed.
+             * @return Pointer to packed pixel data.
+             */
+            static const unsigned char* PackedPixels(const ImageView& img, PooledVector<unsigned char>& scratch)
+            {
+                if (img.IsPacked()) {
+                    return img.data;
+                }
+                scratch.resize(img.RowBytes() * img.height);
+                for (int y = 0; y < img.height; ++y) {
+                    std::memcpy(scratch.data() + y * img.RowBytes(), img.Row(y), img.RowBytes());
+                }
+                return scratch.data();
+            }
+
+            /**
+             * Turns an stb_image_write status into an exception.
+             *
+             * @param status Return value of an stbi_write_* function.
+             */
+            static void Check(int status)
+            {
+                if (status == 0) {
+                    throw std::runtime_error("Error encoding image");
+                }
+            }
+
+        private:
+            /// Encode buffers growing beyond this are released instead of kept for reuse.
+            static constexpr std::size_t kMaxRetainedBuffer = 64u << 20;
+        };
+
+        /**
+         * @class StbPngSettings
+         * @brief Holds stb_image_write's PNG level and filter, which it keeps in process-wide
+         *        variables, at the values of one encode for the lifetime of the object.
+         *
+         * Encodes with the settings currently in place share the lock and run concurrently.
+         * One with other settings waits for them, changes the variables and encodes alone, so
+         * strategies with different options may encode at the same time.
+         */
+        class StbPngSettings
+        {
+        public:
+            /**
+             * @param options The settings of the encode.
+             */
+            explicit StbPngSettings(const EncoderOptions& options) : shared(Mutex())
+            {
+                int filter = static_cast<int>(options.pngFilter);
+                if (stbi_write_png_compression_level == options.pngLevel && stbi_write_force_png_filter == filter) {
+                    return;
+                }
+                shared.unlock();
+                exclusive = std::unique_lock<std::shared_mutex>(Mutex());
+                stbi_write_png_compression_level = options.pngLevel;
+                stbi_write_force_png_filter = filter;
+            }
+
+        private:
+            /// Guards the stb_image_write variables.
+            static std::shared_mutex& Mutex()
+            {
+                static std::shared_mutex mutex;
+                return mutex;
+            }
+
+            std::shared_lock<std::shared_mutex> shared;    ///< Held while the settings are in place.
+            std::unique_lock<std::shared_mutex> exclusive; ///< Held instead after changing them.
+        };
+
+        /**
+         * @class PngSaveStrategy
+         * @brief Concrete strategy for saving images in PNG format.
+         *
+         * Inherits from SaveStrategy and implements the Encode function to handle PNG image saving.
+         * When the build found zlib (BWCONV_HAVE_ZLIB) and the backend is Auto, rows are filtered
+         * here and deflated by zlib, which is several times faster than stb's compressor at the
+         * same level and honours the level and filter per strategy. Bilevel gray images are
+         * then stored with one bit per pixel, and 16-bit and float images with 16 bits per
+         * sample. stb_image_write only stores bytes.
+         */
+        class PngSaveStrategy : public SaveStrategy
+        {
+        public:
+            /**
+             * @param options Compression level, row filter and backend.
+             */
+            explicit PngSaveStrategy(const EncoderOptions& options = EncoderOptions()) : options(options) {}
+
+            /**
+             * Encodes an image in PNG format.
+             * Overrides the Encode method from SaveStrategy.
+             */
+            void Encode(const ImageView& img, std::vector<unsigned char>& out) override
+            {
+                PooledVector<unsigned char> converted;
+#if defined(BWCONV_HAVE_ZLIB)
+                if (options.backend == EncoderBackend::Auto) {
+                    EncodeWithZlib(img.sample == SampleType::F32 ? ConvertedView(img, SampleType::U16, converted) : img,
+                                   out);
+                    return;
+                }
+#endif
+                ImageView bytes = ConvertedView(img, SampleType::U8, converted);
+                StbPngSettings settings(options);
+                Check(stbi_write_png_to_func(Append, &out, bytes.width, bytes.height, bytes.channels, bytes.data,
+                                             static_cast<int>(bytes.stride)));
+            }
+
+        private:
+            EncoderOptions options; ///< Encoder settings.
+
+#if defined(BWCONV_HAVE_ZLIB)
+            /**
+             * Appends a big-endian 32-bit value.
+             */
+            static void PutU32(std::vector<unsigned char>& out, std::uint32_t value)
+            {
+                for (int shift = 24; shift >= 0; shift -= 8) {
+                    out.push_back(static_cast<unsigned char>(value >> shift));
+                }
+            }
+
+            /**
+             * Appends a complete chunk: length, type, data and CRC.
+             */
+            static void PutChunk(std::vector<unsigned char>& out, const char* type, const unsigned char* data,
+                                 std::uint32_t size)
+            {
+                PutU32(out, size);
+                std::size_t typeAt = out.size();
+                out.insert(out.end(), type, type + 4);
+                out.insert(out.end(), data, data + size);
+                PutU32(out, static_cast<std::uint32_t>(crc32(0, out.data() + typeAt, size + 4)));
+            }
+
+            /**
+             * Filters one row into dst with the given filter type.
+             *
+             * @param type Filter 0 to 4.
+             * @param row Current row.
+             * @param prior Previous row, or nullptr for the first row.
+             * @param rowBytes Bytes per row.
+             * @param bpp Bytes per pixel.
+             * @param dst Receives the filtered bytes.
+             */
+            BWCONV_CLONES static void FilterRow(int type, const unsigned char* row, const unsigned char* prior,
+                                                std::size_t rowBytes, std::size_t bpp, unsigned char* dst)
+            {
+                // The first row has an all-zero prior row: Up is None and Paeth is Sub.
+                if (prior == nullptr) {
+                    type = type == 2 ? 0 : (type == 4 ? 1 : type);
+                }
+                std::size_t lead = std::min(bpp, rowBytes);
+                switch (type) {
+                case 1:
+                    std::memcpy(dst, row, lead);
+                    for (std::size_t i = bpp; i < rowBytes; ++i) {
+                        dst[i] = static_cast<unsigned char>(row[i] - row[i - bpp]);
+                    }
+                    break;
+                case 2:
+                    for (std::size_t i = 0; i < rowBytes; ++i) {
+                        dst[i] = static_cast<unsigned char>(row[i] - prior[i]);
+                    }
+                    break;
+                case 3:
+                    for (std::size_t i = 0; i < lead; ++i) {
+                        dst[i] = static_cast<unsigned char>(row[i] - (prior != nullptr ? prior[i] >> 1 : 0));
+                    }
+                    for (std::size_t i = bpp; i < rowBytes; ++i) {
+                        int above = prior != nullptr ? prior[i] : 0;
+                        dst[i] = static_cast<unsigned char>(row[i] - ((row[i - bpp] + above) >> 1));
+                    }
+                    break;
+                case 4:
+                    for (std::size_t i = 0; i < lead; ++i) {
+                        dst[i] = static_cast<unsigned char>(row[i] - prior[i]);
+                    }
+                    for (std::size_t i = bpp; i < rowBytes; ++i) {
+                        int a = row[i - bpp], b = prior[i], c = prior[i - bpp];
+                        int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+                        int predictor = pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+                        dst[i] = static_cast<unsigned char>(row[i] - predictor);
+                    }
+                    break;
+                default:
+                    std::memcpy(dst, row, rowBytes);
+                    break;
+                }
+            }
+
+            /**
+             * @return The sum of the filtered bytes as signed magnitudes, the estimate of how
+             *         well a row compresses that the adaptive filter minimises.
+             */
+            BWCONV_CLONES static long FilterCost(const unsigned char* filtered, std::size_t rowBytes)
+            {
+                long cost = 0;
+                for (std::size_t i = 0; i < rowBytes; ++i) {
+                    cost += std::abs(static_cast<signed char>(filtered[i]));
+                }
+                return cost;
+            }
+
+            /**
+             * Encodes with zlib: IHDR, a single IDAT deflated row by row, IEND.
+             * Bilevel gray views are packed to bit depth 1 first and 16-bit samples are
+             * stored big-endian; filters then work on bytes.
+             */
+            void EncodeWithZlib(const ImageView& img, std::vector<unsigned char>& out)
+            {
+                static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+                static const unsigned char colorTypes[5] = {0, 0, 4, 2, 6};
+                if (img.channels < 1 || img.channels > 4) {
+                    throw std::runtime_error("Error encoding image");
+                }
+                out.insert(out.end(), signature, signature + 8);
+
+                unsigned char header[13] = {};
+                for (int i = 0; i < 4; ++i) {
+                    header[i] = static_cast<unsigned char>(static_cast<std::uint32_t>(img.width) >> (24 - 8 * i));
+                    header[4 + i] = static_cast<unsigned char>(static_cast<std::uint32_t>(img.height) >> (24 - 8 * i));
+                }
+                if (img.sample == SampleType::F32) {
+                    throw std::runtime_error("Error encoding image");
+                }
+                bool wide = img.sample == SampleType::U16;
+                bool packBits = img.bilevel && img.channels == 1 && !wide;
+                bool swapBytes = wide && IsLittleEndianHost();
+                header[8] = packBits ? 1 : (wide ? 16 : 8);
+                header[9] = colorTypes[img.channels];
+                PutChunk(out, "IHDR", header, sizeof(header));
+
+                // zlib's window and hash tables come from the pool like the other encoder buffers.
+                z_stream zs{};
+                zs.zalloc = [](voidpf, uInt items, uInt size) -> voidpf {
+                    return Stats::Allocations::Allocate(static_cast<std::size_t>(items) * size);
+                };
+                zs.zfree = [](voidpf, voidpf data) { Stats::Allocations::Free(data); };
+                if (deflateInit(&zs, options.pngLevel) != Z_OK) {
+                    throw std::runtime_error("Error encoding image");
+                }
+                std::unique_ptr<z_stream, int (*)(z_stream*)> guard(&zs, deflateEnd);
+
+                // The IDAT length is patched in once the compressed size is known.
+                std::size_t lengthAt = out.size();
+                PutU32(out, 0);
+                out.insert(out.end(), {'I', 'D', 'A', 'T'});
+                std::size_t dataAt = out.size();
+
+                std::size_t rowBytes = packBits ? (static_cast<std::size_t>(img.width) + 7) / 8 : img.RowBytes();
+                std::size_t bpp = static_cast<std::size_t>(img.channels) * SampleBytes(img.sample);
+                std::vector<unsigned char> filtered(1 + rowBytes), candidate(1 + rowBytes);
+                std::vector<unsigned char> packed, packedPrior;
+                if (packBits || swapBytes) {
+                    packed.resize(rowBytes);
+                    packedPrior.resize(rowBytes);
+                }
+                unsigned char compressed[1 << 14];
+                for (int y = 0; y <= img.height; ++y) {
+                    bool last = y == img.height;
+                    if (!last) {
+                        const unsigned char* row = img.Row(y);
+                        const unsigned char* prior = y > 0 ? img.Row(y - 1) : nullptr;
+                        if (packBits || swapBytes) {
+                            packed.swap(packedPrior);
+                            if (packBits) {
+                                PackBilevelRow(row, img.width, 1, packed.data());
+                            } else {
+                                for (std::size_t i = 0; i < rowBytes; i += 2) {
+                                    packed[i] = row[i + 1];
+                                    packed[i + 1] = row[i];
+                                }
+                            }
+                            row = packed.data();
+                            prior = y > 0 ? packedPrior.data() : nullptr;
+                        }
+                        if (options.pngFilter == PngFilter::Adaptive) {
+                            long best = -1;
+                            for (int type = 0; type < 5; ++type) {
+                                candidate[0] = static_cast<unsigned char>(type);
+                                FilterRow(type, row, prior, rowBytes, bpp, candidate.data() + 1);
+                                long cost = FilterCost(candidate.data() + 1, rowBytes);
+                                if (best < 0 || cost < best) {
+                                    best = cost;
+                                    filtered.swap(candidate);
+                                }
+                            }
+                        } else {
+                            int type = static_cast<int>(options.pngFilter);
+                            filtered[0] = static_cast<unsigned char>(type);
+                            FilterRow(type, row, prior, rowBytes, bpp, filtered.data() + 1);
+                        }
+                        zs.next_in = filtered.data();
+                        zs.avail_in = static_cast<uInt>(1 + rowBytes);
+                    }
+
+                    int status;
+                    do {
+                        zs.next_out = compressed;
+                        zs.avail_out = sizeof(compressed);
+                        status = deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+                        if (status == Z_STREAM_ERROR) {
+                            throw std::runtime_error("Error encoding image");
+                        }
+                        out.insert(out.end(), compressed, compressed + (sizeof(compressed) - zs.avail_out));
+                    } while (last ? status != Z_STREAM_END : zs.avail_in != 0);
+                }
+
+                std::size_t size = out.size() - dataAt;
+                if (size > 0x7FFFFFFFu) {
+                    throw std::runtime_error("Error encoding image");
+                }
+                for (int i = 0; i < 4; ++i) {
+                    out[lengthAt + i] = static_cast<unsigned char>(size >> (24 - 8 * i));
+                }
+                PutU32(out, static_cast<std::uint32_t>(
+                                crc32(0, out.data() + dataAt - 4, static_cast<uInt>(size + 4))));
+                PutChunk(out, "IEND", nullptr, 0);
+            }
+#endif
+        };
+
+        /**
+         * @class JpegSaveStrategy
+         * @brief Concrete strategy for saving images in JPEG format.
+         *
+         * Inherits from SaveStrategy and implements the Encode function to handle JPEG image saving.
+         * When the build found libjpeg (BWCONV_HAVE_LIBJPEG) and the backend is Auto, the image is
+         * compressed by libjpeg, whose libjpeg-turbo flavour uses SIMD DCT and Huffman coding.
+         */
+        class JpegSaveStrategy : public SaveStrategy
+        {
+        public:
+            /**
+             * @param options Quality and backend.
+             */
+            explicit JpegSaveStrategy(const EncoderOptions& options = EncoderOptions()) : options(options) {}
+
+            /**
+             * Encodes an image in JPEG format.
+             * Overrides the Encode method from SaveStrategy.
+             */
+            void Encode(const ImageView& input, std::vector<unsigned char>& out) override
+            {
+                PooledVector<unsigned char> converted;
+                ImageView img = ConvertedView(input, SampleType::U8, converted);
+#if defined(BWCONV_HAVE_LIBJPEG)
+                if (options.backend == EncoderBackend::Auto) {
+                    if (!EncodeWithLibjpeg(img, out)) {
+                        throw std::runtime_error("Error encoding image");
+                    }
+                    return;
+                }
+#endif
+                PooledVector<unsigned char> scratch;
+                Check(stbi_write_jpg_to_func(Append, &out, img.width, img.height, img.channels,
+                                             PackedPixels(img, scratch), options.jpegQuality));
+            }
+
+        private:
+            EncoderOptions options; ///< Encoder settings.
+
+#if defined(BWCONV_HAVE_LIBJPEG)
+            /**
+             * @class Compressor
+             * @brief libjpeg compression into a malloc'd memory buffer.
+             *
+             * libjpeg reports errors with longjmp, so every libjpeg call is made from a member
+             * function that sets the jump buffer and holds no objects with destructors.
+             */
+            class Compressor
+            {
+            public:
+                Compressor()
+                {
+                    cinfo.err = jpeg_std_error(&error.base);
+                    error.base.error_exit = JpegErrorManager::Exit;
+                    jpeg_create_compress(&cinfo);
+                }
+
+                ~Compressor()
+                {
+                    jpeg_destroy_compress(&cinfo);
+                    std::free(buffer);
+                }
+
+                Compressor(const Compressor&) = delete;
+                Compressor& operator=(const Compressor&) = delete;
+
+                bool Start(int width, int height, int components, int quality)
+                {
+                    if (setjmp(error.jump)) {
+                        return false;
+                    }
+                    jpeg_mem_dest(&cinfo, &buffer, &size);
+                    cinfo.image_width = static_cast<JDIMENSION>(width);
+                    cinfo.image_height = static_cast<JDIMENSION>(height);
+                    cinfo.input_components = components;
+                    cinfo.in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+                    jpeg_set_defaults(&cinfo);
+                    jpeg_set_quality(&cinfo, quality, TRUE);
+                    jpeg_start_compress(&cinfo, TRUE);
+                    return true;
+                }
+
+                bool WriteRow(const unsigned char* row)
+                {
+                    if (setjmp(error.jump)) {
+                        return false;
+                    }
+                    JSAMPROW sample = const_cast<unsigned char*>(row);
+                    jpeg_write_scanlines(&cinfo, &sample, 1);
+                    return true;
+                }
+
+                bool Finish()
+                {
+                    if (setjmp(error.jump)) {
+                        return false;
+                    }
+                    jpeg_finish_compress(&cinfo);
+                    return true;
+                }
+
+                unsigned char* buffer = nullptr; ///< Compressed data, allocated by libjpeg.
+                unsigned long size = 0;          ///< Bytes in buffer.
+
+            private:
+                jpeg_compress_struct cinfo{}; ///< libjpeg compression state.
+                JpegErrorManager error{};     ///< Error handler of cinfo.
+            };
+
+            /**
+             * Compresses with libjpeg. Like stb_image_write, alpha is dropped and gray+alpha
+             * is written as gray.
+             *
+             * @return false if libjpeg reported an error.
+             */
+            bool EncodeWithLibjpeg(const ImageView& img, std::vector<unsigned char>& out)
+            {
+                int components = img.channels >= 3 ? 3 : 1;
+                Compressor compressor;
+                if (!compressor.Start(img.width, img.height, components, options.jpegQuality)) {
+                    return false;
+                }
+                std::vector<unsigned char> row;
+                if (img.channels != components) {
+                    row.resize(static_cast<std::size_t>(img.width) * components);
+                }
+                for (int y = 0; y < img.height; ++y) {
+                    const unsigned char* src = img.Row(y);
+                    if (!row.empty()) {
+                        for (int x = 0; x < img.width; ++x) {
+                            std::memcpy(&row[static_cast<std::size_t>(x) * components],
+                                        src + static_cast<std::size_t>(x) * img.channels, components);
+                        }
+                        src = row.data();
+                    }
+                    if (!compressor.WriteRow(src)) {
+                        return false;
+                    }
+                }
+                if (!compressor.Finish()) {
+                    return false;
+                }
+                out.insert(out.end(), compressor.buffer, compressor.buffer + compressor.size);
+                return true;
+            }
+#endif
+        };
+
+        /**
+         * @class BmpSaveStrategy
+         * @brief Concrete strategy for saving images in BMP format.
+         *
+         * Inherits from SaveStrategy and implements the Encode function to handle BMP image saving.
+         */
+        class BmpSaveStrategy : public SaveStrategy
+        {
+        public:
+            /**
+             * Encodes an image in BMP format.
+             * Overrides the Encode method from SaveStrategy.
+             */
+            void Encode(const ImageView& input, std::vector<unsigned char>& out) override
+            {
+                PooledVector<unsigned char> converted, scratch;
+                ImageView img = ConvertedView(input, SampleType::U8, converted);
+                Check(stbi_write_bmp_to_func(Append, &out, img.width, img.height, img.channels,
+                                             PackedPixels(img, scratch)));
+            }
+        };
+
+        /**
+         * @class TgaSaveStrategy
+         * @brief Concrete strategy for saving images in TGA format.
+         *
+         * Inherits from SaveStrategy and implements the Encode function to handle TGA image saving.
+         */
+        class TgaSaveStrategy : public SaveStrategy
+        {
+        public:
+            /**
+             * Encodes an image in TGA format.
+             * Overrides the Encode method from SaveStrategy.
+             */
+            void Encode(const ImageView& input, std::vector<unsigned char>& out) override
+            {
+                PooledVector<unsigned char> converted, scratch;
+                ImageView img = ConvertedView(input, SampleType::U8, converted);
+                Check(stbi_write_tga_to_func(Append, &out, img.width, img.height, img.channels,
+                                             PackedPixels(img, scratch)));
+            }
+        };
+
+        /**
+         * @class PbmSaveStrategy
+         * @brief Concrete strategy for saving single-channel images as binary PBM (P4), one
+         *        bit per pixel. Gray input is thresholded at 128.
+         */
+        class PbmSaveStrategy : public SaveStrategy
+        {
+        public:
+            /**
+             * Encodes an image in PBM format.
+             * Overrides the Encode method from SaveStrategy.
+             *
+             * @throws std::runtime_error if the image has more than one channel.
+             */
+            void Encode(const ImageView& input, std::vector<unsigned char>& out) override
+            {
+                if (input.channels != 1) {
+                    throw std::runtime_error("PBM output requires a single-channel image");
+                }
+                PooledVector<unsigned char> converted;
+                ImageView img = ConvertedView(input, SampleType::U8, converted);
+                std::string header = "P4\n" + std::to_string(img.width) + " " + std::to_string(img.height) + "\n";
+                out.insert(out.end(), header.begin(), header.end());
+                std::size_t rowBytes = (static_cast<std::size_t>(img.width) + 7) / 8;
+                std::size_t at = out.size();
+                out.resize(at + rowBytes * img.height);
+                for (int y = 0; y < img.height; ++y) {
+                    PackBilevelRow(img.Row(y), img.width, 0, out.data() + at + rowBytes * y);
+                }
+            }
+        };
+
+        /**
+         * @class GifSaveStrategy
+         * @brief Concrete strategy for saving single-channel images as a still GIF with a
+         *        gray color table.
+         */
+        class GifSaveStrategy : public SaveStrategy
+        {
+        public:
+            /**
+             * Encodes an image in GIF format.
+             * Overrides the Encode method from SaveStrategy.
+             *
+             * @throws std::runtime_error if the image has more than one channel.
+             */
+            void Encode(const ImageView& input, std::vector<unsigned char>& out) override
+            {
+                PooledVector<unsigned char> converted;
+                ImageView img = ConvertedView(input, SampleType::U8, converted);
+                Gif::AppendHeader(img.width, img.height, -1, out);
+                Gif::AppendFrame(img, 0, out);
+                Gif::AppendTrailer(out);
+            }
+        };
+
+        /**
+         * Creates the save strategy for a file extension.
+         *
+         * @param extension Lowercase extension without the dot.
+         * @param options Encoder settings.
+         * @return The strategy, or nullptr if the format is not supported.
+         */
+        inline std::unique_ptr<SaveStrategy> CreateSaveStrategy(const std::string& extension,
+                                                                const EncoderOptions& options)
+        {
+            if (extension == "png") {
+                return std::make_unique<PngSaveStrategy>(options);
+            }
+            if (extension == "jpg" || extension == "jpeg") {
+                return std::make_unique<JpegSaveStrategy>(options);
+            }
+            if (extension == "bmp") {
+                return std::make_unique<BmpSaveStrategy>();
+            }
+            if (extension == "tga") {
+                return std::make_unique<TgaSaveStrategy>();
+            }
+            if (extension == "pbm") {
+                return std::make_unique<PbmSaveStrategy>();
+            }
+            if (extension == "gif") {
+                return std::make_unique<GifSaveStrategy>();
+            }
+            return nullptr;
+        }
+    } // namespace SaveFile
+} // namespace bwconv
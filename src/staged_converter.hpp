@@ -0,0 +1,303 @@
+/**
+ * @file staged_converter.hpp
+ * @brief Batch conversion as a pipeline of stages with their own threads and bounded queues.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "batch_converter.hpp"
+#include "bounded_queue.hpp"
+#include "image_converter.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @struct StagedOptions
+     * @brief Sizes of the stages of a StagedBatchConverter and of the queues between them.
+     */
+    struct StagedOptions
+    {
+        std::array<int, Stats::kStageCount> workers{{1, 1, 1, 1, 1}}; ///< Threads per stage, indexed by Stats::Stage.
+        std::size_t queueDepth = 4;                                   ///< Least capacity of every queue.
+    };
+
+    /**
+     * @struct StageReport
+     * @brief What one stage of a StagedBatchConverter did during a run.
+     */
+    struct StageReport
+    {
+        int workers = 0;          ///< Threads of the stage.
+        std::size_t items = 0;    ///< Images the stage handled, including skipped and failed ones.
+        double busy = 0;          ///< Seconds the workers spent in the stage's work, summed.
+        double blocked = 0;       ///< Seconds the workers waited for room in the next queue.
+        double idle = 0;          ///< Seconds the workers waited for input.
+        std::size_t maxDepth = 0; ///< Largest depth of the input queue seen by the stage.
+        double meanDepth = 0;     ///< Mean depth of the input queue seen by the stage.
+    };
+
+    /**
+     * @class StagedBatchConverter
+     * @brief Runs a batch as a pipeline in which reading, decoding, processing, encoding and
+     *        writing each have a group of threads of their own.
+     *
+     * Consecutive stages are connected by lock-free bounded queues. A stage that falls
+     * behind fills the queue in front of it, and the stages before it block on pushing
+     * until it catches up, so the images in flight are bounded by the queue capacities
+     * and worker counts however large the batch is. The groups can be sized to the work:
+     * a single reader and writer keep disk access sequential, while decoders and
+     * encoders, which run single-threaded per image, get one thread per core. The
+     * processors still spread every image over the shared pool.
+     *
+     * Report tells, per stage, how long its workers were busy, blocked by the next stage
+     * (backpressure) or starved by the previous one, and how deep its input queue was;
+     * the stage with busy workers and a full input queue is the bottleneck.
+     */
+    class StagedBatchConverter : public BatchConverter
+    {
+    public:
+        /**
+         * Constructor for StagedBatchConverter.
+         *
+         * @param converter The converter shared by all jobs.
+         * @param pool The pool the processors run on.
+         * @param options Threads per stage and queue capacity.
+         * @throws std::runtime_error if a stage has no threads or the queues no capacity.
+         */
+        StagedBatchConverter(ImageConverter& converter, ThreadPool& pool, const StagedOptions& options)
+            : BatchConverter(converter, pool), options(options)
+        {
+            for (int workers : options.workers) {
+                if (workers < 1) {
+                    throw std::runtime_error("Every pipeline stage needs at least one thread");
+                }
+            }
+            if (options.queueDepth == 0) {
+                throw std::runtime_error("Pipeline queues need a capacity of at least one");
+            }
+        }
+
+        /**
+         * Converts every job and waits for completion. Failures are reported to stderr
+         * and do not stop the remaining jobs.
+         *
+         * @param jobs The jobs to run.
+         * @param finished Optional callback invoked with the index of every job and whether it
+         *                 succeeded, once it has finished; invocations never overlap.
+         * @return The number of jobs that failed.
+         */
+        std::size_t Run(const std::vector<BatchJob>& jobs,
+                        const std::function<void(std::size_t, bool)>& finished = nullptr) override
+        {
+            State state(jobs, finished);
+            for (std::size_t s = 0; s + 1 < Stats::kStageCount; ++s) {
+                state.queues[s] = std::make_unique<Queue>(options.queueDepth);
+            }
+            for (std::size_t s = 0; s < Stats::kStageCount; ++s) {
+                state.running[s] = options.workers[s];
+                report[s] = StageReport();
+                report[s].workers = options.workers[s];
+            }
+
+            std::vector<std::thread> threads;
+            for (std::size_t s = 0; s < Stats::kStageCount; ++s) {
+                for (int w = 0; w < options.workers[s]; ++w) {
+                    threads.emplace_back([this, &state, s] { Work(state, s); });
+                }
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            for (std::size_t s = 1; s < Stats::kStageCount; ++s) {
+                std::size_t samples = report[s].items;
+                report[s].meanDepth = samples != 0 ? state.depthSum[s] / static_cast<double>(samples) : 0;
+            }
+            return state.failed;
+        }
+
+        /**
+         * @return Per stage, indexed by Stats::Stage, what it did during the last run.
+         */
+        const std::array<StageReport, Stats::kStageCount>& Report() const { return report; }
+
+        /**
+         * Prints the last run's Report as a table.
+         *
+         * @param out Stream to print to.
+         */
+        void PrintReport(std::ostream& out) const
+        {
+            out << "stage    threads  images    busy s  blocked s    idle s  queue max  queue mean\n";
+            for (std::size_t s = 0; s < Stats::kStageCount; ++s) {
+                const StageReport& stage = report[s];
+                out << std::left << std::setw(8) << Stats::StageName(static_cast<Stats::Stage>(s)) << std::right
+                    << std::setw(8) << stage.workers << std::setw(8) << stage.items << std::fixed
+                    << std::setprecision(3) << std::setw(10) << stage.busy << std::setw(11) << stage.blocked
+                    << std::setw(10) << stage.idle;
+                if (s == 0) {
+                    out << std::setw(11) << "-" << std::setw(12) << "-";
+                } else {
+                    out << std::setw(11) << stage.maxDepth << std::setprecision(2) << std::setw(12)
+                        << stage.meanDepth;
+                }
+                out << std::defaultfloat << '\n';
+            }
+        }
+
+    private:
+        /**
+         * A job travelling through the stages.
+         */
+        struct Item
+        {
+            std::size_t index = 0;             ///< Index of the job.
+            ImageConverter::StagedImage image; ///< The conversion.
+        };
+
+        using Queue = BoundedQueue<std::unique_ptr<Item>>;
+
+        /**
+         * Everything the workers of one run share.
+         */
+        struct State
+        {
+            State(const std::vector<BatchJob>& jobs, const std::function<void(std::size_t, bool)>& finished)
+                : jobs(jobs), finished(finished)
+            {
+            }
+
+            const std::vector<BatchJob>& jobs;                                 ///< The jobs.
+            const std::function<void(std::size_t, bool)>& finished;            ///< Completion callback.
+            std::array<std::unique_ptr<Queue>, Stats::kStageCount - 1> queues; ///< queues[s] feeds stage s + 1.
+            std::array<std::atomic<int>, Stats::kStageCount> running{};        ///< Workers of each stage still running.
+            std::array<double, Stats::kStageCount> depthSum{};                 ///< Sum of sampled input queue depths.
+            std::atomic<std::size_t> next{0};                                  ///< Next job the read stage claims.
+            std::mutex mutex;                                                  ///< Guards the members below and report.
+            std::size_t failed = 0;                                            ///< Jobs that failed.
+        };
+
+        /**
+         * Body of a worker of one stage: takes items from the stage's input, applies the
+         * stage and passes them on, until the input is exhausted. The last worker of a stage
+         * to finish closes the next queue.
+         *
+         * @param state The run.
+         * @param s Index of the stage.
+         */
+        void Work(State& state, std::size_t s)
+        {
+            static constexpr void (ImageConverter::*kStages[Stats::kStageCount])(ImageConverter::StagedImage&) = {
+                &ImageConverter::StageRead, &ImageConverter::StageDecode, &ImageConverter::StageProcess,
+                &ImageConverter::StageEncode, &ImageConverter::StageWrite};
+            bool last = s + 1 == Stats::kStageCount;
+            StageReport local;
+            double depthSum = 0;
+
+            for (;;) {
+                std::unique_ptr<Item> item;
+                double waitStart = Stats::WallSeconds();
+                if (s == 0) {
+                    std::size_t index = state.next.fetch_add(1);
+                    if (index >= state.jobs.size()) {
+                        break;
+                    }
+                    item = std::make_unique<Item>();
+                    item->index = index;
+                    item->image.source = state.jobs[index].input;
+                    item->image.destination = state.jobs[index].output;
+                    item->image.crop = state.jobs[index].crop;
+                } else {
+                    Queue& input = *state.queues[s - 1];
+                    if (!input.Pop(item)) {
+                        local.idle += Stats::WallSeconds() - waitStart;
+                        break;
+                    }
+                    std::size_t depth = input.Size();
+                    local.maxDepth = std::max(local.maxDepth, depth);
+                    depthSum += static_cast<double>(depth);
+                }
+                double workStart = Stats::WallSeconds();
+                local.idle += workStart - waitStart;
+                ++local.items;
+
+                std::string error;
+                try {
+                    if (s == 0) {
+                        auto parent = std::filesystem::path(item->image.destination).parent_path();
+                        if (!parent.empty()) {
+                            std::filesystem::create_directories(parent);
+                        }
+                    }
+                    (converter.*kStages[s])(item->image);
+                } catch (const std::exception& e) {
+                    error = e.what();
+                }
+                double workEnd = Stats::WallSeconds();
+                local.busy += workEnd - workStart;
+
+                if (last || !error.empty()) {
+                    Finish(state, *item, error);
+                } else if (!state.queues[s]->TryPush(item)) {
+                    state.queues[s]->Push(item);
+                    local.blocked += Stats::WallSeconds() - workEnd;
+                }
+            }
+
+            if (!last && state.running[s].fetch_sub(1) == 1) {
+                state.queues[s]->Close();
+            }
+            std::lock_guard<std::mutex> lock(state.mutex);
+            StageReport& total = report[s];
+            total.items += local.items;
+            total.busy += local.busy;
+            total.blocked += local.blocked;
+            total.idle += local.idle;
+            total.maxDepth = std::max(total.maxDepth, local.maxDepth);
+            state.depthSum[s] += depthSum;
+        }
+
+        /**
+         * Ends the conversion of an item that was written or failed.
+         *
+         * @param state The run.
+         * @param item The item.
+         * @param error Message of the stage that failed, or empty on success.
+         */
+        void Finish(State& state, Item& item, const std::string& error)
+        {
+            converter.FinishStaged(item.image, error);
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (!error.empty()) {
+                std::cerr << "Error: " << item.image.source << ": " << error << std::endl;
+                ++state.failed;
+            }
+            if (state.finished) {
+                state.finished(item.index, error.empty());
+            }
+        }
+
+        StagedOptions options;                              ///< Threads per stage and queue capacity.
+        std::array<StageReport, Stats::kStageCount> report; ///< What every stage did during the last run.
+    };
+} // namespace bwconv
@@ -0,0 +1,658 @@
+/**
+ * @file stats.hpp
+ * @brief Per-conversion telemetry: stage timings, I/O volume, peak allocation and worker use.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "buffer_pool.hpp"
+#include "histogram.hpp"
+#include "platform.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @namespace Stats
+     * @brief Cheap instrumentation of the conversion hot path.
+     *
+     * A ConversionStats record is installed for the converting thread while an image is
+     * converted; the stages below it add their timings to it through Current(). Without
+     * an installed record the probes do nothing, so telemetry costs a few clock reads per
+     * stage when enabled and a thread-local load when not. Sinks turn finished records
+     * into text, JSON lines or a Chrome trace.
+     */
+    namespace Stats
+    {
+        /**
+         * Stages of a conversion. Streaming conversions report reading and decoding as
+         * Decode and encoding and writing as Encode, since they are interleaved per band.
+         */
+        enum class Stage
+        {
+            Read,
+            Decode,
+            Process,
+            Encode,
+            Write
+        };
+
+        /// Number of entries of Stage.
+        constexpr std::size_t kStageCount = 5;
+
+        /**
+         * @return The lowercase name of a stage.
+         */
+        inline const char* StageName(Stage stage)
+        {
+            static const char* const names[kStageCount] = {"read", "decode", "process", "encode", "write"};
+            return names[static_cast<std::size_t>(stage)];
+        }
+
+        /**
+         * @return Seconds on a monotonic clock shared by all threads.
+         */
+        inline double WallSeconds()
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        /**
+         * @return CPU seconds consumed by the calling thread (the whole process where
+         *         per-thread clocks are unavailable).
+         */
+        inline double ThreadCpuSeconds()
+        {
+#if defined(BWCONV_POSIX) && defined(CLOCK_THREAD_CPUTIME_ID)
+            timespec now;
+            ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+            return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) * 1e-9;
+#else
+            return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#endif
+        }
+
+        /**
+         * @return A small number identifying the calling thread, assigned on first use.
+         */
+        inline unsigned int ThreadIndex()
+        {
+            static std::atomic<unsigned int> next{0};
+            thread_local unsigned int index = next.fetch_add(1);
+            return index;
+        }
+
+        /**
+         * @namespace Allocations
+         * @brief Per-thread accounting of the memory stb_image and stb_image_write allocate.
+         *
+         * Both libraries are compiled with these functions as their allocator, which serve
+         * blocks from the BufferPool. Decoding and encoding run on the converting thread,
+         * so a thread-local counter yields the peak of a single conversion even when many
+         * run concurrently. Staged conversions measure each stage on its own thread, see
+         * ScopedRecord; only differences of a counter are used, so blocks freed by another
+         * thread than the one that allocated them do no harm.
+         */
+        namespace Allocations
+        {
+            /**
+             * @struct Counter
+             * @brief Bytes currently held and the high-water mark of one thread.
+             */
+            struct Counter
+            {
+                std::int64_t current = 0; ///< Bytes allocated and not yet freed by this thread.
+                std::int64_t peak = 0;    ///< Largest value current reached since the last reset.
+            };
+
+            /**
+             * @return The calling thread's counter.
+             */
+            inline Counter& ThreadCounter()
+            {
+                thread_local Counter counter;
+                return counter;
+            }
+
+            /**
+             * Records bytes allocated (positive) or released (negative) by the calling thread.
+             */
+            inline void Note(std::int64_t bytes)
+            {
+                Counter& counter = ThreadCounter();
+                counter.current += bytes;
+                counter.peak = std::max(counter.peak, counter.current);
+            }
+
+            /**
+             * malloc replacement recording the block's size.
+             */
+            inline void* Allocate(std::size_t bytes)
+            {
+                void* data = BufferPool::Global().Allocate(bytes);
+                if (data != nullptr) {
+                    Note(static_cast<std::int64_t>(bytes));
+                }
+                return data;
+            }
+
+            /**
+             * free replacement for blocks returned by Allocate or Reallocate.
+             */
+            inline void Free(void* data)
+            {
+                if (data == nullptr) {
+                    return;
+                }
+                Note(-static_cast<std::int64_t>(BufferPool::SizeOf(data)));
+                BufferPool::Global().Free(data);
+            }
+
+            /**
+             * realloc replacement for blocks returned by Allocate or Reallocate.
+             */
+            inline void* Reallocate(void* data, std::size_t bytes)
+            {
+                std::size_t previous = BufferPool::SizeOf(data);
+                void* resized = BufferPool::Global().Reallocate(data, bytes);
+                if (resized != nullptr) {
+                    Note(static_cast<std::int64_t>(bytes) - static_cast<std::int64_t>(previous));
+                }
+                return resized;
+            }
+        } // namespace Allocations
+
+        /**
+         * @struct StageTime
+         * @brief Accumulated time of one stage.
+         */
+        struct StageTime
+        {
+            double wall = 0; ///< Wall-clock seconds.
+            double cpu = 0;  ///< CPU seconds of the converting thread.
+        };
+
+        /**
+         * @struct TraceEvent
+         * @brief One timed span, kept for the Chrome trace.
+         */
+        struct TraceEvent
+        {
+            Stage stage = Stage::Read; ///< The stage timed.
+            double start = 0;          ///< WallSeconds() at the start.
+            double duration = 0;       ///< Length in seconds.
+            unsigned int thread = 0;   ///< ThreadIndex() of the thread that ran it.
+        };
+
+        /**
+         * @struct ConversionStats
+         * @brief Everything measured while converting one image.
+         */
+        struct ConversionStats
+        {
+            std::string input;                       ///< Source path.
+            std::string output;                      ///< Destination path.
+            std::string error;                       ///< Failure message, empty on success.
+            int width = 0;                           ///< Width in pixels.
+            int height = 0;                          ///< Height in pixels.
+            int channels = 0;                        ///< Decoded channels per pixel.
+            bool streamed = false;                   ///< Converted in bands of rows.
+            bool cached = false;                     ///< Output copied from the result cache.
+            double start = 0;                        ///< WallSeconds() when the conversion began.
+            StageTime total;                         ///< The whole conversion.
+            std::array<StageTime, kStageCount> stages{}; ///< Time per Stage.
+            std::uint64_t bytesRead = 0;             ///< Encoded input size.
+            std::uint64_t bytesWritten = 0;          ///< Encoded output size.
+            std::uint64_t peakBytes = 0;             ///< Peak decoder, encoder and band memory.
+            std::vector<double> workerBusy;          ///< Seconds each ParallelFor participant spent in tiles; 0 is the caller.
+            std::vector<TraceEvent> events;          ///< Individual stage spans.
+            std::shared_ptr<HistogramCollector> histogram; ///< Gray levels counted during the conversion, if requested.
+
+            /**
+             * @return The collector of gray levels, created on first use. Call on the
+             *         conversion thread, before handing the collector to workers.
+             */
+            HistogramCollector& GrayHistogram()
+            {
+                if (!histogram) {
+                    histogram = std::make_shared<HistogramCollector>();
+                }
+                return *histogram;
+            }
+
+            /**
+             * @return The record installed for the calling thread, or nullptr.
+             */
+            static ConversionStats*& Current()
+            {
+                thread_local ConversionStats* current = nullptr;
+                return current;
+            }
+
+            /**
+             * Adds per-participant busy times of one ParallelFor call.
+             *
+             * @param busy Seconds per participant.
+             */
+            void AddWorkerBusy(const std::vector<double>& busy)
+            {
+                if (workerBusy.size() < busy.size()) {
+                    workerBusy.resize(busy.size());
+                }
+                for (std::size_t i = 0; i < busy.size(); ++i) {
+                    workerBusy[i] += busy[i];
+                }
+            }
+        };
+
+        /**
+         * @class ScopedStage
+         * @brief Times the enclosing scope as a stage of the current conversion, if any.
+         */
+        class ScopedStage
+        {
+        public:
+            explicit ScopedStage(Stage stage) : stats(ConversionStats::Current()), stage(stage)
+            {
+                if (stats != nullptr) {
+                    wallStart = WallSeconds();
+                    cpuStart = ThreadCpuSeconds();
+                }
+            }
+
+            ScopedStage(const ScopedStage&) = delete;
+            ScopedStage& operator=(const ScopedStage&) = delete;
+
+            ~ScopedStage()
+            {
+                if (stats == nullptr) {
+                    return;
+                }
+                double wall = WallSeconds() - wallStart;
+                StageTime& time = stats->stages[static_cast<std::size_t>(stage)];
+                time.wall += wall;
+                time.cpu += ThreadCpuSeconds() - cpuStart;
+                stats->events.push_back({stage, wallStart, wall, ThreadIndex()});
+            }
+
+        private:
+            ConversionStats* stats; ///< Record receiving the time, or nullptr.
+            Stage stage;            ///< The stage timed.
+            double wallStart = 0;   ///< Wall clock at construction.
+            double cpuStart = 0;    ///< Thread CPU clock at construction.
+        };
+
+        /**
+         * @class ScopedConversion
+         * @brief Installs a record for the calling thread and fills in its totals on exit.
+         */
+        class ScopedConversion
+        {
+        public:
+            explicit ScopedConversion(ConversionStats& stats)
+                : stats(stats), previous(ConversionStats::Current()), cpuStart(ThreadCpuSeconds()),
+                  allocationBase(Allocations::ThreadCounter().current)
+            {
+                stats.start = WallSeconds();
+                Allocations::ThreadCounter().peak = allocationBase;
+                ConversionStats::Current() = &stats;
+            }
+
+            ScopedConversion(const ScopedConversion&) = delete;
+            ScopedConversion& operator=(const ScopedConversion&) = delete;
+
+            ~ScopedConversion()
+            {
+                ConversionStats::Current() = previous;
+                stats.total.wall = WallSeconds() - stats.start;
+                stats.total.cpu = ThreadCpuSeconds() - cpuStart;
+                stats.peakBytes += static_cast<std::uint64_t>(
+                    std::max<std::int64_t>(0, Allocations::ThreadCounter().peak - allocationBase));
+            }
+
+        private:
+            ConversionStats& stats;        ///< The installed record.
+            ConversionStats* previous;     ///< Record to restore.
+            double cpuStart;               ///< Thread CPU clock at construction.
+            std::int64_t allocationBase;   ///< Allocator bytes held before the conversion.
+        };
+
+        /**
+         * @class ScopedRecord
+         * @brief Installs a record for the calling thread without timing the scope, for
+         *        conversions whose stages run on different threads one after another.
+         *
+         * The allocations of the scope are measured like those of ScopedConversion. Memory
+         * that earlier stages left to this one is passed in as held, so that the record's peak
+         * becomes the largest of the stages' held plus allocated bytes.
+         */
+        class ScopedRecord
+        {
+        public:
+            /**
+             * @param stats The record to install, or nullptr.
+             * @param held Bytes of earlier stages that the conversion holds during the scope.
+             */
+            explicit ScopedRecord(ConversionStats* stats, std::uint64_t held = 0)
+                : stats(stats), previous(ConversionStats::Current()), held(held),
+                  allocationBase(Allocations::ThreadCounter().current),
+                  recorded(stats != nullptr ? stats->peakBytes : 0)
+            {
+                if (stats != nullptr) {
+                    Allocations::ThreadCounter().peak = allocationBase;
+                }
+                ConversionStats::Current() = stats;
+            }
+
+            ScopedRecord(const ScopedRecord&) = delete;
+            ScopedRecord& operator=(const ScopedRecord&) = delete;
+
+            ~ScopedRecord()
+            {
+                ConversionStats::Current() = previous;
+                if (stats == nullptr) {
+                    return;
+                }
+                // Band memory that the scope added to the record counts like its allocations.
+                std::uint64_t stage = held + (stats->peakBytes - recorded) +
+                                      static_cast<std::uint64_t>(std::max<std::int64_t>(
+                                          0, Allocations::ThreadCounter().peak - allocationBase));
+                stats->peakBytes = std::max(recorded, stage);
+            }
+
+            /**
+             * Adds memory the conversion acquired outside the allocator during the scope.
+             *
+             * @param bytes Bytes held until the end of the scope or beyond.
+             */
+            void Hold(std::uint64_t bytes) { held += bytes; }
+
+        private:
+            ConversionStats* stats;      ///< The installed record, or nullptr.
+            ConversionStats* previous;   ///< Record to restore.
+            std::uint64_t held;          ///< Bytes held besides the scope's allocations.
+            std::int64_t allocationBase; ///< Allocator bytes of the thread at construction.
+            std::uint64_t recorded;      ///< The record's peak at construction.
+        };
+
+        /**
+         * @class StatsSink
+         * @brief Receives finished conversion records. Implementations are thread-safe.
+         */
+        class StatsSink
+        {
+        public:
+            virtual ~StatsSink() = default;
+
+            /**
+             * Reports one conversion. May be called concurrently.
+             *
+             * @param stats The finished record.
+             */
+            virtual void Record(const ConversionStats& stats) = 0;
+
+            /**
+             * Called once after the last conversion.
+             */
+            virtual void Finish() {}
+
+        protected:
+            std::mutex mutex; ///< Serialises Record calls.
+
+            /**
+             * @return The text quoted and escaped as a JSON string.
+             */
+            static std::string Quote(const std::string& text)
+            {
+                std::string quoted = "\"";
+                for (char c : text) {
+                    if (c == '"' || c == '\\') {
+                        quoted += '\\';
+                        quoted += c;
+                    } else if (static_cast<unsigned char>(c) < 0x20) {
+                        char escaped[8];
+                        std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                        quoted += escaped;
+                    } else {
+                        quoted += c;
+                    }
+                }
+                return quoted + "\"";
+            }
+
+            /**
+             * @return Utilisation of every participant: its busy time over the process stage.
+             */
+            static std::vector<double> Utilization(const ConversionStats& stats)
+            {
+                std::vector<double> result;
+                double wall = stats.stages[static_cast<std::size_t>(Stage::Process)].wall;
+                for (double busy : stats.workerBusy) {
+                    result.push_back(wall > 0 ? std::min(1.0, busy / wall) : 0.0);
+                }
+                return result;
+            }
+        };
+
+        /**
+         * @class TextStatsSink
+         * @brief Prints one line per image and a latency summary for the run.
+         */
+        class TextStatsSink : public StatsSink
+        {
+        public:
+            explicit TextStatsSink(std::ostream& out) : out(out) {}
+
+            void Record(const ConversionStats& stats) override
+            {
+                std::ostringstream line;
+                line << std::fixed << std::setprecision(2) << stats.input << " -> " << stats.output << ": ";
+                if (!stats.error.empty()) {
+                    line << "failed (" << stats.error << ") ";
+                }
+                line << stats.width << 'x' << stats.height << 'x' << stats.channels
+                     << (stats.streamed ? " streamed" : "") << (stats.cached ? " cached" : "") << ", " << stats.total.wall * 1e3 << " ms (cpu "
+                     << stats.total.cpu * 1e3 << " ms)";
+                for (std::size_t i = 0; i < kStageCount; ++i) {
+                    line << ", " << StageName(static_cast<Stage>(i)) << ' ' << stats.stages[i].wall * 1e3 << '/'
+                         << stats.stages[i].cpu * 1e3;
+                }
+                line << " ms wall/cpu, read " << stats.bytesRead / 1024.0 << " KiB, wrote "
+                     << stats.bytesWritten / 1024.0 << " KiB, peak " << stats.peakBytes / 1048576.0 << " MiB";
+                std::vector<double> utilization = Utilization(stats);
+                if (!utilization.empty()) {
+                    line << ", workers";
+                    for (double u : utilization) {
+                        line << ' ' << std::setprecision(0) << u * 100 << '%';
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                out << line.str() << '\n';
+                latencies.push_back(stats.total.wall);
+                failures += stats.error.empty() ? 0 : 1;
+            }
+
+            void Finish() override
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (latencies.size() < 2) {
+                    return;
+                }
+                std::sort(latencies.begin(), latencies.end());
+                auto percentile = [&](double p) {
+                    return latencies[std::min(latencies.size() - 1, static_cast<std::size_t>(p * latencies.size()))];
+                };
+                out << std::fixed << std::setprecision(2) << latencies.size() << " images (" << failures
+                    << " failed): p50 " << percentile(0.5) * 1e3 << " ms, p99 " << percentile(0.99) * 1e3
+                    << " ms, max " << latencies.back() * 1e3 << " ms" << std::endl;
+            }
+
+        private:
+            std::ostream& out;            ///< Destination of the report.
+            std::vector<double> latencies; ///< Wall time of every image, for the summary.
+            std::size_t failures = 0;      ///< Number of failed conversions.
+        };
+
+        /**
+         * @class JsonLinesStatsSink
+         * @brief Writes one JSON object per image, for log pipelines.
+         */
+        class JsonLinesStatsSink : public StatsSink
+        {
+        public:
+            explicit JsonLinesStatsSink(std::ostream& out) : out(out) {}
+
+            void Record(const ConversionStats& stats) override
+            {
+                std::ostringstream line;
+                line << std::setprecision(6) << "{\"input\":" << Quote(stats.input)
+                     << ",\"output\":" << Quote(stats.output) << ",\"ok\":" << (stats.error.empty() ? "true" : "false");
+                if (!stats.error.empty()) {
+                    line << ",\"error\":" << Quote(stats.error);
+                }
+                line << ",\"width\":" << stats.width << ",\"height\":" << stats.height
+                     << ",\"channels\":" << stats.channels << ",\"streamed\":" << (stats.streamed ? "true" : "false")
+                     << ",\"cached\":" << (stats.cached ? "true" : "false")
+                     << ",\"wall_ms\":" << stats.total.wall * 1e3 << ",\"cpu_ms\":" << stats.total.cpu * 1e3
+                     << ",\"stages\":{";
+                for (std::size_t i = 0; i < kStageCount; ++i) {
+                    line << (i != 0 ? "," : "") << '"' << StageName(static_cast<Stage>(i)) << "\":{\"wall_ms\":"
+                         << stats.stages[i].wall * 1e3 << ",\"cpu_ms\":" << stats.stages[i].cpu * 1e3 << '}';
+                }
+                line << "},\"bytes_read\":" << stats.bytesRead << ",\"bytes_written\":" << stats.bytesWritten
+                     << ",\"peak_bytes\":" << stats.peakBytes << ",\"worker_utilization\":[";
+                std::vector<double> utilization = Utilization(stats);
+                for (std::size_t i = 0; i < utilization.size(); ++i) {
+                    line << (i != 0 ? "," : "") << utilization[i];
+                }
+                line << "]}";
+
+                std::lock_guard<std::mutex> lock(mutex);
+                out << line.str() << std::endl;
+            }
+
+        private:
+            std::ostream& out; ///< Destination of the records.
+        };
+
+        /**
+         * @class ChromeTraceSink
+         * @brief Collects stage spans and writes them in Chrome's trace-event format,
+         *        viewable in chrome://tracing or Perfetto.
+         */
+        class ChromeTraceSink : public StatsSink
+        {
+        public:
+            /**
+             * @param path File the trace is written to by Finish.
+             */
+            explicit ChromeTraceSink(std::string path) : path(std::move(path)) {}
+
+            void Record(const ConversionStats& stats) override
+            {
+                std::ostringstream events;
+                events << std::fixed << std::setprecision(3);
+                auto span = [&](const char* name, double start, double duration, unsigned int thread) {
+                    events << ",\n{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+                           << ",\"ts\":" << (start - origin) * 1e6 << ",\"dur\":" << duration * 1e6
+                           << ",\"args\":{\"image\":" << Quote(stats.input) << "}}";
+                };
+                span("convert", stats.start, stats.total.wall, ThreadIndex());
+                for (const TraceEvent& event : stats.events) {
+                    span(StageName(event.stage), event.start, event.duration, event.thread);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                body += events.str();
+            }
+
+            /**
+             * @throws std::runtime_error if the trace file cannot be written.
+             */
+            void Finish() override
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::ofstream file(path);
+                // The leading metadata event lets every span start with a separator.
+                file << "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                        "\"args\":{\"name\":\"bwconv\"}}"
+                     << body << "\n]}\n";
+                if (!file) {
+                    throw std::runtime_error("Unable to write trace " + path);
+                }
+            }
+
+        private:
+            std::string path;              ///< Output file.
+            std::string body;              ///< Serialised events so far.
+            double origin = WallSeconds(); ///< Time zero of the trace.
+        };
+
+        /**
+         * @class HistogramSidecarSink
+         * @brief Writes the gray-level statistics of every converted image next to its
+         *        output, as <output>.json.
+         *
+         * Only conversions whose processors counted gray levels produce a sidecar; failed
+         * conversions and results copied from the cache produce none.
+         */
+        class HistogramSidecarSink : public StatsSink
+        {
+        public:
+            /**
+             * @throws std::runtime_error if a sidecar cannot be written.
+             */
+            void Record(const ConversionStats& stats) override
+            {
+                if (!stats.error.empty() || !stats.histogram) {
+                    return;
+                }
+                Histogram histogram = stats.histogram->Merge();
+                if (histogram.Total() == 0) {
+                    return;
+                }
+
+                std::ostringstream json;
+                json << std::setprecision(6) << "{\"input\":" << Quote(stats.input)
+                     << ",\"output\":" << Quote(stats.output) << ",\"samples\":" << histogram.Total()
+                     << ",\"mean\":" << histogram.Mean() << ",\"stddev\":" << histogram.StandardDeviation()
+                     << ",\"rms_contrast\":" << histogram.StandardDeviation() / 255 << ",\"min\":" << histogram.Min()
+                     << ",\"max\":" << histogram.Max() << ",\"median\":" << histogram.Percentile(0.5)
+                     << ",\"otsu_threshold\":" << histogram.OtsuLevel() << ",\"histogram\":[";
+                for (int v = 0; v < 256; ++v) {
+                    json << (v != 0 ? "," : "") << histogram.counts[v];
+                }
+                json << "]}\n";
+
+                std::string path = stats.output + ".json";
+                std::ofstream file(path);
+                file << json.str();
+                if (!file) {
+                    throw std::runtime_error("Unable to write histogram " + path);
+                }
+            }
+        };
+    } // namespace Stats
+} // namespace bwconv
@@ -0,0 +1,30 @@
+/**
+ * @file stb_impl.cpp
+ * @brief The single translation unit compiling the stb_image and stb_image_write implementations.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "stats.hpp"
+
+#include <cstddef>
+
+// Route the libraries' allocations through the per-thread accounting behind --stats.
+#define STBI_MALLOC(size) bwconv::Stats::Allocations::Allocate(size)
+#define STBI_REALLOC(data, size) bwconv::Stats::Allocations::Reallocate(data, size)
+#define STBI_FREE(data) bwconv::Stats::Allocations::Free(data)
+#define STBIW_MALLOC(size) bwconv::Stats::Allocations::Allocate(size)
+#define STBIW_REALLOC(data, size) bwconv::Stats::Allocations::Reallocate(data, size)
+#define STBIW_FREE(data) bwconv::Stats::Allocations::Free(data)
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include <stb_image.h>
+#include <stb_image_write.h>
+
+namespace bwconv
+{
+    void* ResizeDecodedImage(void* image, std::size_t bytes) { return STBI_REALLOC(image, bytes); }
+} // namespace bwconv
@@ -0,0 +1,1127 @@
+/**
+ * @file streaming.hpp
+ * @brief Band-wise decoding and encoding for images that do not fit in memory.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "encoder_options.hpp"
+#include "image_view.hpp"
+#include "libjpeg_support.hpp"
+#include "sample_conversion.hpp"
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(BWCONV_HAVE_LIBPNG)
+#include <png.h>
+#endif
+
+namespace bwconv
+{
+    /**
+     * @namespace Streaming
+     * @brief Band-wise decoding and encoding for images that do not fit in memory.
+     *
+     * A RowReader delivers an image top to bottom in bands of rows and a RowWriter
+     * encodes them in the same order, so only one band is held at a time. BMP and TGA
+     * are handled natively, as is PBM output; PNG and baseline JPEG use libpng and libjpeg when the build
+     * found them (BWCONV_HAVE_LIBPNG, BWCONV_HAVE_LIBJPEG).
+     */
+    namespace Streaming
+    {
+        /**
+         * @class RowReader
+         * @brief Decodes an image sequentially, a band of rows at a time.
+         *
+         * Pixels are delivered in the channel order stb_image would produce (RGB, RGBA,
+         * gray or gray+alpha), so streamed and whole-image conversions agree. Samples are
+         * bytes unless a reader was asked to keep 16-bit input, see Sample.
+         */
+        class RowReader
+        {
+        public:
+            virtual ~RowReader() = default;
+
+            int Width() const { return width; }
+            int Height() const { return height; }
+            int Channels() const { return channels; }
+            SampleType Sample() const { return sample; }
+
+            /**
+             * Decodes the next rows.
+             *
+             * @param dst Destination of the first row.
+             * @param stride Distance between destination rows in bytes.
+             * @param rows Number of rows to decode.
+             * @throws std::runtime_error on malformed input.
+             */
+            virtual void ReadRows(unsigned char* dst, std::size_t stride, int rows) = 0;
+
+            /**
+             * Passes over the next rows without delivering them. The default decodes them
+             * into a scratch band; readers that can seek or skip decoding override it.
+             *
+             * @param rows Number of rows to skip.
+             * @throws std::runtime_error on malformed input.
+             */
+            virtual void SkipRows(int rows)
+            {
+                std::size_t rowBytes = static_cast<std::size_t>(width) * channels * SampleBytes(sample);
+                std::vector<unsigned char> scratch(rowBytes * std::min(rows, 16));
+                while (rows > 0) {
+                    int count = std::min(rows, 16);
+                    ReadRows(scratch.data(), rowBytes, count);
+                    rows -= count;
+                }
+            }
+
+            /**
+             * Asks for only some columns of every row, before the first row is read or
+             * skipped. Readers that cannot decode part of a row deliver whole rows; others
+             * may round the range outwards. Width() is the width of the delivered rows after.
+             *
+             * @param first First column wanted.
+             * @param columns Number of columns wanted.
+             * @return The column of the delivered rows at which the first wanted one lies.
+             */
+            virtual int CropColumns(int first, int columns)
+            {
+                (void)columns;
+                return first;
+            }
+
+        protected:
+            int width = 0;    ///< Width in pixels.
+            int height = 0;                     ///< Height in pixels.
+            int channels = 0;                   ///< Channels per delivered pixel.
+            SampleType sample = SampleType::U8; ///< Type of the delivered samples.
+        };
+
+        /**
+         * @class RowWriter
+         * @brief Encodes a single-channel image sequentially, a band of rows at a time.
+         */
+        class RowWriter
+        {
+        public:
+            virtual ~RowWriter() = default;
+
+            /**
+             * Encodes the next rows.
+             *
+             * @param src First row of the band.
+             * @param stride Distance between source rows in bytes.
+             * @param rows Number of rows to encode.
+             * @throws std::runtime_error if writing fails.
+             */
+            virtual void WriteRows(const unsigned char* src, std::size_t stride, int rows) = 0;
+
+            /**
+             * Completes the file after the last row.
+             */
+            virtual void Finish() = 0;
+
+            /**
+             * @return The type of the samples WriteRows takes; wider rows are narrowed first.
+             */
+            virtual SampleType Sample() const { return SampleType::U8; }
+        };
+
+        /**
+         * Reads a little-endian integer of the given width from a byte buffer.
+         */
+        inline std::uint32_t ReadLE(const unsigned char* p, int bytes)
+        {
+            std::uint32_t value = 0;
+            for (int i = bytes - 1; i >= 0; --i) {
+                value = (value << 8) | p[i];
+            }
+            return value;
+        }
+
+        /**
+         * Appends a little-endian integer of the given width to a byte buffer.
+         */
+        inline void WriteLE(std::vector<unsigned char>& out, std::uint32_t value, int bytes)
+        {
+            for (int i = 0; i < bytes; ++i) {
+                out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+            }
+        }
+
+        /**
+         * Swaps the first and third channel of every pixel (BGR to RGB).
+         */
+        inline void SwapRedBlue(unsigned char* row, int width, int channels)
+        {
+            for (int x = 0; x < width; ++x) {
+                std::swap(row[x * channels], row[x * channels + 2]);
+            }
+        }
+
+        /**
+         * @class BmpRowReader
+         * @brief Streams uncompressed 8-bit paletted, 24-bit and 32-bit BMP files.
+         *
+         * Bottom-up files are read band by band from the end, so both row orders stream.
+         * Channels and alpha follow stb_image, so streamed and whole-image output agree: most
+         * writers store 0 in every alpha byte of a 32-bit file, which stb_image then replaces
+         * by 255. The alpha bytes are therefore scanned before the first row is delivered.
+         */
+        class BmpRowReader : public RowReader
+        {
+        public:
+            explicit BmpRowReader(const std::string& path) : file(path, std::ios::binary)
+            {
+                unsigned char header[54 + 16];
+                if (!file.read(reinterpret_cast<char*>(header), 54) || header[0] != 'B' || header[1] != 'M') {
+                    throw std::runtime_error("Malformed BMP header");
+                }
+                dataOffset = ReadLE(header + 10, 4);
+                std::uint32_t infoSize = ReadLE(header + 14, 4);
+                std::int32_t rawHeight = static_cast<std::int32_t>(ReadLE(header + 22, 4));
+                width = static_cast<std::int32_t>(ReadLE(header + 18, 4));
+                height = rawHeight < 0 ? -rawHeight : rawHeight;
+                topDown = rawHeight < 0;
+                bitsPerPixel = static_cast<int>(ReadLE(header + 28, 2));
+                std::uint32_t compression = ReadLE(header + 30, 4);
+                std::uint32_t colorsUsed = ReadLE(header + 46, 4);
+
+                if (infoSize < 40 || width <= 0 || height <= 0) {
+                    throw std::runtime_error("Unsupported BMP header");
+                }
+                if (compression == 3 && bitsPerPixel == 32) {
+                    // Only the usual BGRA masks stream; they follow a 40-byte header or sit inside larger ones.
+                    file.read(reinterpret_cast<char*>(header + 54), infoSize == 40 ? 12 : 16);
+                    bool standard = ReadLE(header + 54, 4) == 0x00FF0000u && ReadLE(header + 58, 4) == 0x0000FF00u &&
+                                    ReadLE(header + 62, 4) == 0x000000FFu;
+                    // A 40-byte header carries only color masks; V4 and V5 headers add the alpha mask.
+                    std::uint32_t alphaMask = infoSize == 40 ? 0 : ReadLE(header + 66, 4);
+                    if (!file || !standard || (alphaMask != 0 && alphaMask != 0xFF000000u)) {
+                        throw std::runtime_error("Unsupported BMP bit fields");
+                    }
+                    // stb_image drops alpha when there is no alpha mask.
+                    channels = alphaMask != 0 ? 4 : 3;
+                } else if (compression != 0) {
+                    throw std::runtime_error("Compressed BMP cannot be streamed");
+                } else if (bitsPerPixel == 8) {
+                    std::size_t entries = colorsUsed != 0 ? std::min<std::uint32_t>(colorsUsed, 256) : 256;
+                    std::vector<unsigned char> raw(entries * 4);
+                    file.seekg(14 + infoSize);
+                    if (!file.read(reinterpret_cast<char*>(raw.data()), raw.size())) {
+                        throw std::runtime_error("Malformed BMP palette");
+                    }
+                    palette.assign(256 * 3, 0);
+                    for (std::size_t i = 0; i < entries; ++i) {
+                        palette[i * 3] = raw[i * 4 + 2];
+                        palette[i * 3 + 1] = raw[i * 4 + 1];
+                        palette[i * 3 + 2] = raw[i * 4];
+                    }
+                    channels = 3;
+                } else if (bitsPerPixel == 24) {
+                    channels = 3;
+                } else if (bitsPerPixel == 32) {
+                    channels = 4;
+                } else {
+                    throw std::runtime_error("Unsupported BMP bit depth");
+                }
+
+                fileRowBytes = ((static_cast<std::size_t>(width) * bitsPerPixel + 31) / 32) * 4;
+                if (channels == 4) {
+                    opaque = AlphaIsZero();
+                }
+            }
+
+            void ReadRows(unsigned char* dst, std::size_t stride, int rows) override
+            {
+                // A bottom-up band is one contiguous block of the file in reverse row order.
+                int firstFileRow = topDown ? nextRow : height - nextRow - rows;
+                band.resize(fileRowBytes * rows);
+                file.seekg(dataOffset + static_cast<std::uint64_t>(firstFileRow) * fileRowBytes);
+                if (!file.read(reinterpret_cast<char*>(band.data()), band.size())) {
+                    throw std::runtime_error("Truncated BMP data");
+                }
+
+                for (int r = 0; r < rows; ++r) {
+                    const unsigned char* src = band.data() + fileRowBytes * (topDown ? r : rows - 1 - r);
+                    unsigned char* out = dst + stride * r;
+                    if (bitsPerPixel == 8) {
+                        for (int x = 0; x < width; ++x) {
+                            std::memcpy(out + x * 3, palette.data() + src[x] * 3, 3);
+                        }
+                    } else if (bitsPerPixel == 24 || channels == 4) {
+                        std::memcpy(out, src, static_cast<std::size_t>(width) * channels);
+                        SwapRedBlue(out, width, channels);
+                        if (opaque) {
+                            for (int x = 0; x < width; ++x) {
+                                out[x * 4 + 3] = 255;
+                            }
+                        }
+                    } else {
+                        for (int x = 0; x < width; ++x) {
+                            out[x * 3] = src[x * 4 + 2];
+                            out[x * 3 + 1] = src[x * 4 + 1];
+                            out[x * 3 + 2] = src[x * 4];
+                        }
+                    }
+                }
+                nextRow += rows;
+            }
+
+            /**
+             * Rows are found by their offset, so skipped ones are not read at all.
+             */
+            void SkipRows(int rows) override { nextRow += rows; }
+
+        private:
+            std::ifstream file;                 ///< The BMP file.
+            std::uint64_t dataOffset = 0;       ///< File offset of the pixel array.
+            std::size_t fileRowBytes = 0;       ///< Bytes per stored row including padding.
+            int bitsPerPixel = 0;               ///< Stored bits per pixel.
+            bool topDown = false;               ///< Rows are stored top to bottom.
+            int nextRow = 0;                    ///< Next row to deliver, counted from the top.
+            bool opaque = false;                ///< Every stored alpha byte is 0, delivered as 255.
+            std::vector<unsigned char> palette; ///< RGB palette of 8-bit files.
+            std::vector<unsigned char> band;    ///< Raw bytes of the current band.
+
+            /**
+             * Reads the pixel array in bounded blocks until it finds a nonzero alpha byte.
+             *
+             * @return true if every alpha byte of the 32-bit pixels is zero.
+             * @throws std::runtime_error if the pixel array is truncated.
+             */
+            bool AlphaIsZero()
+            {
+                int blockRows = static_cast<int>(std::max<std::size_t>(1, (1u << 20) / fileRowBytes));
+                band.resize(fileRowBytes * blockRows);
+                file.seekg(dataOffset);
+                for (int y = 0; y < height; y += blockRows) {
+                    int rows = std::min(blockRows, height - y);
+                    if (!file.read(reinterpret_cast<char*>(band.data()), fileRowBytes * rows)) {
+                        throw std::runtime_error("Truncated BMP data");
+                    }
+                    for (int r = 0; r < rows; ++r) {
+                        const unsigned char* row = band.data() + fileRowBytes * r;
+                        for (int x = 0; x < width; ++x) {
+                            if (row[x * 4 + 3] != 0) {
+                                return false;
+                            }
+                        }
+                    }
+                }
+                return true;
+            }
+        };
+
+        /**
+         * @class TgaRowReader
+         * @brief Streams 8-bit gray, 24-bit and 32-bit TGA files.
+         *
+         * Uncompressed files stream in either row order. Run-length encoded files stream
+         * when stored top to bottom; bottom-up RLE would require decoding the whole file.
+         */
+        class TgaRowReader : public RowReader
+        {
+        public:
+            explicit TgaRowReader(const std::string& path) : file(path, std::ios::binary)
+            {
+                unsigned char header[18];
+                if (!file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+                    throw std::runtime_error("Malformed TGA header");
+                }
+                int imageType = header[2];
+                rle = imageType >= 8;
+                width = static_cast<int>(ReadLE(header + 12, 2));
+                height = static_cast<int>(ReadLE(header + 14, 2));
+                int bitsPerPixel = header[16];
+                topDown = (header[17] & 0x20) != 0;
+                bool gray = (imageType & 7) == 3;
+
+                if (header[1] != 0 || ((imageType & 7) != 2 && !gray) || width <= 0 || height <= 0) {
+                    throw std::runtime_error("Unsupported TGA type");
+                }
+                if ((gray && bitsPerPixel != 8) || (!gray && bitsPerPixel != 24 && bitsPerPixel != 32)) {
+                    throw std::runtime_error("Unsupported TGA bit depth");
+                }
+                if (rle && !topDown) {
+                    throw std::runtime_error("Bottom-up RLE TGA cannot be streamed");
+                }
+                channels = bitsPerPixel / 8;
+                dataOffset = sizeof(header) + header[0];
+                file.seekg(dataOffset);
+            }
+
+            void ReadRows(unsigned char* dst, std::size_t stride, int rows) override
+            {
+                std::size_t rowBytes = static_cast<std::size_t>(width) * channels;
+                if (rle) {
+                    for (int r = 0; r < rows; ++r) {
+                        DecodeRle(dst + stride * r, rowBytes);
+                    }
+                } else {
+                    int firstFileRow = topDown ? nextRow : height - nextRow - rows;
+                    band.resize(rowBytes * rows);
+                    file.seekg(dataOffset + static_cast<std::uint64_t>(firstFileRow) * rowBytes);
+                    if (!file.read(reinterpret_cast<char*>(band.data()), band.size())) {
+                        throw std::runtime_error("Truncated TGA data");
+                    }
+                    for (int r = 0; r < rows; ++r) {
+                        std::memcpy(dst + stride * r, band.data() + rowBytes * (topDown ? r : rows - 1 - r), rowBytes);
+                    }
+                }
+                if (channels >= 3) {
+                    for (int r = 0; r < rows; ++r) {
+                        SwapRedBlue(dst + stride * r, width, channels);
+                    }
+                }
+                nextRow += rows;
+            }
+
+            /**
+             * Uncompressed rows are found by their offset; run-length encoded ones are decoded.
+             */
+            void SkipRows(int rows) override
+            {
+                if (rle) {
+                    RowReader::SkipRows(rows);
+                } else {
+                    nextRow += rows;
+                }
+            }
+
+        private:
+            std::ifstream file;              ///< The TGA file.
+            std::uint64_t dataOffset = 0;    ///< File offset of the pixel data.
+            bool rle = false;                ///< Pixel data is run-length encoded.
+            bool topDown = false;            ///< Rows are stored top to bottom.
+            int nextRow = 0;                 ///< Next row to deliver, counted from the top.
+            int runLeft = 0;                 ///< Pixels left in the current RLE packet.
+            bool runRepeats = false;         ///< The current packet repeats one pixel.
+            unsigned char runPixel[4] = {};  ///< The repeated pixel.
+            std::vector<unsigned char> band; ///< Raw bytes of the current band.
+
+            /**
+             * Decodes one row of RLE data; packets may span rows.
+             */
+            void DecodeRle(unsigned char* out, std::size_t rowBytes)
+            {
+                for (std::size_t offset = 0; offset < rowBytes; offset += channels) {
+                    if (runLeft == 0) {
+                        int packet = file.get();
+                        if (packet == EOF) {
+                            throw std::runtime_error("Truncated TGA data");
+                        }
+                        runLeft = (packet & 0x7F) + 1;
+                        runRepeats = (packet & 0x80) != 0;
+                        if (runRepeats) {
+                            file.read(reinterpret_cast<char*>(runPixel), channels);
+                        }
+                    }
+                    if (!runRepeats) {
+                        file.read(reinterpret_cast<char*>(runPixel), channels);
+                    }
+                    if (!file) {
+                        throw std::runtime_error("Truncated TGA data");
+                    }
+                    std::memcpy(out + offset, runPixel, channels);
+                    --runLeft;
+                }
+            }
+        };
+
+        /**
+         * @class BmpRowWriter
+         * @brief Writes an 8-bit gray BMP. Rows are placed at their bottom-up file offsets.
+         */
+        class BmpRowWriter : public RowWriter
+        {
+        public:
+            BmpRowWriter(const std::string& path, int width, int height)
+                : file(path, std::ios::binary | std::ios::trunc), width(width), height(height),
+                  fileRowBytes((static_cast<std::size_t>(width) + 3) & ~static_cast<std::size_t>(3))
+            {
+                if (!file) {
+                    throw std::runtime_error("Error saving image " + path);
+                }
+                std::uint32_t dataOffset = 14 + 40 + 256 * 4;
+                std::vector<unsigned char> header;
+                header.push_back('B');
+                header.push_back('M');
+                WriteLE(header, static_cast<std::uint32_t>(dataOffset + fileRowBytes * height), 4);
+                WriteLE(header, 0, 4);
+                WriteLE(header, dataOffset, 4);
+                WriteLE(header, 40, 4);
+                WriteLE(header, static_cast<std::uint32_t>(width), 4);
+                WriteLE(header, static_cast<std::uint32_t>(height), 4);
+                WriteLE(header, 1, 2);
+                WriteLE(header, 8, 2);
+                WriteLE(header, 0, 4);
+                WriteLE(header, static_cast<std::uint32_t>(fileRowBytes * height), 4);
+                WriteLE(header, 2835, 4);
+                WriteLE(header, 2835, 4);
+                WriteLE(header, 256, 4);
+                WriteLE(header, 0, 4);
+                for (std::uint32_t i = 0; i < 256; ++i) {
+                    WriteLE(header, i * 0x010101u, 4);
+                }
+                file.write(reinterpret_cast<const char*>(header.data()), header.size());
+                this->dataOffset = dataOffset;
+            }
+
+            void WriteRows(const unsigned char* src, std::size_t stride, int rows) override
+            {
+                // The band occupies one contiguous block of the file in reverse row order.
+                band.assign(fileRowBytes * rows, 0);
+                for (int r = 0; r < rows; ++r) {
+                    std::memcpy(band.data() + fileRowBytes * (rows - 1 - r), src + stride * r, width);
+                }
+                file.seekp(dataOffset + static_cast<std::uint64_t>(height - nextRow - rows) * fileRowBytes);
+                file.write(reinterpret_cast<const char*>(band.data()), band.size());
+                nextRow += rows;
+                if (!file) {
+                    throw std::runtime_error("Error writing BMP data");
+                }
+            }
+
+            void Finish() override
+            {
+                file.close();
+                if (!file) {
+                    throw std::runtime_error("Error writing BMP data");
+                }
+            }
+
+        private:
+            std::ofstream file;              ///< The BMP file.
+            int width;                       ///< Width in pixels.
+            int height;                      ///< Height in pixels.
+            std::size_t fileRowBytes;        ///< Bytes per stored row including padding.
+            std::uint64_t dataOffset = 0;    ///< File offset of the pixel array.
+            int nextRow = 0;                 ///< Next row to write, counted from the top.
+            std::vector<unsigned char> band; ///< Padded rows of the current band.
+        };
+
+        /**
+         * @class TgaRowWriter
+         * @brief Writes an uncompressed 8-bit gray TGA with top-left origin.
+         */
+        class TgaRowWriter : public RowWriter
+        {
+        public:
+            TgaRowWriter(const std::string& path, int width, int height)
+                : file(path, std::ios::binary | std::ios::trunc), width(width)
+            {
+                if (!file) {
+                    throw std::runtime_error("Error saving image " + path);
+                }
+                std::vector<unsigned char> header(12, 0);
+                header[2] = 3;
+                WriteLE(header, static_cast<std::uint32_t>(width), 2);
+                WriteLE(header, static_cast<std::uint32_t>(height), 2);
+                header.push_back(8);
+                header.push_back(0x20);
+                file.write(reinterpret_cast<const char*>(header.data()), header.size());
+            }
+
+            void WriteRows(const unsigned char* src, std::size_t stride, int rows) override
+            {
+                for (int r = 0; r < rows; ++r) {
+                    file.write(reinterpret_cast<const char*>(src + stride * r), width);
+                }
+                if (!file) {
+                    throw std::runtime_error("Error writing TGA data");
+                }
+            }
+
+            void Finish() override
+            {
+                file.close();
+                if (!file) {
+                    throw std::runtime_error("Error writing TGA data");
+                }
+            }
+
+        private:
+            std::ofstream file; ///< The TGA file.
+            int width;          ///< Width in pixels.
+        };
+
+        /**
+         * @class PbmRowWriter
+         * @brief Writes a binary PBM (P4), packing each row to one bit per pixel.
+         */
+        class PbmRowWriter : public RowWriter
+        {
+        public:
+            PbmRowWriter(const std::string& path, int width, int height)
+                : file(path, std::ios::binary | std::ios::trunc), width(width)
+            {
+                if (!file) {
+                    throw std::runtime_error("Error saving image " + path);
+                }
+                file << "P4\n" << width << ' ' << height << '\n';
+            }
+
+            void WriteRows(const unsigned char* src, std::size_t stride, int rows) override
+            {
+                std::size_t rowBytes = (static_cast<std::size_t>(width) + 7) / 8;
+                band.resize(rowBytes * rows);
+                for (int r = 0; r < rows; ++r) {
+                    PackBilevelRow(src + stride * r, width, 0, band.data() + rowBytes * r);
+                }
+                file.write(reinterpret_cast<const char*>(band.data()), band.size());
+                if (!file) {
+                    throw std::runtime_error("Error writing PBM data");
+                }
+            }
+
+            void Finish() override
+            {
+                file.close();
+                if (!file) {
+                    throw std::runtime_error("Error writing PBM data");
+                }
+            }
+
+        private:
+            std::ofstream file;              ///< The PBM file.
+            int width;                       ///< Width in pixels.
+            std::vector<unsigned char> band; ///< Packed rows of the current band.
+        };
+
+#if defined(BWCONV_HAVE_LIBPNG)
+        /**
+         * @class PngRowReader
+         * @brief Streams non-interlaced PNG files through libpng, 16-bit ones in native byte
+         *        order when asked to keep them.
+         *
+         * libpng reports errors with longjmp, so every libpng call happens in a member
+         * function that sets the jump buffer and holds no objects with destructors.
+         */
+        class PngRowReader : public RowReader
+        {
+        public:
+            /**
+             * @param path Path to the PNG file.
+             * @param keep16 Deliver the samples of 16-bit files as 16-bit instead of stripping them.
+             */
+            PngRowReader(const std::string& path, bool keep16) : file(std::fopen(path.c_str(), "rb"), std::fclose)
+            {
+                if (!file) {
+                    throw std::runtime_error("Error loading image");
+                }
+                png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+                info = png ? png_create_info_struct(png) : nullptr;
+                if (info == nullptr || !ReadHeader(keep16)) {
+                    throw std::runtime_error("Malformed PNG header");
+                }
+                if (interlaced) {
+                    throw std::runtime_error("Interlaced PNG cannot be streamed");
+                }
+            }
+
+            ~PngRowReader() override { png_destroy_read_struct(&png, &info, nullptr); }
+
+            void ReadRows(unsigned char* dst, std::size_t stride, int rows) override
+            {
+                if (!ReadPngRows(dst, stride, rows)) {
+                    throw std::runtime_error("Malformed PNG data");
+                }
+            }
+
+        private:
+            std::unique_ptr<FILE, int (*)(FILE*)> file; ///< The PNG file.
+            png_structp png = nullptr;                  ///< libpng read state.
+            png_infop info = nullptr;                   ///< libpng image information.
+            bool interlaced = false;                    ///< Adam7 interlacing was found.
+
+            bool ReadHeader(bool keep16)
+            {
+                if (setjmp(png_jmpbuf(png))) {
+                    return false;
+                }
+                png_init_io(png, file.get());
+                png_read_info(png, info);
+                // Match stb_image: 8 bits per channel, palettes expanded, tRNS as alpha.
+                png_set_expand(png);
+                if (keep16 && png_get_bit_depth(png, info) == 16) {
+                    sample = SampleType::U16;
+                    if (IsLittleEndianHost()) {
+                        png_set_swap(png);
+                    }
+                } else {
+                    png_set_strip_16(png);
+                }
+                interlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+                png_read_update_info(png, info);
+                width = static_cast<int>(png_get_image_width(png, info));
+                height = static_cast<int>(png_get_image_height(png, info));
+                channels = png_get_channels(png, info);
+                return true;
+            }
+
+            bool ReadPngRows(unsigned char* dst, std::size_t stride, int rows)
+            {
+                if (setjmp(png_jmpbuf(png))) {
+                    return false;
+                }
+                for (int r = 0; r < rows; ++r) {
+                    png_read_row(png, dst + stride * r, nullptr);
+                }
+                return true;
+            }
+        };
+
+        /**
+         * @class PngRowWriter
+         * @brief Writes a gray PNG row by row through libpng; bilevel rows are packed to one bit
+         *        per pixel, and 16-bit rows are stored at 16 bits.
+         */
+        class PngRowWriter : public RowWriter
+        {
+        public:
+            PngRowWriter(const std::string& path, int width, int height, const EncoderOptions& options, bool bilevel,
+                         bool wide)
+                : file(std::fopen(path.c_str(), "wb"), std::fclose), options(options), width(width),
+                  wide(wide && !bilevel), packed(bilevel ? (static_cast<std::size_t>(width) + 7) / 8 : 0)
+            {
+                if (!file) {
+                    throw std::runtime_error("Error saving image " + path);
+                }
+                png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+                info = png ? png_create_info_struct(png) : nullptr;
+                if (info == nullptr || !WriteHeader(width, height)) {
+                    throw std::runtime_error("Error saving image " + path);
+                }
+            }
+
+            ~PngRowWriter() override { png_destroy_write_struct(&png, &info); }
+
+            void WriteRows(const unsigned char* src, std::size_t stride, int rows) override
+            {
+                if (!WritePngRows(src, stride, rows)) {
+                    throw std::runtime_error("Error writing PNG data");
+                }
+            }
+
+            void Finish() override
+            {
+                if (!WriteEnd() || std::fflush(file.get()) != 0) {
+                    throw std::runtime_error("Error writing PNG data");
+                }
+            }
+
+            SampleType Sample() const override { return wide ? SampleType::U16 : SampleType::U8; }
+
+        private:
+            std::unique_ptr<FILE, int (*)(FILE*)> file; ///< The PNG file.
+            png_structp png = nullptr;                  ///< libpng write state.
+            png_infop info = nullptr;                   ///< libpng image information.
+            EncoderOptions options;                     ///< Compression level and filter.
+            int width;                                  ///< Width in pixels.
+            bool wide;                                  ///< Rows have 16-bit samples in native byte order.
+            std::vector<unsigned char> packed;          ///< One packed row; empty unless bilevel.
+
+            bool WriteHeader(int width, int height)
+            {
+                if (setjmp(png_jmpbuf(png))) {
+                    return false;
+                }
+                png_init_io(png, file.get());
+                png_set_compression_level(png, options.pngLevel);
+                static const int filters[] = {PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG,
+                                              PNG_FILTER_PAETH};
+                png_set_filter(png, PNG_FILTER_TYPE_BASE,
+                               options.pngFilter == PngFilter::Adaptive ? PNG_ALL_FILTERS
+                                                                        : filters[static_cast<int>(options.pngFilter)]);
+                png_set_IHDR(png, info, static_cast<png_uint_32>(width), static_cast<png_uint_32>(height),
+                             packed.empty() ? (wide ? 16 : 8) : 1,
+                             PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                             PNG_FILTER_TYPE_DEFAULT);
+                png_write_info(png, info);
+                if (wide && IsLittleEndianHost()) {
+                    png_set_swap(png);
+                }
+                return true;
+            }
+
+            bool WritePngRows(const unsigned char* src, std::size_t stride, int rows)
+            {
+                if (setjmp(png_jmpbuf(png))) {
+                    return false;
+                }
+                for (int r = 0; r < rows; ++r) {
+                    if (packed.empty()) {
+                        png_write_row(png, src + stride * r);
+                    } else {
+                        PackBilevelRow(src + stride * r, width, 1, packed.data());
+                        png_write_row(png, packed.data());
+                    }
+                }
+                return true;
+            }
+
+            bool WriteEnd()
+            {
+                if (setjmp(png_jmpbuf(png))) {
+                    return false;
+                }
+                png_write_end(png, nullptr);
+                return true;
+            }
+        };
+#endif
+
+#if defined(BWCONV_HAVE_LIBJPEG)
+        /**
+         * @class JpegRowReader
+         * @brief Streams baseline JPEG files through libjpeg.
+         *
+         * When the processor only needs luminance, libjpeg is asked for grayscale output
+         * and skips chroma entirely. Progressive files are rejected because libjpeg has to
+         * buffer the coefficients of the whole image for them.
+         */
+        class JpegRowReader : public RowReader
+        {
+        public:
+            JpegRowReader(const std::string& path, int desiredChannels)
+                : file(std::fopen(path.c_str(), "rb"), std::fclose)
+            {
+                if (!file) {
+                    throw std::runtime_error("Error loading image");
+                }
+                cinfo.err = jpeg_std_error(&error.base);
+                error.base.error_exit = JpegErrorManager::Exit;
+                jpeg_create_decompress(&cinfo);
+                created = true;
+                if (!Start(desiredChannels)) {
+                    throw std::runtime_error("Malformed JPEG header");
+                }
+                if (progressive) {
+                    throw std::runtime_error("Progressive JPEG cannot be streamed");
+                }
+            }
+
+            ~JpegRowReader() override
+            {
+                if (created) {
+                    jpeg_destroy_decompress(&cinfo);
+                }
+            }
+
+            void ReadRows(unsigned char* dst, std::size_t stride, int rows) override
+            {
+                if (!ReadJpegRows(dst, stride, rows)) {
+                    throw std::runtime_error("Malformed JPEG data");
+                }
+            }
+
+#if defined(BWCONV_HAVE_JPEG_CROP)
+            /**
+             * Skipped rows are entropy decoded but not transformed, upsampled or converted.
+             */
+            void SkipRows(int rows) override
+            {
+                if (!SkipJpegRows(rows)) {
+                    throw std::runtime_error("Malformed JPEG data");
+                }
+            }
+
+            /**
+             * Only the iMCU columns the range touches are decoded.
+             */
+            int CropColumns(int first, int columns) override
+            {
+                if (columns >= width) {
+                    return first;
+                }
+                JDIMENSION offset = static_cast<JDIMENSION>(first), cropped = static_cast<JDIMENSION>(columns);
+                if (!CropJpegColumns(offset, cropped)) {
+                    throw std::runtime_error("Malformed JPEG data");
+                }
+                width = static_cast<int>(cropped);
+                return first - static_cast<int>(offset);
+            }
+#endif
+
+        private:
+            std::unique_ptr<FILE, int (*)(FILE*)> file; ///< The JPEG file.
+            jpeg_decompress_struct cinfo{};              ///< libjpeg decompression state.
+            JpegErrorManager error{};                    ///< Error handler of cinfo.
+            bool created = false;                        ///< cinfo was initialised.
+            bool progressive = false;                    ///< The file uses multiple scans.
+
+            bool Start(int desiredChannels)
+            {
+                if (setjmp(error.jump)) {
+                    return false;
+                }
+                jpeg_stdio_src(&cinfo, file.get());
+                jpeg_read_header(&cinfo, TRUE);
+                progressive = jpeg_has_multiple_scans(&cinfo);
+                if (progressive) {
+                    return true;
+                }
+                if (desiredChannels == 1 || cinfo.jpeg_color_space == JCS_GRAYSCALE) {
+                    cinfo.out_color_space = JCS_GRAYSCALE;
+                } else {
+                    cinfo.out_color_space = JCS_RGB;
+                }
+                jpeg_start_decompress(&cinfo);
+                width = static_cast<int>(cinfo.output_width);
+                height = static_cast<int>(cinfo.output_height);
+                channels = cinfo.output_components;
+                return true;
+            }
+
+            bool ReadJpegRows(unsigned char* dst, std::size_t stride, int rows)
+            {
+                if (setjmp(error.jump)) {
+                    return false;
+                }
+                for (int r = 0; r < rows;) {
+                    JSAMPROW row = dst + stride * r;
+                    r += static_cast<int>(jpeg_read_scanlines(&cinfo, &row, 1));
+                }
+                return true;
+            }
+
+#if defined(BWCONV_HAVE_JPEG_CROP)
+            bool SkipJpegRows(int rows)
+            {
+                if (setjmp(error.jump)) {
+                    return false;
+                }
+                jpeg_skip_scanlines(&cinfo, static_cast<JDIMENSION>(rows));
+                return true;
+            }
+
+            bool CropJpegColumns(JDIMENSION& offset, JDIMENSION& columns)
+            {
+                if (setjmp(error.jump)) {
+                    return false;
+                }
+                jpeg_crop_scanline(&cinfo, &offset, &columns);
+                return true;
+            }
+#endif
+        };
+
+        /**
+         * @class JpegRowWriter
+         * @brief Writes an 8-bit gray JPEG scanline by scanline through libjpeg.
+         */
+        class JpegRowWriter : public RowWriter
+        {
+        public:
+            JpegRowWriter(const std::string& path, int width, int height, int quality)
+                : file(std::fopen(path.c_str(), "wb"), std::fclose)
+            {
+                if (!file) {
+                    throw std::runtime_error("Error saving image " + path);
+                }
+                cinfo.err = jpeg_std_error(&error.base);
+                error.base.error_exit = JpegErrorManager::Exit;
+                jpeg_create_compress(&cinfo);
+                created = true;
+                if (!Start(width, height, quality)) {
+                    throw std::runtime_error("Error saving image " + path);
+                }
+            }
+
+            ~JpegRowWriter() override
+            {
+                if (created) {
+                    jpeg_destroy_compress(&cinfo);
+                }
+            }
+
+            void WriteRows(const unsigned char* src, std::size_t stride, int rows) override
+            {
+                if (!WriteJpegRows(src, stride, rows)) {
+                    throw std::runtime_error("Error writing JPEG data");
+                }
+            }
+
+            void Finish() override
+            {
+                if (!WriteEnd() || std::fflush(file.get()) != 0) {
+                    throw std::runtime_error("Error writing JPEG data");
+                }
+            }
+
+        private:
+            std::unique_ptr<FILE, int (*)(FILE*)> file; ///< The JPEG file.
+            jpeg_compress_struct cinfo{};                ///< libjpeg compression state.
+            JpegErrorManager error{};                    ///< Error handler of cinfo.
+            bool created = false;                        ///< cinfo was initialised.
+
+            bool Start(int width, int height, int quality)
+            {
+                if (setjmp(error.jump)) {
+                    return false;
+                }
+                jpeg_stdio_dest(&cinfo, file.get());
+                cinfo.image_width = static_cast<JDIMENSION>(width);
+                cinfo.image_height = static_cast<JDIMENSION>(height);
+                cinfo.input_components = 1;
+                cinfo.in_color_space = JCS_GRAYSCALE;
+                jpeg_set_defaults(&cinfo);
+                jpeg_set_quality(&cinfo, quality, TRUE);
+                jpeg_start_compress(&cinfo, TRUE);
+                return true;
+            }
+
+            bool WriteJpegRows(const unsigned char* src, std::size_t stride, int rows)
+            {
+                if (setjmp(error.jump)) {
+                    return false;
+                }
+                for (int r = 0; r < rows; ++r) {
+                    JSAMPROW row = const_cast<unsigned char*>(src + stride * r);
+                    jpeg_write_scanlines(&cinfo, &row, 1);
+                }
+                return true;
+            }
+
+            bool WriteEnd()
+            {
+                if (setjmp(error.jump)) {
+                    return false;
+                }
+                jpeg_finish_compress(&cinfo);
+                return true;
+            }
+        };
+#endif
+
+        /**
+         * Opens a streaming decoder chosen by the file's signature.
+         *
+         * @param path Path to the input image.
+         * @param desiredChannels Channels the processor wants; decoders may honour it early.
+         * @param keepWide Deliver 16-bit samples of inputs that have them, see RowReader::Sample.
+         * @return The reader, or nullptr if the format cannot be streamed in this build.
+         * @throws std::runtime_error if the file cannot be read or is malformed.
+         */
+        inline std::unique_ptr<RowReader> OpenRowReader(const std::string& path, int desiredChannels,
+                                                        bool keepWide = false)
+        {
+            unsigned char magic[4] = {};
+            {
+                std::ifstream probe(path, std::ios::binary);
+                if (!probe.read(reinterpret_cast<char*>(magic), sizeof(magic))) {
+                    throw std::runtime_error("Error loading image");
+                }
+            }
+
+            if (magic[0] == 'B' && magic[1] == 'M') {
+                return std::make_unique<BmpRowReader>(path);
+            }
+#if defined(BWCONV_HAVE_LIBPNG)
+            if (magic[0] == 0x89 && magic[1] == 'P' && magic[2] == 'N' && magic[3] == 'G') {
+                return std::make_unique<PngRowReader>(path, keepWide);
+            }
+#endif
+#if defined(BWCONV_HAVE_LIBJPEG)
+            if (magic[0] == 0xFF && magic[1] == 0xD8) {
+                return std::make_unique<JpegRowReader>(path, desiredChannels);
+            }
+#endif
+            (void)desiredChannels;
+            // TGA has no signature; stb_image identifies it by a plausible header as well.
+            if (magic[1] <= 1 && (magic[2] == 2 || magic[2] == 3 || magic[2] == 10 || magic[2] == 11)) {
+                return std::make_unique<TgaRowReader>(path);
+            }
+            return nullptr;
+        }
+
+        /**
+         * Creates a streaming encoder for a single-channel image.
+         *
+         * @param path Path of the output image.
+         * @param extension Lowercase extension selecting the format.
+         * @param width Width in pixels.
+         * @param height Height in pixels.
+         * @param options Encoder settings; the backend choice does not apply to streaming.
+         * @param bilevel The rows are black and white only, which PNG then stores at one bit per pixel.
+         * @param sample Type of the samples to write; writers that store fewer bits ask for bytes.
+         * @return The writer, or nullptr if the format cannot be streamed in this build.
+         */
+        inline std::unique_ptr<RowWriter> CreateRowWriter(const std::string& path, const std::string& extension,
+                                                          int width, int height,
+                                                          const EncoderOptions& options = EncoderOptions(),
+                                                          bool bilevel = false, SampleType sample = SampleType::U8)
+        {
+            if (extension == "bmp") {
+                return std::make_unique<BmpRowWriter>(path, width, height);
+            }
+            if (extension == "tga") {
+                return std::make_unique<TgaRowWriter>(path, width, height);
+            }
+            if (extension == "pbm") {
+                return std::make_unique<PbmRowWriter>(path, width, height);
+            }
+#if defined(BWCONV_HAVE_LIBPNG)
+            if (extension == "png") {
+                return std::make_unique<PngRowWriter>(path, width, height, options, bilevel,
+                                                      sample == SampleType::U16);
+            }
+#endif
+#if defined(BWCONV_HAVE_LIBJPEG)
+            if (extension == "jpg" || extension == "jpeg") {
+                return std::make_unique<JpegRowWriter>(path, width, height, options.jpegQuality);
+            }
+#endif
+            (void)options;
+            (void)bilevel;
+            (void)sample;
+            return nullptr;
+        }
+
+        /**
+         * ReduceToLuma for samples of type T.
+         */
+        template <typename T>
+        void ReduceRowsToLuma(const ImageView& img)
+        {
+            for (int y = 0; y < img.height; ++y) {
+                const T* src = reinterpret_cast<const T*>(img.Row(y));
+                T* dst = reinterpret_cast<T*>(img.data) + static_cast<std::size_t>(y) * img.width;
+                for (int x = 0; x < img.width; ++x) {
+                    const T* p = src + x * img.channels;
+                    dst[x] = img.channels >= 3 ? static_cast<T>((p[0] * 77u + p[1] * 150u + p[2] * 29u) >> 8) : p[0];
+                }
+            }
+        }
+
+        /**
+         * Reduces interleaved pixels to luminance the way stb_image does for
+         * desired_channels == 1, so streamed and whole-image --decode-gray agree.
+         * 16-bit samples use the same weights, as stb_image's 16-bit conversion does.
+         */
+        inline void ReduceToLuma(ImageView& img)
+        {
+            if (img.sample == SampleType::U16) {
+                ReduceRowsToLuma<std::uint16_t>(img);
+            } else {
+                ReduceRowsToLuma<unsigned char>(img);
+            }
+            img.channels = 1;
+            img.stride = img.RowBytes();
+        }
+    } // namespace Streaming
+} // namespace bwconv
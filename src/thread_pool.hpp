@@ -0,0 +1,376 @@
+/**
+ * @file thread_pool.hpp
+ * @brief Fixed-size pool of worker threads with a range-stealing ParallelFor.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "numa.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bwconv
+{
+    /**
+     * @class ThreadPool
+     * @brief Fixed-size pool of long-lived worker threads.
+     *
+     * The pool is created once per process and shared by every conversion, so
+     * threads are never spawned or joined per image. Independent jobs (whole files
+     * in batch mode) are queued with Submit, and data-parallel loops inside a single
+     * job use ParallelFor, in which the calling thread takes part in the work. Because
+     * the caller never blocks idly, ParallelFor may be called from inside a pool task.
+     *
+     * ParallelFor schedules by range stealing: the whole range of tiles starts with the
+     * caller, and every participant that runs dry splits off the back half of the largest
+     * remaining range. Participants therefore walk contiguous tiles, and a slow core only
+     * delays the tile it is working on rather than a fixed share of the image.
+     *
+     * Workers can be placed on CPUs and NUMA nodes. Tasks then queue per node: Submit
+     * queues on the caller's node, or on a given one, and a worker takes tasks of its
+     * own node first and only steals those of other nodes when its node has none, so
+     * parallel loops stay on the node whose memory their image lives in.
+     */
+    class ThreadPool
+    {
+    public:
+        /**
+         * Starts the worker threads.
+         *
+         * @param threadCount Number of workers. A pool without workers runs submitted
+         *                    tasks inline and ParallelFor on the calling thread only.
+         */
+        explicit ThreadPool(unsigned int threadCount) : ThreadPool(std::vector<Numa::WorkerPlacement>(threadCount))
+        {
+        }
+
+        /**
+         * Starts one worker per placement, bound to its CPUs and node.
+         *
+         * @param placement Node and CPUs of every worker.
+         */
+        explicit ThreadPool(const std::vector<Numa::WorkerPlacement>& placement)
+        {
+            int nodes = 1;
+            for (const auto& place : placement) {
+                nodes = std::max(nodes, place.node + 1);
+            }
+            tasks.resize(static_cast<std::size_t>(nodes));
+            workers.reserve(placement.size());
+            for (const auto& place : placement) {
+                workers.emplace_back([this, place] {
+                    Numa::PlaceCurrentThread(place);
+                    WorkerLoop(place.node);
+                });
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /**
+         * Finishes the queued tasks and joins the workers.
+         */
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wakeUp.notify_all();
+            for (auto& th : workers) {
+                th.join();
+            }
+        }
+
+        /**
+         * @return The number of worker threads.
+         */
+        unsigned int Size() const { return static_cast<unsigned int>(workers.size()); }
+
+        /**
+         * @return The number of nodes the workers are placed on; 1 without placement.
+         */
+        int Nodes() const { return static_cast<int>(tasks.size()); }
+
+        /**
+         * Queues a task for execution on a worker thread, preferably of the caller's node.
+         * The task must not throw; exceptions are the caller's responsibility.
+         *
+         * @param task The callable to run.
+         */
+        void Submit(std::function<void()> task) { Submit(std::move(task), Numa::CurrentNode()); }
+
+        /**
+         * Queues a task for execution on a worker thread, preferably of the given node.
+         *
+         * @param task The callable to run.
+         * @param node Node whose workers should run it; taken modulo Nodes().
+         */
+        void Submit(std::function<void()> task, int node)
+        {
+            if (workers.empty()) {
+                task();
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks[static_cast<std::size_t>(node) % tasks.size()].push_back(std::move(task));
+            }
+            // With several nodes any woken worker might be of another node, so all are woken
+            // and a worker of the task's node, which looks there first, gets the chance to take it.
+            if (tasks.size() > 1) {
+                wakeUp.notify_all();
+            } else {
+                wakeUp.notify_one();
+            }
+        }
+
+        /**
+         * Runs body over [begin, end) in tiles of grain indices and waits for completion.
+         * The calling thread processes tiles as well. The first exception thrown by the body
+         * is rethrown to the caller once every tile has finished.
+         *
+         * @param begin First index of the range.
+         * @param end One past the last index of the range.
+         * @param grain Number of indices per tile; zero is treated as one.
+         * @param body Callable invoked as body(tileBegin, tileEnd).
+         * @param busySeconds Optional output receiving, per participant, the seconds spent
+         *                    inside body; index 0 is the calling thread.
+         */
+        void ParallelFor(std::size_t begin, std::size_t end, std::size_t grain,
+                         const std::function<void(std::size_t, std::size_t)>& body,
+                         std::vector<double>* busySeconds = nullptr)
+        {
+            if (begin >= end) {
+                return;
+            }
+
+            grain = std::max<std::size_t>(1, grain);
+            std::size_t tiles = (end - begin + grain - 1) / grain;
+            if (tiles == 1 || workers.empty()) {
+                auto start = std::chrono::steady_clock::now();
+                body(begin, end);
+                if (busySeconds != nullptr) {
+                    busySeconds->assign(1, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                }
+                return;
+            }
+
+            std::size_t participants = std::min<std::size_t>(tiles, workers.size() + 1);
+            auto state = std::make_shared<ParallelForState>(participants);
+            state->begin = begin;
+            state->end = end;
+            state->grain = grain;
+            state->tiles = tiles;
+            state->body = &body;
+            state->timed = busySeconds != nullptr;
+            if (state->timed) {
+                state->busy.assign(participants, 0.0);
+            }
+            state->slots[0].range.store(ParallelForState::Pack(0, tiles));
+
+            for (std::size_t i = 1; i < participants; ++i) {
+                Submit([state] { Participate(*state, state->nextSlot.fetch_add(1)); });
+            }
+            Participate(*state, 0);
+
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->finished.wait(lock, [&] { return state->done == state->tiles; });
+            if (busySeconds != nullptr) {
+                *busySeconds = state->busy;
+            }
+            if (state->error) {
+                std::rethrow_exception(state->error);
+            }
+        }
+
+    private:
+        /**
+         * Shared bookkeeping of a single ParallelFor call. Helper tasks may outlive the call
+         * when they start after all tiles were taken, hence the shared ownership.
+         */
+        struct ParallelForState
+        {
+            /**
+             * Tile range owned by one participant, packed as (first << 32) | last so that
+             * the owner taking from the front and thieves splitting off the back can both
+             * update it with a single compare-and-swap.
+             */
+            struct alignas(64) Slot
+            {
+                std::atomic<std::uint64_t> range{0};
+            };
+
+            explicit ParallelForState(std::size_t participants) : slots(participants) {}
+
+            static std::uint64_t Pack(std::uint64_t first, std::uint64_t last) { return (first << 32) | last; }
+            static std::size_t First(std::uint64_t range) { return static_cast<std::size_t>(range >> 32); }
+            static std::size_t Last(std::uint64_t range) { return static_cast<std::size_t>(range & 0xFFFFFFFFu); }
+
+            std::size_t begin = 0;
+            std::size_t end = 0;
+            std::size_t grain = 0;
+            std::size_t tiles = 0;
+            const std::function<void(std::size_t, std::size_t)>* body = nullptr;
+            std::vector<Slot> slots;
+            std::atomic<std::size_t> nextSlot{1};
+            std::mutex mutex;
+            std::condition_variable finished;
+            std::size_t done = 0;
+            std::exception_ptr error;
+            bool timed = false;       ///< Measure the time participants spend in body.
+            std::vector<double> busy; ///< Seconds in body per participant, guarded by mutex.
+        };
+
+        std::vector<std::thread> workers;                     ///< Worker threads.
+        std::vector<std::deque<std::function<void()>>> tasks; ///< Pending tasks of every node.
+        std::mutex mutex;                                     ///< Guards tasks and stopping.
+        std::condition_variable wakeUp;                       ///< Signalled when a task arrives or on shutdown.
+        bool stopping = false;                                ///< Set by the destructor.
+
+        /**
+         * Takes the first tile of the participant's own range.
+         *
+         * @return true and the tile index, or false when the range is empty.
+         */
+        static bool TakeOwn(ParallelForState::Slot& slot, std::size_t& tile)
+        {
+            std::uint64_t range = slot.range.load();
+            for (;;) {
+                std::size_t first = ParallelForState::First(range);
+                std::size_t last = ParallelForState::Last(range);
+                if (first >= last) {
+                    return false;
+                }
+                if (slot.range.compare_exchange_weak(range, ParallelForState::Pack(first + 1, last))) {
+                    tile = first;
+                    return true;
+                }
+            }
+        }
+
+        /**
+         * Moves the back half of the largest range held by another participant into the
+         * thief's own, currently empty, slot.
+         *
+         * @return false when no other participant has at least two tiles left.
+         */
+        static bool Steal(ParallelForState& state, std::size_t thief)
+        {
+            for (;;) {
+                std::size_t victim = thief;
+                std::uint64_t victimRange = 0;
+                std::size_t largest = 1;
+                for (std::size_t i = 0; i < state.slots.size(); ++i) {
+                    std::uint64_t range = state.slots[i].range.load();
+                    std::size_t size = ParallelForState::Last(range) - std::min(ParallelForState::First(range),
+                                                                                 ParallelForState::Last(range));
+                    if (i != thief && size > largest) {
+                        victim = i;
+                        victimRange = range;
+                        largest = size;
+                    }
+                }
+                if (victim == thief) {
+                    return false;
+                }
+
+                std::size_t first = ParallelForState::First(victimRange);
+                std::size_t last = ParallelForState::Last(victimRange);
+                std::size_t middle = first + (last - first) / 2;
+                if (state.slots[victim].range.compare_exchange_strong(victimRange,
+                                                                      ParallelForState::Pack(first, middle))) {
+                    state.slots[thief].range.store(ParallelForState::Pack(middle, last));
+                    return true;
+                }
+            }
+        }
+
+        /**
+         * Processes tiles from the participant's slot, stealing when it runs dry.
+         */
+        static void Participate(ParallelForState& state, std::size_t slot)
+        {
+            std::size_t processed = 0;
+            std::exception_ptr error;
+            std::size_t tile = 0;
+            std::chrono::steady_clock::duration busy{};
+            while (TakeOwn(state.slots[slot], tile) || (Steal(state, slot) && TakeOwn(state.slots[slot], tile))) {
+                std::size_t tileBegin = state.begin + tile * state.grain;
+                std::size_t tileEnd = std::min(state.end, tileBegin + state.grain);
+                auto start = state.timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+                try {
+                    if (!error) {
+                        (*state.body)(tileBegin, tileEnd);
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                if (state.timed) {
+                    busy += std::chrono::steady_clock::now() - start;
+                }
+                ++processed;
+            }
+            if (processed == 0) {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (error && !state.error) {
+                state.error = error;
+            }
+            if (state.timed) {
+                state.busy[slot] += std::chrono::duration<double>(busy).count();
+            }
+            state.done += processed;
+            if (state.done == state.tiles) {
+                state.finished.notify_all();
+            }
+        }
+
+        /**
+         * Main loop of a worker thread.
+         *
+         * @param node The worker's node, whose queue it serves first.
+         */
+        void WorkerLoop(int node)
+        {
+            for (;;) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    std::deque<std::function<void()>>* queue = nullptr;
+                    wakeUp.wait(lock, [&] {
+                        for (std::size_t i = 0; i < tasks.size() && queue == nullptr; ++i) {
+                            std::deque<std::function<void()>>& candidate = tasks[(node + i) % tasks.size()];
+                            queue = candidate.empty() ? nullptr : &candidate;
+                        }
+                        return stopping || queue != nullptr;
+                    });
+                    if (queue == nullptr) {
+                        return;
+                    }
+                    task = std::move(queue->front());
+                    queue->pop_front();
+                }
+                task();
+            }
+        }
+    };
+} // namespace bwconv
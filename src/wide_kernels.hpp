@@ -0,0 +1,585 @@
+/**
+ * @file wide_kernels.hpp
+ * @brief Grayscale and sample conversion kernels for 16-bit and float images.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include "kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace bwconv
+{
+    namespace Kernels
+    {
+        /**
+         * Signature of the gray kernels for wide samples, the counterpart of GrayKernel.
+         *
+         * @tparam T std::uint16_t or float.
+         */
+        template <typename T>
+        using WideGrayKernel = void (*)(const T* src, T* dst, std::size_t pixels);
+
+        /**
+         * Luma weights for wide samples: in units of 1/65536, summing to 65536, for 16-bit
+         * samples, and the exact coefficients for floats.
+         */
+        template <LumaMode Mode>
+        struct WideLumaWeights;
+
+        template <>
+        struct WideLumaWeights<LumaMode::Bt601>
+        {
+            static constexpr std::uint32_t r = 19595, g = 38470, b = 7471;
+            static constexpr float fr = 0.299f, fg = 0.587f, fb = 0.114f;
+        };
+
+        template <>
+        struct WideLumaWeights<LumaMode::Bt709>
+        {
+            static constexpr std::uint32_t r = 13933, g = 46871, b = 4732;
+            static constexpr float fr = 0.2126f, fg = 0.7152f, fb = 0.0722f;
+        };
+
+        /// Float samples are linear light already, so linear luma is BT.709 on them.
+        template <>
+        struct WideLumaWeights<LumaMode::Linear> : WideLumaWeights<LumaMode::Bt709>
+        {
+        };
+
+        /**
+         * Rounds y * a / 65535 exactly for 16-bit y and a.
+         */
+        inline std::uint32_t MultiplyAlpha16(std::uint32_t y, std::uint32_t a)
+        {
+            std::uint32_t t = y * a + 32768;
+            return (t + (t >> 16)) >> 16;
+        }
+
+        /**
+         * Tables converting between 16-bit sRGB samples and linear light.
+         */
+        struct WideLinearTables
+        {
+            float toLinear[65536];       ///< sRGB sample to linear light, 0 to 1.
+            std::uint16_t toSrgb[65536]; ///< Linear light in units of 1/65535 to sRGB sample.
+
+            /**
+             * @return The tables, computed on first use.
+             */
+            static const WideLinearTables& Get()
+            {
+                static const WideLinearTables tables;
+                return tables;
+            }
+
+        private:
+            WideLinearTables()
+            {
+                for (int v = 0; v < 65536; ++v) {
+                    double c = v / 65535.0;
+                    toLinear[v] = static_cast<float>(c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+                    double e = c <= 0.0031308 ? c * 12.92 : 1.055 * std::pow(c, 1 / 2.4) - 0.055;
+                    toSrgb[v] = static_cast<std::uint16_t>(std::lround(std::fmin(1.0, e) * 65535));
+                }
+            }
+        };
+
+        /**
+         * Single-channel input is already gray; the conversion is a copy.
+         */
+        template <typename T>
+        void GrayWideCopy(const T* src, T* dst, std::size_t pixels)
+        {
+            if (src != dst) {
+                std::memmove(dst, src, pixels * sizeof(T));
+            }
+        }
+
+        /**
+         * Portable gray kernel for wide samples, the reference of the SIMD kernels.
+         *
+         * Average is the truncated mean of all channels for 16-bit samples and the mean for
+         * floats. The weighted modes round (wr R + wg G + wb B) / 65536 for 16-bit samples.
+         * Linear decodes 16-bit sRGB, while float samples are linear already.
+         *
+         * @tparam T std::uint16_t or float.
+         * @tparam Channels The number of color channels per pixel, 2 to 4.
+         * @tparam Mode The luma mode.
+         * @tparam Premultiply Scale the result of the weighted modes by the alpha channel, if any.
+         */
+        template <typename T, int Channels, LumaMode Mode, bool Premultiply>
+        void GrayWidePortable(const T* src, T* dst, std::size_t pixels)
+        {
+            static_assert(Channels >= 2 && Channels <= 4, "single-channel input is copied");
+            constexpr bool kScale = Premultiply && Mode != LumaMode::Average && Channels % 2 == 0;
+            for (std::size_t i = 0; i < pixels; ++i) {
+                const T* p = src + i * Channels;
+                if constexpr (std::is_same<T, float>::value) {
+                    float y = p[0];
+                    if constexpr (Mode == LumaMode::Average) {
+                        y = p[0] + p[1];
+                        if constexpr (Channels >= 3) {
+                            y += p[2];
+                        }
+                        if constexpr (Channels == 4) {
+                            y += p[3];
+                        }
+                        y *= 1.0f / Channels;
+                    } else if constexpr (Channels >= 3) {
+                        using W = WideLumaWeights<Mode>;
+                        y = p[0] * W::fr + p[1] * W::fg + p[2] * W::fb;
+                    }
+                    if constexpr (kScale) {
+                        y *= p[Channels - 1];
+                    }
+                    dst[i] = y;
+                } else if constexpr (Mode == LumaMode::Average) {
+                    std::uint32_t sum = 0;
+                    for (int j = 0; j < Channels; ++j) {
+                        sum += p[j];
+                    }
+                    dst[i] = static_cast<T>(sum / Channels);
+                } else if constexpr (Mode == LumaMode::Linear) {
+                    const WideLinearTables& tables = WideLinearTables::Get();
+                    float y = tables.toLinear[p[0]];
+                    if constexpr (Channels >= 3) {
+                        using W = WideLumaWeights<Mode>;
+                        y = tables.toLinear[p[0]] * W::fr + tables.toLinear[p[1]] * W::fg +
+                            tables.toLinear[p[2]] * W::fb;
+                    }
+                    if constexpr (kScale) {
+                        y *= p[Channels - 1] * (1.0f / 65535);
+                    }
+                    dst[i] = tables.toSrgb[std::min(65535, static_cast<int>(y * 65535 + 0.5f))];
+                } else {
+                    std::uint32_t y = p[0];
+                    if constexpr (Channels >= 3) {
+                        using W = WideLumaWeights<Mode>;
+                        y = (p[0] * W::r + p[1] * W::g + p[2] * W::b + 32768) >> 16;
+                    }
+                    if constexpr (kScale) {
+                        y = MultiplyAlpha16(y, p[Channels - 1]);
+                    }
+                    dst[i] = static_cast<T>(y);
+                }
+            }
+        }
+
+#if defined(BWCONV_X86_SIMD)
+        /**
+         * pshufb masks for 16-bit samples: gathering channel c of 8 RGB pixels from the k-th
+         * 16-byte block, and reordering an RGBA pixel pair to R0 R1 G0 G1 B0 B1 A0 A1.
+         */
+        struct WideShuffleMasks
+        {
+            alignas(16) unsigned char rgb[3][3][16];
+            alignas(16) unsigned char rgbaPairs[16];
+        };
+
+        constexpr WideShuffleMasks MakeWideShuffleMasks()
+        {
+            WideShuffleMasks masks{};
+            for (int c = 0; c < 3; ++c) {
+                for (int k = 0; k < 3; ++k) {
+                    for (int i = 0; i < 8; ++i) {
+                        int word = 3 * i + c;
+                        bool inBlock = word / 8 == k;
+                        masks.rgb[c][k][2 * i] = inBlock ? static_cast<unsigned char>(2 * (word % 8)) : 0x80;
+                        masks.rgb[c][k][2 * i + 1] = inBlock ? static_cast<unsigned char>(2 * (word % 8) + 1) : 0x80;
+                    }
+                }
+            }
+            for (int j = 0; j < 8; ++j) {
+                int word = (j % 2) * 4 + j / 2;
+                masks.rgbaPairs[2 * j] = static_cast<unsigned char>(2 * word);
+                masks.rgbaPairs[2 * j + 1] = static_cast<unsigned char>(2 * word + 1);
+            }
+            return masks;
+        }
+
+        inline constexpr WideShuffleMasks kWideShuffle = MakeWideShuffleMasks();
+
+        /**
+         * Splits 8 interleaved 16-bit RGB or RGBA pixels into one vector per channel.
+         */
+        template <int Channels>
+        __attribute__((target("sse4.1"))) inline void LoadWideSse41(const std::uint16_t* p, __m128i& r, __m128i& g,
+                                                                    __m128i& b, __m128i& a)
+        {
+            auto mask = [](const unsigned char* bytes) {
+                return _mm_load_si128(reinterpret_cast<const __m128i*>(bytes));
+            };
+            const __m128i* in = reinterpret_cast<const __m128i*>(p);
+            if constexpr (Channels == 3) {
+                __m128i v0 = _mm_loadu_si128(in), v1 = _mm_loadu_si128(in + 1), v2 = _mm_loadu_si128(in + 2);
+                __m128i* channels[3] = {&r, &g, &b};
+                for (int c = 0; c < 3; ++c) {
+                    *channels[c] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, mask(kWideShuffle.rgb[c][0])),
+                                                             _mm_shuffle_epi8(v1, mask(kWideShuffle.rgb[c][1]))),
+                                                _mm_shuffle_epi8(v2, mask(kWideShuffle.rgb[c][2])));
+                }
+                a = _mm_setzero_si128();
+            } else {
+                const __m128i pairs = mask(kWideShuffle.rgbaPairs);
+                __m128i s0 = _mm_shuffle_epi8(_mm_loadu_si128(in), pairs);
+                __m128i s1 = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), pairs);
+                __m128i s2 = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), pairs);
+                __m128i s3 = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), pairs);
+                __m128i t0 = _mm_unpacklo_epi32(s0, s1), t1 = _mm_unpackhi_epi32(s0, s1);
+                __m128i t2 = _mm_unpacklo_epi32(s2, s3), t3 = _mm_unpackhi_epi32(s2, s3);
+                r = _mm_unpacklo_epi64(t0, t2);
+                g = _mm_unpackhi_epi64(t0, t2);
+                b = _mm_unpacklo_epi64(t1, t3);
+                a = _mm_unpackhi_epi64(t1, t3);
+            }
+        }
+
+        /**
+         * Gray of 4 pixels whose 16-bit channels were widened to 32-bit lanes.
+         */
+        template <int Channels, LumaMode Mode, bool Premultiply>
+        __attribute__((target("sse4.1"))) inline __m128i WeighWideSse41(__m128i r, __m128i g, __m128i b, __m128i a)
+        {
+            if constexpr (Mode == LumaMode::Average) {
+                __m128i sum = _mm_add_epi32(_mm_add_epi32(r, g), b);
+                if constexpr (Channels == 4) {
+                    return _mm_srli_epi32(_mm_add_epi32(sum, a), 2);
+                }
+                // (sum + 0.5) / 3 stays at least 1/6 away from integers, far beyond float error.
+                __m128 third = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(0.5f)), _mm_set1_ps(1.0f / 3));
+                return _mm_cvttps_epi32(third);
+            } else {
+                using W = WideLumaWeights<Mode>;
+                __m128i y = _mm_add_epi32(_mm_mullo_epi32(r, _mm_set1_epi32(W::r)),
+                                          _mm_mullo_epi32(g, _mm_set1_epi32(W::g)));
+                y = _mm_add_epi32(_mm_add_epi32(y, _mm_mullo_epi32(b, _mm_set1_epi32(W::b))), _mm_set1_epi32(32768));
+                y = _mm_srli_epi32(y, 16);
+                if constexpr (Premultiply && Channels == 4) {
+                    __m128i t = _mm_add_epi32(_mm_mullo_epi32(y, a), _mm_set1_epi32(32768));
+                    y = _mm_srli_epi32(_mm_add_epi32(t, _mm_srli_epi32(t, 16)), 16);
+                }
+                return y;
+            }
+        }
+
+        /**
+         * SSE4.1 kernel for 16-bit RGB and RGBA, 8 pixels per iteration. Average, BT.601 and
+         * BT.709 produce the samples of GrayWidePortable.
+         */
+        template <int Channels, LumaMode Mode, bool Premultiply>
+        __attribute__((target("sse4.1"))) void GrayWideSse41(const std::uint16_t* src, std::uint16_t* dst,
+                                                              std::size_t pixels)
+        {
+            static_assert(Channels == 3 || Channels == 4, "SIMD kernels handle color input");
+            const __m128i zero = _mm_setzero_si128();
+            std::size_t i = 0;
+            for (; i + 8 <= pixels; i += 8) {
+                __m128i r, g, b, a;
+                LoadWideSse41<Channels>(src + i * Channels, r, g, b, a);
+                __m128i low = WeighWideSse41<Channels, Mode, Premultiply>(
+                    _mm_cvtepu16_epi32(r), _mm_cvtepu16_epi32(g), _mm_cvtepu16_epi32(b), _mm_cvtepu16_epi32(a));
+                __m128i high = WeighWideSse41<Channels, Mode, Premultiply>(
+                    _mm_unpackhi_epi16(r, zero), _mm_unpackhi_epi16(g, zero), _mm_unpackhi_epi16(b, zero),
+                    _mm_unpackhi_epi16(a, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi32(low, high));
+            }
+            GrayWidePortable<std::uint16_t, Channels, Mode, Premultiply>(src + i * Channels, dst + i, pixels - i);
+        }
+
+        /**
+         * SSE kernel for float RGB and RGBA, 4 pixels per iteration, with the operations of
+         * GrayWidePortable in the same order. RGB pixels are loaded as overlapping groups
+         * of four floats and transposed.
+         */
+        template <int Channels, LumaMode Mode, bool Premultiply>
+        __attribute__((target("sse4.1"))) void GrayFloatSse41(const float* src, float* dst, std::size_t pixels)
+        {
+            static_assert(Channels == 3 || Channels == 4, "SIMD kernels handle color input");
+            std::size_t i = 0;
+            // The last RGB group reads one float past its pixels, which must still be input.
+            for (; i + (Channels == 3 ? 5 : 4) <= pixels; i += 4) {
+                const float* p = src + i * Channels;
+                __m128 r = _mm_loadu_ps(p), g = _mm_loadu_ps(p + Channels);
+                __m128 b = _mm_loadu_ps(p + 2 * Channels), a = _mm_loadu_ps(p + 3 * Channels);
+                _MM_TRANSPOSE4_PS(r, g, b, a);
+                __m128 y;
+                if constexpr (Mode == LumaMode::Average) {
+                    y = _mm_add_ps(_mm_add_ps(r, g), b);
+                    if constexpr (Channels == 4) {
+                        y = _mm_add_ps(y, a);
+                    }
+                    y = _mm_mul_ps(y, _mm_set1_ps(1.0f / Channels));
+                } else {
+                    using W = WideLumaWeights<Mode>;
+                    y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(W::fr)), _mm_mul_ps(g, _mm_set1_ps(W::fg))),
+                                   _mm_mul_ps(b, _mm_set1_ps(W::fb)));
+                    if constexpr (Premultiply && Channels == 4) {
+                        y = _mm_mul_ps(y, a);
+                    }
+                }
+                _mm_storeu_ps(dst + i, y);
+            }
+            GrayWidePortable<float, Channels, Mode, Premultiply>(src + i * Channels, dst + i, pixels - i);
+        }
+#endif
+
+#if defined(BWCONV_NEON_SIMD)
+        /**
+         * NEON kernel for 16-bit RGB and RGBA, 8 pixels per iteration, producing the samples
+         * of GrayWidePortable.
+         */
+        template <int Channels, LumaMode Mode, bool Premultiply>
+        void GrayWideNeon(const std::uint16_t* src, std::uint16_t* dst, std::size_t pixels)
+        {
+            static_assert(Channels == 3 || Channels == 4, "SIMD kernels handle color input");
+            auto weigh = [](uint16x4_t r, uint16x4_t g, uint16x4_t b, uint16x4_t a) -> uint16x4_t {
+                if constexpr (Mode == LumaMode::Average) {
+                    uint32x4_t sum = vaddw_u16(vaddl_u16(r, g), b);
+                    if constexpr (Channels == 4) {
+                        return vshrn_n_u32(vaddw_u16(sum, a), 2);
+                    }
+                    float32x4_t third = vmulq_n_f32(vaddq_f32(vcvtq_f32_u32(sum), vdupq_n_f32(0.5f)), 1.0f / 3);
+                    return vmovn_u32(vcvtq_u32_f32(third));
+                } else {
+                    using W = WideLumaWeights<Mode>;
+                    uint32x4_t y = vmlal_n_u16(vmlal_n_u16(vmull_n_u16(r, W::r), g, W::g), b, W::b);
+                    y = vshrq_n_u32(vaddq_u32(y, vdupq_n_u32(32768)), 16);
+                    if constexpr (Premultiply && Channels == 4) {
+                        uint32x4_t t = vaddq_u32(vmulq_u32(y, vmovl_u16(a)), vdupq_n_u32(32768));
+                        y = vshrq_n_u32(vaddq_u32(t, vshrq_n_u32(t, 16)), 16);
+                    }
+                    return vmovn_u32(y);
+                }
+            };
+            std::size_t i = 0;
+            for (; i + 8 <= pixels; i += 8) {
+                const std::uint16_t* p = src + i * Channels;
+                uint16x8_t r, g, b, a = vdupq_n_u16(0);
+                if constexpr (Channels == 3) {
+                    uint16x8x3_t v = vld3q_u16(p);
+                    r = v.val[0];
+                    g = v.val[1];
+                    b = v.val[2];
+                } else {
+                    uint16x8x4_t v = vld4q_u16(p);
+                    r = v.val[0];
+                    g = v.val[1];
+                    b = v.val[2];
+                    a = v.val[3];
+                }
+                vst1q_u16(dst + i,
+                          vcombine_u16(weigh(vget_low_u16(r), vget_low_u16(g), vget_low_u16(b), vget_low_u16(a)),
+                                       weigh(vget_high_u16(r), vget_high_u16(g), vget_high_u16(b), vget_high_u16(a))));
+            }
+            GrayWidePortable<std::uint16_t, Channels, Mode, Premultiply>(src + i * Channels, dst + i, pixels - i);
+        }
+
+        /**
+         * NEON kernel for float RGB and RGBA, 4 pixels per iteration, with the operations of
+         * GrayWidePortable in the same order.
+         */
+        template <int Channels, LumaMode Mode, bool Premultiply>
+        void GrayFloatNeon(const float* src, float* dst, std::size_t pixels)
+        {
+            static_assert(Channels == 3 || Channels == 4, "SIMD kernels handle color input");
+            std::size_t i = 0;
+            for (; i + 4 <= pixels; i += 4) {
+                const float* p = src + i * Channels;
+                float32x4_t r, g, b, a = vdupq_n_f32(0);
+                if constexpr (Channels == 3) {
+                    float32x4x3_t v = vld3q_f32(p);
+                    r = v.val[0];
+                    g = v.val[1];
+                    b = v.val[2];
+                } else {
+                    float32x4x4_t v = vld4q_f32(p);
+                    r = v.val[0];
+                    g = v.val[1];
+                    b = v.val[2];
+                    a = v.val[3];
+                }
+                float32x4_t y;
+                if constexpr (Mode == LumaMode::Average) {
+                    y = vaddq_f32(vaddq_f32(r, g), b);
+                    if constexpr (Channels == 4) {
+                        y = vaddq_f32(y, a);
+                    }
+                    y = vmulq_n_f32(y, 1.0f / Channels);
+                } else {
+                    using W = WideLumaWeights<Mode>;
+                    y = vaddq_f32(vaddq_f32(vmulq_n_f32(r, W::fr), vmulq_n_f32(g, W::fg)), vmulq_n_f32(b, W::fb));
+                    if constexpr (Premultiply && Channels == 4) {
+                        y = vmulq_f32(y, a);
+                    }
+                }
+                vst1q_f32(dst + i, y);
+            }
+            GrayWidePortable<float, Channels, Mode, Premultiply>(src + i * Channels, dst + i, pixels - i);
+        }
+#endif
+
+        /**
+         * The wide gray kernels of every luma mode, alpha handling and channel count, with
+         * the SIMD ones where the CPU supports them.
+         *
+         * @tparam T std::uint16_t or float.
+         */
+        template <typename T>
+        struct WideGrayKernelTable
+        {
+            /// Indexed by luma mode, premultiplication and channel count.
+            WideGrayKernel<T> kernels[4][2][5] = {};
+
+            WideGrayKernelTable()
+            {
+                Fill<LumaMode::Average>();
+                Fill<LumaMode::Bt601>();
+                Fill<LumaMode::Bt709>();
+                Fill<LumaMode::Linear>();
+            }
+
+        private:
+            template <LumaMode Mode>
+            void Fill()
+            {
+                constexpr bool kFloat = std::is_same<T, float>::value;
+                for (int premultiply = 0; premultiply < 2; ++premultiply) {
+                    WideGrayKernel<T>* entry = kernels[static_cast<int>(Mode)][premultiply];
+                    entry[1] = GrayWideCopy<T>;
+                    entry[2] = premultiply ? GrayWidePortable<T, 2, Mode, true> : GrayWidePortable<T, 2, Mode, false>;
+                    entry[3] = premultiply ? GrayWidePortable<T, 3, Mode, true> : GrayWidePortable<T, 3, Mode, false>;
+                    entry[4] = premultiply ? GrayWidePortable<T, 4, Mode, true> : GrayWidePortable<T, 4, Mode, false>;
+#if defined(BWCONV_X86_SIMD)
+                    __builtin_cpu_init();
+                    if (!__builtin_cpu_supports("sse4.1")) {
+                        continue;
+                    }
+                    if constexpr (kFloat) {
+                        entry[3] = premultiply ? GrayFloatSse41<3, Mode, true> : GrayFloatSse41<3, Mode, false>;
+                        entry[4] = premultiply ? GrayFloatSse41<4, Mode, true> : GrayFloatSse41<4, Mode, false>;
+                    } else if constexpr (Mode != LumaMode::Linear) { // 16-bit linear luma is table-driven.
+                        entry[3] = premultiply ? GrayWideSse41<3, Mode, true> : GrayWideSse41<3, Mode, false>;
+                        entry[4] = premultiply ? GrayWideSse41<4, Mode, true> : GrayWideSse41<4, Mode, false>;
+                    }
+#elif defined(BWCONV_NEON_SIMD)
+                    if constexpr (kFloat) {
+                        entry[3] = premultiply ? GrayFloatNeon<3, Mode, true> : GrayFloatNeon<3, Mode, false>;
+                        entry[4] = premultiply ? GrayFloatNeon<4, Mode, true> : GrayFloatNeon<4, Mode, false>;
+                    } else if constexpr (Mode != LumaMode::Linear) { // 16-bit linear luma is table-driven.
+                        entry[3] = premultiply ? GrayWideNeon<3, Mode, true> : GrayWideNeon<3, Mode, false>;
+                        entry[4] = premultiply ? GrayWideNeon<4, Mode, true> : GrayWideNeon<4, Mode, false>;
+                    }
+#endif
+                }
+            }
+        };
+
+        /**
+         * Picks the fastest gray kernel for wide samples, like SelectGrayKernel.
+         *
+         * @tparam T std::uint16_t or float.
+         * @param channels The number of color channels per pixel.
+         * @param luma How color is weighted into gray.
+         * @param alpha Alpha handling of the weighted modes; Average counts alpha as a channel.
+         * @return The kernel, or nullptr for channel counts other than 1 to 4.
+         */
+        template <typename T>
+        WideGrayKernel<T> SelectWideGrayKernel(int channels, LumaMode luma = LumaMode::Average,
+                                               AlphaMode alpha = AlphaMode::Ignore)
+        {
+            static const WideGrayKernelTable<T> table;
+            return (channels >= 1 && channels <= 4)
+                       ? table.kernels[static_cast<int>(luma)][alpha == AlphaMode::Premultiply ? 1 : 0][channels]
+                       : nullptr;
+        }
+
+        /**
+         * Rounds 16-bit samples to bytes, v / 257. dst may equal src.
+         *
+         * @param src The samples.
+         * @param dst Receives one byte per sample.
+         * @param samples Number of samples.
+         */
+        inline void NarrowSamples(const std::uint16_t* src, unsigned char* dst, std::size_t samples)
+        {
+            std::size_t i = 0;
+#if defined(BWCONV_X86_SIMD) && defined(__SSE2__)
+            // (v * 0xFF01 >> 16) + 128 >> 8 equals v / 257 rounded for every 16-bit v.
+            const __m128i scale = _mm_set1_epi16(static_cast<short>(0xFF01)), half = _mm_set1_epi16(128);
+            for (; i + 16 <= samples; i += 16) {
+                __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8));
+                low = _mm_srli_epi16(_mm_add_epi16(_mm_mulhi_epu16(low, scale), half), 8);
+                high = _mm_srli_epi16(_mm_add_epi16(_mm_mulhi_epu16(high, scale), half), 8);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(low, high));
+            }
+#elif defined(BWCONV_NEON_SIMD)
+            // (v * 255 + 32895) >> 16 equals v / 257 rounded for every 16-bit v.
+            const uint32x4_t bias = vdupq_n_u32(32895);
+            for (; i + 8 <= samples; i += 8) {
+                uint16x8_t v = vld1q_u16(src + i);
+                uint16x4_t low = vshrn_n_u32(vmlal_n_u16(bias, vget_low_u16(v), 255), 16);
+                uint16x4_t high = vshrn_n_u32(vmlal_n_u16(bias, vget_high_u16(v), 255), 16);
+                vst1_u8(dst + i, vmovn_u16(vcombine_u16(low, high)));
+            }
+#endif
+            for (; i < samples; ++i) {
+                dst[i] = static_cast<unsigned char>((src[i] * 255u + 32895u) >> 16);
+            }
+        }
+
+        /**
+         * Table encoding linear light with gamma 1/2.2, the curve stb_image applies when it
+         * converts HDR images to 8 bits. Indexed by the square root of the linear value,
+         * which keeps the steps near black small.
+         */
+        struct GammaTable
+        {
+            std::uint16_t encode[65536]; ///< round(sqrt(v) * 65535) to 16-bit encoded sample.
+
+            /**
+             * @return The table, computed on first use.
+             */
+            static const GammaTable& Get()
+            {
+                static const GammaTable table;
+                return table;
+            }
+
+        private:
+            GammaTable()
+            {
+                for (int i = 0; i < 65536; ++i) {
+                    encode[i] = static_cast<std::uint16_t>(std::lround(std::pow(i / 65535.0, 2 / 2.2) * 65535));
+                }
+            }
+        };
+
+        /**
+         * Encodes linear float samples as 16-bit samples with gamma 1/2.2. Values are clamped
+         * to [0, 1]. dst may equal src.
+         *
+         * @param src The samples.
+         * @param dst Receives one 16-bit sample per float.
+         * @param samples Number of samples.
+         */
+        inline void EncodeSamples(const float* src, std::uint16_t* dst, std::size_t samples)
+        {
+            const GammaTable& gamma = GammaTable::Get();
+            for (std::size_t i = 0; i < samples; ++i) {
+                float v = std::min(1.0f, std::max(0.0f, src[i]));
+                dst[i] = gamma.encode[static_cast<int>(std::sqrt(v) * 65535 + 0.5f)];
+            }
+        }
+    } // namespace Kernels
+} // namespace bwconv